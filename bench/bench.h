@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Each benchmark runs BENCH_RUNS times, the fastest run is reported */
+#define BENCH_RUNS		5
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BENCH_UNIT		"tsc"
+#else
+#define BENCH_UNIT		"ns"
+#endif
+
+/* Side effects of benchmarked operations go here, so they can't be elided */
+static volatile uint64_t bench_sink;
+
+/**
+ * bench_cycles() - Read cycle counter
+ *
+ * Return: time stamp counter on x86, which ticks at a constant reference
+ *	   frequency on any recent CPU, monotonic nanoseconds elsewhere
+ */
+static inline uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * bench_header() - Print description of output format, as comment lines
+ * @what:	Name of benchmark program
+ */
+static inline void bench_header(const char *what)
+{
+	printf("# %s: unit %s, best of %i runs\n", what, BENCH_UNIT, BENCH_RUNS);
+	printf("# name,variant,bytes,ops,cycles_per_op,bytes_per_cycle\n");
+}
+
+/**
+ * bench_report() - Print result for one benchmark as comma-separated values
+ * @name:	Benchmark name, function under test
+ * @variant:	Variant of benchmark, such as implementation or input pattern
+ * @bytes:	Bytes processed by each operation, zero if not meaningful
+ * @ops:	Number of operations in one run
+ * @cycles:	Cycles spent by the fastest run
+ */
+static inline void bench_report(const char *name, const char *variant,
+				size_t bytes, unsigned long ops,
+				uint64_t cycles)
+{
+	double cpo = (double)cycles / ops;
+
+	printf("%s,%s,%zu,%lu,%.2f,%.3f\n", name, variant, bytes, ops, cpo,
+	       cpo > 0 ? bytes / cpo : 0);
+	fflush(stdout);
+}
+
+/**
+ * BENCH_BATCH() - Run statement handling batches, report fastest run
+ * @name:	Benchmark name, function under test
+ * @variant:	Variant of benchmark
+ * @bytes:	Bytes processed by each operation
+ * @ops:	Number of batches in one run
+ * @batch:	Operations handled by each execution of @stmt
+ * @i:		Loop variable, unsigned long, available to @stmt
+ * @stmt:	Statement performing one batch of operations
+ */
+#define BENCH_BATCH(name, variant, bytes, ops, batch, i, stmt)		\
+	do {								\
+		uint64_t best_ = UINT64_MAX, t_;			\
+		int run_;						\
+									\
+		for (run_ = 0; run_ < BENCH_RUNS; run_++) {		\
+			t_ = bench_cycles();				\
+			for ((i) = 0; (i) < (ops); (i)++) {		\
+				stmt;					\
+			}						\
+			t_ = bench_cycles() - t_;			\
+			if (t_ < best_)					\
+				best_ = t_;				\
+		}							\
+		bench_report(name, variant, bytes, (ops) * (batch),	\
+			     best_);					\
+	} while (0)
+
+/**
+ * BENCH() - Run statement for given number of operations, report fastest run
+ * @name:	Benchmark name, function under test
+ * @variant:	Variant of benchmark
+ * @bytes:	Bytes processed by each operation
+ * @ops:	Number of operations in one run
+ * @i:		Loop variable, unsigned long, available to @stmt
+ * @stmt:	Statement performing one operation
+ */
+#define BENCH(name, variant, bytes, ops, i, stmt)			\
+	BENCH_BATCH(name, variant, bytes, ops, 1, i, stmt)
+
+#endif /* BENCH_H */
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/csum.c - Microbenchmark for csum(), for each usable implementation
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#include <netinet/ip.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../checksum.h"
+#include "bench.h"
+
+#define BUF_LEN			(65536 + 64)
+#define BENCH_BYTES		(64UL << 20)
+
+static const char *impls[] = { "avx512", "avx2", "sse4.1", "neon", "generic" };
+
+/* Segment, frame, MSS and jumbo sizes, plus largest datagram */
+static const size_t lens[] = { 64, 576, 1460, 9000, 65535 };
+
+/* Aligned, and at the offset of a payload after Ethernet and IPv4 headers */
+static const size_t offs[] = { 0, 34 };
+
+int main(void)
+{
+	unsigned long i, ops;
+	size_t j, k, l;
+	uint8_t *buf;
+
+	if (!(buf = aligned_alloc(64, BUF_LEN))) {
+		perror("aligned_alloc");
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	for (j = 0; j < BUF_LEN; j++)
+		buf[j] = rand();
+
+	bench_header("csum");
+
+	for (j = 0; j < sizeof(impls) / sizeof(impls[0]); j++) {
+		if (!csum_select(impls[j]))
+			continue;
+
+		for (k = 0; k < sizeof(lens) / sizeof(lens[0]); k++) {
+			for (l = 0; l < sizeof(offs) / sizeof(offs[0]); l++) {
+				const uint8_t *p = buf + offs[l];
+				char variant[32];
+
+				snprintf(variant, sizeof(variant), "%s+%zu",
+					 impls[j], offs[l]);
+
+				ops = BENCH_BYTES / lens[k];
+				BENCH("csum", variant, lens[k], ops, i,
+				      bench_sink += csum(p, lens[k], i));
+			}
+		}
+	}
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/ns_call.c - Microbenchmark for functions run in a network namespace
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Create a network namespace with a listening socket on loopback, then compare
+ * running functions there with NS_CALL(), cloning a process each time, and with
+ * ns_call(), through the persistent helper thread:
+ *
+ * - "noop": ns_enter() only, cost of the mechanism itself
+ * - "connect": socket() and connect() to the listening socket, as done by
+ *   tcp_splice_connect_ns() for each new spliced connection without a pooled
+ *   socket, then accept() and close() in the main thread
+ *
+ * Then check that ns_call() still works in a child process after fork(), which
+ * doesn't copy the helper thread, as happens if the helper is started before
+ * daemonising.
+ *
+ * Creating the namespace needs CAP_SYS_ADMIN: run as root.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../util.h"
+#include "../passt.h"
+#include "../log.h"
+#include "../ns_helper.h"
+
+#include "bench.h"
+
+#define OPS			2000
+
+/* Defined in passt.c, not linked here */
+char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
+char *ip_proto_str[IPPROTO_SCTP + 1];
+
+/**
+ * proto_update_l2_buf() - Stub, L2 buffers are not used here
+ * @eth_d:	Ethernet destination address, unused
+ * @eth_s:	Ethernet source address, unused
+ * @ip_da:	IPv4 destination address, unused
+ */
+void proto_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
+			 const struct in_addr *ip_da)
+{
+	(void)eth_d;
+	(void)eth_s;
+	(void)ip_da;
+}
+
+/**
+ * struct conn_ns_arg - Arguments for conn_ns()
+ * @c:		Execution context
+ * @sa:		Address of listening socket in namespace
+ * @s:		Connected socket, set on return, -1 on failure
+ */
+struct conn_ns_arg {
+	const struct ctx *c;
+	const struct sockaddr_in *sa;
+	int s;
+};
+
+/**
+ * noop_ns() - Enter namespace, do nothing else
+ * @arg:	Execution context
+ *
+ * Return: 0
+ */
+static int noop_ns(void *arg)
+{
+	ns_enter((const struct ctx *)arg);
+	return 0;
+}
+
+/**
+ * conn_ns() - Enter namespace, connect to listening socket there
+ * @arg:	See struct conn_ns_arg
+ *
+ * Return: 0
+ */
+static int conn_ns(void *arg)
+{
+	struct conn_ns_arg *a = (struct conn_ns_arg *)arg;
+	struct linger lin = { 1, 0 };
+
+	ns_enter(a->c);
+
+	if ((a->s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return 0;
+
+	/* Reset on close, don't fill up TIME_WAIT buckets */
+	setsockopt(a->s, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+
+	if (connect(a->s, (const struct sockaddr *)a->sa, sizeof(*a->sa))) {
+		close(a->s);
+		a->s = -1;
+	}
+
+	return 0;
+}
+
+/**
+ * conn() - Connect from namespace, accept and close both sockets
+ * @c:		Execution context
+ * @l:		Listening socket
+ * @sa:		Address of listening socket in namespace
+ * @helper:	Use ns_call(), NS_CALL() otherwise
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int conn(const struct ctx *c, int l, const struct sockaddr_in *sa,
+		int helper)
+{
+	struct conn_ns_arg arg = { c, sa, -1 };
+	int a;
+
+	if (helper)
+		ns_call(conn_ns, &arg);
+	else
+		NS_CALL(conn_ns, &arg);
+
+	if (arg.s < 0 || (a = accept(l, NULL, NULL)) < 0)
+		return -1;
+
+	close(arg.s);
+	close(a);
+
+	return 0;
+}
+
+/**
+ * ns_setup() - Create namespace, bring up loopback, listen on it, go back
+ * @c:		Execution context, namespace file descriptor set on return
+ * @sa:		Address of listening socket, set on return
+ *
+ * Return: listening socket, -1 on failure
+ */
+static int ns_setup(struct ctx *c, struct sockaddr_in *sa)
+{
+	struct ifreq ifr = { .ifr_name = "lo" };
+	socklen_t sl = sizeof(*sa);
+	int init, s, l = -1;
+
+	if ((init = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC)) < 0 ||
+	    unshare(CLONE_NEWNET) ||
+	    (c->pasta_netns_fd = open("/proc/self/ns/net",
+				      O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	    ioctl(s, SIOCGIFFLAGS, &ifr))
+		goto out;
+
+	ifr.ifr_flags |= IFF_UP;
+	if (ioctl(s, SIOCSIFFLAGS, &ifr))
+		goto out;
+
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa->sin_port = 0;
+
+	if ((l = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    bind(l, (struct sockaddr *)sa, sizeof(*sa)) ||
+	    listen(l, SOMAXCONN) ||
+	    getsockname(l, (struct sockaddr *)sa, &sl)) {
+		close(l);
+		l = -1;
+	}
+
+out:
+	close(s);
+	if (setns(init, CLONE_NEWNET))
+		l = -1;
+	close(init);
+
+	return l;
+}
+
+int main(void)
+{
+	struct ctx c = { .mode = MODE_PASTA };
+	struct sockaddr_in sa;
+	int l, status;
+	unsigned long i;
+	pid_t pid;
+
+	__setlogmask(LOG_UPTO(LOG_ERR));
+
+	if ((l = ns_setup(&c, &sa)) < 0) {
+		printf("# ns_call: can't set up namespace (%s), skipping\n",
+		       strerror(errno));
+		return EXIT_SUCCESS;
+	}
+
+	if (conn(&c, l, &sa, 0)) {
+		fprintf(stderr, "Can't connect from namespace\n");
+		return EXIT_FAILURE;
+	}
+
+	bench_header("ns_call");
+
+	BENCH("ns_call", "noop_clone", 0, OPS, i, NS_CALL(noop_ns, &c));
+	BENCH("ns_call", "connect_clone", 0, OPS, i,
+	      bench_sink += conn(&c, l, &sa, 0));
+
+	if (ns_helper_init(&c))
+		return EXIT_FAILURE;
+
+	BENCH("ns_call", "noop_helper", 0, OPS, i, ns_call(noop_ns, &c));
+	BENCH("ns_call", "connect_helper", 0, OPS, i,
+	      bench_sink += conn(&c, l, &sa, 1));
+
+	if (!(pid = fork())) {
+		alarm(5);
+		_exit(conn(&c, l, &sa, 1) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "ns_call() failed after fork()\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/packet.c - Microbenchmark for packet_add() and packet_get()
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../packet.h"
+#include "bench.h"
+
+#define POOL_SIZE		1024
+#define FRAME_LEN		1514
+#define OPS			(4UL << 20)
+
+static char buf[POOL_SIZE * FRAME_LEN];
+
+int main(void)
+{
+	PACKET_POOL_P(p, POOL_SIZE, buf, sizeof(buf));
+	unsigned long i;
+	size_t left;
+
+	bench_header("packet");
+
+	/* Fill pool, flush once full, like tap handlers do for each batch */
+	BENCH("packet_add", "frame", 0, OPS, i,
+	      ((i % POOL_SIZE) ? (void)0 : pool_flush(p),
+	       packet_add(p, FRAME_LEN, buf + i % POOL_SIZE * FRAME_LEN)));
+
+	/* Ethernet header with remaining length, then IPv4 and TCP headers */
+	BENCH("packet_get", "l2", 0, OPS, i,
+	      bench_sink += (uintptr_t)packet_get(p, i % POOL_SIZE, 0, 14,
+						  &left) + left);
+	BENCH("packet_get", "l3", 0, OPS, i,
+	      bench_sink += (uintptr_t)packet_get(p, i % POOL_SIZE, 14, 20,
+						  NULL));
+	BENCH("packet_get", "l4", 0, OPS, i,
+	      bench_sink += (uintptr_t)packet_get(p, i % POOL_SIZE, 34, 20,
+						  NULL));
+
+	/* Out of bounds, exercising the checks that discard malformed frames */
+	BENCH("packet_get_try", "oob", 0, OPS, i,
+	      bench_sink += (uintptr_t)packet_get_try(p, i % POOL_SIZE, 1500,
+						      20, NULL));
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/ports.c - Microbenchmark for detection of bound TCP ports
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Open loopback TCP connections until the given numbers of sockets exist
+ * (default: 10000, 100000 and 1000000), and, for each of them, compare the cost
+ * of a scan of listening TCP sockets, IPv4 and IPv6, as done on each timer run
+ * with automatic port forwarding: via procfs_scan_listen(), parsing
+ * /proc/net/tcp{,6}, and via diag_scan_listen(), dumping LISTEN sockets from
+ * NETLINK_SOCK_DIAG.
+ *
+ * Connections are kept open, two sockets each, as long as the limit on open
+ * files allows, run as root to raise it. Past that, they are closed from the
+ * client side, which leaves one socket in TIME_WAIT state for each: these are
+ * listed in /proc/net/tcp too, up to net.ipv4.tcp_max_tw_buckets, for 60
+ * seconds: stop if the count can't be reached before the first ones expire.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "../util.h"
+#include "../passt.h"
+#include "../log.h"
+
+#include "bench.h"
+
+/* Scans take roughly constant time per socket: keep runs short with 1M */
+#define SCAN_SOCKS_PER_RUN	(1000 * 1000)
+
+/* Stop creating connections in TIME_WAIT after this, TCP_TIMEWAIT_LEN is 60 */
+#define TW_CREATE_MAX_S		45
+
+/* Defined in passt.c, not linked here */
+char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
+char *ip_proto_str[IPPROTO_SCTP + 1];
+
+/**
+ * proto_update_l2_buf() - Stub, L2 buffers are not used here
+ * @eth_d:	Ethernet destination address, unused
+ * @eth_s:	Ethernet source address, unused
+ * @ip_da:	IPv4 destination address, unused
+ */
+void proto_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
+			 const struct in_addr *ip_da)
+{
+	(void)eth_d;
+	(void)eth_s;
+	(void)ip_da;
+}
+
+static uint8_t map_procfs[PORT_BITMAP_SIZE], map_diag[PORT_BITMAP_SIZE];
+static uint8_t exclude[PORT_BITMAP_SIZE];
+
+/**
+ * scan_procfs() - Scan listening TCP sockets, IPv4 and IPv6, from procfs
+ * @c:		Execution context
+ */
+static void scan_procfs(struct ctx *c)
+{
+	procfs_scan_listen(c, IPPROTO_TCP, V4, 0, map_procfs, exclude);
+	procfs_scan_listen(c, IPPROTO_TCP, V6, 0, map_procfs, exclude);
+}
+
+/**
+ * scan_diag() - Scan listening TCP sockets, IPv4 and IPv6, with sock_diag
+ * @c:		Execution context
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int scan_diag(struct ctx *c)
+{
+	int ret = diag_scan_listen(c, IPPROTO_TCP, V4, 0, map_diag, exclude);
+
+	return ret ? ret : diag_scan_listen(c, IPPROTO_TCP, V6, 0, map_diag,
+					    exclude);
+}
+
+/**
+ * conn_open() - Open a loopback TCP connection to listening socket
+ * @l:		Listening socket
+ * @sa:		Address of listening socket
+ * @i:		Connection number, selects local address to spread ports
+ * @tw:		Close connection right away, leaving a socket in TIME_WAIT
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int conn_open(int l, const struct sockaddr_in *sa, unsigned long i,
+		     int tw)
+{
+	struct sockaddr_in src = {
+		.sin_family = AF_INET,
+		/* 127.1.0.0/16, about 28k ephemeral ports each */
+		.sin_addr.s_addr = htonl(0x7f010000 + i / 16384),
+	};
+	int s, a;
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -errno;
+
+	if (bind(s, (struct sockaddr *)&src, sizeof(src)) ||
+	    connect(s, (const struct sockaddr *)sa, sizeof(*sa)) ||
+	    (a = accept(l, NULL, NULL)) < 0) {
+		int ret = -errno;
+
+		close(s);
+		return ret;
+	}
+
+	if (tw) {
+		close(s);
+		close(a);
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned long def[] = { 10000, 100000, 1000000 };
+	struct sockaddr_in sa = { .sin_family = AF_INET,
+				  .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	struct ctx c = { .mode = MODE_PASTA };
+	struct timespec tw_start = { 0 }, now;
+	unsigned long socks = 1, conns = 0, target, ops, i;
+	socklen_t sl = sizeof(sa);
+	struct rlimit lim;
+	int j, l, ret;
+
+	__setlogmask(LOG_UPTO(LOG_ERR));
+
+	c.proc_net_tcp[V4][0] = c.proc_net_tcp[V6][0] = -1;
+	c.sock_diag[0] = -1;
+
+	/* As many as the kernel allows, we need two files per connection */
+	lim.rlim_cur = lim.rlim_max = 1 << 20;
+	if (setrlimit(RLIMIT_NOFILE, &lim)) {
+		getrlimit(RLIMIT_NOFILE, &lim);
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+
+	if ((l = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    bind(l, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(l, SOMAXCONN) ||
+	    getsockname(l, (struct sockaddr *)&sa, &sl)) {
+		perror("listening socket");
+		return EXIT_FAILURE;
+	}
+
+	if ((ret = scan_diag(&c))) {
+		fprintf(stderr, "sock_diag not available: %s\n",
+			strerror(-ret));
+		return EXIT_FAILURE;
+	}
+
+	bench_header("ports");
+	printf("# bytes: sockets opened by this benchmark, others not counted\n");
+
+	for (j = 0; j < (argc > 1 ? argc - 1 : (int)ARRAY_SIZE(def)); j++) {
+		target = argc > 1 ? strtoul(argv[j + 1], NULL, 0) : def[j];
+
+		while (socks < target) {
+			/* Spare some files for procfs and netlink */
+			int tw = socks + 2 + 16 > lim.rlim_cur;
+
+			if (tw && !(conns % 1024)) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (!tw_start.tv_sec)
+					tw_start = now;
+
+				if (now.tv_sec - tw_start.tv_sec >
+				    TW_CREATE_MAX_S) {
+					ret = -ETIMEDOUT;
+					break;
+				}
+			}
+
+			if ((ret = conn_open(l, &sa, conns++, tw)))
+				break;
+
+			socks += tw ? 1 : 2;
+		}
+
+		if (socks < target) {
+			printf("# stopped at %lu sockets: %s\n", socks,
+			       strerror(-ret));
+			break;
+		}
+
+		ops = MAX(SCAN_SOCKS_PER_RUN / target, 1);
+
+		memset(map_procfs, 0, sizeof(map_procfs));
+		memset(map_diag, 0, sizeof(map_diag));
+		scan_procfs(&c);
+		scan_diag(&c);
+		if (memcmp(map_procfs, map_diag, sizeof(map_diag))) {
+			fprintf(stderr, "Port maps differ at %lu sockets\n",
+				socks);
+			return EXIT_FAILURE;
+		}
+
+		BENCH("scan_listen_tcp", "procfs", socks, ops, i,
+		      scan_procfs(&c));
+		BENCH("scan_listen_tcp", "sock_diag", socks, ops, i,
+		      bench_sink += scan_diag(&c));
+	}
+
+	return EXIT_SUCCESS;
+}
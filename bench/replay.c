@@ -0,0 +1,1289 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/replay.c - Replay guest frames from a capture into passt, at line rate
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Load a capture written by passt with --pcap, connect to the UNIX domain
+ * socket of a running passt instance as qemu would, and send frames originally
+ * sent by the guest back to back, with the usual 32-bit length descriptor.
+ *
+ * With -g, destination addresses of TCP, UDP and ICMP echo frames are replaced
+ * by the gateway address, which passt maps to the host, and TCP sink servers
+ * and UDP echo servers are started on loopback addresses for ports found in the
+ * capture, in a separate process. ICMP echo requests are answered by the host.
+ *
+ * TCP frames can't be replayed verbatim, as sequence numbers chosen by passt
+ * differ from the ones in the capture: frames for a connection are held until
+ * passt answers the SYN, their acknowledgement number is replaced with the next
+ * sequence expected from passt, and they are held again if they don't fit the
+ * window advertised by passt. Connections without a SYN in the capture are
+ * skipped. Frames are never reordered, so one connection waiting for passt
+ * holds back the whole replay, for up to WAIT_MS.
+ *
+ * Once done, print comma-separated results: frames and throughput, CPU time
+ * spent by passt for each frame, round-trip latency for UDP datagrams and ICMP
+ * echo requests, tagged with a counter at the beginning of their payload, and
+ * latency between sending TCP data and receiving the matching acknowledgement.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <net/ethernet.h>
+#include <netinet/icmp6.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../checksum.h"
+
+#define SOCKET_DEFAULT		"/tmp/passt_1.socket"
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NS		0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET	1
+
+#define TX_BUF_SIZE		(1 << 20)
+#define TX_STAMPS		4096	/* Timestamps set on write, per batch */
+#define RX_BUF_SIZE		(1 << 20)
+#define WAIT_MS			1000	/* For SYN answer, or window, per frame */
+#define DRAIN_MS		200	/* Wait for frames from passt at the end */
+#define TAG_RING		65536	/* Tagged frames in flight, at most */
+#define ACK_QUEUE		256	/* TCP segments in flight, per connection */
+#define SAMPLES_MAX		(1 << 24)
+
+#define SEQ_GE(a, b)		((int32_t)((a) - (b)) >= 0)
+#define SEQ_GT(a, b)		((int32_t)((a) - (b)) > 0)
+
+/* pcap-savefile(5) */
+struct pcap_hdr {
+	uint32_t magic;
+	uint16_t major;
+	uint16_t minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_pkthdr {
+	uint32_t tv_sec;
+	uint32_t tv_usec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+/**
+ * struct frame - Frame sent by the guest, found in capture
+ * @off:	Offset of frame in capture buffer
+ * @len:	Frame length
+ * @l4off:	Offset of L4 header in frame, zero if not IP
+ * @check_off:	Offset of L4 checksum covering payload, zero if none
+ * @tag_off:	Offset of 32-bit tag for echoed payload, zero if not tagged
+ * @proto:	L4 protocol number
+ * @v6:		Set for IPv6
+ * @flow:	Index of TCP connection, -1 if not TCP or not replayable
+ */
+struct frame {
+	size_t off;
+	uint16_t len;
+	uint16_t l4off;
+	uint16_t check_off;
+	uint16_t tag_off;
+	uint8_t proto;
+	uint8_t v6;
+	int flow;
+};
+
+/**
+ * enum flow_state - Replay state of TCP connection
+ * @FLOW_NEW:		SYN not sent yet
+ * @FLOW_SYN_SENT:	Waiting for SYN from passt
+ * @FLOW_ESTABLISHED:	SYN received from passt
+ * @FLOW_DEAD:		Reset, or timed out waiting: skip further frames
+ */
+enum flow_state {
+	FLOW_NEW = 0,
+	FLOW_SYN_SENT,
+	FLOW_ESTABLISHED,
+	FLOW_DEAD,
+};
+
+/**
+ * struct flow - TCP connection being replayed
+ * @state:	Replay state
+ * @rport:	Remote port, network order
+ * @ws:		Window scaling factor advertised by passt
+ * @rcv_nxt:	Next sequence expected from passt, used for acknowledgements
+ * @snd_una:	Highest sequence acknowledged by passt
+ * @wnd:	Window advertised by passt, scaled
+ * @q:		Segments with data in flight: end sequence and send timestamp
+ * @q_head:	First used entry in @q
+ * @q_tail:	First free entry in @q
+ */
+struct flow {
+	enum flow_state state;
+	in_port_t rport;
+	uint8_t ws;
+	uint32_t rcv_nxt;
+	uint32_t snd_una;
+	uint32_t wnd;
+	struct {
+		uint32_t end;
+		uint64_t ns;
+	} q[ACK_QUEUE];
+	unsigned int q_head;
+	unsigned int q_tail;
+};
+
+/**
+ * struct samples - Latency samples
+ * @v:		Samples, nanoseconds
+ * @n:		Count of samples
+ * @size:	Allocated entries in @v
+ */
+struct samples {
+	uint32_t *v;
+	size_t n;
+	size_t size;
+};
+
+static char *cap;
+static struct frame *frames;
+static size_t frames_n;
+static struct flow *flows;
+static int flows_n;
+
+/* Connection index by guest port, for IPv4 and IPv6, while loading and after
+ * sending the SYN
+ */
+static int load_flow[2][USHRT_MAX + 1];
+static int run_flow[2][USHRT_MAX + 1];
+
+/* Ports to serve locally, TCP and UDP, for IPv4 and IPv6 */
+static uint8_t tcp_ports[2][(USHRT_MAX + 1) / 8];
+static uint8_t udp_ports[2][(USHRT_MAX + 1) / 8];
+
+static struct in_addr gw4;
+static struct in6_addr gw6;
+static int has_gw4, has_gw6;
+
+static char tx_buf[TX_BUF_SIZE];
+static size_t tx_len;
+static uint64_t *tx_stamps[TX_STAMPS];
+static int tx_stamps_n;
+
+static char rx_buf[RX_BUF_SIZE];
+static size_t rx_len;
+
+static struct {
+	uint32_t tag;
+	uint64_t ns;
+} tags[TAG_RING];
+static uint32_t tag_next = 1;
+
+static struct {
+	unsigned long tx_frames;
+	unsigned long long tx_bytes;
+	unsigned long rx_frames;
+	unsigned long skipped;
+	int flows_failed;
+} st;
+
+static struct samples echo_rtt, tcp_ack;
+
+/**
+ * usage() - Print usage and exit
+ * @name:	Executable name
+ */
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s PATH] [-g ADDR]... [-m MAC] FILE\n",
+		name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Replay frames sent by the guest from pcap FILE into a\n"
+			"running passt instance, report throughput, CPU usage\n"
+			"and latency as comma-separated values\n\n");
+	fprintf(stderr, "  -s PATH	UNIX domain socket of passt\n"
+			"		default: " SOCKET_DEFAULT "\n");
+	fprintf(stderr, "  -g ADDR	Gateway address mapped by passt to the "
+			"host, IPv4 or IPv6,\n"
+			"		can be given twice: send TCP, UDP and ICMP "
+			"echo frames\n"
+			"		there, and serve ports locally\n");
+	fprintf(stderr, "  -m MAC	Guest MAC address\n"
+			"		default: source of first frame in capture\n");
+
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * now_ns() - Read monotonic clock
+ *
+ * Return: current time, nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * sample_add() - Add latency sample
+ * @s:		Samples
+ * @ns:		Latency, nanoseconds
+ */
+static void sample_add(struct samples *s, uint64_t ns)
+{
+	if (s->n == s->size) {
+		uint32_t *v;
+
+		if (s->size == SAMPLES_MAX)
+			return;
+
+		s->size = s->size ? s->size * 2 : 4096;
+		if (!(v = realloc(s->v, s->size * sizeof(*v)))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		s->v = v;
+	}
+
+	s->v[s->n++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+/**
+ * port_set() - Mark port in port map
+ * @map:	Port map
+ * @port:	Port, network order
+ */
+static void port_set(uint8_t *map, in_port_t port)
+{
+	map[ntohs(port) / 8] |= 1 << (ntohs(port) % 8);
+}
+
+/**
+ * csum_rewrite() - Update checksum for data about to be replaced
+ * @check:	Checksum, can be NULL
+ * @old:	Data being replaced, 16-bit words
+ * @new:	New data
+ * @len:	Length of data, even
+ */
+static void csum_rewrite(uint16_t *check, const void *old, const void *new,
+			 size_t len)
+{
+	uint16_t o, n;
+	size_t i;
+
+	if (!check)
+		return;
+
+	for (i = 0; i < len; i += 2) {
+		memcpy(&o, (const char *)old + i, 2);
+		memcpy(&n, (const char *)new + i, 2);
+		*check = csum_update(*check, o, n);
+	}
+}
+
+/**
+ * frame_l4() - Find L4 header and protocol of IP frame
+ * @p:		Frame, starting with Ethernet header
+ * @len:	Frame length
+ * @v6:		Set on return for IPv6
+ * @proto:	L4 protocol number, set on return
+ * @l4len:	Length of L4 header and payload, set on return
+ *
+ * Return: offset of L4 header, zero if not an IP frame, or malformed
+ */
+static size_t frame_l4(const char *p, size_t len, int *v6, uint8_t *proto,
+		       size_t *l4len)
+{
+	const struct ethhdr *eh = (const struct ethhdr *)p;
+
+	len -= sizeof(*eh);
+
+	if (eh->h_proto == htons(ETH_P_IP)) {
+		const struct iphdr *iph = (const struct iphdr *)(eh + 1);
+		size_t hlen;
+
+		if (len < sizeof(*iph))
+			return 0;
+
+		hlen = iph->ihl * 4UL;
+		if (hlen < sizeof(*iph) || ntohs(iph->tot_len) > len ||
+		    ntohs(iph->tot_len) < hlen)
+			return 0;
+
+		*v6 = 0;
+		*proto = iph->protocol;
+		*l4len = ntohs(iph->tot_len) - hlen;
+		return sizeof(*eh) + hlen;
+	}
+
+	if (eh->h_proto == htons(ETH_P_IPV6)) {
+		const struct ip6_hdr *ip6h = (const struct ip6_hdr *)(eh + 1);
+
+		if (len < sizeof(*ip6h) ||
+		    ntohs(ip6h->ip6_plen) > len - sizeof(*ip6h))
+			return 0;
+
+		*v6 = 1;
+		*proto = ip6h->ip6_nxt;
+		*l4len = ntohs(ip6h->ip6_plen);
+		return sizeof(*eh) + sizeof(*ip6h);
+	}
+
+	return 0;
+}
+
+/**
+ * flow_new() - Add TCP connection found in capture
+ * @rport:	Remote port, network order
+ *
+ * Return: index of new connection
+ */
+static int flow_new(in_port_t rport)
+{
+	struct flow *fl;
+
+	if (!(flows_n % 1024)) {
+		if (!(fl = realloc(flows, (flows_n + 1024) * sizeof(*flows)))) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		flows = fl;
+	}
+
+	fl = &flows[flows_n];
+	memset(fl, 0, sizeof(*fl));
+	fl->rport = rport;
+
+	return flows_n++;
+}
+
+/**
+ * frame_rewrite() - Send frame to gateway, if applicable, find flow and tag
+ * @f:		Frame, with @off and @len set
+ */
+static void frame_rewrite(struct frame *f)
+{
+	char *p = cap + f->off, *l4;
+	uint16_t *l4check = NULL;
+	size_t l4off, l4len;
+	in_port_t dport = 0;
+	int v6, local = 0;
+	uint8_t proto;
+
+	f->flow = -1;
+
+	if (!(l4off = frame_l4(p, f->len, &v6, &proto, &l4len)))
+		return;
+
+	l4 = p + l4off;
+	f->l4off = l4off;
+	f->proto = proto;
+	f->v6 = v6;
+
+	if (proto == IPPROTO_TCP && l4len >= sizeof(struct tcphdr)) {
+		struct tcphdr *th = (struct tcphdr *)l4;
+
+		dport = th->dest;
+		f->check_off = l4off + offsetof(struct tcphdr, check);
+		local = 1;
+	} else if (proto == IPPROTO_UDP && l4len >= sizeof(struct udphdr)) {
+		struct udphdr *uh = (struct udphdr *)l4;
+
+		dport = uh->dest;
+		if (v6 || uh->check)
+			f->check_off = l4off + offsetof(struct udphdr, check);
+
+		/* Keep DHCP for passt itself */
+		local = dport != htons(67) && dport != htons(547);
+	} else if (!v6 && proto == IPPROTO_ICMP && l4len >= ICMP_MINLEN) {
+		struct icmphdr *ih = (struct icmphdr *)l4;
+
+		f->check_off = l4off + offsetof(struct icmphdr, checksum);
+		local = ih->type == ICMP_ECHO;
+	} else if (v6 && proto == IPPROTO_ICMPV6 &&
+		   l4len >= sizeof(struct icmp6_hdr)) {
+		struct icmp6_hdr *ih = (struct icmp6_hdr *)l4;
+
+		f->check_off = l4off + offsetof(struct icmp6_hdr, icmp6_cksum);
+		local = ih->icmp6_type == ICMP6_ECHO_REQUEST;
+	} else {
+		return;
+	}
+
+	/* The ICMP checksum doesn't cover addresses, others do */
+	if (f->check_off && proto != IPPROTO_ICMP)
+		l4check = (uint16_t *)(p + f->check_off);
+
+	if (local && !v6 && has_gw4) {
+		struct iphdr *iph = (struct iphdr *)(p + sizeof(struct ethhdr));
+		in_addr_t da = ntohl(iph->daddr);
+
+		if (da != INADDR_BROADCAST && !IN_MULTICAST(da)) {
+			csum_rewrite(&iph->check, &iph->daddr, &gw4, 4);
+			csum_rewrite(l4check, &iph->daddr, &gw4, 4);
+			memcpy(&iph->daddr, &gw4, 4);
+		} else {
+			local = 0;
+		}
+	} else if (local && v6 && has_gw6) {
+		struct ip6_hdr *ip6h;
+		struct in6_addr *da;
+
+		ip6h = (struct ip6_hdr *)(p + sizeof(struct ethhdr));
+		da = &ip6h->ip6_dst;
+
+		if (!IN6_IS_ADDR_MULTICAST(da) && !IN6_IS_ADDR_LINKLOCAL(da)) {
+			csum_rewrite(l4check, da, &gw6, sizeof(*da));
+			memcpy(da, &gw6, sizeof(*da));
+		} else {
+			local = 0;
+		}
+	} else {
+		local = 0;
+	}
+
+	if (proto == IPPROTO_TCP) {
+		struct tcphdr *th = (struct tcphdr *)l4;
+		int *lf = &load_flow[v6][ntohs(th->source)];
+		struct flow *fl = *lf >= 0 ? &flows[*lf] : NULL;
+
+		if (local)
+			port_set(tcp_ports[v6], dport);
+
+		if (fl && fl->rport != dport)
+			fl = NULL;
+
+		/* While loading, FLOW_ESTABLISHED means that frames other than
+		 * SYN were seen: otherwise, a SYN is a retransmission
+		 */
+		if (th->syn && !th->ack) {
+			if (!fl || fl->state != FLOW_NEW)
+				*lf = flow_new(dport);
+			f->flow = *lf;
+		} else if (fl) {
+			fl->state = FLOW_ESTABLISHED;
+			f->flow = *lf;
+		}
+
+		return;
+	}
+
+	if (!local)
+		return;
+
+	if (proto == IPPROTO_UDP)
+		port_set(udp_ports[v6], dport);
+
+	/* Tag echoed payload, if there's room for it */
+	if (l4len >= 8 + sizeof(uint32_t))
+		f->tag_off = l4off + 8;
+}
+
+/**
+ * pcap_load() - Load capture, keep frames sent by guest, rewrite them
+ * @path:	Path to capture file
+ * @mac:	Guest MAC address, NULL to use source of first frame
+ */
+static void pcap_load(const char *path, const unsigned char *mac)
+{
+	unsigned char guest[ETH_ALEN];
+	const struct pcap_hdr *h;
+	size_t size, off, skip = 0;
+	struct stat sb;
+	ssize_t n;
+	int fd, i;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &sb)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	size = sb.st_size;
+	if (!(cap = malloc(size))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (off = 0; off < size; off += n) {
+		if ((n = read(fd, cap + off, size - off)) <= 0) {
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(fd);
+
+	h = (struct pcap_hdr *)cap;
+	if (size < sizeof(*h) ||
+	    (h->magic != PCAP_MAGIC && h->magic != PCAP_MAGIC_NS) ||
+	    h->linktype != PCAP_LINKTYPE_ETHERNET) {
+		fprintf(stderr, "%s: not an Ethernet capture in host order\n",
+			path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!(frames = calloc(size / sizeof(struct pcap_pkthdr),
+			      sizeof(*frames)))) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < 2; i++) {
+		memset(load_flow[i], 0xff, sizeof(load_flow[i]));
+		memset(run_flow[i], 0xff, sizeof(run_flow[i]));
+	}
+
+	if (mac)
+		memcpy(guest, mac, ETH_ALEN);
+
+	for (off = sizeof(*h); off + sizeof(struct pcap_pkthdr) <= size;) {
+		const struct ethhdr *eh;
+		struct pcap_pkthdr ph;
+		struct frame *f;
+
+		memcpy(&ph, cap + off, sizeof(ph));
+		off += sizeof(ph);
+
+		if (ph.caplen > size - off)
+			break;
+
+		eh = (struct ethhdr *)(cap + off);
+		off += ph.caplen;
+
+		if (ph.caplen != ph.len || ph.len > USHRT_MAX ||
+		    ph.len < sizeof(*eh)) {
+			skip++;
+			continue;
+		}
+
+		if (!mac) {
+			memcpy(guest, eh->h_source, ETH_ALEN);
+			mac = guest;
+		}
+
+		if (memcmp(eh->h_source, guest, ETH_ALEN))
+			continue;
+
+		f = &frames[frames_n++];
+		f->off = (char *)eh - cap;
+		f->len = ph.len;
+		frame_rewrite(f);
+	}
+
+	if (skip)
+		fprintf(stderr, "Skipped %zu truncated frames\n", skip);
+
+	for (i = 0; i < flows_n; i++)
+		flows[i].state = FLOW_NEW;
+}
+
+/**
+ * enum server_type - Type of socket served locally
+ * @SERVER_LISTEN:	Listening TCP socket
+ * @SERVER_TCP:		Accepted TCP connection, sink
+ * @SERVER_UDP:		UDP socket, echo
+ */
+enum server_type {
+	SERVER_LISTEN,
+	SERVER_TCP,
+	SERVER_UDP,
+};
+
+static struct pollfd *server_pfd;
+static enum server_type *server_type;
+static int server_n, server_size;
+
+/**
+ * server_add() - Add socket to set of sockets served locally
+ * @s:		Socket
+ * @type:	Type of socket
+ */
+static void server_add(int s, enum server_type type)
+{
+	if (server_n == server_size) {
+		server_size = server_size ? server_size * 2 : 64;
+		server_pfd = realloc(server_pfd,
+				     server_size * sizeof(*server_pfd));
+		server_type = realloc(server_type,
+				      server_size * sizeof(*server_type));
+		if (!server_pfd || !server_type) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	server_pfd[server_n] = (struct pollfd){ s, POLLIN, 0 };
+	server_type[server_n++] = type;
+}
+
+/**
+ * server_bind() - Bind socket for port to be served locally, on loopback
+ * @v6:		Set for IPv6
+ * @tcp:	Set for TCP, clear for UDP
+ * @port:	Port, host order
+ */
+static void server_bind(int v6, int tcp, in_port_t port)
+{
+	struct sockaddr_in6 a6 = { .sin6_family = AF_INET6,
+				   .sin6_port = htons(port),
+				   .sin6_addr = IN6ADDR_LOOPBACK_INIT };
+	struct sockaddr_in a4 = { .sin_family = AF_INET,
+				  .sin_port = htons(port),
+				  .sin_addr = { htonl(INADDR_LOOPBACK) } };
+	int s, one = 1, rcvbuf = 16 << 20, ret;
+
+	s = socket(v6 ? AF_INET6 : AF_INET,
+		   (tcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK, 0);
+	if (s < 0) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	/* Don't drop datagrams replayed in bursts, if we have CAP_NET_ADMIN */
+	if (!tcp && setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+			       sizeof(rcvbuf)))
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (v6) {
+		setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+		ret = bind(s, (struct sockaddr *)&a6, sizeof(a6));
+	} else {
+		ret = bind(s, (struct sockaddr *)&a4, sizeof(a4));
+	}
+
+	if (ret || (tcp && listen(s, SOMAXCONN))) {
+		fprintf(stderr, "Can't serve %s port %i on %s: %s\n",
+			tcp ? "TCP" : "UDP", port, v6 ? "::1" : "127.0.0.1",
+			strerror(errno));
+		close(s);
+		return;
+	}
+
+	server_add(s, tcp ? SERVER_LISTEN : SERVER_UDP);
+}
+
+/**
+ * server_handle() - Handle event on socket served locally
+ * @i:		Index of socket
+ *
+ * Return: 1 if the socket was closed and replaced by the last one, 0 otherwise
+ */
+static int server_handle(int i)
+{
+	static char buf[USHRT_MAX];
+	int s = server_pfd[i].fd;
+	struct sockaddr_storage sa;
+	socklen_t sl = sizeof(sa);
+	ssize_t n;
+
+	if (server_type[i] == SERVER_LISTEN) {
+		if ((s = accept4(s, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+			server_add(s, SERVER_TCP);
+		return 0;
+	}
+
+	if (server_type[i] == SERVER_UDP) {
+		n = recvfrom(s, buf, sizeof(buf), 0, (struct sockaddr *)&sa,
+			     &sl);
+		if (n >= 0)
+			sendto(s, buf, n, 0, (struct sockaddr *)&sa, sl);
+		return 0;
+	}
+
+	n = recv(s, buf, sizeof(buf), 0);
+	if (n > 0 || (n < 0 && errno == EAGAIN))
+		return 0;
+
+	close(s);
+	server_pfd[i] = server_pfd[--server_n];
+	server_type[i] = server_type[server_n];
+	return 1;
+}
+
+/**
+ * servers_start() - Bind sockets for local ports, serve them in a new process
+ *
+ * Return: PID of server process
+ */
+static pid_t servers_start(void)
+{
+	int v6, port, i;
+	pid_t pid;
+
+	for (v6 = 0; v6 < 2; v6++) {
+		for (port = 0; port <= USHRT_MAX; port++) {
+			if (tcp_ports[v6][port / 8] & (1 << (port % 8)))
+				server_bind(v6, 1, port);
+			if (udp_ports[v6][port / 8] & (1 << (port % 8)))
+				server_bind(v6, 0, port);
+		}
+	}
+
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid) {
+		for (i = 0; i < server_n; i++)
+			close(server_pfd[i].fd);
+		return pid;
+	}
+
+	/* TCP sinks and UDP echo servers, until killed */
+	while (poll(server_pfd, server_n, -1) >= 0) {
+		for (i = 0; i < server_n; i++) {
+			if (server_pfd[i].revents && server_handle(i))
+				i--;
+		}
+	}
+
+	_exit(EXIT_FAILURE);
+}
+
+/**
+ * tap_connect() - Connect to UNIX domain socket of passt
+ * @path:	Socket path
+ * @pid:	PID of passt, set on return
+ *
+ * Return: connected socket
+ */
+static int tap_connect(const char *path, pid_t *pid)
+{
+	struct sockaddr_un a = { .sun_family = AF_UNIX };
+	int s, rcvbuf = 16 << 20;
+	struct ucred uc;
+	socklen_t sl = sizeof(uc);
+
+	if (strlen(path) >= sizeof(a.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(a.sun_path, path);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+	    connect(s, (struct sockaddr *)&a, sizeof(a))) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)))
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &uc, &sl)) {
+		perror("getsockopt SO_PEERCRED");
+		exit(EXIT_FAILURE);
+	}
+
+	*pid = uc.pid;
+	return s;
+}
+
+/**
+ * cpu_ns() - Get CPU time used by process, user and system
+ * @pid:	Process
+ *
+ * Return: CPU time in nanoseconds, zero if unavailable
+ */
+static uint64_t cpu_ns(pid_t pid)
+{
+	unsigned long long utime, stime;
+	char path[64], buf[BUFSIZ], *p;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%i/stat", pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = 0;
+
+	/* Fields 14 and 15, after process name, which might contain spaces */
+	if (!(p = strrchr(buf, ')')) ||
+	    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+		   &utime, &stime) != 2)
+		return 0;
+
+	return (utime + stime) * 1000000000ULL / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * rx_tcp() - Update state of TCP connection from segment sent by passt
+ * @th:		TCP header
+ * @l4len:	Length of TCP header and payload
+ * @v6:		Set for IPv6
+ * @now:	Current timestamp, nanoseconds
+ */
+static void rx_tcp(const struct tcphdr *th, size_t l4len, int v6, uint64_t now)
+{
+	int i = run_flow[v6][ntohs(th->dest)];
+	uint32_t seq = ntohl(th->seq), ack = ntohl(th->ack_seq), end;
+	struct flow *fl;
+
+	if (i < 0 || flows[i].rport != th->source)
+		return;
+
+	fl = &flows[i];
+
+	if (th->rst) {
+		if (fl->state != FLOW_DEAD)
+			st.flows_failed++;
+		fl->state = FLOW_DEAD;
+		return;
+	}
+
+	if (th->syn && th->ack && fl->state == FLOW_SYN_SENT) {
+		const uint8_t *o = (const uint8_t *)(th + 1);
+		const uint8_t *e = (const uint8_t *)th + th->doff * 4;
+
+		while (o < e && *o != TCPOPT_EOL) {
+			if (*o == TCPOPT_NOP) {
+				o++;
+				continue;
+			}
+			if (o + 1 >= e || o[1] < 2)
+				break;
+			if (*o == TCPOPT_WINDOW && o[1] == TCPOLEN_WINDOW &&
+			    o + 2 < e)
+				fl->ws = o[2] > 14 ? 14 : o[2];
+			o += o[1];
+		}
+
+		fl->state = FLOW_ESTABLISHED;
+		fl->rcv_nxt = seq + 1;
+		fl->snd_una = ack;
+		fl->wnd = ntohs(th->window);
+		return;
+	}
+
+	if (fl->state != FLOW_ESTABLISHED || !th->ack)
+		return;
+
+	if (SEQ_GE(ack, fl->snd_una))
+		fl->snd_una = ack;
+	fl->wnd = (uint32_t)ntohs(th->window) << fl->ws;
+
+	for (; fl->q_head != fl->q_tail; fl->q_head++) {
+		unsigned int j = fl->q_head % ACK_QUEUE;
+
+		if (!SEQ_GE(ack, fl->q[j].end))
+			break;
+		if (fl->q[j].ns)
+			sample_add(&tcp_ack, now - fl->q[j].ns);
+	}
+
+	end = seq + l4len - th->doff * 4 + th->fin;
+	if (SEQ_GT(end, fl->rcv_nxt))
+		fl->rcv_nxt = end;
+}
+
+/**
+ * rx_frame() - Handle frame sent by passt
+ * @p:		Frame
+ * @len:	Frame length
+ * @now:	Current timestamp, nanoseconds
+ */
+static void rx_frame(const char *p, size_t len, uint64_t now)
+{
+	size_t l4off, l4len;
+	const char *l4;
+	uint8_t proto;
+	uint32_t tag;
+	int v6;
+
+	st.rx_frames++;
+
+	if (len < sizeof(struct ethhdr) ||
+	    !(l4off = frame_l4(p, len, &v6, &proto, &l4len)))
+		return;
+
+	l4 = p + l4off;
+
+	if (proto == IPPROTO_TCP) {
+		if (l4len >= sizeof(struct tcphdr))
+			rx_tcp((const struct tcphdr *)l4, l4len, v6, now);
+		return;
+	}
+
+	if (l4len < 8 + sizeof(tag))
+		return;
+
+	if (!(proto == IPPROTO_UDP ||
+	      (!v6 && proto == IPPROTO_ICMP &&
+	       ((const struct icmphdr *)l4)->type == ICMP_ECHOREPLY) ||
+	      (v6 && proto == IPPROTO_ICMPV6 &&
+	       ((const struct icmp6_hdr *)l4)->icmp6_type == ICMP6_ECHO_REPLY)))
+		return;
+
+	memcpy(&tag, l4 + 8, sizeof(tag));
+	tag = ntohl(tag);
+
+	if (tags[tag % TAG_RING].tag == tag && tags[tag % TAG_RING].ns) {
+		sample_add(&echo_rtt, now - tags[tag % TAG_RING].ns);
+		tags[tag % TAG_RING].ns = 0;
+	}
+}
+
+/**
+ * rx() - Receive and handle frames from passt
+ * @fd:		Socket connected to passt
+ * @timeout:	Timeout for poll(), milliseconds
+ *
+ * Return: number of frames received
+ */
+static int rx(int fd, int timeout)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	size_t off = 0;
+	uint64_t now;
+	ssize_t n;
+	int count = 0;
+
+	if (poll(&pfd, 1, timeout) <= 0)
+		return 0;
+
+	n = recv(fd, rx_buf + rx_len, sizeof(rx_buf) - rx_len, MSG_DONTWAIT);
+	if (n <= 0) {
+		if (!n || (errno != EAGAIN && errno != EINTR)) {
+			fprintf(stderr, "Connection to passt closed\n");
+			exit(EXIT_FAILURE);
+		}
+		return 0;
+	}
+	rx_len += n;
+	now = now_ns();
+
+	while (rx_len - off >= sizeof(uint32_t)) {
+		uint32_t len;
+
+		memcpy(&len, rx_buf + off, sizeof(len));
+		len = ntohl(len);
+
+		if (rx_len - off < sizeof(len) + len)
+			break;
+
+		rx_frame(rx_buf + off + sizeof(len), len, now);
+		off += sizeof(len) + len;
+		count++;
+	}
+
+	memmove(rx_buf, rx_buf + off, rx_len - off);
+	rx_len -= off;
+
+	return count;
+}
+
+/**
+ * tx_flush() - Write out pending frames, receiving frames meanwhile
+ * @fd:		Socket connected to passt
+ */
+static void tx_flush(int fd)
+{
+	uint64_t now = now_ns();
+	size_t off = 0;
+	int i;
+
+	for (i = 0; i < tx_stamps_n; i++)
+		*tx_stamps[i] = now;
+	tx_stamps_n = 0;
+
+	while (off < tx_len) {
+		struct pollfd pfd = { fd, POLLIN | POLLOUT, 0 };
+		ssize_t n;
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pfd.revents & POLLIN)
+			rx(fd, 0);
+
+		if (!(pfd.revents & POLLOUT))
+			continue;
+
+		n = send(fd, tx_buf + off, tx_len - off,
+			 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("send");
+			exit(EXIT_FAILURE);
+		}
+		off += n;
+	}
+
+	tx_len = 0;
+	rx(fd, 0);
+}
+
+/**
+ * tx_ready() - Check if frame can be sent now, or should wait for passt
+ * @f:		Frame
+ *
+ * Return: 1 if ready, 0 to wait, -1 if frame should be skipped
+ */
+static int tx_ready(const struct frame *f)
+{
+	const struct tcphdr *th;
+	struct flow *fl;
+	uint32_t end;
+	size_t dlen;
+
+	if (f->proto != IPPROTO_TCP)
+		return 1;
+
+	if (f->flow < 0)
+		return -1;
+
+	fl = &flows[f->flow];
+	th = (const struct tcphdr *)(cap + f->off + f->l4off);
+
+	if (fl->state == FLOW_DEAD)
+		return -1;
+
+	if (th->syn && !th->ack)
+		return 1;
+
+	if (fl->state != FLOW_ESTABLISHED)
+		return 0;
+
+	dlen = f->len - f->l4off - th->doff * 4;
+	end = ntohl(th->seq) + dlen;
+	return !dlen || !SEQ_GT(end, fl->snd_una + fl->wnd);
+}
+
+/**
+ * tx_frame() - Queue frame with length descriptor, update TCP and tag fields
+ * @fd:		Socket connected to passt, used if buffer is full
+ * @f:		Frame
+ */
+static void tx_frame(int fd, const struct frame *f)
+{
+	uint32_t vnet_len = htonl(f->len);
+	uint16_t *check;
+	char *p;
+
+	if (tx_len + sizeof(vnet_len) + f->len > sizeof(tx_buf) ||
+	    tx_stamps_n == TX_STAMPS)
+		tx_flush(fd);
+
+	memcpy(tx_buf + tx_len, &vnet_len, sizeof(vnet_len));
+	p = tx_buf + tx_len + sizeof(vnet_len);
+	memcpy(p, cap + f->off, f->len);
+	tx_len += sizeof(vnet_len) + f->len;
+
+	check = f->check_off ? (uint16_t *)(p + f->check_off) : NULL;
+
+	if (f->proto == IPPROTO_TCP) {
+		struct tcphdr *th = (struct tcphdr *)(p + f->l4off);
+		struct flow *fl = &flows[f->flow];
+		size_t dlen = f->len - f->l4off - th->doff * 4;
+
+		if (th->syn && !th->ack) {
+			fl->state = fl->state == FLOW_NEW ? FLOW_SYN_SENT
+							  : fl->state;
+			run_flow[f->v6][ntohs(th->source)] = f->flow;
+		}
+
+		if (th->ack) {
+			uint32_t ack = htonl(fl->rcv_nxt);
+
+			csum_rewrite(check, &th->ack_seq, &ack, sizeof(ack));
+			th->ack_seq = ack;
+		}
+
+		if (dlen && fl->q_tail - fl->q_head < ACK_QUEUE) {
+			unsigned int j = fl->q_tail++ % ACK_QUEUE;
+
+			fl->q[j].end = ntohl(th->seq) + dlen;
+			fl->q[j].ns = 0;
+			tx_stamps[tx_stamps_n++] = &fl->q[j].ns;
+		}
+	} else if (f->tag_off) {
+		uint32_t tag = htonl(tag_next);
+
+		csum_rewrite(check, p + f->tag_off, &tag, sizeof(tag));
+		memcpy(p + f->tag_off, &tag, sizeof(tag));
+
+		tags[tag_next % TAG_RING].tag = tag_next;
+		tags[tag_next % TAG_RING].ns = 0;
+		tx_stamps[tx_stamps_n++] = &tags[tag_next % TAG_RING].ns;
+		tag_next++;
+	}
+
+	st.tx_frames++;
+	st.tx_bytes += f->len;
+}
+
+/**
+ * u32_cmp() - Compare two uint32_t values, for qsort()
+ * @a:		First value
+ * @b:		Second value
+ *
+ * Return: negative, zero or positive, as usual
+ */
+static int u32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * samples_print() - Print count, minimum, median, 99th percentile and maximum
+ * @name:	Prefix for metric names
+ * @s:		Samples
+ */
+static void samples_print(const char *name, struct samples *s)
+{
+	printf("%s_samples,%zu\n", name, s->n);
+	if (!s->n)
+		return;
+
+	qsort(s->v, s->n, sizeof(*s->v), u32_cmp);
+	printf("%s_us_min,%.1f\n", name, s->v[0] / 1000.);
+	printf("%s_us_p50,%.1f\n", name, s->v[s->n / 2] / 1000.);
+	printf("%s_us_p99,%.1f\n", name, s->v[s->n * 99 / 100] / 1000.);
+	printf("%s_us_max,%.1f\n", name, s->v[s->n - 1] / 1000.);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = SOCKET_DEFAULT;
+	unsigned char mac[ETH_ALEN];
+	uint64_t start, end, cpu;
+	int fd, opt, has_mac = 0;
+	pid_t server, passt;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "s:g:m:h")) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'g':
+			if (inet_pton(AF_INET, optarg, &gw4) == 1)
+				has_gw4 = 1;
+			else if (inet_pton(AF_INET6, optarg, &gw6) == 1)
+				has_gw6 = 1;
+			else
+				usage(argv[0]);
+			break;
+		case 'm':
+			if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+				   &mac[0], &mac[1], &mac[2],
+				   &mac[3], &mac[4], &mac[5]) != ETH_ALEN)
+				usage(argv[0]);
+			has_mac = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	pcap_load(argv[optind], has_mac ? mac : NULL);
+	if (!frames_n) {
+		fprintf(stderr, "No frames from guest in capture\n");
+		exit(EXIT_FAILURE);
+	}
+
+	server = servers_start();
+	fd = tap_connect(path, &passt);
+
+	cpu = cpu_ns(passt);
+	start = now_ns();
+
+	for (i = 0; i < frames_n; i++) {
+		const struct frame *f = &frames[i];
+		uint64_t deadline = 0;
+		int r;
+
+		while (!(r = tx_ready(f))) {
+			if (!deadline) {
+				tx_flush(fd);
+				deadline = now_ns() + WAIT_MS * 1000000ULL;
+			} else if (now_ns() > deadline) {
+				flows[f->flow].state = FLOW_DEAD;
+				st.flows_failed++;
+				r = -1;
+				break;
+			}
+
+			rx(fd, WAIT_MS / 10);
+		}
+
+		if (r < 0) {
+			st.skipped++;
+			continue;
+		}
+
+		tx_frame(fd, f);
+	}
+	tx_flush(fd);
+	end = now_ns();
+
+	while (rx(fd, DRAIN_MS))
+		;
+
+	cpu = cpu_ns(passt) - cpu;
+
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+
+	printf("frames_tx,%lu\n", st.tx_frames);
+	printf("frames_skipped,%lu\n", st.skipped);
+	printf("frames_rx,%lu\n", st.rx_frames);
+	printf("bytes_tx,%llu\n", st.tx_bytes);
+	printf("tx_seconds,%.6f\n", (end - start) / 1e9);
+	printf("tx_frames_per_second,%.0f\n", st.tx_frames * 1e9 / (end - start));
+	printf("tx_mbit_per_second,%.1f\n",
+	       st.tx_bytes * 8 * 1e3 / (end - start));
+	printf("tcp_flows,%i\n", flows_n);
+	printf("tcp_flows_failed,%i\n", st.flows_failed);
+	printf("passt_cpu_ns_per_frame,%.0f\n",
+	       st.tx_frames ? (double)cpu / st.tx_frames : 0);
+	samples_print("echo_rtt", &echo_rtt);
+	samples_print("tcp_ack", &tcp_ack);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/siphash.c - Microbenchmark for fixed-length SipHash functions
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../siphash.h"
+#include "bench.h"
+
+#define OPS			(4UL << 20)
+
+int main(void)
+{
+	uint64_t k[2] = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+	uint8_t in[40] __attribute__ ((aligned(8)));
+	unsigned long i;
+
+	memset(in, 0x5a, sizeof(in));
+
+	bench_header("siphash");
+
+	/* Variants name users: tcp_seq_init() and tcp_hash(), for IPv4 or IPv6.
+	 * Vary input at each iteration, so that nothing can be hoisted out.
+	 */
+	BENCH("siphash_12b", "seq_init4", 12, OPS, i,
+	      (memcpy(in, &i, sizeof(i)), bench_sink += siphash_12b(in, k)));
+	BENCH("siphash_20b", "hash6", 20, OPS, i,
+	      (memcpy(in, &i, sizeof(i)), bench_sink += siphash_20b(in, k)));
+	BENCH("siphash_36b", "seq_init6", 36, OPS, i,
+	      (memcpy(in, &i, sizeof(i)), bench_sink += siphash_36b(in, k)));
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/tap.c - Microbenchmark for frame classification in tap4_handler()
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Build batches of BATCH IPv4 frames with different mixes of L4 tuples, and
+ * pass them to tap4_handler() with TCP and UDP handlers disabled, so that only
+ * header validation and grouping into per-tuple sequences is measured.
+ */
+
+#include <syslog.h>
+#include <time.h>
+
+#include "../tap.c"
+
+#include "bench.h"
+
+#define BATCH			64
+#define FRAME_LEN		1514
+#define OPS			(64UL << 10)
+
+/* Defined in passt.c, not linked here */
+char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
+char *ip_proto_str[IPPROTO_SCTP + 1];
+
+/**
+ * proto_update_l2_buf() - Stub, L2 buffers are not used here
+ * @eth_d:	Ethernet destination address, unused
+ * @eth_s:	Ethernet source address, unused
+ * @ip_da:	IPv4 destination address, unused
+ */
+void proto_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
+			 const struct in_addr *ip_da)
+{
+	(void)eth_d;
+	(void)eth_s;
+	(void)ip_da;
+}
+
+/**
+ * frame_fill() - Write Ethernet, IPv4 and L4 headers for a frame
+ * @p:		Start of frame
+ * @proto:	IPPROTO_TCP or IPPROTO_UDP
+ * @flow:	Flow number, selects destination address and source port
+ * @ok:		Set for a valid frame, clear for a bad IPv4 total length
+ */
+static void frame_fill(char *p, uint8_t proto, int flow, int ok)
+{
+	struct ethhdr *eh = (struct ethhdr *)p;
+	struct iphdr *iph = (struct iphdr *)(eh + 1);
+	struct udphdr *uh = (struct udphdr *)(iph + 1);
+	struct tcphdr *th = (struct tcphdr *)(iph + 1);
+
+	memset(p, 0, FRAME_LEN);
+
+	eh->h_proto = htons(ETH_P_IP);
+
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->ttl = 64;
+	iph->protocol = proto;
+	iph->tot_len = htons(FRAME_LEN - sizeof(*eh) + !ok);
+	iph->saddr = htonl(0x0a000002);
+	iph->daddr = htonl(0xc0000201 + flow);
+
+	if (proto == IPPROTO_UDP) {
+		uh->source = htons(40000 + flow);
+		uh->dest = htons(5201);
+		uh->len = htons(FRAME_LEN - sizeof(*eh) - sizeof(*iph));
+	} else {
+		th->source = htons(40000 + flow);
+		th->dest = htons(5201);
+		th->doff = sizeof(*th) / 4;
+		th->ack = 1;
+	}
+}
+
+/**
+ * batch_fill() - Fill input pool with a batch of frames
+ * @in:		Input pool, frames are stored at the beginning of pkt_buf
+ * @proto:	IPPROTO_TCP or IPPROTO_UDP, zero to alternate between them
+ * @flows:	Number of different flows, used in round-robin order
+ * @bad:	Every @bad frames, one has a bad length, zero for none
+ */
+static void batch_fill(struct pool *in, uint8_t proto, int flows, int bad)
+{
+	int i;
+
+	pool_flush(in);
+
+	for (i = 0; i < BATCH; i++) {
+		char *p = pkt_buf + i * FRAME_LEN;
+		uint8_t pr = proto;
+
+		if (!pr)
+			pr = (i / flows) % 2 ? IPPROTO_UDP : IPPROTO_TCP;
+
+		frame_fill(p, pr, i % flows, !bad || i % bad);
+		packet_add(in, FRAME_LEN, p);
+	}
+}
+
+int main(void)
+{
+	static const struct {
+		const char *variant;
+		uint8_t proto;
+		int flows;
+		int bad;
+	} v[] = {
+		{ "tcp_1flow",		IPPROTO_TCP,	1,	0 },
+		{ "tcp_8flows",		IPPROTO_TCP,	8,	0 },
+		{ "tcp_64flows",	IPPROTO_TCP,	64,	0 },
+		{ "udp_1flow",		IPPROTO_UDP,	1,	0 },
+		{ "mixed_8flows",	0,		8,	0 },
+		{ "tcp_bad_1in4",	IPPROTO_TCP,	1,	4 },
+	};
+	struct ctx c = { .mode = MODE_PASST, .ifi4 = 1,
+			 .no_tcp = 1, .no_udp = 1, .no_icmp = 1 };
+	size_t sz = sizeof(pkt_buf);
+	struct timespec now;
+	unsigned long i;
+	unsigned int j;
+
+	__setlogmask(LOG_UPTO(LOG_ERR));
+
+	/* As tap_sock_init() does, without creating any socket */
+	pool_tap4_storage = PACKET_INIT(pool_tap4, TAP_MSGS, pkt_buf, sz);
+	for (j = 0; j < TAP_SEQS; j++)
+		tap4_l4[j].p = PACKET_INIT(pool_l4, TAP_SEQS, pkt_buf, sz);
+
+	c.ip4.addr_seen.s_addr = htonl(0x0a000002);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	bench_header("tap");
+
+	for (j = 0; j < ARRAY_SIZE(v); j++) {
+		batch_fill(pool_tap4, v[j].proto, v[j].flows, v[j].bad);
+
+		BENCH_BATCH("tap4_handler", v[j].variant, FRAME_LEN, OPS,
+			    BATCH, i,
+			    bench_sink += tap4_handler(&c, pool_tap4, &now));
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/tap_csum.c - Microbenchmark for UDP over IPv6 with --csum-offload
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Prepare the UDP checksum of an IPv6 frame and send it with tap_send_csum() to
+ * /dev/null, standing in for the pasta tap, for increasing payload sizes:
+ *
+ * - "full": complete checksum, as udp_sock_fill_data_v6() does by default
+ * - "offload": pseudo-header checksum only, with a virtio-net header asking
+ *   the namespace to complete it
+ *
+ * Before that, check that completing the checksum as the kernel does, from the
+ * offset given in the virtio-net header, gives the same result as the complete
+ * checksum, and that offloaded bytes are counted.
+ */
+
+#include <fcntl.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "../tap.c"
+
+#include "bench.h"
+
+#define FRAME_MAX		(ETH_HLEN + 65535)
+#define OPS			(64UL << 10)
+
+/* Defined in passt.c, not linked here */
+char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
+char *ip_proto_str[IPPROTO_SCTP + 1];
+
+static char frame[FRAME_MAX];
+
+/**
+ * proto_update_l2_buf() - Stub, L2 buffers are not used here
+ * @eth_d:	Ethernet destination address, unused
+ * @eth_s:	Ethernet source address, unused
+ * @ip_da:	IPv4 destination address, unused
+ */
+void proto_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
+			 const struct in_addr *ip_da)
+{
+	(void)eth_d;
+	(void)eth_s;
+	(void)ip_da;
+}
+
+/**
+ * udp6_fill() - Set checksum and send UDP over IPv6 frame, as udp.c does
+ * @c:		Execution context, selects checksum offload
+ * @len:	UDP payload length
+ *
+ * Return: return code from tap_send_csum()
+ */
+static int udp6_fill(const struct ctx *c, size_t len)
+{
+	struct ethhdr *eh = (struct ethhdr *)frame;
+	struct ipv6hdr *ip6h = (struct ipv6hdr *)(eh + 1);
+	struct udphdr *uh = (struct udphdr *)(ip6h + 1);
+	size_t ip_len = sizeof(*ip6h) + sizeof(*uh) + len;
+
+	eh->h_proto = htons(ETH_P_IPV6);
+
+	ip6h->payload_len = htons(sizeof(*uh) + len);
+	inet_pton(AF_INET6, "2001:db8::1", &ip6h->saddr);
+	inet_pton(AF_INET6, "2001:db8::2", &ip6h->daddr);
+
+	uh->source = htons(5201);
+	uh->dest = htons(40000);
+	uh->len = ip6h->payload_len;
+
+	if (c->csum_offload) {
+		struct in6_addr saddr = ip6h->saddr, daddr = ip6h->daddr;
+
+		uh->check = csum_ip6_pseudo(&saddr, &daddr, ntohs(uh->len),
+					    IPPROTO_UDP);
+	} else {
+		ip6h->hop_limit = IPPROTO_UDP;
+		ip6h->version = ip6h->nexthdr = uh->check = 0;
+		uh->check = csum(ip6h, ip_len, 0);
+	}
+
+	ip6h->version = 6;
+	ip6h->nexthdr = IPPROTO_UDP;
+	ip6h->hop_limit = 255;
+
+	return tap_send_csum(c, frame, ETH_HLEN + ip_len);
+}
+
+/**
+ * udp6_check() - Check that completion of offloaded checksum gives full one
+ * @c:		Execution context
+ * @len:	UDP payload length
+ *
+ * Return: 0 on match, -1 on mismatch or if offloaded bytes weren't counted
+ */
+static int udp6_check(struct ctx *c, size_t len)
+{
+	const struct udphdr *uh = (struct udphdr *)(frame + ETH_HLEN +
+						    sizeof(struct ipv6hdr));
+	size_t l4len = sizeof(*uh) + len;
+	uint64_t offloaded = stats.csum_offload_bytes;
+	uint16_t full;
+
+	c->csum_offload = 0;
+	udp6_fill(c, len);
+	full = uh->check;
+
+	c->csum_offload = 1;
+	udp6_fill(c, len);
+
+	if (stats.csum_offload_bytes - offloaded != l4len)
+		return -1;
+
+	/* As skb_checksum_help(): sum from csum_start, field holds pseudo */
+	return csum(uh, l4len, 0) == full ? 0 : -1;
+}
+
+int main(void)
+{
+	size_t sizes[] = { 64, 512, 1452, 8952, 65527 };
+	struct ctx c = { .mode = MODE_PASTA };
+	unsigned long i;
+	unsigned int j;
+
+	__setlogmask(LOG_UPTO(LOG_ERR));
+
+	if ((c.fd_tap = open("/dev/null", O_WRONLY)) < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	for (j = 0; j < sizeof(frame); j++)
+		frame[j] = rand();
+	memset(frame, 0, ETH_HLEN + sizeof(struct ipv6hdr));
+
+	for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+		if (udp6_check(&c, sizes[j])) {
+			fprintf(stderr, "Offloaded checksum mismatch, %zu bytes\n",
+				sizes[j]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	bench_header("tap_csum");
+
+	for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+		c.csum_offload = 0;
+		BENCH("tap_send_csum", "full", sizes[j], OPS, i,
+		      bench_sink += udp6_fill(&c, sizes[j]));
+
+		c.csum_offload = 1;
+		BENCH("tap_send_csum", "offload", sizes[j], OPS, i,
+		      bench_sink += udp6_fill(&c, sizes[j]));
+	}
+
+	return EXIT_SUCCESS;
+}
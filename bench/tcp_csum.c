@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/tcp_csum.c - Microbenchmark for tcp_l2_buf_fill_headers() in batches
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Fill headers for full batches of frames of the same connection, with a
+ * shorter last frame, as tcp_data_from_sock() does, for IPv4 and IPv6, with
+ * and without --csum-offload, for a 1460 bytes and a 64 KiB MSS:
+ *
+ * - "scratch": checksums computed for every frame, passing no previous buffer
+ * - "incremental": checksums updated from the previous frame (RFC 1624)
+ *
+ * Results are per frame. Before that, check that both ways give the same
+ * checksums.
+ */
+
+#include <syslog.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../tcp.c"
+
+#include "bench.h"
+
+#define BATCH			TCP_FRAMES_MEM
+#define BATCH_BYTES		(256UL << 20)	/* Payload bytes for one run */
+#define LAST_LEN		100		/* Payload of last frame */
+
+/* Defined in passt.c, not linked here */
+char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
+char *ip_proto_str[IPPROTO_SCTP + 1];
+
+/**
+ * proto_update_l2_buf() - Stub, L2 buffers are set up directly here
+ * @eth_d:	Ethernet destination address, unused
+ * @eth_s:	Ethernet source address, unused
+ * @ip_da:	IPv4 destination address, unused
+ */
+void proto_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
+			 const struct in_addr *ip_da)
+{
+	(void)eth_d;
+	(void)eth_s;
+	(void)ip_da;
+}
+
+/**
+ * batch_fill() - Fill headers for a batch of frames, as tcp_data_to_tap() does
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @mss:	Payload length for all frames but the last one
+ * @incr:	Update checksums from the previous frame
+ *
+ * Return: sum of 802.3 lengths
+ */
+static size_t batch_fill(const struct ctx *c, struct tcp_conn *conn,
+			 size_t mss, int incr)
+{
+	uint32_t seq = conn->seq_to_tap;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < BATCH; i++) {
+		size_t plen = i == BATCH - 1 ? LAST_LEN : mss;
+		void *b, *prev;
+
+		if (CONN_V4(conn)) {
+			b = &tcp4_l2_buf[i];
+			prev = incr && i ? &tcp4_l2_buf[i - 1] : NULL;
+		} else {
+			b = &tcp6_l2_buf[i];
+			prev = incr && i ? &tcp6_l2_buf[i - 1] : NULL;
+		}
+
+		len += tcp_l2_buf_fill_headers(c, conn, b, plen, prev, seq);
+		seq += plen;
+	}
+
+	return len;
+}
+
+/**
+ * batch_check() - Check that incremental and full updates give same checksums
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @mss:	Payload length for all frames but the last one
+ *
+ * Return: 0 on match, -1 on mismatch
+ */
+static int batch_check(const struct ctx *c, struct tcp_conn *conn, size_t mss)
+{
+	static uint16_t check[BATCH][2];
+	int i;
+
+	batch_fill(c, conn, mss, 0);
+	for (i = 0; i < BATCH; i++) {
+		if (CONN_V4(conn)) {
+			check[i][0] = tcp4_l2_buf[i].iph.check;
+			check[i][1] = tcp4_l2_buf[i].th.check;
+		} else {
+			check[i][1] = tcp6_l2_buf[i].th.check;
+		}
+	}
+
+	batch_fill(c, conn, mss, 1);
+	for (i = 0; i < BATCH; i++) {
+		if (CONN_V4(conn)) {
+			if (check[i][0] != tcp4_l2_buf[i].iph.check ||
+			    check[i][1] != tcp4_l2_buf[i].th.check)
+				return -1;
+		} else if (check[i][1] != tcp6_l2_buf[i].th.check) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	static const size_t mss[] = { 1460, MIN(MSS4, MSS6) };
+	static const char *af_name[] = { "ipv4", "ipv6" };
+	const char *impl = csum_select(NULL);
+	struct ctx c = { .mode = MODE_PASST };
+	struct tcp_conn conn[2] = { 0 };
+	unsigned int af, offload, j;
+	char variant[BUFSIZ];
+	unsigned long i, ops;
+
+	__setlogmask(LOG_UPTO(LOG_ERR));
+
+	inet_pton(AF_INET, "192.0.2.2", &c.ip4.addr_seen);
+	inet_pton(AF_INET6, "2001:db8::2", &c.ip6.addr_seen);
+
+	tcp_sock4_iov_init();
+	tcp_sock6_iov_init();
+	tcp_update_l2_buf(NULL, NULL, &c.ip4.addr_seen);
+
+	inet_pton(AF_INET6, "::ffff:192.0.2.1", &conn[0].a.a6);
+	inet_pton(AF_INET6, "2001:db8::1", &conn[1].a.a6);
+	for (af = 0; af < ARRAY_SIZE(conn); af++) {
+		conn[af].sock_port = 80;
+		conn[af].tap_port = 54321;
+		conn[af].events = ESTABLISHED;
+		conn[af].wnd_to_tap = 65535;
+		conn[af].sock = 42;
+	}
+
+	for (af = 0; af < ARRAY_SIZE(conn); af++) {
+		for (offload = 0; offload < 2; offload++) {
+			c.csum_offload = offload;
+
+			for (j = 0; j < ARRAY_SIZE(mss); j++) {
+				if (!batch_check(&c, &conn[af], mss[j]))
+					continue;
+
+				fprintf(stderr, "Checksum mismatch: %s%s, %zu\n",
+					af_name[af], offload ? " offload" : "",
+					mss[j]);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	bench_header("tcp_csum");
+	printf("# ops: frames, batches of %i with last frame of %i bytes\n",
+	       BATCH, LAST_LEN);
+	printf("# checksum implementation: %s\n", impl);
+
+	for (af = 0; af < ARRAY_SIZE(conn); af++) {
+		for (offload = 0; offload < 2; offload++) {
+			c.csum_offload = offload;
+
+			for (j = 0; j < ARRAY_SIZE(mss); j++) {
+				ops = BATCH_BYTES / (mss[j] * BATCH) + 1;
+
+				snprintf(variant, sizeof(variant), "%s%s_scratch",
+					 af_name[af], offload ? "_offload" : "");
+				BENCH_BATCH("tcp_l2_buf_fill_headers", variant,
+					    mss[j], ops, BATCH, i,
+					    bench_sink += batch_fill(&c, &conn[af],
+								     mss[j], 0));
+
+				snprintf(variant, sizeof(variant),
+					 "%s%s_incremental", af_name[af],
+					 offload ? "_offload" : "");
+				BENCH_BATCH("tcp_l2_buf_fill_headers", variant,
+					    mss[j], ops, BATCH, i,
+					    bench_sink += batch_fill(&c, &conn[af],
+								     mss[j], 1));
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/tcp_hash.c - Microbenchmark for tcp_hash_lookup() on a full table
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Fill the connection table with CONNS entries, half IPv4 and half IPv6, with
+ * random addresses and ports, then look them up in insertion order, in random
+ * order, and look up tuples that are not in the table.
+ */
+
+#include <syslog.h>
+#include <time.h>
+
+#include "../tcp.c"
+
+#include "bench.h"
+
+#define CONNS			(128 * 1024)
+#define OPS			(4UL << 20)
+
+/* Defined in passt.c, not linked here */
+char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
+char *ip_proto_str[IPPROTO_SCTP + 1];
+
+/**
+ * proto_update_l2_buf() - Stub, L2 buffers are not used here
+ * @eth_d:	Ethernet destination address, unused
+ * @eth_s:	Ethernet source address, unused
+ * @ip_da:	IPv4 destination address, unused
+ */
+void proto_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
+			 const struct in_addr *ip_da)
+{
+	(void)eth_d;
+	(void)eth_s;
+	(void)ip_da;
+}
+
+/**
+ * struct tuple - Lookup key, as passed to tcp_hash_lookup()
+ * @af:		Address family
+ * @addr:	Remote address, IPv4 address in first four bytes for AF_INET
+ * @tap_port:	tap-facing port
+ * @sock_port:	Socket-facing port
+ */
+static struct tuple {
+	int af;
+	struct in6_addr addr;
+	in_port_t tap_port;
+	in_port_t sock_port;
+} tuples[CONNS], misses[CONNS];
+
+static unsigned int order[CONNS];
+
+/**
+ * tuple_random() - Fill tuple with random address and ports
+ * @t:		Tuple
+ * @af:		Address family
+ */
+static void tuple_random(struct tuple *t, int af)
+{
+	raw_random(&t->addr, sizeof(t->addr));
+	raw_random(&t->tap_port, sizeof(t->tap_port));
+	raw_random(&t->sock_port, sizeof(t->sock_port));
+	t->af = af;
+}
+
+/**
+ * tuple_lookup() - Look up connection for tuple
+ * @c:		Execution context
+ * @t:		Tuple
+ *
+ * Return: connection pointer, NULL if not found
+ */
+static struct tcp_conn *tuple_lookup(const struct ctx *c, const struct tuple *t)
+{
+	return tcp_hash_lookup(c, t->af, &t->addr, t->tap_port, t->sock_port);
+}
+
+int main(void)
+{
+	struct ctx c = { .mode = MODE_PASST, .ifi4 = 1, .ifi6 = 1,
+			 .tcp.max_conns = CONNS };
+	unsigned long i;
+
+	__setlogmask(LOG_UPTO(LOG_ERR));
+	tcp_init(&c);
+
+	for (i = 0; i < CONNS; i++) {
+		struct tuple *t = &tuples[i];
+		struct tcp_conn *conn;
+
+		tuple_random(t, i % 2 ? AF_INET6 : AF_INET);
+		tuple_random(&misses[i], t->af);
+
+		if (!(conn = ctable_add(&tcp_tab))) {
+			fprintf(stderr, "Can't add connection %lu\n", i);
+			return EXIT_FAILURE;
+		}
+
+		if (t->af == AF_INET) {
+			memset(&conn->a.a4.one, 0xff, sizeof(conn->a.a4.one));
+			memcpy(&conn->a.a4.a, &t->addr, sizeof(conn->a.a4.a));
+		} else {
+			memcpy(&conn->a.a6, &t->addr, sizeof(conn->a.a6));
+		}
+		conn->tap_port = t->tap_port;
+		conn->sock_port = t->sock_port;
+
+		ctable_insert(&tcp_tab, conn);
+	}
+
+	ctable_migrate(&tcp_tab, UINT_MAX);
+
+	for (i = 0; i < CONNS; i++) {
+		if (tuple_lookup(&c, &tuples[i]) != CONN(i)) {
+			fprintf(stderr, "Lookup failed for connection %lu\n", i);
+			return EXIT_FAILURE;
+		}
+		order[i] = i;
+	}
+
+	for (i = CONNS - 1; i > 0; i--) {
+		unsigned int j;
+
+		raw_random(&j, sizeof(j));
+		j %= i + 1;
+		SWAP(order[i], order[j]);
+	}
+
+	bench_header("tcp_hash");
+
+	BENCH("tcp_hash_lookup", "hit_seq", 0, OPS, i,
+	      bench_sink += (uintptr_t)tuple_lookup(&c, &tuples[i % CONNS]));
+	BENCH("tcp_hash_lookup", "hit_random", 0, OPS, i,
+	      bench_sink += (uintptr_t)tuple_lookup(&c,
+						     &tuples[order[i % CONNS]]));
+	BENCH("tcp_hash_lookup", "miss", 0, OPS, i,
+	      bench_sink += (uintptr_t)tuple_lookup(&c, &misses[i % CONNS]));
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/tcp_rebind.c - Microbenchmark for tcp_port_rebind() on timer runs
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Forward increasing numbers of ports from init, as automatic forwarding would
+ * after detecting them, binding listening sockets on a local, non-loopback
+ * IPv4 address and on loopback. Then measure periodic rebinds with unchanged
+ * maps, checking only changed ports, as tcp_timer() does, and checking every
+ * port, as if all the bits changed, which is the cost of a full sweep.
+ */
+
+#include <ifaddrs.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "../tcp.c"
+
+#include "bench.h"
+
+#define PORT_BASE		20000
+#define OPS			1000
+
+/* Defined in passt.c, not linked here */
+char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
+char *ip_proto_str[IPPROTO_SCTP + 1];
+
+/**
+ * proto_update_l2_buf() - Stub, L2 buffers are not used here
+ * @eth_d:	Ethernet destination address, unused
+ * @eth_s:	Ethernet source address, unused
+ * @ip_da:	IPv4 destination address, unused
+ */
+void proto_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
+			 const struct in_addr *ip_da)
+{
+	(void)eth_d;
+	(void)eth_s;
+	(void)ip_da;
+}
+
+/**
+ * local_addr4() - Find a local, non-loopback IPv4 address
+ * @addr:	Address, set on return
+ *
+ * Return: 0 on success, -1 if none was found
+ */
+static int local_addr4(struct in_addr *addr)
+{
+	struct ifaddrs *ifa, *i;
+	int ret = -1;
+
+	if (getifaddrs(&ifa))
+		return -1;
+
+	for (i = ifa; i; i = i->ifa_next) {
+		const struct sockaddr_in *sa;
+
+		if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET)
+			continue;
+
+		sa = (const struct sockaddr_in *)i->ifa_addr;
+		if (IN4_IS_ADDR_LOOPBACK(&sa->sin_addr))
+			continue;
+
+		*addr = sa->sin_addr;
+		ret = 0;
+		break;
+	}
+
+	freeifaddrs(ifa);
+	return ret;
+}
+
+int main(void)
+{
+	static const unsigned int nports[] = { 0, 1000, 4000 };
+	struct ctx c = { .mode = MODE_PASTA, .ifi4 = 1 };
+	struct tcp_port_rebind_arg arg = { &c, 0 };
+	unsigned long i;
+	unsigned int j;
+	in_port_t p;
+
+	__setlogmask(LOG_UPTO(LOG_ERR));
+
+	if (local_addr4(&c.ip4.addr)) {
+		printf("# tcp_rebind: no local IPv4 address, skipping\n");
+		return EXIT_SUCCESS;
+	}
+
+	c.epollfd = epoll_create1(EPOLL_CLOEXEC);
+	c.tcp.fwd_in.mode = c.tcp.fwd_out.mode = FWD_AUTO;
+
+	/* As tcp_init() does, without any connection tracking */
+	memset(tcp_sock_init_lo,	0xff,	sizeof(tcp_sock_init_lo));
+	memset(tcp_sock_init_ext,	0xff,	sizeof(tcp_sock_init_ext));
+	memset(tcp_rebind[0].retry,	0xff,	PORT_BITMAP_SIZE);
+
+	bench_header("tcp_rebind");
+	printf("# bytes: forwarded ports, each with two listening sockets\n");
+
+	for (j = 0; j < ARRAY_SIZE(nports); j++) {
+		for (p = PORT_BASE; p < PORT_BASE + nports[j]; p++)
+			bitmap_set(c.tcp.fwd_in.map, p);
+
+		tcp_port_rebind(&arg);
+
+		for (p = PORT_BASE; p < PORT_BASE + nports[j]; p++) {
+			if (tcp_port_unbound(&c, tcp_sock_init_ext[p]) ||
+			    tcp_port_unbound(&c, tcp_sock_init_lo[p])) {
+				fprintf(stderr, "Failed to bind port %i\n", p);
+				return EXIT_FAILURE;
+			}
+		}
+
+		BENCH("tcp_port_rebind", "diff", nports[j], OPS, i,
+		      tcp_port_rebind(&arg));
+
+		BENCH("tcp_port_rebind", "sweep", nports[j], OPS, i,
+		      (memset(tcp_rebind[0].retry, 0xff, PORT_BITMAP_SIZE),
+		       tcp_port_rebind(&arg)));
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,255 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/tcp_splice.c - Microbenchmark for tcp_sock_handler_splice() transfers
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Set up a spliced connection between two pairs of loopback sockets, then, for
+ * increasing transfer sizes, write to one end, call tcp_sock_handler_splice()
+ * as the main loop would, and read everything on the other end:
+ *
+ * - "copy": no pipe held by the connection, as it is now between transfers, so
+ *   that short transfers are copied with recv() and send()
+ * - "splice": a pipe is taken from the pool before the handler runs, which
+ *   forces the splice() path, as if it was always used
+ * - "sockmap": both sockets are in the BPF sockmap, and the handler isn't
+ *   called at all, as the kernel forwards data. Skipped if BPF isn't permitted
+ *
+ * Then report the cost of opening and closing the two pipes a connection used
+ * to own for its whole lifetime, which connections don't pay anymore, and, with
+ * the sockmap, check that a FIN is passed on once data before it is forwarded.
+ *
+ * This runs in a single namespace, without pasta, so it's not a replacement for
+ * connection rate tests (tcp_crr) through a pasta instance, which weren't run
+ * for on-demand pipes, nor for the loopback throughput tests in pasta_tcp, which
+ * weren't run for the sockmap. Redirects between sockets in different
+ * namespaces aren't covered either.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "../tcp_splice.c"
+
+#include "bench.h"
+
+#define OPS			10000
+
+/* Defined in passt.c, not linked here */
+char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
+char *ip_proto_str[IPPROTO_SCTP + 1];
+
+static char buf[1 << 20];
+
+/**
+ * proto_update_l2_buf() - Stub, L2 buffers are not used here
+ * @eth_d:	Ethernet destination address, unused
+ * @eth_s:	Ethernet source address, unused
+ * @ip_da:	IPv4 destination address, unused
+ */
+void proto_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
+			 const struct in_addr *ip_da)
+{
+	(void)eth_d;
+	(void)eth_s;
+	(void)ip_da;
+}
+
+/**
+ * sock_pair() - Connect two TCP sockets over loopback
+ * @s:		Connecting and accepted socket, set on return
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int sock_pair(int s[2])
+{
+	struct sockaddr_in sa = { .sin_family = AF_INET,
+				  .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t sl = sizeof(sa);
+	int l;
+
+	if ((l = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    bind(l, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(l, 1) || getsockname(l, (struct sockaddr *)&sa, &sl) ||
+	    (s[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    connect(s[0], (struct sockaddr *)&sa, sizeof(sa)) ||
+	    (s[1] = accept4(l, NULL, NULL, SOCK_NONBLOCK)) < 0)
+		return -1;
+
+	close(l);
+	return 0;
+}
+
+/**
+ * xfer() - Write to source peer, forward if needed, read at destination peer
+ * @c:		Execution context
+ * @conn:	Spliced connection
+ * @src:	Peer socket of @conn->a
+ * @dst:	Peer socket of @conn->b
+ * @size:	Bytes to transfer
+ * @splice:	Take pipe from pool first, to force splice() path
+ */
+static void xfer(struct ctx *c, struct tcp_splice_conn *conn, int src, int dst,
+		 size_t size, int splice)
+{
+	union epoll_ref ref = { .r.proto = IPPROTO_TCP,
+				.r.p.tcp.tcp.splice = 1,
+				.r.p.tcp.tcp.index = conn - tc };
+	size_t done = 0;
+	ssize_t n;
+
+	if (write(src, buf, size) != (ssize_t)size)
+		exit(EXIT_FAILURE);
+
+	if (splice && tcp_splice_pipe_get(c, conn->pipe_a_b))
+		exit(EXIT_FAILURE);
+
+	ref.r.s = conn->a;
+	if (!(conn->flags & IN_SOCKMAP))
+		tcp_sock_handler_splice(c, ref, EPOLLIN);
+
+	while (done < size) {
+		if ((n = recv(dst, buf, size - done, MSG_DONTWAIT)) > 0) {
+			done += n;
+			continue;
+		}
+
+		if (conn->flags & IN_SOCKMAP)
+			continue;
+
+		if (conn->events & B_OUT_WAIT) {
+			ref.r.s = conn->b;
+			tcp_sock_handler_splice(c, ref, EPOLLOUT);
+		} else {
+			ref.r.s = conn->a;
+			tcp_sock_handler_splice(c, ref, EPOLLIN);
+		}
+	}
+
+	if (conn->flags & CLOSING)
+		exit(EXIT_FAILURE);
+}
+
+/**
+ * fin() - Send FIN from source peer, run main loop until it's passed on
+ * @c:		Execution context
+ * @src:	Peer socket of @conn->a
+ * @dst:	Peer socket of @conn->b
+ *
+ * Return: 0 if @dst sees end of file, -1 on failure or timeout
+ */
+static int fin(struct ctx *c, int src, int dst)
+{
+	struct epoll_event ev[8];
+	int i, n, loops;
+
+	if (write(src, buf, 1) != 1 || shutdown(src, SHUT_WR))
+		return -1;
+
+	for (loops = 0; loops < 1000; loops++) {
+		if (recv(dst, buf, sizeof(buf), MSG_DONTWAIT) == 0)
+			return 0;
+
+		n = epoll_wait(c->epollfd, ev, ARRAY_SIZE(ev), 1);
+		for (i = 0; i < n; i++) {
+			union epoll_ref ref = { .u64 = ev[i].data.u64 };
+
+			tcp_sock_handler_splice(c, ref, ev[i].events);
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * pipes_open_close() - Open and close two pipes, as connections used to do
+ * @c:		Execution context
+ */
+static void pipes_open_close(const struct ctx *c)
+{
+	int p[2][2];
+
+	if (tcp_splice_pipe_open(c, p[0]) || tcp_splice_pipe_open(c, p[1]))
+		exit(EXIT_FAILURE);
+
+	close(p[0][0]);
+	close(p[0][1]);
+	close(p[1][0]);
+	close(p[1][1]);
+}
+
+int main(void)
+{
+	size_t sizes[] = { 64, 512, 4096, 16384, 65536 };
+	struct ctx c = { .mode = MODE_PASTA, .sockmap = 1 };
+	struct tcp_splice_conn *conn;
+	int pa[2], pb[2], sockmap;
+	unsigned long i;
+	unsigned j;
+
+	__setlogmask(LOG_UPTO(LOG_ERR));
+
+	if ((c.epollfd = epoll_create1(0)) < 0 ||
+	    sock_pair(pa) || sock_pair(pb)) {
+		fprintf(stderr, "Can't set up sockets: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	tcp_splice_init(&c);
+	tcp_splice_pipe_refill(&c);
+
+	/* Not for the first variants: the handler would hand over connection */
+	sockmap = c.sockmap;
+	c.sockmap = 0;
+
+	conn = CONN(c.tcp.splice_conn_count++);
+	conn->a = pa[1];
+	conn->b = pb[0];
+	conn->pipe_a_b[0] = conn->pipe_a_b[1] = -1;
+	conn->pipe_b_a[0] = conn->pipe_b_a[1] = -1;
+	conn_event(&c, conn, ESTABLISHED);
+
+	bench_header("tcp_splice");
+
+	for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+		BENCH("tcp_sock_handler_splice", "copy", sizes[j], OPS, i,
+		      xfer(&c, conn, pa[0], pb[1], sizes[j], 0));
+		BENCH("tcp_sock_handler_splice", "splice", sizes[j], OPS, i,
+		      xfer(&c, conn, pa[0], pb[1], sizes[j], 1));
+	}
+
+	BENCH("tcp_splice_pipe_open", "two_pipes", 0, OPS, i,
+	      pipes_open_close(&c));
+
+	if (!sockmap) {
+		printf("# tcp_splice: BPF sockmap not available, skipping\n");
+		return EXIT_SUCCESS;
+	}
+
+	c.sockmap = 1;
+	tcp_splice_sockmap(&c, conn);
+	if (!(conn->flags & IN_SOCKMAP)) {
+		fprintf(stderr, "Can't insert connection into sockmap\n");
+		return EXIT_FAILURE;
+	}
+
+	for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+		BENCH("tcp_sock_handler_splice", "sockmap", sizes[j], OPS, i,
+		      xfer(&c, conn, pa[0], pb[1], sizes[j], 0));
+	}
+
+	if (fin(&c, pa[0], pb[1])) {
+		fprintf(stderr, "FIN not passed on from sockmap\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,188 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * bench/twheel.c - Microbenchmark for timer wheel, against timerfds
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Set TIMERS timers, as many TCP connections would, first as timerfds added to
+ * an epoll instance, as connections used to have, then in a timer wheel, and
+ * report file descriptors used and the cost of re-arming a timer: a
+ * timerfd_settime() call, or tw_add(), without system calls.
+ *
+ * Then check that, with random timeouts and random steps of time, timers fire
+ * exactly at their expiry tick, and measure tw_run() across idle periods of
+ * increasing length, with a timer far ahead, which needs cascading.
+ */
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "../twheel.h"
+#include "bench.h"
+
+#define TIMERS			1024
+#define OPS			(64UL << 10)
+#define CHECK_STEPS		100000
+#define IDLE_OPS		100	/* Far timer mustn't expire: ~15h at most */
+
+static struct tw_entry e[TIMERS];
+static struct twheel w;
+static int fired;
+
+/**
+ * fds_open() - Count open file descriptors
+ *
+ * Return: count of entries in /proc/self/fd, excluding the one used to list it
+ */
+static int fds_open(void)
+{
+	DIR *d = opendir("/proc/self/fd");
+	int n = 0;
+
+	if (!d)
+		return -1;
+
+	while (readdir(d))
+		n++;
+
+	closedir(d);
+	return n - 3;	/* ".", "..", and the descriptor for d itself */
+}
+
+/**
+ * ts_add_ticks() - Advance timestamp by a number of ticks
+ * @ts:		Timestamp, updated
+ * @ticks:	Ticks to add
+ */
+static void ts_add_ticks(struct timespec *ts, unsigned long ticks)
+{
+	unsigned long long ns = ts->tv_nsec +
+				(unsigned long long)ticks * TW_TICK_MS * 1000000;
+
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/**
+ * expire_check() - Timer callback: check that timer fires at its expiry tick
+ * @arg:	Unused
+ * @i:		Index of timer
+ */
+static void expire_check(void *arg, int i)
+{
+	(void)arg;
+
+	if (e[i].expires != w.now) {
+		fprintf(stderr, "Timer %i for tick %u fired at tick %u\n",
+			i, e[i].expires, w.now);
+		exit(EXIT_FAILURE);
+	}
+
+	fired++;
+	tw_add(&w, i, rand() % (600 * 1000));
+}
+
+/**
+ * expire_none() - Timer callback for idle periods: no timer should fire
+ * @arg:	Unused
+ * @i:		Index of timer
+ */
+static void expire_none(void *arg, int i)
+{
+	(void)arg;
+	(void)i;
+
+	fprintf(stderr, "Unexpected expiry\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(void)
+{
+	static const struct {
+		const char *name;
+		unsigned long ticks;
+	} idle[] = {
+		{ "idle_10ms", 1 },	{ "idle_1s", 100 },
+		{ "idle_10s", 1000 },	{ "idle_100s", 10000 },
+	};
+	struct itimerspec its = { .it_value.tv_sec = 1 };
+	struct timespec now;
+	int fds[TIMERS], ep, before, i;
+	unsigned long op;
+	unsigned int j;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	tw_init(&w, e, &now);
+
+	before = fds_open();
+	if ((ep = epoll_create1(0)) < 0)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < TIMERS; i++) {
+		struct epoll_event ev = { .events = EPOLLIN };
+
+		if ((fds[i] = timerfd_create(CLOCK_MONOTONIC, 0)) < 0 ||
+		    epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], &ev))
+			return EXIT_FAILURE;
+	}
+
+	printf("# twheel: %i timers: %i file descriptors with timerfd, "
+	       "%i with timer wheel\n", TIMERS, fds_open() - before, 0);
+
+	bench_header("twheel");
+
+	BENCH("rearm", "timerfd_settime", 0, OPS, op,
+	      bench_sink += timerfd_settime(fds[op % TIMERS], 0, &its, NULL));
+	BENCH("rearm", "tw_add", 0, OPS, op,
+	      tw_add(&w, op % TIMERS, 1000));
+
+	for (i = 0; i < TIMERS; i++) {
+		close(fds[i]);
+		tw_del(&w, i);
+	}
+	close(ep);
+
+	/* Random timeouts up to ten minutes, random steps up to ten seconds */
+	srand(1);
+	for (i = 0; i < TIMERS; i++)
+		tw_add(&w, i, rand() % (600 * 1000));
+
+	for (op = 0; op < CHECK_STEPS; op++) {
+		ts_add_ticks(&now, rand() % 1000);
+		tw_run(&w, &now, expire_check, NULL);
+	}
+
+	if (!fired) {
+		fprintf(stderr, "No timer fired\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("# twheel: %i expiries at expected tick\n", fired);
+
+	for (i = 0; i < TIMERS; i++)
+		tw_del(&w, i);
+
+	/* One timer at ~40 hours, idle periods can't reach it */
+	tw_add(&w, 0, 40 * 3600 * 1000U);
+
+	for (j = 0; j < sizeof(idle) / sizeof(idle[0]); j++) {
+		BENCH("tw_run", idle[j].name, 0, IDLE_OPS, op,
+		      ts_add_ticks(&now, idle[j].ticks);
+		      tw_run(&w, &now, expire_none, NULL));
+	}
+
+	return EXIT_SUCCESS;
+}
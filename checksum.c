@@ -51,11 +51,14 @@
 #include <netinet/tcp.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <linux/udp.h>
 #include <linux/icmp.h>
 #include <linux/icmpv6.h>
 
+#include "checksum.h"
+
 /* Checksums are optional for UDP over IPv4, so we usually just set
  * them to 0.  Change this to 1 to calculate real UDP over IPv4
  * checksums
@@ -99,6 +102,21 @@ uint16_t csum_fold(uint32_t sum)
 	return sum;
 }
 
+/**
+ * csum_update() - Update checksum for a changed 16-bit word, see RFC 1624
+ * @check:	Checksum, complemented, as found in header
+ * @old:	Previous value of 16-bit word
+ * @new:	New value of 16-bit word
+ *
+ * Return: updated checksum, from eq. 3 in RFC 1624: HC' = ~(~HC + ~m + m')
+ */
+uint16_t csum_update(uint16_t check, uint16_t old, uint16_t new)
+{
+	uint32_t sum = (uint16_t)~check + (uint16_t)~old + new;
+
+	return (uint16_t)~csum_fold(sum);
+}
+
 /**
  * csum_unaligned() - Compute TCP/IP-style checksum for not 32-byte aligned data
  * @buf:	Input data
@@ -192,6 +210,27 @@ void csum_udp6(struct udphdr *udp6hr,
 	udp6hr->check = csum_unaligned(payload, len, psum);
 }
 
+/**
+ * csum_ip6_pseudo() - Checksum of IPv6 pseudo-header only, for offload
+ * @saddr:	IPv6 source address
+ * @daddr:	IPv6 destination address
+ * @l4len:	Length of L4 header and payload
+ * @proto:	L4 protocol number
+ *
+ * Return: folded, non-inverted sum, as expected in the L4 checksum field if the
+ *	   receiver completes the checksum (CHECKSUM_PARTIAL)
+ */
+uint16_t csum_ip6_pseudo(const struct in6_addr *saddr,
+			 const struct in6_addr *daddr, size_t l4len,
+			 uint8_t proto)
+{
+	uint32_t psum = sum_16b(saddr, sizeof(*saddr)) +
+			sum_16b(daddr, sizeof(*daddr)) +
+			htons(l4len) + htons(proto);
+
+	return csum_fold(psum);
+}
+
 /**
  * csum_icmp6() - Calculate and set checksum for an ICMPv6 packet
  * @icmp6hr:	ICMPv6 header, initialised apart from checksum
@@ -215,12 +254,113 @@ void csum_icmp6(struct icmp6hdr *icmp6hr,
 	icmp6hr->icmp6_cksum = csum_unaligned(payload, len, psum);
 }
 
-#ifdef __AVX2__
+/**
+ * csum_generic() - Compute 32-bit checksum, portable version
+ * @buf:	Input buffer
+ * @len:	Input length
+ * @init:	Initial 32-bit checksum, 0 for no pre-computed checksum
+ *
+ * Return: 32-bit checksum, not complemented, not folded
+ */
+static uint32_t csum_generic(const void *buf, size_t len, uint32_t init)
+{
+	uint64_t sum64 = (uint64_t)sum_16b(buf, len) + init;
+
+	sum64 = (sum64 >> 32) + (sum64 & 0xffffffff);
+	sum64 += sum64 >> 32;
+
+	return (uint32_t)sum64;
+}
+
+#ifdef __x86_64__
 #include <immintrin.h>
 
+/**
+ * csum_avx512() - Compute 32-bit checksum using AVX-512 SIMD instructions
+ * @buf:	Input buffer, ideally aligned to 32-byte boundary
+ * @len:	Input length
+ * @init:	Initial 32-bit checksum, 0 for no pre-computed checksum
+ *
+ * Same approach as csum_avx2(), with 64-byte vectors: 16-bit words up to the
+ * first 32-byte boundary and one 32-byte block up to the first 64-byte
+ * boundary are summed first, as non-temporal loads need aligned addresses.
+ *
+ * Return: 32-bit checksum, not complemented, not folded
+ */
+__attribute__((target("avx512f")))
+static uint32_t csum_avx512(const void *buf, size_t len, uint32_t init)
+{
+	__m512i a, b, sum_a, sum_b, sum_c, sum_d, zero;
+	const uint16_t *buf16 = buf;
+	const __m512i *buf512;
+	uint64_t sum64 = init;
+	int odd = len & 1;
+
+	if ((uintptr_t)buf & 1)
+		return csum_generic(buf, len, init);
+
+	for (; (uintptr_t)buf16 % sizeof(__m256i) && len >= 2; len -= 2)
+		sum64 += *buf16++;
+
+	if ((uintptr_t)buf16 % sizeof(__m512i) && len >= sizeof(__m256i)) {
+		__m256i x = _mm256_stream_load_si256((__m256i *)buf16);
+		__m256i z = _mm256_setzero_si256();
+		__m256i s = _mm256_add_epi64(_mm256_unpackhi_epi32(x, z),
+					     _mm256_unpacklo_epi32(x, z));
+
+		sum64 += _mm256_extract_epi64(s, 0) + _mm256_extract_epi64(s, 1) +
+			 _mm256_extract_epi64(s, 2) + _mm256_extract_epi64(s, 3);
+
+		buf16 += sizeof(__m256i) / sizeof(*buf16);
+		len -= sizeof(__m256i);
+	}
+
+	buf512 = (const __m512i *)buf16;
+	zero = _mm512_setzero_si512();
+	sum_a = sum_b = sum_c = sum_d = zero;
+
+	for (; len >= sizeof(a) * 2; len -= sizeof(a) * 2, buf512 += 2) {
+		a = _mm512_stream_load_si512((void *)buf512);
+		b = _mm512_stream_load_si512((void *)(buf512 + 1));
+
+		sum_a = _mm512_add_epi64(sum_a, _mm512_unpackhi_epi32(a, zero));
+		sum_b = _mm512_add_epi64(sum_b, _mm512_unpacklo_epi32(a, zero));
+		sum_c = _mm512_add_epi64(sum_c, _mm512_unpackhi_epi32(b, zero));
+		sum_d = _mm512_add_epi64(sum_d, _mm512_unpacklo_epi32(b, zero));
+	}
+
+	if (len >= sizeof(a)) {
+		a = _mm512_stream_load_si512((void *)buf512++);
+
+		sum_a = _mm512_add_epi64(sum_a, _mm512_unpackhi_epi32(a, zero));
+		sum_b = _mm512_add_epi64(sum_b, _mm512_unpacklo_epi32(a, zero));
+		len -= sizeof(a);
+	}
+
+	a = _mm512_add_epi64(_mm512_add_epi64(sum_a, sum_b),
+			     _mm512_add_epi64(sum_c, sum_d));
+	sum64 += _mm512_reduce_add_epi64(a);
+
+	/* Remaining 16-bit words, and last 8 bits */
+	buf16 = (const uint16_t *)buf512;
+	while (len >= sizeof(uint16_t)) {
+		sum64 += *buf16++;
+		len -= sizeof(uint16_t);
+	}
+
+	if (odd)
+		sum64 += *(const uint8_t *)buf16;
+
+	sum64 = (sum64 >> 32) + (sum64 & 0xffffffff);
+	sum64 += sum64 >> 32;
+
+	return (uint32_t)sum64;
+}
+
+
 /**
  * csum_avx2() - Compute 32-bit checksum using AVX2 SIMD instructions
- * @buf:	Input buffer, must be aligned to 32-byte boundary
+ * @buf:	Input buffer, ideally aligned to 32-byte boundary
  * @len:	Input length
  * @init:	Initial 32-bit checksum, 0 for no pre-computed checksum
  *
@@ -244,19 +384,29 @@ void csum_icmp6(struct icmp6hdr *icmp6hr,
  *   outperforms the original hand-coded loop there
  * - sum_a/sum_b unpacking is interleaved and not sequential to reduce stalls
  * - coding style adaptation
+ * - 16-bit words up to the first 32-byte boundary are summed separately, so
+ *   that any even address can be used, see also CSUM_ALIGN in checksum.h
  */
+__attribute__((target("avx2")))
 static uint32_t csum_avx2(const void *buf, size_t len, uint32_t init)
 {
 	__m256i a, b, sum256, sum_a_hi, sum_a_lo, sum_b_hi, sum_b_lo, c, d;
 	__m256i __sum_a_hi, __sum_a_lo, __sum_b_hi, __sum_b_lo;
-	const __m256i *buf256 = (const __m256i *)buf;
+	const uint16_t *buf16 = buf;
+	const __m256i *buf256;
 	const uint64_t *buf64;
-	const uint16_t *buf16;
 	uint64_t sum64 = init;
 	int odd = len & 1;
 	__m128i sum128;
 	__m256i zero;
 
+	if ((uintptr_t)buf & 1)
+		return csum_generic(buf, len, init);
+
+	for (; (uintptr_t)buf16 % sizeof(__m256i) && len >= 2; len -= 2)
+		sum64 += *buf16++;
+
+	buf256 = (const __m256i *)buf16;
 	zero = _mm256_setzero_si256();
 
 	if (len < sizeof(__m256i) * 4)
@@ -384,31 +534,192 @@ less_than_128_bytes:
 }
 
 /**
- * csum() - Compute TCP/IP-style checksum
- * @buf:	Input buffer, must be aligned to 32-byte boundary
+ * csum_sse41() - Compute 32-bit checksum using SSE4.1 SIMD instructions
+ * @buf:	Input buffer, ideally aligned to 16-byte boundary
  * @len:	Input length
  * @init:	Initial 32-bit checksum, 0 for no pre-computed checksum
  *
- * Return: 16-bit folded, complemented checksum sum
+ * Same approach as csum_avx2(), with 16-byte vectors and non-temporal loads
+ * (MOVNTDQA, introduced with SSE4.1), four streams in parallel.
+ *
+ * Return: 32-bit checksum, not complemented, not folded
  */
-uint16_t csum(const void *buf, size_t len, uint32_t init)
+__attribute__((target("sse4.1")))
+static uint32_t csum_sse41(const void *buf, size_t len, uint32_t init)
 {
-	return (uint16_t)~csum_fold(csum_avx2(buf, len, init));
+	__m128i a, b, c, d, sum_a, sum_b, sum_c, sum_d, zero;
+	const uint16_t *buf16 = buf;
+	const __m128i *buf128;
+	uint64_t sum64 = init;
+	int odd = len & 1;
+
+	if ((uintptr_t)buf & 1)
+		return csum_generic(buf, len, init);
+
+	for (; (uintptr_t)buf16 % sizeof(__m128i) && len >= 2; len -= 2)
+		sum64 += *buf16++;
+
+	buf128 = (const __m128i *)buf16;
+	zero = _mm_setzero_si128();
+	sum_a = sum_b = sum_c = sum_d = zero;
+
+	for (; len >= sizeof(a) * 4; len -= sizeof(a) * 4, buf128 += 4) {
+		a = _mm_stream_load_si128((__m128i *)buf128);
+		b = _mm_stream_load_si128((__m128i *)(buf128 + 1));
+		c = _mm_stream_load_si128((__m128i *)(buf128 + 2));
+		d = _mm_stream_load_si128((__m128i *)(buf128 + 3));
+
+		sum_a = _mm_add_epi64(sum_a, _mm_unpackhi_epi32(a, zero));
+		sum_b = _mm_add_epi64(sum_b, _mm_unpacklo_epi32(a, zero));
+		sum_c = _mm_add_epi64(sum_c, _mm_unpackhi_epi32(b, zero));
+		sum_d = _mm_add_epi64(sum_d, _mm_unpacklo_epi32(b, zero));
+
+		sum_a = _mm_add_epi64(sum_a, _mm_unpackhi_epi32(c, zero));
+		sum_b = _mm_add_epi64(sum_b, _mm_unpacklo_epi32(c, zero));
+		sum_c = _mm_add_epi64(sum_c, _mm_unpackhi_epi32(d, zero));
+		sum_d = _mm_add_epi64(sum_d, _mm_unpacklo_epi32(d, zero));
+	}
+
+	for (; len >= sizeof(a); len -= sizeof(a), buf128++) {
+		a = _mm_stream_load_si128((__m128i *)buf128);
+
+		sum_a = _mm_add_epi64(sum_a, _mm_unpackhi_epi32(a, zero));
+		sum_b = _mm_add_epi64(sum_b, _mm_unpacklo_epi32(a, zero));
+	}
+
+	a = _mm_add_epi64(_mm_add_epi64(sum_a, sum_b),
+			  _mm_add_epi64(sum_c, sum_d));
+	sum64 += _mm_extract_epi64(a, 0) + _mm_extract_epi64(a, 1);
+
+	/* Remaining 16-bit words, and last 8 bits */
+	buf16 = (const uint16_t *)buf128;
+	while (len >= sizeof(uint16_t)) {
+		sum64 += *buf16++;
+		len -= sizeof(uint16_t);
+	}
+
+	if (odd)
+		sum64 += *(const uint8_t *)buf16;
+
+	sum64 = (sum64 >> 32) + (sum64 & 0xffffffff);
+	sum64 += sum64 >> 32;
+
+	return (uint32_t)sum64;
 }
 
-#else /* __AVX2__ */
+/* For csum_impl, __builtin_cpu_supports() only takes string literals */
+static int csum_has_avx512(void) { return __builtin_cpu_supports("avx512f"); }
+static int csum_has_avx2(void)   { return __builtin_cpu_supports("avx2"); }
+static int csum_has_sse41(void)  { return __builtin_cpu_supports("sse4.1"); }
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
 
 /**
- * csum() - Compute TCP/IP-style checksum
+ * csum_neon() - Compute 32-bit checksum using NEON SIMD instructions
  * @buf:	Input buffer
  * @len:	Input length
- * @sum:	Initial 32-bit checksum, 0 for no pre-computed checksum
+ * @init:	Initial 32-bit checksum, 0 for no pre-computed checksum
+ *
+ * Pairs of 32-bit words are added and accumulated into 64-bit lanes (UADALP),
+ * from two streams in parallel. NEON loads have no alignment requirements.
  *
- * Return: 16-bit folded, complemented checksum
+ * Return: 32-bit checksum, not complemented, not folded
  */
-uint16_t csum(const void *buf, size_t len, uint32_t init)
+static uint32_t csum_neon(const void *buf, size_t len, uint32_t init)
+{
+	uint64x2_t sum_a = vdupq_n_u64(0), sum_b = vdupq_n_u64(0);
+	const uint8_t *p = buf;
+	uint64_t sum64 = init;
+
+	for (; len >= 64; len -= 64, p += 64) {
+		sum_a = vpadalq_u32(sum_a, vreinterpretq_u32_u8(vld1q_u8(p)));
+		sum_b = vpadalq_u32(sum_b,
+				    vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+		sum_a = vpadalq_u32(sum_a,
+				    vreinterpretq_u32_u8(vld1q_u8(p + 32)));
+		sum_b = vpadalq_u32(sum_b,
+				    vreinterpretq_u32_u8(vld1q_u8(p + 48)));
+	}
+
+	for (; len >= 16; len -= 16, p += 16)
+		sum_a = vpadalq_u32(sum_a, vreinterpretq_u32_u8(vld1q_u8(p)));
+
+	sum64 += vaddvq_u64(vaddq_u64(sum_a, sum_b));
+	sum64 += sum_16b(p, len);
+
+	sum64 = (sum64 >> 32) + (sum64 & 0xffffffff);
+	sum64 += sum64 >> 32;
+
+	return (uint32_t)sum64;
+}
+
+#endif /* __aarch64__ */
+
+/**
+ * struct csum_impl - Checksum implementation, in order of preference
+ * @name:	Name for csum_select() and logging
+ * @fn:		Function returning 32-bit checksum, not complemented, not folded
+ * @usable:	Check if the CPU supports it, NULL if always usable
+ */
+static const struct csum_impl {
+	const char *name;
+	uint32_t (*fn)(const void *buf, size_t len, uint32_t init);
+	int (*usable)(void);
+} csum_impls[] = {
+#ifdef __x86_64__
+	{ "avx512",	csum_avx512,	csum_has_avx512 },
+	{ "avx2",	csum_avx2,	csum_has_avx2 },
+	{ "sse4.1",	csum_sse41,	csum_has_sse41 },
+#elif defined(__aarch64__)
+	{ "neon",	csum_neon,	NULL },
+#endif
+	{ "generic",	csum_generic,	NULL },
+};
+
+/* Selected implementation, generic one until csum_select() is called */
+static const struct csum_impl *csum_impl =
+	&csum_impls[sizeof(csum_impls) / sizeof(csum_impls[0]) - 1];
+
+/**
+ * csum_select() - Select checksum implementation by name
+ * @name:	Name of implementation, NULL for the best one supported by CPU
+ *
+ * Return: name of selected implementation, NULL if not found or not usable
+ */
+const char *csum_select(const char *name)
 {
-	return csum_unaligned(buf, len, init);
+	unsigned i;
+
+#ifdef __x86_64__
+	__builtin_cpu_init();
+#endif
+
+	for (i = 0; i < sizeof(csum_impls) / sizeof(csum_impls[0]); i++) {
+		const struct csum_impl *impl = &csum_impls[i];
+
+		if (name && strcmp(name, impl->name))
+			continue;
+
+		if (impl->usable && !impl->usable())
+			continue;
+
+		csum_impl = impl;
+		return impl->name;
+	}
+
+	return NULL;
 }
 
-#endif /* !__AVX2__ */
+/**
+ * csum() - Compute TCP/IP-style checksum
+ * @buf:	Input buffer, ideally aligned to CSUM_ALIGN bytes, see checksum.h
+ * @len:	Input length
+ * @init:	Initial 32-bit checksum, 0 for no pre-computed checksum
+ *
+ * Return: 16-bit folded, complemented checksum sum
+ */
+uint16_t csum(const void *buf, size_t len, uint32_t init)
+{
+	return (uint16_t)~csum_fold(csum_impl->fn(buf, len, init));
+}
@@ -6,12 +6,24 @@
 #ifndef CHECKSUM_H
 #define CHECKSUM_H
 
+struct iphdr;
 struct udphdr;
 struct icmphdr;
 struct icmp6hdr;
 
+/* Buffer alignment giving the best results with csum() implementations that
+ * might be selected at run time: csum_avx2() and csum_avx512() use aligned,
+ * non-temporal loads on 32-byte boundaries on x86_64. Other alignments work.
+ */
+#ifdef __x86_64__
+#define CSUM_ALIGN		32
+#else
+#define CSUM_ALIGN		4
+#endif
+
 uint32_t sum_16b(const void *buf, size_t len);
 uint16_t csum_fold(uint32_t sum);
+uint16_t csum_update(uint16_t check, uint16_t old, uint16_t new);
 uint16_t csum_unaligned(const void *buf, size_t len, uint32_t init);
 void csum_ip4_header(struct iphdr *ip4h);
 void csum_udp4(struct udphdr *udp4hr,
@@ -21,9 +33,13 @@ void csum_icmp4(struct icmphdr *ih, const void *payload, size_t len);
 void csum_udp6(struct udphdr *udp6hr,
 	       const struct in6_addr *saddr, const struct in6_addr *daddr,
 	       const void *payload, size_t len);
+uint16_t csum_ip6_pseudo(const struct in6_addr *saddr,
+			 const struct in6_addr *daddr, size_t l4len,
+			 uint8_t proto);
 void csum_icmp6(struct icmp6hdr *icmp6hr,
 		const struct in6_addr *saddr, const struct in6_addr *daddr,
 		const void *payload, size_t len);
+const char *csum_select(const char *name);
 uint16_t csum(const void *buf, size_t len, uint32_t init);
 
 #endif /* CHECKSUM_H */
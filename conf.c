@@ -41,6 +41,23 @@
 #include "lineread.h"
 #include "isolation.h"
 #include "log.h"
+#include "sk_lookup.h"
+
+/**
+ * scan_listen() - Set bits for listening sockets, from sock_diag or procfs
+ * @c:		Execution context
+ * @proto:	IPPROTO_TCP or IPPROTO_UDP
+ * @ip_version:	IP version, V4 or V6
+ * @ns:		Scan namespace if set, init otherwise
+ * @map:	Bitmap where numbers of ports in listening state will be set
+ * @exclude:	Bitmap of ports to exclude from setting (and clear)
+ */
+static void scan_listen(struct ctx *c, uint8_t proto, int ip_version, int ns,
+			uint8_t *map, uint8_t *exclude)
+{
+	if (diag_scan_listen(c, proto, ip_version, ns, map, exclude))
+		procfs_scan_listen(c, proto, ip_version, ns, map, exclude);
+}
 
 /**
  * get_bound_ports() - Get maps of ports with bound sockets
@@ -66,15 +83,15 @@ void get_bound_ports(struct ctx *c, int ns, uint8_t proto)
 
 	if (proto == IPPROTO_UDP) {
 		memset(udp_map, 0, PORT_BITMAP_SIZE);
-		procfs_scan_listen(c, IPPROTO_UDP, V4, ns, udp_map, udp_excl);
-		procfs_scan_listen(c, IPPROTO_UDP, V6, ns, udp_map, udp_excl);
+		scan_listen(c, IPPROTO_UDP, V4, ns, udp_map, udp_excl);
+		scan_listen(c, IPPROTO_UDP, V6, ns, udp_map, udp_excl);
 
-		procfs_scan_listen(c, IPPROTO_TCP, V4, ns, udp_map, udp_excl);
-		procfs_scan_listen(c, IPPROTO_TCP, V6, ns, udp_map, udp_excl);
+		scan_listen(c, IPPROTO_TCP, V4, ns, udp_map, udp_excl);
+		scan_listen(c, IPPROTO_TCP, V6, ns, udp_map, udp_excl);
 	} else if (proto == IPPROTO_TCP) {
 		memset(tcp_map, 0, PORT_BITMAP_SIZE);
-		procfs_scan_listen(c, IPPROTO_TCP, V4, ns, tcp_map, tcp_excl);
-		procfs_scan_listen(c, IPPROTO_TCP, V6, ns, tcp_map, tcp_excl);
+		scan_listen(c, IPPROTO_TCP, V4, ns, tcp_map, tcp_excl);
+		scan_listen(c, IPPROTO_TCP, V6, ns, tcp_map, tcp_excl);
 	}
 }
 
@@ -783,11 +800,22 @@ static void usage(const char *name)
 	info(   "  --no-map-gw		Don't map gateway address to host");
 	info(   "  -4, --ipv4-only	Enable IPv4 operation only");
 	info(   "  -6, --ipv6-only	Enable IPv6 operation only");
+	info(   "  --busy-poll USEC	Spin up to USEC microseconds before");
+	info(   "    waiting for events, for lower latency");
+	info(   "    default: don't spin");
+	info(   "  --max-conns N		Maximum number of TCP connections");
+	info(   "    default: %i, maximum: %i", TCP_MAX_CONNS_DEFAULT,
+		TCP_MAX_CONNS);
+	info(   "  --stats-socket PATH	Export counters on UNIX domain socket");
+	info(   "    default: no statistics socket");
 
 	if (strstr(name, "pasta"))
 		goto pasta_opts;
 
 	info(   "  -1, --one-off	Quit after handling one single client");
+	info(   "  --vhost-user		Act as vhost-user back-end on socket");
+	info(   "  --sk-lookup		Steer forwarded TCP ports to a single");
+	info(   "    socket with BPF sk_lookup, needs CAP_BPF, CAP_NET_ADMIN");
 	info(   "  -t, --tcp-ports SPEC	TCP port forwarding to guest");
 	info(   "    can be specified multiple times");
 	info(   "    SPEC can be:");
@@ -858,6 +886,9 @@ pasta_opts:
 	info(   "  			network namespace is deleted");
 	info(   "  --config-net		Configure tap interface in namespace");
 	info(   "  --ns-mac-addr ADDR	Set MAC address on tap interface");
+	info(   "  --csum-offload	Leave L4 checksums to namespace");
+	info(   "  --sockmap		Forward spliced TCP data with BPF sockmap");
+	info(   "    needs CAP_BPF, CAP_NET_ADMIN");
 
 	exit(EXIT_FAILURE);
 }
@@ -1128,6 +1159,13 @@ void conf(struct ctx *c, int argc, char **argv)
 		{"runas",	required_argument,	NULL,		12 },
 		{"log-size",	required_argument,	NULL,		13 },
 		{"version",	no_argument,		NULL,		14 },
+		{"vhost-user",	no_argument,		NULL,		15 },
+		{"busy-poll",	required_argument,	NULL,		17 },
+		{"csum-offload", no_argument,		NULL,		18 },
+		{"max-conns",	required_argument,	NULL,		20 },
+		{"stats-socket", required_argument,	NULL,		21 },
+		{"sk-lookup",	no_argument,		NULL,		22 },
+		{"sockmap",	no_argument,		NULL,		23 },
 		{ 0 },
 	};
 	struct get_bound_ports_ns_arg ns_ports_arg = { .c = c };
@@ -1139,8 +1177,10 @@ void conf(struct ctx *c, int argc, char **argv)
 	struct in_addr *dns4 = c->ip4.dns;
 	const char *optstring;
 	unsigned int ifi = 0;
+	unsigned long busy_poll, max_conns;
 	int name, ret, b, i;
 	size_t logsize = 0;
+	char *end;
 	uid_t uid;
 	gid_t gid;
 
@@ -1291,6 +1331,98 @@ void conf(struct ctx *c, int argc, char **argv)
 				c->mode == MODE_PASST ? "passt " : "pasta ");
 			fprintf(stdout, VERSION_BLOB);
 			exit(EXIT_SUCCESS);
+		case 15:
+			if (c->mode != MODE_PASST) {
+				err("--vhost-user is for passt mode only");
+				usage(argv[0]);
+			}
+
+			if (c->vhost_user) {
+				err("Multiple --vhost-user options given");
+				usage(argv[0]);
+			}
+
+			c->vhost_user = 1;
+			break;
+		case 22:
+			if (c->mode != MODE_PASST) {
+				err("--sk-lookup is for passt mode only");
+				usage(argv[0]);
+			}
+
+			if (c->sk_lookup) {
+				err("Multiple --sk-lookup options given");
+				usage(argv[0]);
+			}
+
+			c->sk_lookup = 1;
+			break;
+		case 23:
+			if (c->mode != MODE_PASTA) {
+				err("--sockmap is for pasta mode only");
+				usage(argv[0]);
+			}
+
+			if (c->sockmap) {
+				err("Multiple --sockmap options given");
+				usage(argv[0]);
+			}
+
+			c->sockmap = 1;
+			break;
+		case 17:
+			if (c->busy_poll) {
+				err("Multiple --busy-poll options given");
+				usage(argv[0]);
+			}
+
+			errno = 0;
+			busy_poll = strtoul(optarg, &end, 0);
+			if (errno || *end || !busy_poll ||
+			    busy_poll > BUSY_POLL_MAX) {
+				err("Invalid --busy-poll: %s", optarg);
+				usage(argv[0]);
+			}
+
+			c->busy_poll = busy_poll;
+			break;
+		case 18:
+			if (c->mode != MODE_PASTA) {
+				err("--csum-offload is for pasta mode only");
+				usage(argv[0]);
+			}
+
+			c->csum_offload = 1;
+			break;
+		case 20:
+			if (c->tcp.max_conns) {
+				err("Multiple --max-conns options given");
+				usage(argv[0]);
+			}
+
+			errno = 0;
+			max_conns = strtoul(optarg, &end, 0);
+			if (errno || *end || !max_conns ||
+			    max_conns > TCP_MAX_CONNS) {
+				err("Invalid --max-conns: %s", optarg);
+				usage(argv[0]);
+			}
+
+			c->tcp.max_conns = max_conns;
+			break;
+		case 21:
+			if (*c->stats_sock_path) {
+				err("Multiple --stats-socket options given");
+				usage(argv[0]);
+			}
+
+			ret = snprintf(c->stats_sock_path,
+				       sizeof(c->stats_sock_path), "%s", optarg);
+			if (ret <= 0 || ret >= (int)sizeof(c->stats_sock_path)) {
+				err("Invalid statistics socket path: %s", optarg);
+				usage(argv[0]);
+			}
+			break;
 		case 'd':
 			if (c->debug) {
 				err("Multiple --debug options given");
@@ -1614,6 +1746,23 @@ void conf(struct ctx *c, int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if (c->sk_lookup) {
+		uint8_t bound[PORT_BITMAP_SIZE] = { 0 };
+		uint8_t none[PORT_BITMAP_SIZE] = { 0 };
+
+		c->proc_net_tcp[V4][0] = c->proc_net_tcp[V6][0] = -1;
+		c->sock_diag[0] = -1;
+
+		scan_listen(c, IPPROTO_TCP, V4, 0, bound, none);
+		scan_listen(c, IPPROTO_TCP, V6, 0, bound, none);
+
+		if ((ret = sk_lookup_init(c, bound))) {
+			warn("Can't set up BPF sk_lookup: %s, binding ports",
+			     strerror(-ret));
+			c->sk_lookup = 0;
+		}
+	}
+
 	/* Inbound port options can be parsed now (after IPv4/IPv6 settings) */
 	optind = 1;
 	do {
@@ -1692,6 +1841,7 @@ void conf(struct ctx *c, int argc, char **argv)
 		c->proc_net_tcp[V6][0] = c->proc_net_tcp[V6][1] = -1;
 		c->proc_net_udp[V4][0] = c->proc_net_udp[V4][1] = -1;
 		c->proc_net_udp[V6][0] = c->proc_net_udp[V6][1] = -1;
+		c->sock_diag[0] = c->sock_diag[1] = -1;
 
 		if (!c->tcp.fwd_in.mode || c->tcp.fwd_in.mode == FWD_AUTO) {
 			c->tcp.fwd_in.mode = FWD_AUTO;
@@ -1722,6 +1872,9 @@ void conf(struct ctx *c, int argc, char **argv)
 			c->udp.fwd_out.f.mode = FWD_NONE;
 	}
 
+	if (!c->tcp.max_conns)
+		c->tcp.max_conns = TCP_MAX_CONNS_DEFAULT;
+
 	if (!c->quiet)
 		conf_print(c);
 }
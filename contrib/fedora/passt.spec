@@ -53,11 +53,6 @@ This package adds SELinux enforcement to passt(1) and pasta(1).
 
 %install
 %make_install DESTDIR=%{buildroot} prefix=%{_prefix} bindir=%{_bindir} mandir=%{_mandir} docdir=%{_docdir}/%{name}
-%ifarch x86_64
-ln -sr %{buildroot}%{_mandir}/man1/passt.1 %{buildroot}%{_mandir}/man1/passt.avx2.1
-ln -sr %{buildroot}%{_mandir}/man1/pasta.1 %{buildroot}%{_mandir}/man1/pasta.avx2.1
-%endif
-
 pushd contrib/selinux
 make -f %{_datadir}/selinux/devel/Makefile
 install -p -m 644 -D passt.pp %{buildroot}%{_datadir}/selinux/packages/%{name}/passt.pp
@@ -83,12 +78,6 @@ semodule -r pasta 2>/dev/null || :
 %{_mandir}/man1/passt.1*
 %{_mandir}/man1/pasta.1*
 %{_mandir}/man1/qrap.1*
-%ifarch x86_64
-%{_bindir}/passt.avx2
-%{_mandir}/man1/passt.avx2.1*
-%{_bindir}/pasta.avx2
-%{_mandir}/man1/pasta.avx2.1*
-%endif
 
 %files selinux
 %dir %{_datadir}/selinux/packages/%{name}
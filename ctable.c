@@ -0,0 +1,337 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * ctable.c - Compact tables with timers and resizable hash, for TCP and flows
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Entries are kept in address space reserved at start-up for a maximum number
+ * of them, and memory is committed and released in chunks as the table grows
+ * and shrinks, see lazy_mem_commit() and lazy_mem_release(). The table is
+ * always compact: on removal, the last entry is moved to the free slot, so
+ * there are no holes to account for. Each entry has a timer, with the same
+ * index, in a timer wheel owned by the table, see twheel.c.
+ *
+ * The hash table has a power-of-two number of buckets, doubled and halved to
+ * keep the load factor between CTABLE_HASH_LOAD_MIN and CTABLE_HASH_LOAD_MAX.
+ * Buckets are moved to the new array a few at a time, on insertions and
+ * removals (and whenever users call ctable_migrate()), while lookups check
+ * which array holds a given bucket, so there's no need to rehash everything at
+ * once.
+ *
+ * Chains are linked by index, and the link is part of entries, so that it can
+ * be packed with other fields: users provide accessors, and the hash function,
+ * in struct ctable_ops. Lookups walk chains directly, from ctable_head(), so
+ * that matching doesn't need indirect calls.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "util.h"
+#include "twheel.h"
+#include "log.h"
+#include "ctable.h"
+
+#define CTABLE_HEAD(t, n, b)	(((int *)(t)->h.t[(n)].base)[(b)])
+
+/**
+ * ctable_bucket() - Find bucket for hash value, in current or previous array
+ * @t:		Compact table
+ * @h:		Hash value
+ * @n:		Array holding bucket, set on return
+ *
+ * Return: bucket index in array @n
+ */
+static unsigned int ctable_bucket(const struct ctable *t, unsigned int h,
+				  int *n)
+{
+	int old = !t->h.cur;
+
+	/* Buckets not moved yet */
+	if (t->h.resizing && (h & (t->h.size[old] - 1)) >= t->h.pos) {
+		*n = old;
+		return h & (t->h.size[old] - 1);
+	}
+
+	*n = t->h.cur;
+	return h & (t->h.size[t->h.cur] - 1);
+}
+
+/**
+ * ctable_migrate() - Move buckets from previous to current array, if resizing
+ * @t:		Compact table
+ * @n:		Number of buckets to move, at most
+ */
+void ctable_migrate(struct ctable *t, unsigned int n)
+{
+	int cur = t->h.cur, old = !cur;
+
+	for (; n && t->h.resizing; n--) {
+		void *e, *next;
+
+		e = ctable_entry(t, CTABLE_HEAD(t, old, t->h.pos) - 1);
+		CTABLE_HEAD(t, old, t->h.pos) = 0;
+
+		for (; e; e = next) {
+			unsigned int b = t->ops->hash(t->arg, e) &
+					 (t->h.size[cur] - 1);
+
+			next = ctable_entry(t, t->ops->next(e));
+
+			t->ops->set_next(e, CTABLE_HEAD(t, cur, b) - 1);
+			CTABLE_HEAD(t, cur, b) = ctable_index(t, e) + 1;
+		}
+
+		if (++t->h.pos < t->h.size[old])
+			continue;
+
+		/* All buckets moved, and cleared: array is ready for reuse */
+		t->h.resizing = 0;
+		lazy_mem_release(&t->h.t[old], 0);
+
+		debug("%s: hash table resized from %u to %u buckets",
+		      t->name, t->h.size[old], t->h.size[cur]);
+	}
+}
+
+/**
+ * ctable_balance() - Move some buckets, or start resize if load is off-limits
+ * @t:		Compact table
+ */
+static void ctable_balance(struct ctable *t)
+{
+	unsigned int size = t->h.size[t->h.cur], new;
+	unsigned int load = (unsigned int)t->count * 100;
+
+	if (t->h.resizing) {
+		ctable_migrate(t, CTABLE_HASH_MIGRATE_STEP);
+		return;
+	}
+
+	if (load > size * CTABLE_HASH_LOAD_MAX && size < t->h.max)
+		new = size * 2;
+	else if (load < size * CTABLE_HASH_LOAD_MIN &&
+		 size > CTABLE_HASH_BUCKETS_MIN)
+		new = size / 2;
+	else
+		return;
+
+	/* The other array is empty, but might need to be committed first */
+	if (lazy_mem_commit(&t->h.t[!t->h.cur], new * sizeof(int))) {
+		debug("%s: can't resize hash table to %u buckets",
+		      t->name, new);
+		return;
+	}
+
+	t->h.cur = !t->h.cur;
+	t->h.size[t->h.cur] = new;
+	t->h.pos = 0;
+	t->h.resizing = 1;
+
+	ctable_migrate(t, CTABLE_HASH_MIGRATE_STEP);
+}
+
+/**
+ * ctable_unlink() - Replace reference to entry in its hash chain
+ * @t:		Compact table
+ * @e:		Entry
+ * @with:	Index to replace reference with, -1 to drop entry from chain
+ */
+static void ctable_unlink(const struct ctable *t, const void *e, int with)
+{
+	void *entry, *prev = NULL;
+	unsigned int b;
+	int n;
+
+	b = ctable_bucket(t, t->ops->hash(t->arg, e), &n);
+
+	for (entry = ctable_entry(t, CTABLE_HEAD(t, n, b) - 1); entry;
+	     prev = entry, entry = ctable_entry(t, t->ops->next(entry))) {
+		if (entry != e)
+			continue;
+
+		if (prev)
+			t->ops->set_next(prev, with);
+		else
+			CTABLE_HEAD(t, n, b) = with + 1;
+		return;
+	}
+}
+
+/**
+ * ctable_reserve() - Make sure there's room for a new entry in table
+ * @t:		Compact table
+ *
+ * Return: 0 on success, -1 if the table is full, or can't grow
+ */
+int ctable_reserve(struct ctable *t)
+{
+	size_t n = t->count + 1;
+	int ret;
+
+	if (n > t->max)
+		return -1;
+
+	if ((ret = lazy_mem_commit(&t->mem, n * t->esize)) ||
+	    (ret = lazy_mem_commit(&t->timer_mem,
+				   n * sizeof(struct tw_entry)))) {
+		debug("%s: can't grow table: %s", t->name, strerror(-ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * ctable_add() - Add zeroed entry at the end of table, not hashed yet
+ * @t:		Compact table
+ *
+ * Return: new entry, NULL if the table is full, or can't grow
+ */
+void *ctable_add(struct ctable *t)
+{
+	void *e;
+
+	if (ctable_reserve(t))
+		return NULL;
+
+	e = (char *)t->mem.base + (size_t)t->count++ * t->esize;
+	memset(e, 0, t->esize);
+
+	return e;
+}
+
+/**
+ * ctable_insert() - Insert entry into hash table, once its key is set
+ * @t:		Compact table
+ * @e:		Entry, from ctable_add()
+ */
+void ctable_insert(struct ctable *t, void *e)
+{
+	unsigned int b;
+	int n;
+
+	b = ctable_bucket(t, t->ops->hash(t->arg, e), &n);
+	t->ops->set_next(e, CTABLE_HEAD(t, n, b) - 1);
+	CTABLE_HEAD(t, n, b) = ctable_index(t, e) + 1;
+
+	ctable_balance(t);
+}
+
+/**
+ * ctable_head() - Get first entry in hash chain for given hash value
+ * @t:		Compact table
+ * @h:		Hash value
+ *
+ * Return: index of first entry, -1 if chain is empty
+ */
+int ctable_head(const struct ctable *t, unsigned int h)
+{
+	unsigned int b;
+	int n;
+
+	b = ctable_bucket(t, h, &n);
+
+	return CTABLE_HEAD(t, n, b) - 1;
+}
+
+/**
+ * ctable_del() - Drop entry from hash table, move last entry to its slot
+ * @t:		Compact table
+ * @e:		Entry, hashed with ctable_insert(), timer not armed
+ *
+ * Return: previous index of entry moved to the slot of @e, -1 if none
+ */
+int ctable_del(struct ctable *t, void *e)
+{
+	int i = ctable_index(t, e), last = t->count - 1;
+
+	ctable_unlink(t, e, t->ops->next(e));
+
+	if (i != last) {
+		void *from = ctable_entry(t, last);
+
+		ctable_unlink(t, from, i);
+		memcpy(e, from, t->esize);
+		tw_move(&t->tw, last, i);
+		e = from;
+	}
+
+	memset(e, 0, t->esize);
+	t->count--;
+	ctable_balance(t);
+
+	lazy_mem_release(&t->mem, t->count * t->esize);
+	lazy_mem_release(&t->timer_mem, t->count * sizeof(struct tw_entry));
+
+	return i != last ? last : -1;
+}
+
+/**
+ * ctable_mem() - Get memory committed for table, timers and hash table
+ * @t:		Compact table
+ *
+ * Return: bytes committed
+ */
+size_t ctable_mem(const struct ctable *t)
+{
+	return t->mem.committed + t->timer_mem.committed +
+	       t->h.t[0].committed + t->h.t[1].committed;
+}
+
+/**
+ * ctable_init() - Reserve memory for table, timers and hash table
+ * @t:		Compact table
+ * @name:	Name of table, for messages
+ * @esize:	Size of one entry, bytes
+ * @max:	Maximum number of entries
+ * @ops:	Entry operations
+ * @arg:	Opaque argument for @ops->hash
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+int ctable_init(struct ctable *t, const char *name, size_t esize,
+		unsigned int max, const struct ctable_ops *ops, const void *arg)
+{
+	struct timespec now;
+	int ret;
+
+	memset(t, 0, sizeof(*t));
+	t->name = name;
+	t->esize = esize;
+	t->max = max;
+	t->ops = ops;
+	t->arg = arg;
+
+	for (t->h.max = CTABLE_HASH_BUCKETS_MIN;
+	     t->h.max * CTABLE_HASH_LOAD_MAX < max * 100;
+	     t->h.max *= 2)
+		;
+
+	if ((ret = lazy_mem_init(&t->mem, max * esize)) ||
+	    (ret = lazy_mem_init(&t->timer_mem,
+				 max * sizeof(struct tw_entry))) ||
+	    (ret = lazy_mem_init(&t->h.t[0], t->h.max * sizeof(int))) ||
+	    (ret = lazy_mem_init(&t->h.t[1], t->h.max * sizeof(int))) ||
+	    (ret = lazy_mem_commit(&t->h.t[0],
+				   CTABLE_HASH_BUCKETS_MIN * sizeof(int))))
+		return ret;
+
+	t->h.size[0] = CTABLE_HASH_BUCKETS_MIN;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	tw_init(&t->tw, t->timer_mem.base, &now);
+
+	return 0;
+}
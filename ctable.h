@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#ifndef CTABLE_H
+#define CTABLE_H
+
+#define CTABLE_HASH_BUCKETS_MIN		1024
+#define CTABLE_HASH_LOAD_MAX		75	/* %, double size above this */
+#define CTABLE_HASH_LOAD_MIN		25	/* %, halve size below this */
+#define CTABLE_HASH_MIGRATE_STEP	16	/* Buckets moved per operation */
+
+/**
+ * struct ctable_ops - Entry operations needed by compact table
+ * @hash:	Calculate hash value for entry, given opaque argument
+ * @next:	Get index of next entry in hash chain, -1 if last
+ * @set_next:	Set index of next entry in hash chain, -1 if last
+ */
+struct ctable_ops {
+	unsigned int (*hash)(const void *arg, const void *e);
+	int (*next)(const void *e);
+	void (*set_next)(void *e, int next);
+};
+
+/**
+ * struct ctable - Compact table of entries with timers, and hash table
+ * @name:	Name of table, for messages
+ * @esize:	Size of one entry, bytes
+ * @max:	Maximum number of entries
+ * @count:	Number of entries, always stored from index 0 with no holes
+ * @mem:	Entries, committed as needed
+ * @timer_mem:	Timers, same indices as entries
+ * @tw:		Timer wheel for entries
+ * @ops:	Entry operations
+ * @arg:	Opaque argument for @ops->hash
+ * @h.t:	Bucket arrays: entry index plus one, for chain heads, zero for
+ *		empty buckets, so that freshly committed memory is empty
+ * @h.size:	Number of buckets for arrays in @h.t, power of two
+ * @h.max:	Maximum number of buckets, for @max entries at maximum load
+ * @h.cur:	Current array, only one in use if not @h.resizing
+ * @h.resizing:	Set if buckets are being moved from the other array
+ * @h.pos:	Next bucket to move from other array, if @h.resizing
+ */
+struct ctable {
+	const char *name;
+	size_t esize;
+	unsigned int max;
+	int count;
+	struct lazy_mem mem;
+	struct lazy_mem timer_mem;
+	struct twheel tw;
+	const struct ctable_ops *ops;
+	const void *arg;
+	struct {
+		struct lazy_mem t[2];
+		unsigned int size[2];
+		unsigned int max;
+		int cur;
+		int resizing;
+		unsigned int pos;
+	} h;
+};
+
+/**
+ * ctable_entry() - Get entry from index
+ * @t:		Compact table
+ * @i:		Index of entry
+ *
+ * Return: pointer to entry, NULL if @i is out of bounds (including -1)
+ */
+static inline void *ctable_entry(const struct ctable *t, int i)
+{
+	if (i < 0 || i >= t->count)
+		return NULL;
+
+	return (char *)t->mem.base + (size_t)i * t->esize;
+}
+
+/**
+ * ctable_index() - Get index of entry
+ * @t:		Compact table
+ * @e:		Entry
+ *
+ * Return: index of @e
+ */
+static inline int ctable_index(const struct ctable *t, const void *e)
+{
+	return ((const char *)e - (const char *)t->mem.base) / t->esize;
+}
+
+int ctable_init(struct ctable *t, const char *name, size_t esize,
+		unsigned int max, const struct ctable_ops *ops, const void *arg);
+int ctable_reserve(struct ctable *t);
+void *ctable_add(struct ctable *t);
+void ctable_insert(struct ctable *t, void *e);
+int ctable_head(const struct ctable *t, unsigned int h);
+int ctable_del(struct ctable *t, void *e);
+void ctable_migrate(struct ctable *t, unsigned int n);
+size_t ctable_mem(const struct ctable *t);
+
+#endif /* CTABLE_H */
@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * flow.c - Flow table for datagram protocols, keyed by protocol and addresses
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * UDP bindings and mappings (including spliced ones) and ICMP echo identifiers
+ * are tracked as entries of a single table, looked up by type of flow, peer
+ * address and ports (or echo identifier), see struct flow_key.
+ *
+ * Like the TCP connection table, flows are kept in a compact table, with a
+ * hash table resized as the number of flows changes, see ctable.c.
+ *
+ * Flows expire with a per-type inactivity timeout, set again with flow_touch()
+ * on activity, using a timer wheel driven by the main loop, see twheel.c. On
+ * expiry, the socket owned by the flow, if any, is closed. Flows without a
+ * timer, such as bindings for configured ports, never expire.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "passt.h"
+#include "siphash.h"
+#include "twheel.h"
+#include "ctable.h"
+#include "log.h"
+#include "flow.h"
+
+static struct ctable flow_tab;
+static uint64_t flow_secret[2];
+
+#define FLOWTAB			((struct flow *)flow_tab.mem.base)
+
+static const char *flow_type_str[] = {
+	[FLOW_UDP_BIND]		= "UDP binding",
+	[FLOW_UDP]		= "UDP",
+	[FLOW_UDP_CONN]		= "UDP connected",
+	[FLOW_UDP_TO_NS]	= "UDP spliced to namespace",
+	[FLOW_UDP_TO_INIT]	= "UDP spliced to init",
+	[FLOW_ICMP]		= "ICMP echo",
+};
+
+/**
+ * flow_key_set() - Fill in key for flow
+ * @k:		Key to fill
+ * @type:	Type of flow
+ * @af:		Address family, AF_INET or AF_INET6
+ * @faddr:	Peer address, pointer to in_addr or in6_addr, NULL if none
+ * @eport:	Guest-facing port, or source port, or echo identifier
+ * @fport:	Peer port, 0 if none
+ */
+void flow_key_set(struct flow_key *k, enum flow_type type, int af,
+		  const void *faddr, in_port_t eport, in_port_t fport)
+{
+	memset(k, 0, sizeof(*k));
+
+	if (af == AF_INET) {
+		k->faddr.s6_addr[10] = k->faddr.s6_addr[11] = 0xff;
+		if (faddr)
+			memcpy(&k->faddr.s6_addr[12], faddr, 4);
+	} else if (faddr) {
+		k->faddr = *(const struct in6_addr *)faddr;
+	}
+
+	k->eport = eport;
+	k->fport = fport;
+	k->type = type;
+}
+
+/**
+ * flow_v6() - Check if flow is an IPv6 one
+ * @f:		Flow
+ *
+ * Return: 1 for IPv6 flows, 0 for IPv4 flows
+ */
+int flow_v6(const struct flow *f)
+{
+	return !IN6_IS_ADDR_V4MAPPED(&f->k.faddr);
+}
+
+/**
+ * flow_hash_key() - Calculate hash value for key
+ * @k:		Key
+ *
+ * Return: hash value, see ctable_head()
+ */
+static unsigned int flow_hash_key(const struct flow_key *k)
+{
+	struct {
+		struct in6_addr faddr;
+		in_port_t eport;
+		in_port_t fport;
+	} __attribute__((__packed__)) in = {
+		k->faddr, k->eport, k->fport,
+	};
+
+	return (unsigned int)siphash_20b((uint8_t *)&in, flow_secret) ^ k->type;
+}
+
+/**
+ * flow_match() - Check if flow matches key
+ * @f:		Flow
+ * @k:		Key
+ *
+ * Return: 1 on match, 0 otherwise
+ */
+static int flow_match(const struct flow *f, const struct flow_key *k)
+{
+	return f->k.type == k->type && f->k.eport == k->eport &&
+	       f->k.fport == k->fport &&
+	       IN6_ARE_ADDR_EQUAL(&f->k.faddr, &k->faddr);
+}
+
+/**
+ * flow_hash() - Calculate hash value for flow, for compact table
+ * @arg:	Unused
+ * @e:		Flow
+ *
+ * Return: hash value
+ */
+static unsigned int flow_hash(const void *arg, const void *e)
+{
+	(void)arg;
+
+	return flow_hash_key(&((const struct flow *)e)->k);
+}
+
+/**
+ * flow_next() - Get index of next flow in hash chain, for compact table
+ * @e:		Flow
+ *
+ * Return: index of next flow, -1 if last
+ */
+static int flow_next(const void *e)
+{
+	return ((const struct flow *)e)->next;
+}
+
+/**
+ * flow_set_next() - Set index of next flow in hash chain, for compact table
+ * @e:		Flow
+ * @next:	Index of next flow, -1 if last
+ */
+static void flow_set_next(void *e, int next)
+{
+	((struct flow *)e)->next = next;
+}
+
+static const struct ctable_ops flow_ops = {
+	flow_hash, flow_next, flow_set_next,
+};
+
+/**
+ * flow_lookup() - Look up flow by key
+ * @k:		Key
+ *
+ * Return: flow, NULL if not found
+ */
+struct flow *flow_lookup(const struct flow_key *k)
+{
+	struct flow *f;
+
+	for (f = ctable_entry(&flow_tab, ctable_head(&flow_tab,
+						      flow_hash_key(k))); f;
+	     f = ctable_entry(&flow_tab, f->next)) {
+		if (flow_match(f, k))
+			return f;
+	}
+
+	return NULL;
+}
+
+/**
+ * flow_add() - Add flow to table, no socket, no timer
+ * @k:		Key, not in table yet
+ *
+ * Return: new flow, NULL if the table is full, or can't grow
+ */
+struct flow *flow_add(const struct flow_key *k)
+{
+	struct flow *f;
+
+	if (!(f = ctable_add(&flow_tab)))
+		return NULL;
+
+	f->k = *k;
+	f->sock = -1;
+	ctable_insert(&flow_tab, f);
+
+	return f;
+}
+
+/**
+ * flow_touch() - Set inactivity timeout for flow, replacing any previous one
+ * @f:		Flow
+ * @timeout:	Timeout, milliseconds
+ */
+void flow_touch(const struct flow *f, unsigned int timeout)
+{
+	tw_add(&flow_tab.tw, f - FLOWTAB, timeout);
+}
+
+/**
+ * flow_expire() - Close socket for expired flow, remove it, compact table
+ * @arg:	Execution context, const struct ctx *
+ * @i:		Index of flow
+ */
+static void flow_expire(void *arg, int i)
+{
+	const struct ctx *c = (const struct ctx *)arg;
+	struct flow *f = &FLOWTAB[i];
+
+	debug("Flow: %s flow %i expired, socket %i",
+	      flow_type_str[f->k.type], i, f->sock);
+
+	if (f->sock >= 0) {
+		epoll_ctl(c->epollfd, EPOLL_CTL_DEL, f->sock, NULL);
+		close(f->sock);
+	}
+
+	ctable_del(&flow_tab, f);
+}
+
+/**
+ * flow_timer() - Expire inactive flows
+ * @c:		Execution context
+ * @now:	Current timestamp
+ */
+void flow_timer(const struct ctx *c, const struct timespec *now)
+{
+	tw_run(&flow_tab.tw, now, flow_expire, (void *)c);
+}
+
+/**
+ * flow_timer_next() - Time until flow_timer() needs to run again
+ *
+ * Return: milliseconds, -1 if no flow timeouts are pending
+ */
+int flow_timer_next(void)
+{
+	return tw_next_ms(&flow_tab.tw);
+}
+
+/**
+ * flow_init() - Reserve memory for flow table, get hash secret
+ *
+ * Doesn't return on failure
+ */
+void flow_init(void)
+{
+	if (raw_random(flow_secret, sizeof(flow_secret))) {
+		perror("Flow hash secret");
+		exit(EXIT_FAILURE);
+	}
+
+	if (ctable_init(&flow_tab, "Flow", sizeof(struct flow), FLOW_MAX,
+			&flow_ops, NULL)) {
+		perror("Flow table reservation");
+		exit(EXIT_FAILURE);
+	}
+}
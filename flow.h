@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#ifndef FLOW_H
+#define FLOW_H
+
+#define FLOW_MAX		(128 * 1024)
+
+/**
+ * enum flow_type - Type of flow, part of the key
+ * @FLOW_UDP_BIND:	Socket bound to tap-facing port, any peer: @fport is 0,
+ *			@faddr is unspecified
+ * @FLOW_UDP:		Tap-facing port and peer, for replies to local host
+ * @FLOW_UDP_CONN:	Tap-facing port and peer, connected socket if busy
+ * @FLOW_UDP_TO_NS:	Spliced, from loopback in init to namespace
+ * @FLOW_UDP_TO_INIT:	Spliced, from loopback in namespace to init
+ * @FLOW_ICMP:		Echo identifier (as @eport), one socket for any peer:
+ *			@faddr is unspecified
+ */
+enum flow_type {
+	FLOW_UDP_BIND = 1,
+	FLOW_UDP,
+	FLOW_UDP_CONN,
+	FLOW_UDP_TO_NS,
+	FLOW_UDP_TO_INIT,
+	FLOW_ICMP,
+};
+
+/**
+ * struct flow_key - Protocol, addresses and ports identifying a flow
+ * @faddr:	Peer address as seen by the guest, IPv4-mapped for IPv4, unspecified
+ *		for bindings, spliced flows and echo identifiers
+ * @eport:	Guest-facing port (source port, for spliced flows), host order
+ * @fport:	Peer port, host order
+ * @type:	Type of flow, implying the protocol, see enum flow_type
+ *
+ * There's a single guest, so its address is not part of the key.
+ */
+struct flow_key {
+	struct in6_addr faddr;
+	in_port_t eport;
+	in_port_t fport;
+	uint8_t type;
+};
+
+/**
+ * struct flow - Tracked flow, compact table entry
+ * @k:			Key
+ * @next:		Index of next flow in hash chain, -1 if last
+ * @sock:		Socket owned by this flow, closed on expiry, -1 if none
+ * @u.addr:		FLOW_UDP: actual address of local peer
+ * @u.bound_sock:	FLOW_UDP_TO_*: originating bound socket, for replies,
+ *			FLOW_UDP_BIND: socket for configured port, not owned
+ * @u.seq:		FLOW_ICMP: last sequence number sent to tap, -1 if none
+ * @u.pkts:		FLOW_UDP_CONN: datagrams from tap, before connecting
+ */
+struct flow {
+	struct flow_key k;
+	int next;
+	int sock;
+	union {
+		struct in6_addr addr;
+		int bound_sock;
+		int seq;
+		unsigned int pkts;
+	} u;
+};
+
+void flow_key_set(struct flow_key *k, enum flow_type type, int af,
+		  const void *faddr, in_port_t eport, in_port_t fport);
+int flow_v6(const struct flow *f);
+struct flow *flow_lookup(const struct flow_key *k);
+struct flow *flow_add(const struct flow_key *k);
+void flow_touch(const struct flow *f, unsigned int timeout);
+void flow_timer(const struct ctx *c, const struct timespec *now);
+int flow_timer_next(void);
+void flow_init(void);
+
+#endif /* FLOW_H */
@@ -37,27 +37,9 @@
 #include "tap.h"
 #include "log.h"
 #include "icmp.h"
+#include "flow.h"
 
 #define ICMP_ECHO_TIMEOUT	60 /* s, timeout for ICMP socket activity */
-#define ICMP_NUM_IDS		(1U << 16)
-
-/**
- * struct icmp_id_sock - Tracking information for single ICMP echo identifier
- * @sock:	Bound socket for identifier
- * @seq:	Last sequence number sent to tap, host order, -1: not sent yet
- * @ts:		Last associated activity from tap, seconds
- */
-struct icmp_id_sock {
-	int sock;
-	int seq;
-	time_t ts;
-};
-
-/* Indexed by ICMP echo identifier */
-static struct icmp_id_sock icmp_id_map[IP_VERSIONS][ICMP_NUM_IDS];
-
-/* Bitmaps, activity monitoring needed for identifier */
-static uint8_t icmp_act[IP_VERSIONS][DIV_ROUND_UP(ICMP_NUM_IDS, 8)];
 
 /**
  * icmp_sock_handler() - Handle new data from socket
@@ -73,7 +55,9 @@ void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
 	struct sockaddr_storage sr;
 	socklen_t sl = sizeof(sr);
 	char buf[USHRT_MAX];
+	struct flow_key k;
 	uint16_t seq, id;
+	struct flow *f;
 	ssize_t n;
 
 	(void)events;
@@ -98,10 +82,14 @@ void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
 
 		/* In PASTA mode, we'll get any reply we send, discard them. */
 		if (c->mode == MODE_PASTA) {
-			if (icmp_id_map[V6][id].seq == seq)
-				return;
+			flow_key_set(&k, FLOW_ICMP, AF_INET6, NULL,
+				     iref->icmp.id, 0);
+			if ((f = flow_lookup(&k))) {
+				if (f->u.seq == seq)
+					return;
 
-			icmp_id_map[V6][id].seq = seq;
+				f->u.seq = seq;
+			}
 		}
 
 		debug("ICMPv6: echo %s to tap, ID: %i, seq: %i",
@@ -120,11 +108,14 @@ void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
 			ih->un.echo.id = htons(iref->icmp.id);
 
 		if (c->mode == MODE_PASTA) {
+			flow_key_set(&k, FLOW_ICMP, AF_INET, NULL,
+				     iref->icmp.id, 0);
+			if ((f = flow_lookup(&k))) {
+				if (f->u.seq == seq)
+					return;
 
-			if (icmp_id_map[V4][id].seq == seq)
-				return;
-
-			icmp_id_map[V4][id].seq = seq;
+				f->u.seq = seq;
+			}
 		}
 
 		debug("ICMP: echo %s to tap, ID: %i, seq: %i",
@@ -147,8 +138,12 @@ void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
 int icmp_tap_handler(const struct ctx *c, int af, const void *addr,
 		     const struct pool *p, const struct timespec *now)
 {
+	struct flow_key k;
+	struct flow *f;
 	size_t plen;
 
+	(void)now;
+
 	if (af == AF_INET) {
 		union icmp_epoll_ref iref = { .icmp.v6 = 0 };
 		struct sockaddr_in sa = {
@@ -169,22 +164,24 @@ int icmp_tap_handler(const struct ctx *c, int af, const void *addr,
 
 		iref.icmp.id = id = ntohs(ih->un.echo.id);
 
-		if ((s = icmp_id_map[V4][id].sock) <= 0) {
+		flow_key_set(&k, FLOW_ICMP, AF_INET, NULL, id, 0);
+		if (!(f = flow_lookup(&k))) {
 			s = sock_l4(c, AF_INET, IPPROTO_ICMP, NULL, NULL, id,
 				    iref.u32);
 			if (s < 0)
 				goto fail_sock;
-			if (s > SOCKET_MAX) {
+			if (s > SOCKET_MAX || !(f = flow_add(&k))) {
 				close(s);
 				return 1;
 			}
 
-			icmp_id_map[V4][id].sock = s;
+			f->sock = s;
+			f->u.seq = -1;
 
 			debug("ICMP: new socket %i for echo ID %i", s, id);
 		}
-		icmp_id_map[V4][id].ts = now->tv_sec;
-		bitmap_set(icmp_act[V4], id);
+		flow_touch(f, ICMP_ECHO_TIMEOUT * 1000);
+		s = f->sock;
 
 		sa.sin_addr = *(struct in_addr *)addr;
 		if (sendto(s, ih, sizeof(*ih) + plen, MSG_NOSIGNAL,
@@ -215,22 +212,25 @@ int icmp_tap_handler(const struct ctx *c, int af, const void *addr,
 		sa.sin6_port = ih->icmp6_identifier;
 
 		iref.icmp.id = id = ntohs(ih->icmp6_identifier);
-		if ((s = icmp_id_map[V6][id].sock) <= 0) {
+
+		flow_key_set(&k, FLOW_ICMP, AF_INET6, NULL, id, 0);
+		if (!(f = flow_lookup(&k))) {
 			s = sock_l4(c, AF_INET6, IPPROTO_ICMPV6, NULL, NULL, id,
 				    iref.u32);
 			if (s < 0)
 				goto fail_sock;
-			if (s > SOCKET_MAX) {
+			if (s > SOCKET_MAX || !(f = flow_add(&k))) {
 				close(s);
 				return 1;
 			}
 
-			icmp_id_map[V6][id].sock = s;
+			f->sock = s;
+			f->u.seq = -1;
 
 			debug("ICMPv6: new socket %i for echo ID %i", s, id);
 		}
-		icmp_id_map[V6][id].ts = now->tv_sec;
-		bitmap_set(icmp_act[V6], id);
+		flow_touch(f, ICMP_ECHO_TIMEOUT * 1000);
+		s = f->sock;
 
 		sa.sin6_addr = *(struct in6_addr *)addr;
 		if (sendto(s, ih, sizeof(*ih) + plen, MSG_NOSIGNAL,
@@ -251,64 +251,3 @@ fail_sock:
 	warn("...echo requests/replies will fail.");
 	return 1;
 }
-
-/**
- * icmp_timer_one() - Handler for timed events related to a given identifier
- * @c:		Execution context
- * @v6:		Set for IPv6 echo identifier bindings
- * @id:		Echo identifier, host order
- * @ts:		Timestamp from caller
- */
-static void icmp_timer_one(const struct ctx *c, int v6, uint16_t id,
-			   const struct timespec *ts)
-{
-	struct icmp_id_sock *id_map = &icmp_id_map[v6 ? V6 : V4][id];
-
-	if (ts->tv_sec - id_map->ts <= ICMP_ECHO_TIMEOUT)
-		return;
-
-	bitmap_clear(icmp_act[v6 ? V6 : V4], id);
-
-	epoll_ctl(c->epollfd, EPOLL_CTL_DEL, id_map->sock, NULL);
-	close(id_map->sock);
-	id_map->sock = 0;
-	id_map->seq = -1;
-}
-
-/**
- * icmp_timer() - Scan activity bitmap for identifiers with timed events
- * @c:		Execution context
- * @ts:		Timestamp from caller
- */
-void icmp_timer(const struct ctx *c, const struct timespec *ts)
-{
-	long *word, tmp;
-	unsigned int i;
-	int n, v6 = 0;
-
-v6:
-	word = (long *)icmp_act[v6 ? V6 : V4];
-	for (i = 0; i < ARRAY_SIZE(icmp_act); i += sizeof(long), word++) {
-		tmp = *word;
-		while ((n = ffsl(tmp))) {
-			tmp &= ~(1UL << (n - 1));
-			icmp_timer_one(c, v6, i * 8 + n - 1, ts);
-		}
-	}
-
-	if (!v6) {
-		v6 = 1;
-		goto v6;
-	}
-}
-
-/**
- * icmp_init() - Initialise sequences in ID map to -1 (no sequence sent yet)
- */
-void icmp_init(void)
-{
-	unsigned i;
-
-	for (i = 0; i < ICMP_NUM_IDS; i++)
-		icmp_id_map[V4][i].seq = icmp_id_map[V6][i].seq = -1;
-}
@@ -6,16 +6,12 @@
 #ifndef ICMP_H
 #define ICMP_H
 
-#define ICMP_TIMER_INTERVAL		1000 /* ms */
-
 struct ctx;
 
 void icmp_sock_handler(const struct ctx *c, union epoll_ref ref,
 		       uint32_t events, const struct timespec *now);
 int icmp_tap_handler(const struct ctx *c, int af, const void *addr,
 		     const struct pool *p, const struct timespec *now);
-void icmp_timer(const struct ctx *c, const struct timespec *ts);
-void icmp_init(void);
 
 /**
  * union icmp_epoll_ref - epoll reference portion for ICMP tracking
@@ -31,12 +27,4 @@ union icmp_epoll_ref {
 	uint32_t u32;
 };
 
-/**
- * struct icmp_ctx - Execution context for ICMP routines
- * @timer_run:		Timestamp of most recent timer run
- */
-struct icmp_ctx {
-	struct timespec timer_run;
-};
-
 #endif /* ICMP_H */
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * ns_helper.c - Persistent helper thread running functions in target namespace
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * NS_CALL() clones a new process, sharing memory and file descriptors, that
+ * joins the network namespace with setns() and runs a given function. That's
+ * fine for setup steps, but spliced connections and timer handlers need
+ * sockets in the namespace all the time, and a clone() and setns() for each
+ * of them costs more than the connection itself.
+ *
+ * Instead, start a thread once, joining the namespace, and pass it functions
+ * to run on a single-producer, single-consumer ring: the main loop appends to
+ * it, wakes up the thread with a futex, and waits for completion on another
+ * one. Sockets created by the thread are visible right away to the main loop,
+ * as threads share the file descriptor table.
+ *
+ * Calls are synchronous, like NS_CALL(), so functions can keep using data of
+ * the main loop without further locking: the main loop doesn't run while the
+ * helper does.
+ *
+ * The thread isn't copied by fork(): start it only once daemonised. Should it
+ * be gone anyway, ns_call() notices, and falls back to NS_CALL().
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "util.h"
+#include "passt.h"
+#include "log.h"
+#include "ns_helper.h"
+
+#define NS_HELPER_RING_SIZE	8	/* Power of two */
+#define NS_HELPER_CHECK_NS	(100 * 1000 * 1000) /* Check thread every 100ms */
+
+/**
+ * struct ns_helper_req - Function to run in namespace, with its argument
+ * @fn:		Function, same as for NS_CALL()
+ * @arg:	Argument for @fn
+ */
+struct ns_helper_req {
+	int (*fn)(void *);
+	void *arg;
+};
+
+static struct ns_helper_req ns_helper_ring[NS_HELPER_RING_SIZE];
+
+/* Free-running indices: @head written by main loop, @tail by helper only */
+static uint32_t ns_helper_head;
+static uint32_t ns_helper_tail;
+
+static int ns_helper_running;
+
+/* Process and thread ID of helper, to check it's still there */
+static pid_t ns_helper_pid;
+static pid_t ns_helper_tid;
+
+/* Set for the helper thread, which is already in the target namespace */
+__thread int ns_helper_self;
+
+/**
+ * ns_helper_futex() - Wrapper for futex() syscall, wait or wake
+ * @addr:	Futex word
+ * @op:		FUTEX_WAIT_PRIVATE or FUTEX_WAKE_PRIVATE
+ * @val:	Expected value for FUTEX_WAIT_PRIVATE, ignored otherwise
+ * @timeout:	Relative timeout for FUTEX_WAIT_PRIVATE, NULL to wait forever
+ *
+ * Return: return value from futex(), negative error code on failure
+ *
+ * #syscalls:pasta futex
+ */
+static int ns_helper_futex(uint32_t *addr, int op, uint32_t val,
+			   const struct timespec *timeout)
+{
+	if (op == FUTEX_WAKE_PRIVATE)
+		val = INT_MAX;
+
+	if (syscall(SYS_futex, addr, op, val, timeout, NULL, 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * ns_helper_alive() - Check if helper thread is still there
+ *
+ * Return: true if thread exists, or didn't report its ID yet
+ *
+ * #syscalls:pasta tgkill getpid
+ */
+static bool ns_helper_alive(void)
+{
+	pid_t tid = __atomic_load_n(&ns_helper_tid, __ATOMIC_ACQUIRE);
+
+	/* Forked child: thread, if any, belongs to the parent */
+	if (getpid() != ns_helper_pid)
+		return false;
+
+	if (!tid)
+		return true;
+
+	return !(syscall(SYS_tgkill, ns_helper_pid, tid, 0) && errno == ESRCH);
+}
+
+/**
+ * ns_helper_atfork_child() - Helper thread is not copied by fork(): forget it
+ */
+static void ns_helper_atfork_child(void)
+{
+	ns_helper_running = 0;
+	ns_helper_tid = 0;
+	ns_helper_head = ns_helper_tail = 0;
+}
+
+/**
+ * ns_helper() - Thread entry point: join namespace, run requests from ring
+ * @arg:	Execution context
+ *
+ * Return: doesn't return
+ */
+static void *ns_helper(void *arg)
+{
+	const struct ctx *c = (const struct ctx *)arg;
+	uint32_t tail = __atomic_load_n(&ns_helper_tail, __ATOMIC_ACQUIRE);
+
+	ns_enter(c);
+	ns_helper_self = 1;
+	__atomic_store_n(&ns_helper_tid, syscall(SYS_gettid), __ATOMIC_RELEASE);
+
+	for (;;) {
+		uint32_t head = __atomic_load_n(&ns_helper_head,
+						__ATOMIC_ACQUIRE);
+		struct ns_helper_req *req;
+
+		if (head == tail) {
+			ns_helper_futex(&ns_helper_head, FUTEX_WAIT_PRIVATE,
+					head, NULL);
+			continue;
+		}
+
+		req = &ns_helper_ring[tail % NS_HELPER_RING_SIZE];
+		req->fn(req->arg);
+
+		__atomic_store_n(&ns_helper_tail, ++tail, __ATOMIC_RELEASE);
+		ns_helper_futex(&ns_helper_tail, FUTEX_WAKE_PRIVATE, 0, NULL);
+	}
+
+	return NULL;
+}
+
+/**
+ * ns_helper_init() - Start helper thread for target namespace
+ * @c:		Execution context
+ *
+ * Return: 0 on success, negative error code on failure: ns_call() then falls
+ *	   back to NS_CALL()
+ *
+ * #syscalls:pasta clone3 set_robust_list rseq mprotect rt_sigprocmask gettid
+ */
+int ns_helper_init(const struct ctx *c)
+{
+	static bool atfork;
+	sigset_t all, old;
+	pthread_t t;
+	int ret;
+
+	if (!atfork) {
+		pthread_atfork(NULL, NULL, ns_helper_atfork_child);
+		atfork = true;
+	}
+
+	ns_helper_pid = getpid();
+
+	/* Signals are for the main loop, block them in the helper */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&t, NULL, ns_helper, (void *)c);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		warn("Can't start namespace helper thread: %s", strerror(ret));
+		return -ret;
+	}
+
+	pthread_detach(t);
+	ns_helper_running = 1;
+
+	return 0;
+}
+
+/**
+ * ns_call() - Run function in target namespace, wait for it to return
+ * @fn:		Function, calling ns_enter() first, as for NS_CALL()
+ * @arg:	Argument for @fn
+ */
+void ns_call(int (*fn)(void *), void *arg)
+{
+	const struct timespec check = { 0, NS_HELPER_CHECK_NS };
+	uint32_t head = ns_helper_head, tail;
+
+	if (!ns_helper_running) {
+		NS_CALL(fn, arg);
+		return;
+	}
+
+	ns_helper_ring[head % NS_HELPER_RING_SIZE].fn = fn;
+	ns_helper_ring[head % NS_HELPER_RING_SIZE].arg = arg;
+
+	__atomic_store_n(&ns_helper_head, ++head, __ATOMIC_RELEASE);
+	ns_helper_futex(&ns_helper_head, FUTEX_WAKE_PRIVATE, 0, NULL);
+
+	while ((tail = __atomic_load_n(&ns_helper_tail, __ATOMIC_ACQUIRE)) !=
+	       head) {
+		if (ns_helper_futex(&ns_helper_tail, FUTEX_WAIT_PRIVATE, tail,
+				    &check) != -ETIMEDOUT || ns_helper_alive())
+			continue;
+
+		/* Request wasn't served: drop it, and don't use helper again */
+		err("Namespace helper thread gone, falling back to clone()");
+		ns_helper_running = 0;
+		ns_helper_head = tail;
+		NS_CALL(fn, arg);
+		return;
+	}
+}
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#ifndef NS_HELPER_H
+#define NS_HELPER_H
+
+extern __thread int ns_helper_self;
+
+int ns_helper_init(const struct ctx *c);
+void ns_call(int (*fn)(void *), void *arg);
+
+#endif /* NS_HELPER_H */
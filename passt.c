@@ -32,7 +32,11 @@
 #include <time.h>
 #include <syslog.h>
 #include <sys/prctl.h>
+#include <sys/ioctl.h>
 #include <netinet/if_ether.h>
+#ifdef HAS_EPOLL_PARAMS
+#include <linux/eventpoll.h>
+#endif
 
 #include "util.h"
 #include "passt.h"
@@ -43,13 +47,17 @@
 #include "tap.h"
 #include "conf.h"
 #include "pasta.h"
-#include "arch.h"
 #include "log.h"
+#include "flow.h"
+#include "checksum.h"
+#include "stats.h"
+#include "ns_helper.h"
 
 #define EPOLL_EVENTS		8
 
-#define __TIMER_INTERVAL	MIN(TCP_TIMER_INTERVAL, UDP_TIMER_INTERVAL)
-#define TIMER_INTERVAL		MIN(__TIMER_INTERVAL, ICMP_TIMER_INTERVAL)
+#define BUSY_POLL_MISSES_MAX	8 /* Halve spin time on miss, until zero */
+
+#define TIMER_INTERVAL		TCP_TIMER_INTERVAL
 
 char pkt_buf[PKT_BUF_BYTES]	__attribute__ ((aligned(PAGE_SIZE)));
 
@@ -61,6 +69,73 @@ char *ip_proto_str[IPPROTO_SCTP + 1] = {
 	[IPPROTO_SCTP]		= "SCTP",
 };
 
+/**
+ * busy_poll_init() - Enable kernel busy polling on epoll instance, if available
+ * @c:		Execution context
+ *
+ * #syscalls ioctl
+ */
+static void busy_poll_init(const struct ctx *c)
+{
+#ifdef HAS_EPOLL_PARAMS
+	struct epoll_params p = {
+		.busy_poll_usecs	= c->busy_poll,
+		.busy_poll_budget	= 8,
+		.prefer_busy_poll	= 1,
+	};
+
+	if (ioctl(c->epollfd, EPIOCSPARAMS, &p))
+		debug("Can't enable epoll busy polling: %s", strerror(errno));
+#else
+	(void)c;
+#endif
+}
+
+/**
+ * busy_poll_wait() - Spin on epoll instance before blocking, adaptively
+ * @c:		Execution context
+ * @events:	epoll events, filled on return
+ * @timeout:	Timeout for blocking wait, milliseconds
+ *
+ * Spin for c->busy_poll microseconds at most, halving the time for each
+ * consecutive spin that finds no events, down to not spinning at all, so that
+ * idle instances don't burn CPU. Events found while spinning restore the full
+ * spin time, events found after blocking restore it gradually.
+ *
+ * Return: number of events, as epoll_wait()
+ */
+static int busy_poll_wait(const struct ctx *c, struct epoll_event *events,
+			  int timeout)
+{
+	static unsigned int misses;
+	int nfds;
+
+	if (misses < BUSY_POLL_MISSES_MAX) {
+		long budget = (long)c->busy_poll >> misses;
+		struct timespec start, now;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			nfds = epoll_wait(c->epollfd, events, EPOLL_EVENTS, 0);
+			if (nfds) {
+				if (nfds > 0)
+					misses = 0;
+				return nfds;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while (timespec_diff_us(&now, &start) < budget);
+
+		misses++;
+	}
+
+	nfds = epoll_wait(c->epollfd, events, EPOLL_EVENTS, timeout);
+	if (nfds > 0 && misses)
+		misses--;
+
+	return nfds;
+}
+
 /**
  * sock_handler() - Event handler for L4 sockets
  * @c:		Execution context
@@ -84,6 +159,25 @@ static void sock_handler(struct ctx *c, union epoll_ref ref,
 		icmp_sock_handler(c, ref, events, now);
 }
 
+/**
+ * loop_timeout() - Timeout for epoll_wait(), as next timer or periodic tasks
+ * @c:		Execution context
+ *
+ * Return: timeout in milliseconds
+ */
+static int loop_timeout(const struct ctx *c)
+{
+	int timeout = TIMER_INTERVAL, next = tcp_conn_timers_next();
+
+	if (!c->no_tcp && next >= 0)
+		timeout = MIN(timeout, next);
+
+	if ((next = flow_timer_next()) >= 0)
+		timeout = MIN(timeout, next);
+
+	return timeout;
+}
+
 /**
  * post_handler() - Run periodic and deferred tasks for L4 protocol handlers
  * @c:		Execution context
@@ -109,12 +203,13 @@ static void post_handler(struct ctx *c, const struct timespec *now)
 		} 							\
 	} while (0)
 
-	/* NOLINTNEXTLINE(bugprone-branch-clone): intervals can be the same */
+	/* Connection timers might queue frames: flush them with deferred tasks */
+	if (!c->no_tcp)
+		tcp_conn_timers(c, now);
+
+	flow_timer(c, now);
+
 	CALL_PROTO_HANDLER(c, now, tcp, TCP);
-	/* NOLINTNEXTLINE(bugprone-branch-clone): intervals can be the same */
-	CALL_PROTO_HANDLER(c, now, udp, UDP);
-	/* NOLINTNEXTLINE(bugprone-branch-clone): intervals can be the same */
-	CALL_PROTO_HANDLER(c, now, icmp, ICMP);
 
 #undef CALL_PROTO_HANDLER
 }
@@ -126,7 +221,7 @@ static void post_handler(struct ctx *c, const struct timespec *now)
  */
 static void timer_init(struct ctx *c, const struct timespec *now)
 {
-	c->tcp.timer_run = c->udp.timer_run = c->icmp.timer_run = *now;
+	c->tcp.timer_run = *now;
 }
 
 /**
@@ -183,11 +278,10 @@ int main(int argc, char **argv)
 	struct timespec now;
 	struct sigaction sa;
 
-	arch_avx2_exec(argv);
-
 	//isolate_initial();
 
-	c.pasta_netns_fd = c.fd_tap = c.fd_tap_listen = -1;
+	c.pasta_netns_fd = c.fd_tap = c.fd_tap_listen = c.fd_vu_kick = -1;
+	c.fd_stats = -1;
 
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = 0;
@@ -240,9 +334,16 @@ int main(int argc, char **argv)
 	}
 	sock_probe_mem(&c);
 
+	flow_init();
+
 	conf(&c, argc, argv);
 	trace_init(c.trace);
 
+	debug("Using %s checksum implementation", csum_select(NULL));
+
+	if (c.busy_poll)
+		busy_poll_init(&c);
+
 #undef stderr
 	if (!c.debug && (c.stderr || isatty(fileno(stdout))))
 		__openlog(log_name, LOG_PERROR, LOG_DAEMON);
@@ -257,9 +358,6 @@ int main(int argc, char **argv)
 	if ((!c.no_udp && udp_init(&c)) || (!c.no_tcp && tcp_init(&c)))
 		exit(EXIT_FAILURE);
 
-	if (!c.no_icmp)
-		icmp_init();
-
 	proto_update_l2_buf(c.mac_guest, c.mac, &c.ip4.addr);
 
 	if (c.ifi4 && !c.no_dhcp)
@@ -276,6 +374,7 @@ int main(int argc, char **argv)
 		__setlogmask(LOG_UPTO(LOG_INFO));
 
 	pcap_init(&c);
+	stats_init(&c);
 
 	if (!c.foreground) {
 		if ((devnull_fd = open("/dev/null", O_RDWR | O_CLOEXEC)) < 0) {
@@ -307,12 +406,20 @@ int main(int argc, char **argv)
 
 	//isolate_postfork(&c);
 
+	/* Threads don't survive fork(): start helper once daemonised. Until
+	 * then, ns_call() falls back to NS_CALL()
+	 */
+	if (c.mode == MODE_PASTA)
+		ns_helper_init(&c);
+
 	timer_init(&c, &now);
 
 loop:
-	/* NOLINTNEXTLINE(bugprone-branch-clone): intervals can be the same */
-	/* cppcheck-suppress [duplicateValueTernary, unmatchedSuppression] */
-	nfds = epoll_wait(c.epollfd, events, EPOLL_EVENTS, TIMER_INTERVAL);
+	if (c.busy_poll)
+		nfds = busy_poll_wait(&c, events, loop_timeout(&c));
+	else
+		nfds = epoll_wait(c.epollfd, events, EPOLL_EVENTS,
+				  loop_timeout(&c));
 	if (nfds == -1 && errno != EINTR) {
 		perror("epoll_wait");
 		exit(EXIT_FAILURE);
@@ -324,10 +431,13 @@ loop:
 		union epoll_ref ref = *((union epoll_ref *)&events[i].data.u64);
 		int fd = events[i].data.fd;
 
-		if (fd == c.fd_tap || fd == c.fd_tap_listen)
+		if (fd == c.fd_tap || fd == c.fd_tap_listen ||
+		    fd == c.fd_vu_kick)
 			tap_handler(&c, fd, events[i].events, &now);
 		else if (fd == quit_fd)
 			pasta_netns_quit_handler(&c, fd);
+		else if (fd == c.fd_stats)
+			stats_handler(&c);
 		else
 			sock_handler(&c, ref, events[i].events, &now);
 	}
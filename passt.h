@@ -65,13 +65,14 @@ union epoll_ref {
 
 #define TAP_BUF_BYTES							\
 	ROUND_DOWN(((ETH_MAX_MTU + sizeof(uint32_t)) * 128), PAGE_SIZE)
-#define TAP_BUF_FILL		(TAP_BUF_BYTES - ETH_MAX_MTU - sizeof(uint32_t))
 #define TAP_MSGS							\
 	DIV_ROUND_UP(TAP_BUF_BYTES, ETH_ZLEN - 2 * ETH_ALEN + sizeof(uint32_t))
 
 #define PKT_BUF_BYTES		MAX(TAP_BUF_BYTES, 0)
 extern char pkt_buf		[PKT_BUF_BYTES];
 
+#define BUSY_POLL_MAX		10000 /* us, see --busy-poll */
+
 extern char *ip_proto_str[];
 #define IP_PROTO_STR(n)							\
 	(((uint8_t)(n) <= IPPROTO_SCTP && ip_proto_str[(n)]) ?		\
@@ -151,15 +152,24 @@ struct ip6_ctx {
  * @sock_path:		Path for UNIX domain socket
  * @pcap:		Path for packet capture file
  * @pid_file:		Path to PID file, empty string if not configured
+ * @stats_sock_path:	Path for statistics UNIX domain socket, empty if none
+ * @fd_stats:		File descriptor for listening statistics socket, if any
+ * @sk_lookup:		Steer forwarded TCP ports to one socket, BPF sk_lookup
  * @pasta_netns_fd:	File descriptor for network namespace in pasta mode
  * @no_netns_quit:	In pasta mode, don't exit if fs-bound namespace is gone
  * @netns_base:		Base name for fs-bound namespace, if any, in pasta mode
  * @netns_dir:		Directory of fs-bound namespace, if any, in pasta mode
  * @proc_net_tcp:	Stored handles for /proc/net/tcp{,6} in init and ns
  * @proc_net_udp:	Stored handles for /proc/net/udp{,6} in init and ns
+ * @sock_diag:		Stored NETLINK_SOCK_DIAG sockets in init and ns
  * @epollfd:		File descriptor for epoll instance
+ * @busy_poll:		Maximum time to spin for events before blocking, us
  * @fd_tap_listen:	File descriptor for listening AF_UNIX socket, if any
  * @fd_tap:		File descriptor for AF_UNIX socket or tuntap device
+ * @vhost_user:		Speak vhost-user on AF_UNIX socket, frames in virtqueues
+ * @fd_vu_kick:		eventfd for guest transmit notifications, vhost-user mode
+ * @csum_offload:	Leave TCP and UDP checksums to namespace, pasta mode
+ * @sockmap:		Forward spliced TCP data in kernel, BPF sockmap, pasta mode
  * @mac:		Host MAC address
  * @mac_guest:		MAC address of guest or namespace, seen or configured
  * @ifi4:		Index of routable interface for IPv4, 0 if IPv4 disabled
@@ -175,7 +185,6 @@ struct ip6_ctx {
  * @no_tcp:		Disable UDP operation
  * @udp:		Context for UDP protocol handler
  * @no_icmp:		Disable ICMP operation
- * @icmp:		Context for ICMP protocol handler
  * @mtu:		MTU passed via DHCP/NDP
  * @no_dns:		Do not source/use DNS servers for any purpose
  * @no_dns_search:	Do not source/use domain search lists for any purpose
@@ -200,6 +209,9 @@ struct ctx {
 	char sock_path[UNIX_PATH_MAX];
 	char pcap[PATH_MAX];
 	char pid_file[PATH_MAX];
+	char stats_sock_path[UNIX_PATH_MAX];
+	int fd_stats;
+	int sk_lookup;
 	int one_off;
 
 	int pasta_netns_fd;
@@ -210,10 +222,16 @@ struct ctx {
 
 	int proc_net_tcp[IP_VERSIONS][2];
 	int proc_net_udp[IP_VERSIONS][2];
+	int sock_diag[2];
 
 	int epollfd;
+	unsigned int busy_poll;
 	int fd_tap_listen;
 	int fd_tap;
+	int vhost_user;
+	int fd_vu_kick;
+	int csum_offload;
+	int sockmap;
 	unsigned char mac[ETH_ALEN];
 	unsigned char mac_guest[ETH_ALEN];
 
@@ -234,7 +252,6 @@ struct ctx {
 	int no_udp;
 	struct udp_ctx udp;
 	int no_icmp;
-	struct icmp_ctx icmp;
 
 	int mtu;
 	int no_dns;
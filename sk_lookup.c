@@ -0,0 +1,356 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * sk_lookup.c - Steer forwarded TCP ports to catch-all sockets, BPF sk_lookup
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Instead of one listening socket per forwarded port and IP version, attach a
+ * BPF_PROG_TYPE_SK_LOOKUP program to the network namespace, assigning incoming
+ * connections for forwarded ports to a single listening socket, dual-stack if
+ * both IPv4 and IPv6 are enabled. The original destination port is then given
+ * by getsockname() on accepted sockets.
+ *
+ * The program is hand-assembled, to avoid a dependency on a BPF toolchain, and
+ * uses two maps:
+ *
+ * - an array indexed by port number, mmap()ed here, with bit 0 set in values
+ *   for IPv4 forwarding, and bit 1 for IPv6
+ *
+ * - a sockmap with listening sockets: IPv4 at index 0, IPv6 at index 1. A
+ *   dual-stack socket is stored at both
+ *
+ * Loading and attaching the program needs CAP_BPF and CAP_NET_ADMIN (or
+ * CAP_SYS_ADMIN), and Linux 5.9 or later.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifdef HAS_SK_LOOKUP
+#include <linux/bpf.h>
+#endif
+
+#include "util.h"
+#include "passt.h"
+#include "log.h"
+#include "tcp.h"
+#include "sk_lookup.h"
+
+#ifdef HAS_SK_LOOKUP
+
+#define SK_LOOKUP_KEY_V4	0
+#define SK_LOOKUP_KEY_V6	1
+#define SK_LOOKUP_KEYS		2
+
+#define INSN(c, d, s, o, i)						\
+	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s),	\
+			    .off = (o), .imm = (i) })
+
+/* Load map file descriptor, two instructions */
+#define INSN_LD_MAP_FD(d, fd)						\
+	INSN(BPF_LD | BPF_DW | BPF_IMM, (d), BPF_PSEUDO_MAP_FD, 0, (fd)),	\
+	INSN(0, 0, 0, 0, 0)
+
+/* Bitmap of ports already bound by other sockets: never steer those */
+static uint8_t sk_lookup_bound[PORT_BITMAP_SIZE];
+
+/* mmap()ed values of port map, one per port, see comment on top */
+static uint64_t *sk_lookup_ports;
+
+/**
+ * sk_lookup_bpf() - Wrapper for bpf() syscall
+ * @cmd:	Command
+ * @attr:	Attributes for command
+ *
+ * Return: return value from bpf(), negative error code on failure
+ *
+ * #syscalls:passt bpf
+ */
+static int sk_lookup_bpf(int cmd, union bpf_attr *attr)
+{
+	int ret = syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+
+	return ret < 0 ? -errno : ret;
+}
+
+/**
+ * sk_lookup_map() - Create BPF map
+ * @type:	Map type
+ * @value_size:	Size of values
+ * @max:	Number of entries
+ * @flags:	Flags for map creation
+ *
+ * Return: file descriptor for map, negative error code on failure
+ */
+static int sk_lookup_map(uint32_t type, uint32_t value_size, uint32_t max,
+			 uint32_t flags)
+{
+	union bpf_attr attr = {
+		.map_type	= type,
+		.key_size	= sizeof(uint32_t),
+		.value_size	= value_size,
+		.max_entries	= max,
+		.map_flags	= flags,
+	};
+
+	return sk_lookup_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/**
+ * sk_lookup_prog() - Load sk_lookup program using given maps
+ * @ports:	File descriptor for port map
+ * @socks:	File descriptor for sockmap
+ *
+ * Return: file descriptor for program, negative error code on failure
+ */
+static int sk_lookup_prog(int ports, int socks)
+{
+	const struct bpf_insn insns[] = {
+		/* r6 = ctx; if (ctx->protocol != IPPROTO_TCP) goto pass */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+		     offsetof(struct bpf_sk_lookup, protocol), 0),
+		INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 30, IPPROTO_TCP),
+
+		/* r0 = bpf_map_lookup_elem(ports, &ctx->local_port) */
+		INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+		     offsetof(struct bpf_sk_lookup, local_port), 0),
+		INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -4, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+		INSN_LD_MAP_FD(BPF_REG_1, ports),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 22, 0),
+
+		/* r3 = family == AF_INET6; if (!(*r0 >> r3 & 1)) goto pass */
+		INSN(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_7, BPF_REG_0, 0, 0),
+		INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+		     offsetof(struct bpf_sk_lookup, family), 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0,
+		     SK_LOOKUP_KEY_V4),
+		INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 1, AF_INET6),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0,
+		     SK_LOOKUP_KEY_V6),
+		INSN(BPF_ALU64 | BPF_RSH | BPF_X, BPF_REG_7, BPF_REG_3, 0, 0),
+		INSN(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_7, 0, 0, 1),
+		INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_7, 0, 14, 0),
+
+		/* r0 = bpf_map_lookup_elem(socks, &r3) */
+		INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_3, -8, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+		INSN_LD_MAP_FD(BPF_REG_1, socks),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 7, 0),
+
+		/* bpf_sk_assign(ctx, r0, 0); bpf_sk_release(r0) */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_7, BPF_REG_0, 0, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_0, 0, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 0),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_assign),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_release),
+
+		/* pass: return SK_PASS, socket assigned or not */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	static char log[BUFSIZ];
+	union bpf_attr attr = {
+		.prog_type		= BPF_PROG_TYPE_SK_LOOKUP,
+		.expected_attach_type	= BPF_SK_LOOKUP,
+		.insns			= (uintptr_t)insns,
+		.insn_cnt		= ARRAY_SIZE(insns),
+		.license		= (uintptr_t)"GPL",
+		.log_buf		= (uintptr_t)log,
+		.log_size		= sizeof(log),
+		.log_level		= 1,
+	};
+	int ret;
+
+	if ((ret = sk_lookup_bpf(BPF_PROG_LOAD, &attr)) < 0 && *log)
+		debug("sk_lookup program rejected by verifier:\n%s", log);
+
+	return ret;
+}
+
+/**
+ * sk_lookup_sock() - Store listening socket in sockmap
+ * @socks:	File descriptor for sockmap
+ * @key:	SK_LOOKUP_KEY_V4 or SK_LOOKUP_KEY_V6
+ * @s:		Listening socket
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int sk_lookup_sock(int socks, uint32_t key, int s)
+{
+	uint64_t value = s;
+	union bpf_attr attr = {
+		.map_fd	= socks,
+		.key	= (uintptr_t)&key,
+		.value	= (uintptr_t)&value,
+		.flags	= BPF_ANY,
+	};
+	int ret = sk_lookup_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * sk_lookup_init() - Load and attach sk_lookup program, open TCP listeners
+ * @c:		Execution context
+ * @bound:	Bitmap of TCP ports already bound by other sockets
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+int sk_lookup_init(struct ctx *c, const uint8_t *bound)
+{
+	union bpf_attr attr = { 0 };
+	int ports, socks, prog, netns, link, s, ret;
+	void *p;
+
+	ports = sk_lookup_map(BPF_MAP_TYPE_ARRAY, sizeof(uint64_t), NUM_PORTS,
+			      BPF_F_MMAPABLE);
+	if (ports < 0)
+		return ports;
+
+	p = mmap(NULL, NUM_PORTS * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+		 MAP_SHARED, ports, 0);
+	if (p == MAP_FAILED) {
+		ret = -errno;
+		goto close_ports;
+	}
+
+	socks = sk_lookup_map(BPF_MAP_TYPE_SOCKMAP, sizeof(uint64_t),
+			      SK_LOOKUP_KEYS, 0);
+	if (socks < 0) {
+		ret = socks;
+		goto unmap;
+	}
+
+	if ((prog = sk_lookup_prog(ports, socks)) < 0) {
+		ret = prog;
+		goto close_socks;
+	}
+
+	/* One socket: IPv6, dual-stack if IPv4 is enabled too, or IPv4 */
+	if ((s = tcp_sock_init_lookup(c, c->ifi6 ? AF_INET6 : AF_INET)) < 0) {
+		ret = s;
+		goto close_prog;
+	}
+
+	if ((c->ifi4 && (ret = sk_lookup_sock(socks, SK_LOOKUP_KEY_V4, s))) ||
+	    (c->ifi6 && (ret = sk_lookup_sock(socks, SK_LOOKUP_KEY_V6, s))))
+		goto close_sock;
+
+	if ((netns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC)) < 0) {
+		ret = -errno;
+		goto close_sock;
+	}
+
+	attr.link_create.prog_fd	= prog;
+	attr.link_create.target_fd	= netns;
+	attr.link_create.attach_type	= BPF_SK_LOOKUP;
+	link = sk_lookup_bpf(BPF_LINK_CREATE, &attr);
+	close(netns);
+	if (link < 0) {
+		ret = link;
+		goto close_sock;
+	}
+
+	/* The link holds references to program and maps: keep it open only */
+	close(prog);
+	close(socks);
+	close(ports);
+
+	memcpy(sk_lookup_bound, bound, PORT_BITMAP_SIZE);
+	sk_lookup_ports = p;
+
+	info("TCP ports steered to %s listening socket with BPF sk_lookup",
+	     c->ifi4 && c->ifi6 ? "dual-stack" : "single");
+
+	return 0;
+
+close_sock:
+	epoll_ctl(c->epollfd, EPOLL_CTL_DEL, s, NULL);
+	close(s);
+close_prog:
+	close(prog);
+close_socks:
+	close(socks);
+unmap:
+	munmap(p, NUM_PORTS * sizeof(uint64_t));
+close_ports:
+	close(ports);
+	return ret;
+}
+
+/**
+ * sk_lookup_add() - Steer a TCP port to catch-all listening sockets
+ * @af:		Address family to select a specific IP version, or AF_UNSPEC
+ * @port:	Port, host order
+ *
+ * Return: 0 on success, -EADDRINUSE if port is bound by another socket
+ */
+int sk_lookup_add(sa_family_t af, in_port_t port)
+{
+	if (bitmap_isset(sk_lookup_bound, port))
+		return -EADDRINUSE;
+
+	if (af == AF_INET || af == AF_UNSPEC)
+		sk_lookup_ports[port] |= 1 << SK_LOOKUP_KEY_V4;
+	if (af == AF_INET6 || af == AF_UNSPEC)
+		sk_lookup_ports[port] |= 1 << SK_LOOKUP_KEY_V6;
+
+	return 0;
+}
+
+#else /* !HAS_SK_LOOKUP */
+
+/**
+ * sk_lookup_init() - Stub, BPF sk_lookup not supported by build environment
+ * @c:		Execution context, unused
+ * @bound:	Bitmap of TCP ports already bound by other sockets, unused
+ *
+ * Return: -ENOTSUP
+ */
+int sk_lookup_init(struct ctx *c, const uint8_t *bound)
+{
+	(void)c;
+	(void)bound;
+
+	return -ENOTSUP;
+}
+
+/**
+ * sk_lookup_add() - Stub, never called without sk_lookup_init()
+ * @af:		Address family, unused
+ * @port:	Port, unused
+ *
+ * Return: -ENOTSUP
+ */
+int sk_lookup_add(sa_family_t af, in_port_t port)
+{
+	(void)af;
+	(void)port;
+
+	return -ENOTSUP;
+}
+
+#endif /* HAS_SK_LOOKUP */
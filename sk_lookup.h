@@ -0,0 +1,11 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#ifndef SK_LOOKUP_H
+#define SK_LOOKUP_H
+
+int sk_lookup_init(struct ctx *c, const uint8_t *bound);
+int sk_lookup_add(sa_family_t af, in_port_t port);
+
+#endif /* SK_LOOKUP_H */
@@ -0,0 +1,400 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * sockmap.c - Forward data between spliced TCP sockets in kernel, BPF sockmap
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Once a spliced connection is established and idle, both its sockets can be
+ * inserted into a BPF_MAP_TYPE_SOCKHASH with a BPF_PROG_TYPE_SK_SKB verdict
+ * program attached: data received on either socket is then redirected by the
+ * kernel to the egress of the other one, without waking us up.
+ *
+ * The program is hand-assembled, to avoid a dependency on a BPF toolchain, and
+ * uses two maps, both indexed by socket cookie:
+ *
+ * - a hash table, giving the cookie of the peer socket for a given socket
+ *
+ * - the sockhash itself, with both sockets of each spliced connection
+ *
+ * Loading the program and creating maps needs CAP_BPF and CAP_NET_ADMIN (or
+ * CAP_SYS_ADMIN), and Linux 5.13 or later.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#if defined(HAS_SOCKMAP) && defined(HAS_BYTES_ACKED)
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h> /* For struct tcp_info */
+#endif
+
+#include "util.h"
+#include "passt.h"
+#include "log.h"
+#include "sockmap.h"
+
+#if defined(HAS_SOCKMAP) && defined(HAS_BYTES_ACKED)
+
+#define INSN(c, d, s, o, i)						\
+	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s),	\
+			    .off = (o), .imm = (i) })
+
+/* Load map file descriptor, two instructions */
+#define INSN_LD_MAP_FD(d, fd)						\
+	INSN(BPF_LD | BPF_DW | BPF_IMM, (d), BPF_PSEUDO_MAP_FD, 0, (fd)),	\
+	INSN(0, 0, 0, 0, 0)
+
+/* Maps: peer socket cookies, and sockhash, see comment on top */
+static int sockmap_peers = -1;
+static int sockmap_socks = -1;
+
+/**
+ * sockmap_bpf() - Wrapper for bpf() syscall
+ * @cmd:	Command
+ * @attr:	Attributes for command
+ *
+ * Return: return value from bpf(), negative error code on failure
+ *
+ * #syscalls:pasta bpf
+ */
+static int sockmap_bpf(int cmd, union bpf_attr *attr)
+{
+	int ret = syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+
+	return ret < 0 ? -errno : ret;
+}
+
+/**
+ * sockmap_map() - Create BPF map indexed by socket cookie
+ * @type:	Map type
+ * @max:	Number of entries
+ * @flags:	Flags for map creation
+ *
+ * Return: file descriptor for map, negative error code on failure
+ */
+static int sockmap_map(uint32_t type, uint32_t max, uint32_t flags)
+{
+	union bpf_attr attr = {
+		.map_type	= type,
+		.key_size	= sizeof(uint64_t),
+		.value_size	= sizeof(uint64_t),
+		.max_entries	= max,
+		.map_flags	= flags,
+	};
+
+	return sockmap_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/**
+ * sockmap_prog() - Load verdict program redirecting data to peer sockets
+ *
+ * Return: file descriptor for program, negative error code on failure
+ */
+static int sockmap_prog(void)
+{
+	const struct bpf_insn insns[] = {
+		/* r6 = ctx; *(fp - 8) = bpf_get_socket_cookie(ctx) */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+		INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+
+		/* r0 = bpf_map_lookup_elem(peers, fp - 8) */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+		INSN_LD_MAP_FD(BPF_REG_1, sockmap_peers),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 10, 0),
+
+		/* *(fp - 16) = *r0; return bpf_sk_redirect_hash(...) */
+		INSN(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, 0, 0),
+		INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_1, -16, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+		INSN_LD_MAP_FD(BPF_REG_2, sockmap_socks),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+		/* pass: no peer, leave data to socket */
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	static char log[BUFSIZ];
+	union bpf_attr attr = {
+		.prog_type		= BPF_PROG_TYPE_SK_SKB,
+		.insns			= (uintptr_t)insns,
+		.insn_cnt		= ARRAY_SIZE(insns),
+		.license		= (uintptr_t)"GPL",
+		.log_buf		= (uintptr_t)log,
+		.log_size		= sizeof(log),
+		.log_level		= 1,
+	};
+	int ret;
+
+	if ((ret = sockmap_bpf(BPF_PROG_LOAD, &attr)) < 0 && *log)
+		debug("sockmap program rejected by verifier:\n%s", log);
+
+	return ret;
+}
+
+/**
+ * sockmap_cookie() - Get socket cookie
+ * @s:		Socket
+ * @cookie:	Cookie, set on return
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int sockmap_cookie(int s, uint64_t *cookie)
+{
+	socklen_t sl = sizeof(*cookie);
+
+	if (getsockopt(s, SOL_SOCKET, SO_COOKIE, cookie, &sl))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * sockmap_update() - Insert or update map element
+ * @map:	File descriptor for map
+ * @key:	Key, socket cookie
+ * @value:	Value, peer cookie or socket
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int sockmap_update(int map, uint64_t key, uint64_t value)
+{
+	union bpf_attr attr = {
+		.map_fd	= map,
+		.key	= (uintptr_t)&key,
+		.value	= (uintptr_t)&value,
+		.flags	= BPF_ANY,
+	};
+	int ret = sockmap_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * sockmap_delete() - Delete map element, if present
+ * @map:	File descriptor for map
+ * @key:	Key, socket cookie
+ */
+static void sockmap_delete(int map, uint64_t key)
+{
+	union bpf_attr attr = {
+		.map_fd	= map,
+		.key	= (uintptr_t)&key,
+	};
+
+	sockmap_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/**
+ * sockmap_init() - Create maps, load verdict program and attach it to sockhash
+ * @max:	Maximum number of connections
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+int sockmap_init(unsigned int max)
+{
+	union bpf_attr attr = { 0 };
+	int prog, ret;
+
+	/* Sized for the maximum number of connections: don't preallocate */
+	sockmap_peers = sockmap_map(BPF_MAP_TYPE_HASH, max * 2,
+				    BPF_F_NO_PREALLOC);
+	if (sockmap_peers < 0)
+		return sockmap_peers;
+
+	sockmap_socks = sockmap_map(BPF_MAP_TYPE_SOCKHASH, max * 2, 0);
+	if (sockmap_socks < 0) {
+		ret = sockmap_socks;
+		goto close_peers;
+	}
+
+	if ((prog = sockmap_prog()) < 0) {
+		ret = prog;
+		goto close_socks;
+	}
+
+	attr.target_fd		= sockmap_socks;
+	attr.attach_bpf_fd	= prog;
+	attr.attach_type	= BPF_SK_SKB_VERDICT;
+	ret = sockmap_bpf(BPF_PROG_ATTACH, &attr);
+
+	/* The sockhash holds a reference to the program once attached */
+	close(prog);
+	if (ret < 0)
+		goto close_socks;
+
+	info("Spliced TCP connections forwarded in kernel with BPF sockmap");
+
+	return 0;
+
+close_socks:
+	close(sockmap_socks);
+	sockmap_socks = -1;
+close_peers:
+	close(sockmap_peers);
+	sockmap_peers = -1;
+	return ret;
+}
+
+/**
+ * sockmap_add() - Redirect data between two connected sockets in kernel
+ * @a:		Socket
+ * @b:		Peer socket
+ *
+ * Return: 0 on success, negative error code on failure
+ *
+ * #syscalls:pasta getsockopt
+ */
+int sockmap_add(int a, int b)
+{
+	uint64_t ca, cb;
+	int ret;
+
+	if ((ret = sockmap_cookie(a, &ca)) || (ret = sockmap_cookie(b, &cb)))
+		return ret;
+
+	/* Peers first: the program only runs for sockets in the sockhash */
+	if ((ret = sockmap_update(sockmap_peers, ca, cb)) ||
+	    (ret = sockmap_update(sockmap_peers, cb, ca)) ||
+	    (ret = sockmap_update(sockmap_socks, ca, a)) ||
+	    (ret = sockmap_update(sockmap_socks, cb, b))) {
+		sockmap_delete(sockmap_socks, ca);
+		sockmap_delete(sockmap_peers, ca);
+		sockmap_delete(sockmap_peers, cb);
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * sockmap_del() - Stop redirecting data between two sockets, before closing
+ * @a:		Socket
+ * @b:		Peer socket
+ */
+void sockmap_del(int a, int b)
+{
+	uint64_t ca, cb;
+
+	if (sockmap_cookie(a, &ca) || sockmap_cookie(b, &cb))
+		return;
+
+	sockmap_delete(sockmap_socks, ca);
+	sockmap_delete(sockmap_socks, cb);
+	sockmap_delete(sockmap_peers, ca);
+	sockmap_delete(sockmap_peers, cb);
+}
+
+/**
+ * sockmap_seq() - Get byte counters for one direction of forwarding
+ * @from:	Source socket
+ * @to:		Destination socket
+ * @in:		Bytes received on @from, including FIN, set on return
+ * @out:	Bytes queued for sending on @to, set on return
+ *
+ * Return: 0 on success, negative error code on failure
+ *
+ * #syscalls:pasta ioctl
+ */
+int sockmap_seq(int from, int to, uint32_t *in, uint32_t *out)
+{
+	struct tcp_info tinfo;
+	socklen_t sl = sizeof(tinfo);
+	int outq;
+
+	if (getsockopt(from, IPPROTO_TCP, TCP_INFO, &tinfo, &sl))
+		return -errno;
+
+	*in = tinfo.tcpi_bytes_received;
+
+	if (getsockopt(to, IPPROTO_TCP, TCP_INFO, &tinfo, &sl) ||
+	    ioctl(to, SIOCOUTQ, &outq))
+		return -errno;
+
+	/* Acknowledged, plus unacknowledged and unsent data in send queue */
+	*out = tinfo.tcpi_bytes_acked + outq;
+
+	return 0;
+}
+
+#else /* !HAS_SOCKMAP || !HAS_BYTES_ACKED */
+
+/**
+ * sockmap_init() - Stub, BPF sockmap not supported by build environment
+ * @max:	Maximum number of connections, unused
+ *
+ * Return: -ENOTSUP
+ */
+int sockmap_init(unsigned int max)
+{
+	(void)max;
+
+	return -ENOTSUP;
+}
+
+/**
+ * sockmap_add() - Stub, never called without sockmap_init()
+ * @a:		Socket, unused
+ * @b:		Peer socket, unused
+ *
+ * Return: -ENOTSUP
+ */
+int sockmap_add(int a, int b)
+{
+	(void)a;
+	(void)b;
+
+	return -ENOTSUP;
+}
+
+/**
+ * sockmap_del() - Stub, never called without sockmap_init()
+ * @a:		Socket, unused
+ * @b:		Peer socket, unused
+ */
+void sockmap_del(int a, int b)
+{
+	(void)a;
+	(void)b;
+}
+
+/**
+ * sockmap_seq() - Stub, never called without sockmap_init()
+ * @from:	Source socket, unused
+ * @to:		Destination socket, unused
+ * @in:		Bytes received on @from, unused
+ * @out:	Bytes queued for sending on @to, unused
+ *
+ * Return: -ENOTSUP
+ */
+int sockmap_seq(int from, int to, uint32_t *in, uint32_t *out)
+{
+	(void)from;
+	(void)to;
+	(void)in;
+	(void)out;
+
+	return -ENOTSUP;
+}
+
+#endif /* HAS_SOCKMAP && HAS_BYTES_ACKED */
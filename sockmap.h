@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#ifndef SOCKMAP_H
+#define SOCKMAP_H
+
+int sockmap_init(unsigned int max);
+int sockmap_add(int a, int b);
+void sockmap_del(int a, int b);
+int sockmap_seq(int from, int to, uint32_t *in, uint32_t *out);
+
+#endif /* SOCKMAP_H */
@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * stats.c - Statistics counters, exported over a UNIX domain socket
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Counters are plain integers, incremented in place by protocol and tap
+ * handlers. Connecting to the socket given with --stats-socket dumps them in
+ * Prometheus text exposition format, then closes the connection, e.g.:
+ *
+ *	socat - UNIX-CONNECT:/tmp/passt_stats.socket
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "passt.h"
+#include "log.h"
+#include "stats.h"
+
+#define STATS_BUF_SIZE		8192
+
+struct stats stats;
+
+static const char *stats_dir_str[STATS_DIR_MAX] = {
+	"from_tap", "to_tap",
+};
+
+static const char *stats_proto_str[STATS_PROTO_MAX] = {
+	"tcp", "udp", "icmp", "other",
+};
+
+/**
+ * stats_proto() - Map IP protocol number to protocol class
+ * @proto:	IP protocol number, or IPv6 next header
+ *
+ * Return: protocol class for counters
+ */
+static enum stats_proto stats_proto(uint8_t proto)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+		return STATS_TCP;
+	case IPPROTO_UDP:
+		return STATS_UDP;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		return STATS_ICMP;
+	default:
+		return STATS_OTHER;
+	}
+}
+
+/**
+ * stats_frame() - Account for one frame handled on the tap interface
+ * @dir:	Direction of frame
+ * @frame:	Frame, starting from Ethernet header
+ * @len:	L2 length of frame
+ *
+ * IPv6 extension headers are not walked: frames carrying them are counted as
+ * STATS_OTHER.
+ */
+void stats_frame(enum stats_dir dir, const char *frame, size_t len)
+{
+	const struct ethhdr *eh = (const struct ethhdr *)frame;
+	enum stats_proto p = STATS_OTHER;
+
+	if (len >= sizeof(*eh) + sizeof(struct iphdr) &&
+	    eh->h_proto == htons(ETH_P_IP))
+		p = stats_proto(((const struct iphdr *)(eh + 1))->protocol);
+	else if (len >= sizeof(*eh) + sizeof(struct ip6_hdr) &&
+		 eh->h_proto == htons(ETH_P_IPV6))
+		p = stats_proto(((const struct ip6_hdr *)(eh + 1))->ip6_nxt);
+
+	stats.frames[dir][p]++;
+	stats.bytes[dir][p] += len;
+}
+
+/**
+ * stats_init() - Create and bind AF_UNIX socket for statistics, if configured
+ * @c:		Execution context
+ */
+void stats_init(struct ctx *c)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct epoll_event ev = { 0 };
+	int fd;
+
+	if (!*c->stats_sock_path)
+		return;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("UNIX socket for statistics");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(addr.sun_path, c->stats_sock_path, UNIX_PATH_MAX);
+	unlink(addr.sun_path);
+
+	if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 0)) {
+		err("Can't bind statistics socket at %s: %s", addr.sun_path,
+		    strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	info("Statistics available on UNIX domain socket at %s", addr.sun_path);
+
+	ev.data.fd = c->fd_stats = fd;
+	ev.events = EPOLLIN;
+	epoll_ctl(c->epollfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * stats_printf() - Append formatted output to buffer, truncate if full
+ * @buf:	Buffer
+ * @size:	Size of @buf
+ * @off:	Current length of output in @buf, updated on return
+ * @fmt:	Format string, then arguments
+ */
+__attribute__((format(printf, 4, 5)))
+static void stats_printf(char *buf, size_t size, size_t *off,
+			 const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	if (*off >= size)
+		return;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(buf + *off, size - *off, fmt, ap);
+	va_end(ap);
+
+	if (ret > 0)
+		*off = MIN(*off + ret, size);
+}
+
+/**
+ * stats_metric() - Append HELP and TYPE lines for a metric
+ * @buf:	Buffer
+ * @size:	Size of @buf
+ * @off:	Current length of output in @buf, updated on return
+ * @name:	Metric name
+ * @type:	Metric type, "counter" or "gauge"
+ * @help:	Description of metric
+ */
+static void stats_metric(char *buf, size_t size, size_t *off, const char *name,
+			 const char *type, const char *help)
+{
+	stats_printf(buf, size, off, "# HELP %s %s\n# TYPE %s %s\n",
+		     name, help, name, type);
+}
+
+/**
+ * stats_handler() - Accept connection on statistics socket, dump counters
+ * @c:		Execution context
+ */
+void stats_handler(const struct ctx *c)
+{
+	static const struct {
+		const char *name;
+		const uint64_t *v;
+		const char *help;
+	} counters[] = {
+		{ "passt_tap_partial_writes_total",	&stats.tap_partial,
+		  "Frames partially written to tap, then completed" },
+		{ "passt_tap_dropped_frames_total",	&stats.tap_drop,
+		  "Frames dropped on short or failed writes to tap" },
+		{ "passt_tcp_resets_total",		&stats.tcp_rst,
+		  "TCP resets sent to tap" },
+		{ "passt_tcp_sock_pool_empty_total",	&stats.sock_pool_empty,
+		  "TCP connections finding no pre-opened socket in pool" },
+		{ "passt_splice_pipe_refills_total",
+		  &stats.splice_pipe_refill,
+		  "Pipes opened for spliced TCP, to refill pool or on demand" },
+		{ "passt_splice_sockmap_total",		&stats.splice_sockmap,
+		  "Spliced TCP connections forwarded in kernel by BPF sockmap" },
+		{ "passt_tap_csum_offload_bytes_total",
+		  &stats.csum_offload_bytes,
+		  "L4 bytes sent to tap with checksum left to namespace" },
+	};
+	char buf[STATS_BUF_SIZE];
+	size_t off = 0;
+	unsigned int d, p, i;
+	int fd;
+
+	fd = accept4(c->fd_stats, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	stats_metric(buf, sizeof(buf), &off, "passt_frames_total", "counter",
+		     "Frames handled on tap interface");
+	for (d = 0; d < STATS_DIR_MAX; d++) {
+		for (p = 0; p < STATS_PROTO_MAX; p++) {
+			stats_printf(buf, sizeof(buf), &off,
+				     "passt_frames_total"
+				     "{direction=\"%s\",proto=\"%s\"} %llu\n",
+				     stats_dir_str[d], stats_proto_str[p],
+				     (unsigned long long)stats.frames[d][p]);
+		}
+	}
+
+	stats_metric(buf, sizeof(buf), &off, "passt_bytes_total", "counter",
+		     "L2 bytes handled on tap interface");
+	for (d = 0; d < STATS_DIR_MAX; d++) {
+		for (p = 0; p < STATS_PROTO_MAX; p++) {
+			stats_printf(buf, sizeof(buf), &off,
+				     "passt_bytes_total"
+				     "{direction=\"%s\",proto=\"%s\"} %llu\n",
+				     stats_dir_str[d], stats_proto_str[p],
+				     (unsigned long long)stats.bytes[d][p]);
+		}
+	}
+
+	stats_metric(buf, sizeof(buf), &off, "passt_tcp_retransmits_total",
+		     "counter", "TCP retransmissions to tap");
+	stats_printf(buf, sizeof(buf), &off,
+		     "passt_tcp_retransmits_total{kind=\"timeout\"} %llu\n"
+		     "passt_tcp_retransmits_total{kind=\"fast\"} %llu\n",
+		     (unsigned long long)stats.tcp_retrans,
+		     (unsigned long long)stats.tcp_fast_retrans);
+
+	for (i = 0; i < ARRAY_SIZE(counters); i++) {
+		stats_metric(buf, sizeof(buf), &off, counters[i].name,
+			     "counter", counters[i].help);
+		stats_printf(buf, sizeof(buf), &off, "%s %llu\n",
+			     counters[i].name,
+			     (unsigned long long)*counters[i].v);
+	}
+
+	stats_metric(buf, sizeof(buf), &off, "passt_tcp_connections", "gauge",
+		     "TCP connections in table");
+	stats_printf(buf, sizeof(buf), &off,
+		     "passt_tcp_connections{kind=\"tap\"} %i\n"
+		     "passt_tcp_connections{kind=\"spliced\"} %i\n",
+		     tcp_conn_count(), c->tcp.splice_conn_count);
+
+	/* A fresh socket has plenty of buffer space, don't wait for a reader */
+	if (write(fd, buf, off) != (ssize_t)off)
+		debug("Short write on statistics socket");
+
+	close(fd);
+}
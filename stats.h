@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+/**
+ * enum stats_dir - Direction of frames on the tap interface
+ * @STATS_FROM_TAP:	Frames received from guest or namespace
+ * @STATS_TO_TAP:	Frames sent to guest or namespace
+ */
+enum stats_dir {
+	STATS_FROM_TAP,
+	STATS_TO_TAP,
+	STATS_DIR_MAX,
+};
+
+/**
+ * enum stats_proto - Protocol classes for frame and byte counters
+ * @STATS_TCP:		TCP over IPv4 or IPv6
+ * @STATS_UDP:		UDP over IPv4 or IPv6
+ * @STATS_ICMP:		ICMP or ICMPv6
+ * @STATS_OTHER:	Anything else, including ARP
+ */
+enum stats_proto {
+	STATS_TCP,
+	STATS_UDP,
+	STATS_ICMP,
+	STATS_OTHER,
+	STATS_PROTO_MAX,
+};
+
+/**
+ * struct stats - Counters, only ever incremented
+ * @frames:		Frames handled on tap, by direction and protocol
+ * @bytes:		L2 bytes handled on tap, by direction and protocol
+ * @tap_partial:	Frames partially written to tap, completed later
+ * @tap_drop:		Frames dropped on tap, short or failed writes
+ * @tcp_retrans:	TCP retransmissions on ACK timeout
+ * @tcp_fast_retrans:	TCP fast retransmissions on duplicate ACKs from tap
+ * @tcp_rst:		TCP resets sent to tap
+ * @sock_pool_empty:	New TCP connections not served from socket pools
+ * @splice_pipe_refill:	Pipes opened for spliced TCP, refill or on demand
+ * @splice_sockmap:	Spliced TCP connections handed over to BPF sockmap
+ * @csum_offload_bytes:	L4 bytes sent to tap without checksum, --csum-offload
+ */
+struct stats {
+	uint64_t frames[STATS_DIR_MAX][STATS_PROTO_MAX];
+	uint64_t bytes[STATS_DIR_MAX][STATS_PROTO_MAX];
+	uint64_t tap_partial;
+	uint64_t tap_drop;
+	uint64_t tcp_retrans;
+	uint64_t tcp_fast_retrans;
+	uint64_t tcp_rst;
+	uint64_t sock_pool_empty;
+	uint64_t splice_pipe_refill;
+	uint64_t splice_sockmap;
+	uint64_t csum_offload_bytes;
+};
+
+extern struct stats stats;
+
+void stats_frame(enum stats_dir dir, const char *frame, size_t len);
+void stats_init(struct ctx *c);
+void stats_handler(const struct ctx *c);
+
+#endif /* STATS_H */
@@ -14,6 +14,7 @@
  */
 
 #include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <errno.h>
 #include <limits.h>
@@ -40,6 +41,7 @@
 #include <netinet/if_ether.h>
 
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 #include <linux/icmpv6.h>
 
 #include "checksum.h"
@@ -53,7 +55,10 @@
 #include "netlink.h"
 #include "pasta.h"
 #include "packet.h"
+#include "tap.h"
+#include "vhost_user.h"
 #include "log.h"
+#include "stats.h"
 
 /* IPv4 (plus ARP) and IPv6 message batches from tap/guest to IP handlers */
 static PACKET_POOL_NOINIT(pool_tap4, TAP_MSGS, pkt_buf);
@@ -61,29 +66,321 @@ static PACKET_POOL_NOINIT(pool_tap6, TAP_MSGS, pkt_buf);
 
 #define TAP_SEQS		128 /* Different L4 tuples in one batch */
 
+/* virtio-net header for frames to pasta tap: no checksum or GSO requests */
+static const struct virtio_net_hdr tap_vnet_hdr = {
+	.gso_type = VIRTIO_NET_HDR_GSO_NONE,
+};
+
+/* Offloads we accept from namespace: frames might be GSO, or miss checksums */
+#define TAP_TUN_OFFLOADS	(TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6)
+
 /**
- * tap_send() - Send frame, with qemu socket header if needed
+ * tap_send_vnet() - Send frame, with qemu socket or virtio-net header if needed
  * @c:		Execution context
+ * @h:		virtio-net header for pasta tap
  * @data:	Packet buffer
  * @len:	Total L2 packet length
  *
- * Return: return code from send() or write()
+ * Return: return code from send() or writev()
  */
-int tap_send(const struct ctx *c, const void *data, size_t len)
+static int tap_send_vnet(const struct ctx *c, const struct virtio_net_hdr *h,
+			 const void *data, size_t len)
 {
+	struct iovec iov[2] = {
+		{ (void *)h,			sizeof(*h) },
+		{ (void *)data,			len },
+	};
+
+	int ret;
+
 	pcap(data, len);
 
-	if (c->mode == MODE_PASST) {
+	if (c->vhost_user) {
+		ret = vu_send(c, data, len);
+	} else if (c->mode == MODE_PASST) {
 		int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
 		uint32_t vnet_len = htonl(len);
 
-		if (send(c->fd_tap, &vnet_len, 4, flags) < 0)
-			return -1;
+		ret = send(c->fd_tap, &vnet_len, 4, flags);
+		if (ret >= 0)
+			ret = send(c->fd_tap, data, len, flags);
+	} else {
+		ret = writev(c->fd_tap, iov, ARRAY_SIZE(iov));
+	}
+
+	if (ret < 0)
+		stats.tap_drop++;
+	else
+		stats_frame(STATS_TO_TAP, data, len);
+
+	return ret;
+}
+
+/**
+ * tap_send() - Send frame, with qemu socket header if needed
+ * @c:		Execution context
+ * @data:	Packet buffer
+ * @len:	Total L2 packet length
+ *
+ * Return: return code from send() or writev()
+ */
+int tap_send(const struct ctx *c, const void *data, size_t len)
+{
+	return tap_send_vnet(c, &tap_vnet_hdr, data, len);
+}
+
+/**
+ * tap_send_remainder() - Send remainder of a partially sent frame
+ * @c:		Execution context
+ * @iov:	Partially sent buffer
+ * @offset:	Number of bytes already sent from @iov
+ */
+static void tap_send_remainder(const struct ctx *c, const struct iovec *iov,
+			       size_t offset)
+{
+	const char *base = (char *)iov->iov_base;
+	size_t len = iov->iov_len;
+
+	stats.tap_partial++;
+
+	while (offset < len) {
+		ssize_t sent = send(c->fd_tap, base + offset, len - offset,
+				    MSG_NOSIGNAL);
+		if (sent < 0) {
+			debug("tap: failed to flush %lu missing bytes",
+			      len - offset);
+			return;
+		}
+
+		offset += sent;
+	}
+}
+
+/**
+ * tap_send_frames_passt() - Send multiple frames to the passt tap
+ * @c:		Execution context
+ * @iov:	Array of buffers, each containing one frame, with vnet_len
+ * @n:		Number of buffers/frames in @iov
+ *
+ * Return: number of frames successfully sent
+ *
+ * #syscalls:passt sendmsg
+ */
+static size_t tap_send_frames_passt(const struct ctx *c,
+				    const struct iovec *iov, size_t n)
+{
+	struct msghdr mh = {
+		.msg_iov = (void *)iov,
+		.msg_iovlen = n,
+	};
+	size_t end = 0, i;
+	ssize_t sent;
+
+	sent = sendmsg(c->fd_tap, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (sent < 0)
+		return 0;
+
+	/* A partial frame would leave the stream inconsistent: complete it */
+	for (i = 0; i < n; i++) {
+		end += iov[i].iov_len;
+		if (end >= (size_t)sent)
+			break;
+	}
+
+	if (i == n)
+		return n;
+
+	if (end > (size_t)sent)
+		tap_send_remainder(c, &iov[i], iov[i].iov_len - (end - sent));
+
+	return i + 1;
+}
+
+/**
+ * tap_vnet_hdr_csum() - Request checksum completion for TCP, UDP over IPv6
+ * @h:		virtio-net header to update
+ * @frame:	Frame, starting from Ethernet header
+ * @len:	Length of frame
+ *
+ * With checksum offload, TCP and UDP over IPv6 checksum fields only contain the
+ * pseudo-header checksum. UDP over IPv4 is sent without checksum altogether.
+ */
+static void tap_vnet_hdr_csum(struct virtio_net_hdr *h, const char *frame,
+			      size_t len)
+{
+	const struct ethhdr *eh = (const struct ethhdr *)frame;
+	size_t l4 = sizeof(*eh);
+	uint8_t proto;
+
+	if (eh->h_proto == htons(ETH_P_IP) &&
+	    len >= l4 + sizeof(struct iphdr)) {
+		const struct iphdr *iph = (const struct iphdr *)(eh + 1);
+
+		l4 += iph->ihl * 4;
+		if ((proto = iph->protocol) != IPPROTO_TCP)
+			return;
+	} else if (eh->h_proto == htons(ETH_P_IPV6) &&
+		   len >= l4 + sizeof(struct ipv6hdr)) {
+		const struct ipv6hdr *ip6h = (const struct ipv6hdr *)(eh + 1);
+
+		l4 += sizeof(*ip6h);
+		if ((proto = ip6h->nexthdr) != IPPROTO_TCP &&
+		    proto != IPPROTO_UDP)
+			return;
+	} else {
+		return;
+	}
+
+	if (len <= l4)
+		return;
+
+	h->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	h->csum_start = l4;
+	if (proto == IPPROTO_TCP)
+		h->csum_offset = offsetof(struct tcphdr, check);
+	else
+		h->csum_offset = offsetof(struct udphdr, check);
+}
+
+/**
+ * tap_send_csum() - Send frame, L4 checksum left to namespace if offloaded
+ * @c:		Execution context
+ * @data:	Packet buffer
+ * @len:	Total L2 packet length
+ *
+ * With --csum-offload, the L4 checksum field of TCP, or UDP over IPv6 frames
+ * must only contain the pseudo-header checksum, which the tap completes.
+ *
+ * Return: return code from send() or writev()
+ */
+int tap_send_csum(const struct ctx *c, const void *data, size_t len)
+{
+	struct virtio_net_hdr hdr = tap_vnet_hdr;
+	int ret;
+
+	if (c->csum_offload)
+		tap_vnet_hdr_csum(&hdr, data, len);
+
+	ret = tap_send_vnet(c, &hdr, data, len);
+
+	if (ret >= 0 && (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		stats.csum_offload_bytes += len - hdr.csum_start;
+
+	return ret;
+}
+
+/**
+ * tap_sock_reset() - Handle closing or failure of connected AF_UNIX or tap
+ * @c:		Execution context
+ */
+static void tap_sock_reset(struct ctx *c)
+{
+	if (c->one_off) {
+		info("Client closed connection, exiting");
+		exit(EXIT_SUCCESS);
+	}
+
+	tap_sock_init(c);
+}
+
+/**
+ * tap_send_frames_pasta() - Send multiple frames to the pasta tap
+ * @c:		Execution context
+ * @iov:	Array of buffers, each containing one frame, with vnet_len
+ * @n:		Number of buffers/frames in @iov
+ *
+ * The tap is opened with IFF_VNET_HDR: vnet_len is skipped, and frames are
+ * written after a virtio-net header instead. For checksum offload, the header
+ * is built from the first frame: frames in a batch are of the same type.
+ *
+ * Return: number of frames successfully sent
+ *
+ * #syscalls:pasta writev
+ */
+static size_t tap_send_frames_pasta(struct ctx *c,
+				    const struct iovec *iov, size_t n)
+{
+	struct virtio_net_hdr hdr = tap_vnet_hdr;
+	struct iovec v[2] = { { &hdr, sizeof(hdr) } };
+	size_t i;
+
+	if (c->csum_offload) {
+		tap_vnet_hdr_csum(&hdr,
+				  (char *)iov[0].iov_base + sizeof(uint32_t),
+				  iov[0].iov_len - sizeof(uint32_t));
+	}
+
+	for (i = 0; i < n; i++) {
+		v[1].iov_base = (char *)iov[i].iov_base + sizeof(uint32_t);
+		v[1].iov_len = iov[i].iov_len - sizeof(uint32_t);
+
+		if (writev(c->fd_tap, v, ARRAY_SIZE(v)) < 0) {
+			debug("tap write: %s", strerror(errno));
 
-		return send(c->fd_tap, data, len, flags);
+			/* Tap queue full: keep trying, it's drained by kernel */
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR) {
+				i--;
+				continue;
+			}
+
+			/* Anything else, e.g. device gone: set up a new one */
+			tap_sock_reset(c);
+			break;
+		}
+	}
+
+	if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		size_t j;
+
+		for (j = 0; j < i; j++) {
+			stats.csum_offload_bytes += iov[j].iov_len -
+						    sizeof(uint32_t) -
+						    hdr.csum_start;
+		}
+	}
+
+	return i;
+}
+
+/**
+ * tap_send_frames() - Send out multiple prepared frames
+ * @c:		Execution context
+ * @iov:	Array of buffers, each containing one frame, with 4-byte
+ *		qemu vnet_len header (unused, except in passt mode)
+ * @n:		Number of buffers/frames in @iov
+ *
+ * Return: number of frames actually sent
+ */
+size_t tap_send_frames(struct ctx *c, const struct iovec *iov, size_t n)
+{
+	size_t m, i;
+
+	if (!n)
+		return 0;
+
+	if (c->vhost_user)
+		m = vu_send_frames(c, iov, n);
+	else if (c->mode == MODE_PASST)
+		m = tap_send_frames_passt(c, iov, n);
+	else
+		m = tap_send_frames_pasta(c, iov, n);
+
+	if (m < n) {
+		debug("tap: dropped %lu frames of %lu due to short send",
+		      n - m, n);
+		stats.tap_drop += n - m;
 	}
 
-	return write(c->fd_tap, (char *)data, len);
+	for (i = 0; i < m; i++) {
+		const char *frame = (char *)iov[i].iov_base + sizeof(uint32_t);
+		size_t len = iov[i].iov_len - sizeof(uint32_t);
+
+		pcap(frame, len);
+		stats_frame(STATS_TO_TAP, frame, len);
+	}
+
+	return m;
 }
 
 /**
@@ -716,89 +1013,139 @@ append:
 	return in->count;
 }
 
+/**
+ * tap_flush_pools() - Flush both IPv4 and IPv6 packet pools
+ */
+void tap_flush_pools(void)
+{
+	pool_flush(pool_tap4);
+	pool_flush(pool_tap6);
+}
+
+/**
+ * tap_add_packet() - Queue/capture packet, update notion of guest MAC address
+ * @c:		Execution context
+ * @l2len:	Total L2 packet length
+ * @p:		Packet buffer
+ */
+void tap_add_packet(struct ctx *c, ssize_t l2len, char *p)
+{
+	const struct ethhdr *eh;
+
+	pcap(p, l2len);
+	stats_frame(STATS_FROM_TAP, p, l2len);
+
+	eh = (struct ethhdr *)p;
+
+	if (memcmp(c->mac_guest, eh->h_source, ETH_ALEN)) {
+		memcpy(c->mac_guest, eh->h_source, ETH_ALEN);
+		proto_update_l2_buf(c->mac_guest, NULL, NULL);
+	}
+
+	switch (ntohs(eh->h_proto)) {
+	case ETH_P_ARP:
+	case ETH_P_IP:
+		packet_add(pool_tap4, l2len, p);
+		break;
+	case ETH_P_IPV6:
+		packet_add(pool_tap6, l2len, p);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * tap_handle_pools() - Process packets queued with tap_add_packet()
+ * @c:		Execution context
+ * @now:	Current timestamp
+ */
+void tap_handle_pools(struct ctx *c, const struct timespec *now)
+{
+	tap4_handler(c, pool_tap4, now);
+	tap6_handler(c, pool_tap6, now);
+}
+
+/**
+ * struct tap_passt_stream - Reassembly state for frames from qemu socket
+ * @partial:	Bytes of incomplete frame, with length, at start of pkt_buf
+ */
+static struct tap_passt_stream {
+	size_t partial;
+} tap_passt_stream;
+
 /**
  * tap_handler_passt() - Packet handler for AF_UNIX file descriptor
  * @c:		Execution context
  * @now:	Current timestamp
  *
- * Return: -ECONNRESET on receive error, 0 otherwise
+ * Frames straddling the end of a read are kept, and completed by the next
+ * read: we never wait for the rest of a frame here. A length that can't be
+ * right means we lost track of frame boundaries: there's no way to find them
+ * again in the stream, so give up on the connection altogether.
+ *
+ * Return: -ECONNRESET on receive error or invalid frame length, 0 otherwise
  */
 static int tap_handler_passt(struct ctx *c, const struct timespec *now)
 {
-	struct ethhdr *eh;
-	ssize_t n, rem;
+	struct tap_passt_stream *s = &tap_passt_stream;
+	ssize_t n, size;
 	char *p;
 
 redo:
 	p = pkt_buf;
-	rem = 0;
+	size = TAP_BUF_BYTES - s->partial;
 
-	pool_flush(pool_tap4);
-	pool_flush(pool_tap6);
+	tap_flush_pools();
 
-	n = recv(c->fd_tap, p, TAP_BUF_FILL, MSG_DONTWAIT);
+	n = recv(c->fd_tap, pkt_buf + s->partial, size, MSG_DONTWAIT);
 	if (n < 0) {
 		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
 			return 0;
 
-		epoll_ctl(c->epollfd, EPOLL_CTL_DEL, c->fd_tap, NULL);
-		close(c->fd_tap);
-
+		/* Socket is closed by tap_sock_init(), via tap_sock_reset() */
+		s->partial = 0;
 		return -ECONNRESET;
 	}
 
-	while (n > (ssize_t)sizeof(uint32_t)) {
-		ssize_t len = ntohl(*(uint32_t *)p);
+	size -= n;	/* Zero if we filled the buffer */
+	n += s->partial;
 
-		p += sizeof(uint32_t);
-		n -= sizeof(uint32_t);
-
-		/* At most one packet might not fit in a single read, and this
-		 * needs to be blocking.
-		 */
-		if (len > n) {
-			rem = recv(c->fd_tap, p + n, len - n, 0);
-			if ((n += rem) != len)
-				return 0;
-		}
+	while (n > 0) {
+		ssize_t len;
 
-		/* Complete the partial read above before discarding a malformed
-		 * frame, otherwise the stream will be inconsistent.
-		 */
-		if (len < (ssize_t)sizeof(*eh) || len > (ssize_t)ETH_MAX_MTU)
-			goto next;
-
-		pcap(p, len);
+		if (n < (ssize_t)sizeof(uint32_t))
+			break;
 
-		eh = (struct ethhdr *)p;
+		len = ntohl(*(uint32_t *)p);
 
-		if (memcmp(c->mac_guest, eh->h_source, ETH_ALEN)) {
-			memcpy(c->mac_guest, eh->h_source, ETH_ALEN);
-			proto_update_l2_buf(c->mac_guest, NULL, NULL);
+		if (len < (ssize_t)sizeof(struct ethhdr) ||
+		    len > (ssize_t)(ETH_HLEN + ETH_MAX_MTU)) {
+			warn("Invalid frame length %zi from guest, resetting",
+			     len);
+			tap_handle_pools(c, now);
+			s->partial = 0;
+			return -ECONNRESET;
 		}
 
-		switch (ntohs(eh->h_proto)) {
-		case ETH_P_ARP:
-		case ETH_P_IP:
-			packet_add(pool_tap4, len, p);
+		if (n < (ssize_t)sizeof(uint32_t) + len)
 			break;
-		case ETH_P_IPV6:
-			packet_add(pool_tap6, len, p);
-			break;
-		default:
-			break;
-		}
 
-next:
+		p += sizeof(uint32_t);
+		tap_add_packet(c, len, p);
+
 		p += len;
-		n -= len;
+		n -= sizeof(uint32_t) + len;
 	}
 
-	tap4_handler(c, pool_tap4, now);
-	tap6_handler(c, pool_tap6, now);
+	tap_handle_pools(c, now);
+
+	/* Pools are handled, keep the incomplete frame for the next read */
+	memmove(pkt_buf, p, n);
+	s->partial = n;
 
 	/* We can't use EPOLLET otherwise. */
-	if (rem)
+	if (!size)
 		goto redo;
 
 	return 0;
@@ -819,35 +1166,22 @@ static int tap_handler_pasta(struct ctx *c, const struct timespec *now)
 redo:
 	n = 0;
 
-	pool_flush(pool_tap4);
-	pool_flush(pool_tap6);
+	tap_flush_pools();
 restart:
 	while ((len = read(c->fd_tap, pkt_buf + n, TAP_BUF_BYTES - n)) > 0) {
-		struct ethhdr *eh = (struct ethhdr *)(pkt_buf + n);
+		/* Frames might exceed the MTU (GSO), and lack checksums: we
+		 * don't care, as we don't forward frames as they are.
+		 */
+		ssize_t l2len = len - sizeof(struct virtio_net_hdr);
 
-		if (len < (ssize_t)sizeof(*eh) || len > (ssize_t)ETH_MAX_MTU) {
+		if (l2len < (ssize_t)sizeof(struct ethhdr) ||
+		    l2len > (ssize_t)ETH_MAX_MTU) {
 			n += len;
 			continue;
 		}
 
-		pcap(pkt_buf + n, len);
-
-		if (memcmp(c->mac_guest, eh->h_source, ETH_ALEN)) {
-			memcpy(c->mac_guest, eh->h_source, ETH_ALEN);
-			proto_update_l2_buf(c->mac_guest, NULL, NULL);
-		}
-
-		switch (ntohs(eh->h_proto)) {
-		case ETH_P_ARP:
-		case ETH_P_IP:
-			packet_add(pool_tap4, len, pkt_buf + n);
-			break;
-		case ETH_P_IPV6:
-			packet_add(pool_tap6, len, pkt_buf + n);
-			break;
-		default:
-			break;
-		}
+		tap_add_packet(c, l2len,
+			       pkt_buf + n + sizeof(struct virtio_net_hdr));
 
 		if ((n += len) == TAP_BUF_BYTES)
 			break;
@@ -858,8 +1192,7 @@ restart:
 
 	ret = errno;
 
-	tap4_handler(c, pool_tap4, now);
-	tap6_handler(c, pool_tap6, now);
+	tap_handle_pools(c, now);
 
 	if (len > 0 || ret == EAGAIN)
 		return 0;
@@ -867,9 +1200,7 @@ restart:
 	if (n == TAP_BUF_BYTES)
 		goto redo;
 
-	epoll_ctl(c->epollfd, EPOLL_CTL_DEL, c->fd_tap, NULL);
-	close(c->fd_tap);
-
+	/* Device is closed and set up again by tap_sock_init() */
 	return -ECONNRESET;
 }
 
@@ -944,6 +1275,13 @@ static void tap_sock_unix_init(struct ctx *c)
 	ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
 	epoll_ctl(c->epollfd, EPOLL_CTL_ADD, c->fd_tap_listen, &ev);
 
+	if (c->vhost_user) {
+		info("You can now start qemu with a vhost-user network device:");
+		info("    kvm ... -object memory-backend-memfd,id=m,share=on,size=<guest memory> -numa node,memdev=m -chardev socket,id=c,path=%s -netdev vhost-user,id=v,chardev=c -device virtio-net-pci,netdev=v",
+		     addr.sun_path);
+		return;
+	}
+
 	info("You can now start qemu (>= 7.2, with commit 13c6be96618c):");
 	info("    kvm ... -device virtio-net-pci,netdev=s -netdev stream,id=s,server=off,addr.type=unix,addr.path=%s",
 	     addr.sun_path);
@@ -981,10 +1319,14 @@ static void tap_sock_unix_new(struct ctx *c)
 	}
 
 	c->fd_tap = accept4(c->fd_tap_listen, NULL, NULL, SOCK_CLOEXEC);
+	tap_passt_stream.partial = 0;
 
 	if (!getsockopt(c->fd_tap, SOL_SOCKET, SO_PEERCRED, &ucred, &len))
 		info("accepted connection from PID %i", ucred.pid);
 
+	if (c->vhost_user)
+		vu_init(c);
+
 	if (!c->low_rmem &&
 	    setsockopt(c->fd_tap, SOL_SOCKET, SO_RCVBUF, &v, sizeof(v)))
 		trace("tap: failed to set SO_RCVBUF to %i", v);
@@ -999,6 +1341,7 @@ static void tap_sock_unix_new(struct ctx *c)
 }
 
 static int tun_ns_fd = -1;
+static int tun_ns_offload_err;
 
 /**
  * tap_ns_tun() - Get tuntap fd in namespace
@@ -1010,7 +1353,7 @@ static int tun_ns_fd = -1;
  */
 static int tap_ns_tun(void *arg)
 {
-	struct ifreq ifr = { .ifr_flags = IFF_TAP | IFF_NO_PI };
+	struct ifreq ifr = { .ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR };
 	int flags = O_RDWR | O_NONBLOCK | O_CLOEXEC;
 	struct ctx *c = (struct ctx *)arg;
 
@@ -1023,8 +1366,13 @@ static int tap_ns_tun(void *arg)
 		if (tun_ns_fd != -1)
 			close(tun_ns_fd);
 		tun_ns_fd = -1;
+		return 0;
 	}
 
+	/* Not fatal: namespace will just send us MTU-sized, checksummed frames */
+	if (ioctl(tun_ns_fd, TUNSETOFFLOAD, TAP_TUN_OFFLOADS))
+		tun_ns_offload_err = errno;
+
 	return 0;
 }
 
@@ -1042,6 +1390,11 @@ static void tap_sock_tun_init(struct ctx *c)
 		exit(EXIT_FAILURE);
 	}
 
+	if (tun_ns_offload_err) {
+		debug("Can't enable offloads on tap: %s",
+		      strerror(tun_ns_offload_err));
+	}
+
 	pasta_ns_conf(c);
 
 	c->fd_tap = tun_ns_fd;
@@ -1069,6 +1422,9 @@ void tap_sock_init(struct ctx *c)
 	}
 
 	if (c->fd_tap != -1) {
+		if (c->vhost_user)
+			vu_cleanup(c);
+
 		epoll_ctl(c->epollfd, EPOLL_CTL_DEL, c->fd_tap, NULL);
 		close(c->fd_tap);
 		c->fd_tap = -1;
@@ -1097,19 +1453,23 @@ void tap_handler(struct ctx *c, int fd, uint32_t events,
 		return;
 	}
 
+	if (c->vhost_user && fd == c->fd_vu_kick) {
+		vu_kick_handler(c, now);
+		return;
+	}
+
 	if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
 		goto reinit;
 
-	if ((c->mode == MODE_PASST && tap_handler_passt(c, now)) ||
-	    (c->mode == MODE_PASTA && tap_handler_pasta(c, now)))
+	if (c->vhost_user) {
+		if (vu_control_handler(c))
+			goto reinit;
+	} else if ((c->mode == MODE_PASST && tap_handler_passt(c, now)) ||
+		   (c->mode == MODE_PASTA && tap_handler_pasta(c, now))) {
 		goto reinit;
+	}
 
 	return;
 reinit:
-	if (c->one_off) {
-		info("Client closed connection, exiting");
-		exit(EXIT_SUCCESS);
-	}
-
-	tap_sock_init(c);
+	tap_sock_reset(c);
 }
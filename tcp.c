@@ -65,8 +65,14 @@
  * Limits
  * ------
  *
- * To avoid the need for dynamic memory allocation, a maximum, reasonable amount
- * of connections is defined by TCP_MAX_CONNS (currently 128k).
+ * The connection table, and the lookup hash table, are kept in address space
+ * reserved at start-up for a maximum amount of connections, set by --max-conns
+ * (128k by default, at most TCP_MAX_CONNS, currently 1M), and memory is
+ * committed and released in chunks as the table grows and shrinks. The table is
+ * always compact, so there are no holes to account for, and the hash table is
+ * resized incrementally to keep its load factor in bounds, see ctable.c. Hash
+ * buckets are also moved periodically, so that resizing doesn't depend on new
+ * connections coming and going.
  *
  * Data needs to linger on sockets as long as it's not acknowledged by the
  * guest, and is read using MSG_PEEK into preallocated static buffers sized
@@ -76,6 +82,10 @@
  * factors will be accepted, but resulting, larger values are never advertised
  * to the other side, and not used while queueing data.
  *
+ * If the kernel supports SO_PEEK_OFF for TCP sockets (Linux >= 6.9), the peek
+ * offset tracks data already sent, so that only new data is read, and the
+ * "discard" buffer is not used. The offset is rewound on retransmissions.
+ *
  *
  * Ports
  * -----
@@ -177,7 +187,8 @@
  * Aging and timeout
  * -----------------
  *
- * Timeouts are implemented by means of timerfd timers, set based on flags:
+ * Timeouts are implemented by means of a timer wheel (see twheel.c), driven by
+ * the main loop, with one timer per connection, set based on flags:
  *
  * - SYN_TIMEOUT: if no ACK is received from tap/guest during handshake (flag
  *   ACK_FROM_TAP_DUE without ESTABLISHED event) within this time, reset the
@@ -279,11 +290,7 @@
 #include <stddef.h>
 #include <string.h>
 #include <sys/epoll.h>
-#ifdef HAS_GETRANDOM
-#include <sys/random.h>
-#endif
 #include <sys/socket.h>
-#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -300,18 +307,20 @@
 #include "conf.h"
 #include "tcp_splice.h"
 #include "log.h"
+#include "twheel.h"
+#include "ctable.h"
+#include "ns_helper.h"
+#include "stats.h"
+#include "sk_lookup.h"
 
 #define TCP_FRAMES_MEM			128
 #define TCP_FRAMES							\
 	(c->mode == MODE_PASST ? TCP_FRAMES_MEM : 1)
 
 #define TCP_FILE_PRESSURE		30	/* % of c->nofile */
-#define TCP_CONN_PRESSURE		30	/* % of c->tcp.conn_count */
+#define TCP_CONN_PRESSURE		30	/* % of tcp_tab.count */
 
-#define TCP_HASH_BUCKET_BITS		(TCP_CONN_INDEX_BITS + 1)
-#define TCP_HASH_TABLE_LOAD		70		/* % */
-#define TCP_HASH_TABLE_SIZE		(TCP_MAX_CONNS * 100 /		\
-					 TCP_HASH_TABLE_LOAD)
+#define TCP_HASH_MIGRATE_TIMER		4096	/* Buckets moved by tcp_timer() */
 
 #define MAX_WS				8
 #define MAX_WINDOW			(1 << (16 + (MAX_WS)))
@@ -322,7 +331,7 @@
 struct tcp4_l2_head {	/* For MSS4 macro: keep in sync with tcp4_l2_buf_t */
 	uint32_t psum;
 	uint32_t tsum;
-#ifdef __AVX2__
+#if CSUM_ALIGN == 32
 	uint8_t pad[18];
 #else
 	uint8_t pad[2];
@@ -331,14 +340,14 @@ struct tcp4_l2_head {	/* For MSS4 macro: keep in sync with tcp4_l2_buf_t */
 	struct ethhdr eh;
 	struct iphdr iph;
 	struct tcphdr th;
-#ifdef __AVX2__
-} __attribute__ ((packed, aligned(32)));
+#if CSUM_ALIGN == 32
+} __attribute__ ((packed, aligned(CSUM_ALIGN)));
 #else
 } __attribute__ ((packed, aligned(__alignof__(unsigned int))));
 #endif
 
 struct tcp6_l2_head {	/* For MSS6 macro: keep in sync with tcp6_l2_buf_t */
-#ifdef __AVX2__
+#if CSUM_ALIGN == 32
 	uint8_t pad[14];
 #else
 	uint8_t pad[2];
@@ -347,8 +356,8 @@ struct tcp6_l2_head {	/* For MSS6 macro: keep in sync with tcp6_l2_buf_t */
 	struct ethhdr eh;
 	struct ipv6hdr ip6h;
 	struct tcphdr th;
-#ifdef __AVX2__
-} __attribute__ ((packed, aligned(32)));
+#if CSUM_ALIGN == 32
+} __attribute__ ((packed, aligned(CSUM_ALIGN)));
 #else
 } __attribute__ ((packed, aligned(__alignof__(unsigned int))));
 #endif
@@ -408,9 +417,7 @@ struct tcp6_l2_head {	/* For MSS6 macro: keep in sync with tcp6_l2_buf_t */
  * @tap_mss:		MSS advertised by tap/guest, rounded to 2 ^ TCP_MSS_BITS
  * @sock:		Socket descriptor number
  * @events:		Connection events, implying connection states
- * @timer:		timerfd descriptor for timeout events
  * @flags:		Connection flags representing internal attributes
- * @hash_bucket:	Bucket index in connection lookup hash table
  * @retrans:		Number of retransmissions occurred due to ACK_TIMEOUT
  * @ws_from_tap:	Window scaling factor advertised from tap/guest
  * @ws_to_tap:		Window scaling factor advertised to tap/guest
@@ -431,7 +438,7 @@ struct tcp6_l2_head {	/* For MSS6 macro: keep in sync with tcp6_l2_buf_t */
  * @seq_init_from_tap:	Initial sequence number from tap
  */
 struct tcp_conn {
-	int	 	next_index	:TCP_CONN_INDEX_BITS + 2;
+	int	 	next_index	:TCP_CONN_INDEX_BITS + 1;
 
 #define TCP_RETRANS_BITS		3
 	unsigned int	retrans		:TCP_RETRANS_BITS;
@@ -461,8 +468,6 @@ struct tcp_conn {
 	(SOCK_ACCEPTED | TAP_SYN_RCVD | ESTABLISHED)
 
 
-	int		timer		:SOCKET_REF_BITS;
-
 	uint8_t		flags;
 #define STALLED			BIT(0)
 #define LOCAL			BIT(1)
@@ -473,8 +478,6 @@ struct tcp_conn {
 #define ACK_FROM_TAP_DUE	BIT(6)
 
 
-	unsigned int	hash_bucket	:TCP_HASH_BUCKET_BITS;
-
 #define TCP_MSS_BITS			14
 	unsigned int	tap_mss		:TCP_MSS_BITS;
 #define MSS_SET(conn, mss)	(conn->tap_mss = (mss >> (16 - TCP_MSS_BITS)))
@@ -524,7 +527,10 @@ struct tcp_conn {
  * use this only after well-defined sequence points (no pre-/post-increments).
  */
 #define CONN_OR_NULL(index)						\
-	(((int)(index) >= 0 && (index) < TCP_MAX_CONNS) ? (tc + (index)) : NULL)
+	(((int)(index) >= 0 && (size_t)(index) < TC_COMMITTED) ?	\
+	 (tc + (index)) : NULL)
+
+#define TC_COMMITTED		(tcp_tab.mem.committed / sizeof(struct tcp_conn))
 
 static const char *tcp_event_str[] __attribute((__unused__)) = {
 	"SOCK_ACCEPTED", "TAP_SYN_RCVD", "ESTABLISHED", "TAP_SYN_ACK_SENT",
@@ -553,6 +559,21 @@ static int tcp_sock_init_lo	[NUM_PORTS][IP_VERSIONS];
 static int tcp_sock_init_ext	[NUM_PORTS][IP_VERSIONS];
 static int tcp_sock_ns		[NUM_PORTS][IP_VERSIONS];
 
+/**
+ * struct tcp_port_rebind_state - Forwarding maps as of last rebind
+ * @map:		Ports forwarded in this direction
+ * @excl:		Ports forwarded in the opposite direction, not looped back
+ * @retry:		Ports to check again: binding failed, or never checked
+ */
+struct tcp_port_rebind_state {
+	uint8_t map[PORT_BITMAP_SIZE];
+	uint8_t excl[PORT_BITMAP_SIZE];
+	uint8_t retry[PORT_BITMAP_SIZE];
+};
+
+/* Rebind state for sockets in init, index 0, and in namespace, index 1 */
+static struct tcp_port_rebind_state tcp_rebind[2];
+
 /* Table of destinations with very low RTT (assumed to be local), LRU */
 static struct in6_addr low_rtt_dst[LOW_RTT_TABLE_SIZE];
 
@@ -562,7 +583,7 @@ static struct in6_addr low_rtt_dst[LOW_RTT_TABLE_SIZE];
  * tcp4_l2_buf_t - Pre-cooked IPv4 packet buffers for tap connections
  * @psum:	Partial IP header checksum (excluding tot_len and saddr)
  * @tsum:	Partial TCP header checksum (excluding length and saddr)
- * @pad:	Align TCP header to 32 bytes, for AVX2 checksum calculation only
+ * @pad:	Align TCP header to CSUM_ALIGN bytes, for SIMD checksum calculation
  * @vnet_len:	4-byte qemu vnet buffer length descriptor, only for passt mode
  * @eh:		Pre-filled Ethernet header
  * @iph:	Pre-filled IP header (except for tot_len and saddr)
@@ -572,7 +593,7 @@ static struct in6_addr low_rtt_dst[LOW_RTT_TABLE_SIZE];
 static struct tcp4_l2_buf_t {
 	uint32_t psum;		/* 0 */
 	uint32_t tsum;		/* 4 */
-#ifdef __AVX2__
+#if CSUM_ALIGN == 32
 	uint8_t pad[18];	/* 8, align th to 32 bytes */
 #else
 	uint8_t pad[2];		/*	align iph to 4 bytes	8 */
@@ -583,8 +604,8 @@ static struct tcp4_l2_buf_t {
 	struct tcphdr th;	/* 64				48 */
 	uint8_t data[MSS4];	/* 84				68 */
 				/* 65541			65525 */
-#ifdef __AVX2__
-} __attribute__ ((packed, aligned(32)))
+#if CSUM_ALIGN == 32
+} __attribute__ ((packed, aligned(CSUM_ALIGN)))
 #else
 } __attribute__ ((packed, aligned(__alignof__(unsigned int))))
 #endif
@@ -595,7 +616,7 @@ static size_t tcp4_l2_buf_bytes;
 
 /**
  * tcp6_l2_buf_t - Pre-cooked IPv6 packet buffers for tap connections
- * @pad:	Align IPv6 header for checksum calculation to 32B (AVX2) or 4B
+ * @pad:	Align IPv6 header for checksum calculation to CSUM_ALIGN bytes
  * @vnet_len:	4-byte qemu vnet buffer length descriptor, only for passt mode
  * @eh:		Pre-filled Ethernet header
  * @ip6h:	Pre-filled IP header (except for payload_len and addresses)
@@ -603,7 +624,7 @@ static size_t tcp4_l2_buf_bytes;
  * @data:	Storage for TCP payload
  */
 struct tcp6_l2_buf_t {
-#ifdef __AVX2__
+#if CSUM_ALIGN == 32
 	uint8_t pad[14];	/* 0	align ip6h to 32 bytes */
 #else
 	uint8_t pad[2];		/*	align ip6h to 4 bytes	0 */
@@ -614,8 +635,8 @@ struct tcp6_l2_buf_t {
 	struct tcphdr th;	/* 72				60 */
 	uint8_t data[MSS6];	/* 92				80 */
 				/* 65639			65627 */
-#ifdef __AVX2__
-} __attribute__ ((packed, aligned(32)))
+#if CSUM_ALIGN == 32
+} __attribute__ ((packed, aligned(CSUM_ALIGN)))
 #else
 } __attribute__ ((packed, aligned(__alignof__(unsigned int))))
 #endif
@@ -642,7 +663,7 @@ static struct iovec	tcp_iov			[UIO_MAXIOV];
  * tcp4_l2_flags_buf_t - IPv4 packet buffers for segments without data (flags)
  * @psum:	Partial IP header checksum (excluding tot_len and saddr)
  * @tsum:	Partial TCP header checksum (excluding length and saddr)
- * @pad:	Align TCP header to 32 bytes, for AVX2 checksum calculation only
+ * @pad:	Align TCP header to CSUM_ALIGN bytes, for SIMD checksum calculation
  * @vnet_len:	4-byte qemu vnet buffer length descriptor, only for passt mode
  * @eh:		Pre-filled Ethernet header
  * @iph:	Pre-filled IP header (except for tot_len and saddr)
@@ -652,7 +673,7 @@ static struct iovec	tcp_iov			[UIO_MAXIOV];
 static struct tcp4_l2_flags_buf_t {
 	uint32_t psum;		/* 0 */
 	uint32_t tsum;		/* 4 */
-#ifdef __AVX2__
+#if CSUM_ALIGN == 32
 	uint8_t pad[18];	/* 8, align th to 32 bytes */
 #else
 	uint8_t pad[2];		/*	align iph to 4 bytes	8 */
@@ -662,8 +683,8 @@ static struct tcp4_l2_flags_buf_t {
 	struct iphdr iph;	/* 44				28 */
 	struct tcphdr th;	/* 64				48 */
 	char opts[OPT_MSS_LEN + OPT_WS_LEN + 1];
-#ifdef __AVX2__
-} __attribute__ ((packed, aligned(32)))
+#if CSUM_ALIGN == 32
+} __attribute__ ((packed, aligned(CSUM_ALIGN)))
 #else
 } __attribute__ ((packed, aligned(__alignof__(unsigned int))))
 #endif
@@ -674,7 +695,7 @@ static size_t tcp4_l2_flags_buf_bytes;
 
 /**
  * tcp6_l2_flags_buf_t - IPv6 packet buffers for segments without data (flags)
- * @pad:	Align IPv6 header for checksum calculation to 32B (AVX2) or 4B
+ * @pad:	Align IPv6 header for checksum calculation to CSUM_ALIGN bytes
  * @vnet_len:	4-byte qemu vnet buffer length descriptor, only for passt mode
  * @eh:		Pre-filled Ethernet header
  * @ip6h:	Pre-filled IP header (except for payload_len and addresses)
@@ -682,7 +703,7 @@ static size_t tcp4_l2_flags_buf_bytes;
  * @opts:	Headroom for TCP options
  */
 static struct tcp6_l2_flags_buf_t {
-#ifdef __AVX2__
+#if CSUM_ALIGN == 32
 	uint8_t pad[14];	/* 0	align ip6h to 32 bytes */
 #else
 	uint8_t pad[2];		/*	align ip6h to 4 bytes		   0 */
@@ -692,8 +713,8 @@ static struct tcp6_l2_flags_buf_t {
 	struct ipv6hdr ip6h;	/* 32					  20 */
 	struct tcphdr th	/* 72 */ __attribute__ ((aligned(4))); /* 60 */ 
 	char opts[OPT_MSS_LEN + OPT_WS_LEN + 1];
-#ifdef __AVX2__
-} __attribute__ ((packed, aligned(32)))
+#if CSUM_ALIGN == 32
+} __attribute__ ((packed, aligned(CSUM_ALIGN)))
 #else
 } __attribute__ ((packed, aligned(__alignof__(unsigned int))))
 #endif
@@ -702,11 +723,9 @@ tcp6_l2_flags_buf[TCP_FRAMES_MEM];
 static unsigned int tcp6_l2_flags_buf_used;
 static size_t tcp6_l2_flags_buf_bytes;
 
-/* TCP connections */
-static struct tcp_conn tc[TCP_MAX_CONNS];
-
-/* Table for lookup from remote address, local port, remote port */
-static struct tcp_conn *tc_hash[TCP_HASH_TABLE_SIZE];
+/* TCP connections, with timers and lookup hash table, see ctable.c */
+static struct ctable tcp_tab;
+static struct tcp_conn *tc;
 
 /* Pools for pre-opened sockets */
 int init_sock_pool4		[TCP_SOCK_POOL_SIZE];
@@ -768,8 +787,7 @@ static int tcp_epoll_ctl(const struct ctx *c, struct tcp_conn *conn)
 	if (conn->events == CLOSED) {
 		if (conn->flags & IN_EPOLL)
 			epoll_ctl(c->epollfd, EPOLL_CTL_DEL, conn->sock, &ev);
-		if (conn->timer != -1)
-			epoll_ctl(c->epollfd, EPOLL_CTL_DEL, conn->timer, &ev);
+		tw_del(&tcp_tab.tw, conn - tc);
 		return 0;
 	}
 
@@ -780,76 +798,37 @@ static int tcp_epoll_ctl(const struct ctx *c, struct tcp_conn *conn)
 
 	conn->flags |= IN_EPOLL;	/* No need to log this */
 
-	if (conn->timer != -1) {
-		union epoll_ref ref_t = { .r.proto = IPPROTO_TCP,
-					  .r.s = conn->sock,
-					  .r.p.tcp.tcp.timer = 1,
-					  .r.p.tcp.tcp.index = conn - tc };
-		struct epoll_event ev_t = { .data.u64 = ref_t.u64,
-					    .events = EPOLLIN | EPOLLET };
-
-		if (epoll_ctl(c->epollfd, EPOLL_CTL_MOD, conn->timer, &ev_t))
-			return -errno;
-	}
-
 	return 0;
 }
 
 /**
- * tcp_timer_ctl() - Set timerfd based on flags/events, create timerfd if needed
- * @c:		Execution context
+ * tcp_timer_ctl() - Set timer based on flags/events, replacing previous setting
  * @conn:	Connection pointer
- *
- * #syscalls timerfd_create timerfd_settime
  */
-static void tcp_timer_ctl(const struct ctx *c, struct tcp_conn *conn)
+static void tcp_timer_ctl(struct tcp_conn *conn)
 {
-	struct itimerspec it = { { 0 }, { 0 } };
+	unsigned int ms;
 
 	if (conn->events == CLOSED)
 		return;
 
-	if (conn->timer == -1) {
-		union epoll_ref ref = { .r.proto = IPPROTO_TCP,
-					.r.s = conn->sock,
-					.r.p.tcp.tcp.timer = 1,
-					.r.p.tcp.tcp.index = conn - tc };
-		struct epoll_event ev = { .data.u64 = ref.u64,
-					  .events = EPOLLIN | EPOLLET };
-		int fd;
-
-		fd = timerfd_create(CLOCK_MONOTONIC, 0);
-		if (fd == -1 || fd > SOCKET_MAX) {
-			debug("TCP: failed to get timer: %s", strerror(errno));
-			return;
-		}
-		conn->timer = fd;
-
-		if (epoll_ctl(c->epollfd, EPOLL_CTL_ADD, conn->timer, &ev)) {
-			debug("TCP: failed to add timer: %s", strerror(errno));
-			close(conn->timer);
-			conn->timer = -1;
-			return;
-		}
-	}
-
 	if (conn->flags & ACK_TO_TAP_DUE) {
-		it.it_value.tv_nsec = (long)ACK_INTERVAL * 1000 * 1000;
+		ms = ACK_INTERVAL;
 	} else if (conn->flags & ACK_FROM_TAP_DUE) {
 		if (!(conn->events & ESTABLISHED))
-			it.it_value.tv_sec = SYN_TIMEOUT;
+			ms = SYN_TIMEOUT * 1000;
 		else
-			it.it_value.tv_sec = ACK_TIMEOUT;
+			ms = ACK_TIMEOUT * 1000;
 	} else if (CONN_HAS(conn, SOCK_FIN_SENT | TAP_FIN_ACKED)) {
-		it.it_value.tv_sec = FIN_TIMEOUT;
+		ms = FIN_TIMEOUT * 1000;
 	} else {
-		it.it_value.tv_sec = ACT_TIMEOUT;
+		ms = ACT_TIMEOUT * 1000;
 	}
 
-	debug("TCP: index %li, timer expires in %lu.%03lus", conn - tc,
-	      it.it_value.tv_sec, it.it_value.tv_nsec / 1000 / 1000);
+	debug("TCP: index %li, timer expires in %u.%03us", conn - tc,
+	      ms / 1000, ms % 1000);
 
-	timerfd_settime(conn->timer, 0, &it, NULL);
+	tw_add(&tcp_tab.tw, conn - tc, ms);
 }
 
 /**
@@ -884,10 +863,12 @@ static void conn_flag_do(const struct ctx *c, struct tcp_conn *conn,
 	if (flag == STALLED || flag == ~STALLED)
 		tcp_epoll_ctl(c, conn);
 
-	if (flag == ACK_FROM_TAP_DUE || flag == ACK_TO_TAP_DUE		  ||
-	    (flag == ~ACK_FROM_TAP_DUE && (conn->flags & ACK_TO_TAP_DUE)) ||
-	    (flag == ~ACK_TO_TAP_DUE   && (conn->flags & ACK_FROM_TAP_DUE)))
-		tcp_timer_ctl(c, conn);
+	/* Re-arming is cheap: also do that as flags are cleared, so that any
+	 * expiry without ACK flags is an actual FIN or activity timeout.
+	 */
+	if (flag == ACK_FROM_TAP_DUE  || flag == ACK_TO_TAP_DUE ||
+	    flag == ~ACK_FROM_TAP_DUE || flag == ~ACK_TO_TAP_DUE)
+		tcp_timer_ctl(conn);
 }
 
 /**
@@ -941,7 +922,7 @@ static void conn_event_do(const struct ctx *c, struct tcp_conn *conn,
 		tcp_epoll_ctl(c, conn);
 
 	if (CONN_HAS(conn, SOCK_FIN_SENT | TAP_FIN_ACKED))
-		tcp_timer_ctl(c, conn);
+		tcp_timer_ctl(conn);
 }
 
 #define conn_event(c, conn, event)					\
@@ -1080,6 +1061,21 @@ static void tcp_update_check_tcp4(struct tcp4_l2_buf_t *buf)
 	buf->th.check = csum(&buf->th, tlen, sum);
 }
 
+/**
+ * tcp_update_psum_tcp4() - Set pseudo-header checksum only, for offload
+ * @buf:	L2 packet buffer with final IPv4 header
+ */
+static void tcp_update_psum_tcp4(struct tcp4_l2_buf_t *buf)
+{
+	uint32_t sum = buf->tsum;
+
+	sum += (buf->iph.saddr >> 16) & 0xffff;
+	sum += buf->iph.saddr & 0xffff;
+	sum += htons(ntohs(buf->iph.tot_len) - 20);
+
+	buf->th.check = csum_fold(sum);
+}
+
 /**
  * tcp_update_check_tcp6() - Calculate TCP checksum for IPv6
  * @buf:	L2 packet buffer with final IPv6 header
@@ -1307,7 +1303,7 @@ static int tcp_hash_match(const struct tcp_conn *conn, int af, const void *addr,
  * @tap_port:	tap-facing port
  * @sock_port:	Socket-facing port
  *
- * Return: hash value, already modulo size of the hash table
+ * Return: hash value, see ctable_head()
  */
 #if TCP_HASH_NOINLINE
 __attribute__((__noinline__))	/* See comment in Makefile */
@@ -1317,6 +1313,12 @@ static unsigned int tcp_hash(const struct ctx *c, int af, const void *addr,
 {
 	uint64_t b = 0;
 
+	/* Connections are rehashed from their IPv4-mapped address, on resize */
+	if (af == AF_INET6 && IN6_IS_ADDR_V4MAPPED(addr)) {
+		af = AF_INET;
+		addr = &((const struct in6_addr *)addr)->s6_addr[12];
+	}
+
 	if (af == AF_INET) {
 		struct {
 			struct in_addr addr;
@@ -1339,81 +1341,55 @@ static unsigned int tcp_hash(const struct ctx *c, int af, const void *addr,
 		b = siphash_20b((uint8_t *)&in, c->tcp.hash_secret);
 	}
 
-	return (unsigned int)(b % TCP_HASH_TABLE_SIZE);
+	return (unsigned int)b;
 }
 
 /**
- * tcp_hash_insert() - Insert connection into hash table, chain link
- * @c:		Execution context
- * @conn:	Connection pointer
- * @af:		Address family, AF_INET or AF_INET6
- * @addr:	Remote address, pointer to in_addr or in6_addr
+ * tcp_conn_hash() - Calculate hash value for existing connection
+ * @arg:	Execution context, const struct ctx *
+ * @e:		Connection pointer
+ *
+ * Return: hash value, see ctable_head()
  */
-static void tcp_hash_insert(const struct ctx *c, struct tcp_conn *conn,
-			    int af, const void *addr)
+static unsigned int tcp_conn_hash(const void *arg, const void *e)
 {
-	int b;
+	const struct tcp_conn *conn = (const struct tcp_conn *)e;
+	const struct ctx *c = (const struct ctx *)arg;
 
-	b = tcp_hash(c, af, addr, conn->tap_port, conn->sock_port);
-	conn->next_index = tc_hash[b] ? tc_hash[b] - tc : -1;
-	tc_hash[b] = conn;
-	conn->hash_bucket = b;
+	if (CONN_V4(conn)) {
+		return tcp_hash(c, AF_INET, &conn->a.a4.a,
+				conn->tap_port, conn->sock_port);
+	}
 
-	debug("TCP: hash table insert: index %li, sock %i, bucket: %i, next: "
-	      "%p", conn - tc, conn->sock, b, CONN_OR_NULL(conn->next_index));
+	return tcp_hash(c, AF_INET6, &conn->a.a6,
+			conn->tap_port, conn->sock_port);
 }
 
 /**
- * tcp_hash_remove() - Drop connection from hash table, chain unlink
- * @conn:	Connection pointer
+ * tcp_conn_next() - Get index of next connection in hash chain
+ * @e:		Connection pointer
+ *
+ * Return: index of next connection, -1 if last
  */
-static void tcp_hash_remove(const struct tcp_conn *conn)
+static int tcp_conn_next(const void *e)
 {
-	struct tcp_conn *entry, *prev = NULL;
-	int b = conn->hash_bucket;
-
-	for (entry = tc_hash[b]; entry;
-	     prev = entry, entry = CONN_OR_NULL(entry->next_index)) {
-		if (entry == conn) {
-			if (prev)
-				prev->next_index = conn->next_index;
-			else
-				tc_hash[b] = CONN_OR_NULL(conn->next_index);
-			break;
-		}
-	}
-
-	debug("TCP: hash table remove: index %li, sock %i, bucket: %i, new: %p",
-	      conn - tc, conn->sock, b,
-	      prev ? CONN_OR_NULL(prev->next_index) : tc_hash[b]);
+	return ((const struct tcp_conn *)e)->next_index;
 }
 
 /**
- * tcp_hash_update() - Update pointer for given connection
- * @old:	Old connection pointer
- * @new:	New connection pointer
+ * tcp_conn_set_next() - Set index of next connection in hash chain
+ * @e:		Connection pointer
+ * @next:	Index of next connection, -1 if last
  */
-static void tcp_hash_update(struct tcp_conn *old, struct tcp_conn *new)
+static void tcp_conn_set_next(void *e, int next)
 {
-	struct tcp_conn *entry, *prev = NULL;
-	int b = old->hash_bucket;
-
-	for (entry = tc_hash[b]; entry;
-	     prev = entry, entry = CONN_OR_NULL(entry->next_index)) {
-		if (entry == old) {
-			if (prev)
-				prev->next_index = new - tc;
-			else
-				tc_hash[b] = new;
-			break;
-		}
-	}
-
-	debug("TCP: hash table update: old index %li, new index %li, sock %i, "
-	      "bucket: %i, old: %p, new: %p",
-	      old - tc, new - tc, new->sock, b, old, new);
+	((struct tcp_conn *)e)->next_index = next;
 }
 
+static const struct ctable_ops tcp_conn_ops = {
+	tcp_conn_hash, tcp_conn_next, tcp_conn_set_next,
+};
+
 /**
  * tcp_hash_lookup() - Look up connection given remote address and ports
  * @c:		Execution context
@@ -1428,10 +1404,11 @@ static struct tcp_conn *tcp_hash_lookup(const struct ctx *c, int af,
 					const void *addr,
 					in_port_t tap_port, in_port_t sock_port)
 {
-	int b = tcp_hash(c, af, addr, tap_port, sock_port);
+	unsigned int h = tcp_hash(c, af, addr, tap_port, sock_port);
 	struct tcp_conn *conn;
 
-	for (conn = tc_hash[b]; conn; conn = CONN_OR_NULL(conn->next_index)) {
+	for (conn = CONN_OR_NULL(ctable_head(&tcp_tab, h)); conn;
+	     conn = CONN_OR_NULL(conn->next_index)) {
 		if (tcp_hash_match(conn, af, addr, tap_port, sock_port))
 			return conn;
 	}
@@ -1439,37 +1416,6 @@ static struct tcp_conn *tcp_hash_lookup(const struct ctx *c, int af,
 	return NULL;
 }
 
-/**
- * tcp_table_compact() - Perform compaction on connection table
- * @c:		Execution context
- * @hole:	Pointer to recently closed connection
- */
-static void tcp_table_compact(struct ctx *c, struct tcp_conn *hole)
-{
-	struct tcp_conn *from, *to;
-
-	if ((hole - tc) == --c->tcp.conn_count) {
-		debug("TCP: hash table compaction: maximum index was %li (%p)",
-		      hole - tc, hole);
-		memset(hole, 0, sizeof(*hole));
-		return;
-	}
-
-	from = CONN(c->tcp.conn_count);
-	memcpy(hole, from, sizeof(*hole));
-
-	to = hole;
-	tcp_hash_update(from, to);
-
-	tcp_epoll_ctl(c, to);
-
-	debug("TCP: hash table compaction: old index %li, new index %li, "
-	      "sock %i, from: %p, to: %p",
-	      from - tc, to - tc, from->sock, from, to);
-
-	memset(from, 0, sizeof(*from));
-}
-
 /**
  * tcp_conn_destroy() - Close sockets, trigger hash table removal and compaction
  * @c:		Execution context
@@ -1477,12 +1423,18 @@ static void tcp_table_compact(struct ctx *c, struct tcp_conn *hole)
  */
 static void tcp_conn_destroy(struct ctx *c, struct tcp_conn *conn)
 {
+	int from;
+
 	close(conn->sock);
-	if (conn->timer != -1)
-		close(conn->timer);
+	tw_del(&tcp_tab.tw, conn - tc);
+
+	if ((from = ctable_del(&tcp_tab, conn)) < 0)
+		return;
 
-	tcp_hash_remove(conn);
-	tcp_table_compact(c, conn);
+	tcp_epoll_ctl(c, conn);
+
+	debug("TCP: table compaction: old index %i, new index %li, sock %i",
+	      from, conn - tc, conn->sock);
 }
 
 static void tcp_rst_do(struct ctx *c, struct tcp_conn *conn);
@@ -1493,52 +1445,6 @@ static void tcp_rst_do(struct ctx *c, struct tcp_conn *conn);
 		tcp_rst_do(c, conn);					\
 	} while (0)
 
-/**
- * tcp_l2_buf_write_one() - Write a single buffer to tap file descriptor
- * @c:		Execution context
- * @iov:	struct iovec item pointing to buffer
- * @ts:		Current timestamp
- *
- * Return: 0 on success, negative error code on failure (tap reset possible)
- */
-static int tcp_l2_buf_write_one(struct ctx *c, const struct iovec *iov)
-{
-	if (write(c->fd_tap, (char *)iov->iov_base + 4, iov->iov_len - 4) < 0) {
-		debug("tap write: %s", strerror(errno));
-		if (errno != EAGAIN && errno != EWOULDBLOCK)
-			tap_handler(c, c->fd_tap, EPOLLERR, NULL);
-		return -errno;
-	}
-
-	return 0;
-}
-
-/**
- * tcp_l2_buf_flush_part() - Ensure a complete last message on partial sendmsg()
- * @c:		Execution context
- * @mh:		Message header that was partially sent by sendmsg()
- * @sent:	Bytes already sent
- */
-static void tcp_l2_buf_flush_part(const struct ctx *c,
-				  const struct msghdr *mh, size_t sent)
-{
-	size_t end = 0, missing;
-	struct iovec *iov;
-	unsigned int i;
-	char *p;
-
-	for (i = 0, iov = mh->msg_iov; i < mh->msg_iovlen; i++, iov++) {
-		end += iov->iov_len;
-		if (end >= sent)
-			break;
-	}
-
-	missing = end - sent;
-	p = (char *)iov->iov_base + iov->iov_len - missing;
-	if (send(c->fd_tap, p, missing, MSG_NOSIGNAL))
-		debug("TCP: failed to flush %lu missing bytes to tap", missing);
-}
-
 /**
  * tcp_l2_flags_buf_flush() - Send out buffers for segments with or without data
  * @c:		Execution context
@@ -1552,22 +1458,9 @@ static void tcp_l2_buf_flush(struct ctx *c, struct msghdr *mh,
 	if (!(mh->msg_iovlen = *buf_used))
 		return;
 
-	if (c->mode == MODE_PASST) {
-		size_t n = sendmsg(c->fd_tap, mh, MSG_NOSIGNAL | MSG_DONTWAIT);
-		if (n > 0 && n < *buf_bytes)
-			tcp_l2_buf_flush_part(c, mh, n);
-	} else {
-		size_t i;
+	tap_send_frames(c, mh->msg_iov, mh->msg_iovlen);
 
-		for (i = 0; i < mh->msg_iovlen; i++) {
-			struct iovec *iov = &mh->msg_iov[i];
-
-			if (tcp_l2_buf_write_one(c, iov))
-				i--;
-		}
-	}
 	*buf_used = *buf_bytes = 0;
-	pcapm(mh);
 }
 
 /**
@@ -1618,7 +1511,7 @@ static void tcp_l2_data_buf_flush(struct ctx *c)
  */
 void tcp_defer_handler(struct ctx *c)
 {
-	int max_conns = c->tcp.conn_count / 100 * TCP_CONN_PRESSURE;
+	int max_conns = tcp_tab.count / 100 * TCP_CONN_PRESSURE;
 	int max_files = c->nofile / 100 * TCP_FILE_PRESSURE;
 	struct tcp_conn *conn;
 
@@ -1627,10 +1520,10 @@ void tcp_defer_handler(struct ctx *c)
 
 	tcp_splice_defer_handler(c);
 
-	if (c->tcp.conn_count < MIN(max_files, max_conns))
+	if (tcp_tab.count < MIN(max_files, max_conns))
 		return;
 
-	for (conn = CONN(c->tcp.conn_count - 1); conn >= tc; conn--) {
+	for (conn = CONN(tcp_tab.count - 1); conn >= tc; conn--) {
 		if (conn->events == CLOSED)
 			tcp_conn_destroy(c, conn);
 	}
@@ -1643,7 +1536,8 @@ void tcp_defer_handler(struct ctx *c)
  * @conn:	Connection pointer
  * @p:		Pointer to any type of TCP pre-cooked buffer
  * @plen:	Payload length (including TCP header options)
- * @check:	Checksum, if already known
+ * @prev:	Previous buffer of the same type for this connection, in the
+ *		same batch, to update checksums from (RFC 1624), NULL if none
  * @seq:	Sequence number for this segment
  *
  * Return: 802.3 length, host order
@@ -1651,7 +1545,7 @@ void tcp_defer_handler(struct ctx *c)
 static size_t tcp_l2_buf_fill_headers(const struct ctx *c,
 				      const struct tcp_conn *conn,
 				      void *p, size_t plen,
-				      const uint16_t *check, uint32_t seq)
+				      const void *prev, uint32_t seq)
 {
 	size_t ip_len, eth_len;
 
@@ -1686,7 +1580,25 @@ do {									\
 
 		SET_TCP_HEADER_COMMON_V4_V6(b, conn, seq);
 
-		tcp_update_check_tcp6(b);
+		if (c->csum_offload && prev) {
+			const struct tcp6_l2_buf_t *pb = prev;
+
+			/* Pseudo-header checksum: only length might change */
+			if (pb->ip6h.payload_len == b->ip6h.payload_len) {
+				b->th.check = pb->th.check;
+			} else {
+				b->th.check = ~csum_update(~pb->th.check,
+							   pb->ip6h.payload_len,
+							   b->ip6h.payload_len);
+			}
+		} else if (c->csum_offload) {
+			b->th.check = csum_ip6_pseudo(&b->ip6h.saddr,
+						      &b->ip6h.daddr,
+						      ip_len - sizeof(b->ip6h),
+						      IPPROTO_TCP);
+		} else {
+			tcp_update_check_tcp6(b);
+		}
 
 		b->ip6h.flow_lbl[0] = (conn->sock >> 16) & 0xf;
 		b->ip6h.flow_lbl[1] = (conn->sock >> 8) & 0xff;
@@ -1703,14 +1615,39 @@ do {									\
 		b->iph.saddr = conn->a.a4.a.s_addr;
 		b->iph.daddr = c->ip4.addr_seen.s_addr;
 
-		if (check)
-			b->iph.check = *check;
-		else
+		SET_TCP_HEADER_COMMON_V4_V6(b, conn, seq);
+
+		if (prev) {
+			const struct tcp4_l2_buf_t *pb = prev;
+
+			/* Addresses are the same, only lengths might change */
+			if (pb->iph.tot_len == b->iph.tot_len) {
+				b->iph.check = pb->iph.check;
+			} else {
+				b->iph.check = csum_update(pb->iph.check,
+							   pb->iph.tot_len,
+							   b->iph.tot_len);
+			}
+		} else {
 			tcp_update_check_ip4(b);
+		}
 
-		SET_TCP_HEADER_COMMON_V4_V6(b, conn, seq);
+		if (c->csum_offload && prev) {
+			const struct tcp4_l2_buf_t *pb = prev;
+			uint16_t l4len = htons(ip_len - sizeof(struct iphdr));
+			uint16_t pl4len = htons(ntohs(pb->iph.tot_len) -
+						sizeof(struct iphdr));
 
-		tcp_update_check_tcp4(b);
+			if (l4len == pl4len)
+				b->th.check = pb->th.check;
+			else
+				b->th.check = ~csum_update(~pb->th.check,
+							   pl4len, l4len);
+		} else if (c->csum_offload) {
+			tcp_update_psum_tcp4(b);
+		} else {
+			tcp_update_check_tcp4(b);
+		}
 
 		eth_len = ip_len + sizeof(struct ethhdr);
 		if (c->mode == MODE_PASST)
@@ -1969,8 +1906,10 @@ static void tcp_rst_do(struct ctx *c, struct tcp_conn *conn)
 	if (conn->events == CLOSED)
 		return;
 
-	if (!tcp_send_flag(c, conn, RST))
+	if (!tcp_send_flag(c, conn, RST)) {
+		stats.tcp_rst++;
 		conn_event(c, conn, CLOSED);
+	}
 }
 
 /**
@@ -2092,8 +2031,10 @@ static int tcp_conn_new_sock(const struct ctx *c, sa_family_t af)
 			break;
 	}
 
-	if (s < 0)
+	if (s < 0) {
+		stats.sock_pool_empty++;
 		s = socket(af, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	}
 
 	if (s > SOCKET_MAX) {
 		close(s);
@@ -2140,6 +2081,30 @@ static uint16_t tcp_conn_tap_mss(const struct ctx *c,
 	return MIN(mss, USHRT_MAX);
 }
 
+/**
+ * tcp_set_peek_offset() - Set SO_PEEK_OFF offset on connection socket, if used
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @offset:	Offset in bytes, from start of data not acknowledged by tap/guest
+ *
+ * Return: 0 on success or if SO_PEEK_OFF is not used, -1 on failure
+ */
+static int tcp_set_peek_offset(const struct ctx *c,
+			       const struct tcp_conn *conn, int offset)
+{
+	if (!c->tcp.peek_offset_cap)
+		return 0;
+
+	if (setsockopt(conn->sock, SOL_SOCKET, SO_PEEK_OFF,
+		       &offset, sizeof(offset))) {
+		debug("TCP: index %li, failed to set SO_PEEK_OFF to %i: %s",
+		      conn - tc, offset, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 /**
  * tcp_conn_from_tap() - Handle connection request (SYN segment) from tap
  * @c:		Execution context
@@ -2169,7 +2134,7 @@ static void tcp_conn_from_tap(struct ctx *c, int af, const void *addr,
 	socklen_t sl;
 	int s, mss;
 
-	if (c->tcp.conn_count >= TCP_MAX_CONNS)
+	if (ctable_reserve(&tcp_tab))
 		return;
 
 	if ((s = tcp_conn_new_sock(c, af)) < 0)
@@ -2194,9 +2159,8 @@ static void tcp_conn_from_tap(struct ctx *c, int af, const void *addr,
 		}
 	}
 
-	conn = CONN(c->tcp.conn_count++);
+	conn = ctable_add(&tcp_tab);
 	conn->sock = s;
-	conn->timer = -1;
 	conn_event(c, conn, TAP_SYN_RCVD);
 
 	conn->wnd_to_tap = WINDOW_DEFAULT;
@@ -2238,7 +2202,12 @@ static void tcp_conn_from_tap(struct ctx *c, int af, const void *addr,
 	conn->seq_to_tap = tcp_seq_init(c, af, addr, th->dest, th->source, now);
 	conn->seq_ack_from_tap = conn->seq_to_tap + 1;
 
-	tcp_hash_insert(c, conn, af, addr);
+	ctable_insert(&tcp_tab, conn);
+
+	if (tcp_set_peek_offset(c, conn, 0)) {
+		tcp_rst(c, conn);
+		return;
+	}
 
 	if (!bind(s, sa, sl)) {
 		tcp_rst(c, conn);	/* Nobody is listening then */
@@ -2296,21 +2265,21 @@ static int tcp_sock_consume(struct tcp_conn *conn, uint32_t ack_seq)
  * @c:		Execution context
  * @conn:	Connection pointer
  * @plen:	Payload length at L4
- * @no_csum:	Don't compute IPv4 checksum, use the one from previous buffer
+ * @cont:	Previous buffer, if any, was filled for this connection: update
+ *		checksums from there instead of computing them again
  * @seq:	Sequence number to be sent
- * @now:	Current timestamp
  */
 static void tcp_data_to_tap(struct ctx *c, struct tcp_conn *conn,
-			    ssize_t plen, int no_csum, uint32_t seq)
+			    ssize_t plen, int cont, uint32_t seq)
 {
 	struct iovec *iov;
 	size_t len;
 
 	if (CONN_V4(conn)) {
 		struct tcp4_l2_buf_t *b = &tcp4_l2_buf[tcp4_l2_buf_used];
-		uint16_t *check = no_csum ? &(b - 1)->iph.check : NULL;
+		const void *prev = cont && tcp4_l2_buf_used ? b - 1 : NULL;
 
-		len = tcp_l2_buf_fill_headers(c, conn, b, plen, check, seq);
+		len = tcp_l2_buf_fill_headers(c, conn, b, plen, prev, seq);
 
 		iov = tcp4_l2_iov + tcp4_l2_buf_used++;
 		tcp4_l2_buf_bytes += iov->iov_len = len + sizeof(b->vnet_len);
@@ -2318,8 +2287,9 @@ static void tcp_data_to_tap(struct ctx *c, struct tcp_conn *conn,
 			tcp_l2_data_buf_flush(c);
 	} else if (CONN_V6(conn)) {
 		struct tcp6_l2_buf_t *b = &tcp6_l2_buf[tcp6_l2_buf_used];
+		const void *prev = cont && tcp6_l2_buf_used ? b - 1 : NULL;
 
-		len = tcp_l2_buf_fill_headers(c, conn, b, plen, NULL, seq);
+		len = tcp_l2_buf_fill_headers(c, conn, b, plen, prev, seq);
 
 		iov = tcp6_l2_iov + tcp6_l2_buf_used++;
 		tcp6_l2_buf_bytes += iov->iov_len = len + sizeof(b->vnet_len);
@@ -2356,6 +2326,10 @@ static int tcp_data_from_sock(struct ctx *c, struct tcp_conn *conn)
 		      conn->seq_ack_from_tap, conn->seq_to_tap);
 		conn->seq_to_tap = conn->seq_ack_from_tap;
 		already_sent = 0;
+		if (tcp_set_peek_offset(c, conn, 0)) {
+			tcp_rst(c, conn);
+			return -1;
+		}
 	}
 
 	if (!wnd_scaled || already_sent >= wnd_scaled) {
@@ -2373,11 +2347,17 @@ static int tcp_data_from_sock(struct ctx *c, struct tcp_conn *conn)
 		iov_rem = (wnd_scaled - already_sent) % mss;
 	}
 
-	mh_sock.msg_iov = iov_sock;
-	mh_sock.msg_iovlen = fill_bufs + 1;
+	if (c->tcp.peek_offset_cap) {
+		/* Kernel skips already sent data for us */
+		mh_sock.msg_iov = iov_sock + 1;
+		mh_sock.msg_iovlen = fill_bufs;
+	} else {
+		mh_sock.msg_iov = iov_sock;
+		mh_sock.msg_iovlen = fill_bufs + 1;
 
-	iov_sock[0].iov_base = tcp_buf_discard;
-	iov_sock[0].iov_len = already_sent;
+		iov_sock[0].iov_base = tcp_buf_discard;
+		iov_sock[0].iov_len = already_sent;
+	}
 
 	if (( v4 && tcp4_l2_buf_used + fill_bufs > ARRAY_SIZE(tcp4_l2_buf)) ||
 	    (!v4 && tcp6_l2_buf_used + fill_bufs > ARRAY_SIZE(tcp6_l2_buf))) {
@@ -2403,13 +2383,21 @@ recvmsg:
 	if (len < 0) {
 		if (errno == EINTR)
 			goto recvmsg;
-		goto err;
+
+		/* With SO_PEEK_OFF, nothing past the offset, data still queued */
+		if (!already_sent || (errno != EAGAIN && errno != EWOULDBLOCK))
+			goto err;
+
+		len = 0;
 	}
 
-	if (!len)
+	if (!len && !already_sent)
 		goto zero_len;
 
-	sendlen = len - already_sent;
+	sendlen = len;
+	if (!c->tcp.peek_offset_cap)
+		sendlen -= already_sent;
+
 	if (sendlen <= 0) {
 		conn_flag(c, conn, STALLED);
 		return 0;
@@ -2426,12 +2414,10 @@ recvmsg:
 	/* Finally, queue to tap */
 	plen = mss;
 	for (i = 0; i < send_bufs; i++) {
-		int no_csum = i && i != send_bufs - 1 && tcp4_l2_buf_used;
-
 		if (i == send_bufs - 1)
 			plen = last_len;
 
-		tcp_data_to_tap(c, conn, plen, no_csum, conn->seq_to_tap);
+		tcp_data_to_tap(c, conn, plen, i, conn->seq_to_tap);
 		conn->seq_to_tap += plen;
 	}
 
@@ -2594,8 +2580,13 @@ static void tcp_data_from_tap(struct ctx *c, struct tcp_conn *conn,
 	if (retr) {
 		trace("TCP: fast re-transmit, ACK: %u, previous sequence: %u",
 		      max_ack_seq, conn->seq_to_tap);
+		stats.tcp_fast_retrans++;
 		conn->seq_ack_from_tap = max_ack_seq;
 		conn->seq_to_tap = max_ack_seq;
+		if (tcp_set_peek_offset(c, conn, 0)) {
+			tcp_rst(c, conn);
+			return;
+		}
 		tcp_data_from_sock(c, conn);
 	}
 
@@ -2840,6 +2831,55 @@ static void tcp_connect_finish(struct ctx *c, struct tcp_conn *conn)
 	conn_flag(c, conn, ACK_FROM_TAP_DUE);
 }
 
+/**
+ * tcp_lookup_port() - Get forwarded port for socket accepted via sk_lookup
+ * @c:		Execution context
+ * @s:		Accepted socket
+ * @sa:		Peer address, IPv4-mapped IPv6 addresses converted on return
+ * @tap_port:	Destination port on tap, set on return
+ *
+ * Return: 0 on success, -1 if the original destination port isn't forwarded
+ */
+static int tcp_lookup_port(const struct ctx *c, int s,
+			   struct sockaddr_storage *sa, in_port_t *tap_port)
+{
+	struct sockaddr_storage local;
+	socklen_t sl = sizeof(local);
+	in_port_t port;
+
+	if (getsockname(s, (struct sockaddr *)&local, &sl))
+		return -1;
+
+	if (local.ss_family == AF_INET6)
+		port = ntohs(((struct sockaddr_in6 *)&local)->sin6_port);
+	else
+		port = ntohs(((struct sockaddr_in *)&local)->sin_port);
+
+	/* Connections to the port we bound for ourselves land here, too */
+	if (!bitmap_isset(c->tcp.fwd_in.map, port))
+		return -1;
+
+	*tap_port = port + c->tcp.fwd_in.delta[port];
+
+	if (sa->ss_family == AF_INET6) {
+		struct sockaddr_in6 sa6;
+
+		memcpy(&sa6, sa, sizeof(sa6));
+		if (IN6_IS_ADDR_V4MAPPED(&sa6.sin6_addr)) {
+			struct sockaddr_in sa4 = {
+				.sin_family = AF_INET,
+				.sin_port = sa6.sin6_port,
+			};
+
+			memcpy(&sa4.sin_addr, &sa6.sin6_addr.s6_addr[12],
+			       sizeof(sa4.sin_addr));
+			memcpy(sa, &sa4, sizeof(sa4));
+		}
+	}
+
+	return 0;
+}
+
 /**
  * tcp_conn_from_sock() - Handle new connection request from listening socket
  * @c:		Execution context
@@ -2851,10 +2891,11 @@ static void tcp_conn_from_sock(struct ctx *c, union epoll_ref ref,
 {
 	struct sockaddr_storage sa;
 	struct tcp_conn *conn;
+	in_port_t tap_port;
 	socklen_t sl;
 	int s;
 
-	if (c->tcp.conn_count >= TCP_MAX_CONNS)
+	if (ctable_reserve(&tcp_tab))
 		return;
 
 	sl = sizeof(sa);
@@ -2862,13 +2903,21 @@ static void tcp_conn_from_sock(struct ctx *c, union epoll_ref ref,
 	if (s < 0)
 		return;
 
-	conn = CONN(c->tcp.conn_count++);
+	if (ref.r.p.tcp.tcp.lookup) {
+		if (tcp_lookup_port(c, s, &sa, &tap_port)) {
+			close(s);
+			return;
+		}
+	} else {
+		tap_port = ref.r.p.tcp.tcp.index;
+	}
+
+	conn = ctable_add(&tcp_tab);
 	conn->sock = s;
-	conn->timer = -1;
 	conn->ws_to_tap = conn->ws_from_tap = 0;
 	conn_event(c, conn, SOCK_ACCEPTED);
 
-	if (ref.r.p.tcp.tcp.v6) {
+	if (sa.ss_family == AF_INET6) {
 		struct sockaddr_in6 sa6;
 
 		memcpy(&sa6, &sa, sizeof(sa6));
@@ -2889,14 +2938,14 @@ static void tcp_conn_from_sock(struct ctx *c, union epoll_ref ref,
 		memcpy(&conn->a.a6, &sa6.sin6_addr, sizeof(conn->a.a6));
 
 		conn->sock_port = ntohs(sa6.sin6_port);
-		conn->tap_port = ref.r.p.tcp.tcp.index;
+		conn->tap_port = tap_port;
 
 		conn->seq_to_tap = tcp_seq_init(c, AF_INET6, &sa6.sin6_addr,
 						conn->sock_port,
 						conn->tap_port,
 						now);
 
-		tcp_hash_insert(c, conn, AF_INET6, &sa6.sin6_addr);
+		ctable_insert(&tcp_tab, conn);
 	} else {
 		struct sockaddr_in sa4;
 
@@ -2913,18 +2962,23 @@ static void tcp_conn_from_sock(struct ctx *c, union epoll_ref ref,
 		conn->a.a4.a = sa4.sin_addr;
 
 		conn->sock_port = ntohs(sa4.sin_port);
-		conn->tap_port = ref.r.p.tcp.tcp.index;
+		conn->tap_port = tap_port;
 
 		conn->seq_to_tap = tcp_seq_init(c, AF_INET, &sa4.sin_addr,
 						conn->sock_port,
 						conn->tap_port,
 						now);
 
-		tcp_hash_insert(c, conn, AF_INET, &sa4.sin_addr);
+		ctable_insert(&tcp_tab, conn);
 	}
 
 	conn->seq_ack_from_tap = conn->seq_to_tap + 1;
 
+	if (tcp_set_peek_offset(c, conn, 0)) {
+		tcp_rst(c, conn);
+		return;
+	}
+
 	conn->wnd_from_tap = WINDOW_DEFAULT;
 
 	tcp_send_flag(c, conn, SYN);
@@ -2934,26 +2988,16 @@ static void tcp_conn_from_sock(struct ctx *c, union epoll_ref ref,
 }
 
 /**
- * tcp_timer_handler() - timerfd events: close, send ACK, retransmit, or reset
- * @c:		Execution context
- * @ref:	epoll reference of timer (not connection)
- *
- * #syscalls timerfd_gettime
+ * tcp_timer_handler() - Timer expiry: close, send ACK, retransmit, or reset
+ * @arg:	Execution context
+ * @index:	Index of connection in table
  */
-static void tcp_timer_handler(struct ctx *c, union epoll_ref ref)
+static void tcp_timer_handler(void *arg, int index)
 {
-	struct tcp_conn *conn = CONN_OR_NULL(ref.r.p.tcp.tcp.index);
-	struct itimerspec check_armed = { { 0 }, { 0 } };
+	struct tcp_conn *conn = CONN_OR_NULL(index);
+	struct ctx *c = arg;
 
-	if (!conn)
-		return;
-
-	/* We don't reset timers on ~ACK_FROM_TAP_DUE, ~ACK_TO_TAP_DUE. If the
-	 * timer is currently armed, this event came from a previous setting,
-	 * and we just set the timer to a new point in the future: discard it.
-	 */
-	timerfd_gettime(conn->timer, &check_armed);
-	if (check_armed.it_value.tv_sec || check_armed.it_value.tv_nsec)
+	if (!conn || conn->events == CLOSED)
 		return;
 
 	if (conn->flags & ACK_TO_TAP_DUE) {
@@ -2973,30 +3017,59 @@ static void tcp_timer_handler(struct ctx *c, union epoll_ref ref)
 		} else {
 			debug("TCP: index %li, ACK timeout, retry", conn - tc);
 			conn->retrans++;
+			stats.tcp_retrans++;
 			conn->seq_to_tap = conn->seq_ack_from_tap;
+			if (tcp_set_peek_offset(c, conn, 0)) {
+				tcp_rst(c, conn);
+				return;
+			}
 			tcp_data_from_sock(c, conn);
-			tcp_timer_ctl(c, conn);
+			tcp_timer_ctl(conn);
 		}
+	} else if (CONN_HAS(conn, SOCK_FIN_SENT | TAP_FIN_ACKED)) {
+		debug("TCP: index %li, FIN timeout", conn - tc);
+		tcp_rst(c, conn);
 	} else {
-		struct itimerspec new = { { 0 }, { ACT_TIMEOUT, 0 } };
-		struct itimerspec old = { { 0 }, { 0 } };
-
-		/* Activity timeout: if it was already set, reset the
-		 * connection, otherwise, it was a left-over from ACK_TO_TAP_DUE
-		 * or ACK_FROM_TAP_DUE, so just set the long timeout in that
-		 * case. This avoids having to preemptively reset the timer on
-		 * ~ACK_TO_TAP_DUE or ~ACK_FROM_TAP_DUE.
+		/* Timers are re-armed on any change of ACK flags, so this is
+		 * not a left-over from a previous setting
 		 */
-		timerfd_settime(conn->timer, 0, &new, &old);
-		if (old.it_value.tv_sec == ACT_TIMEOUT) {
-			debug("TCP: index %li, activity timeout", conn - tc);
-			tcp_rst(c, conn);
-		}
+		debug("TCP: index %li, activity timeout", conn - tc);
+		tcp_rst(c, conn);
 	}
 }
 
 /**
- * tcp_sock_handler() - Handle new data from socket, or timerfd event
+ * tcp_conn_timers() - Run expired connection timers
+ * @c:		Execution context
+ * @now:	Current timestamp
+ */
+void tcp_conn_timers(struct ctx *c, const struct timespec *now)
+{
+	tw_run(&tcp_tab.tw, now, tcp_timer_handler, c);
+}
+
+/**
+ * tcp_conn_timers_next() - Time until next connection timer might expire
+ *
+ * Return: milliseconds, -1 if no timers are set
+ */
+int tcp_conn_timers_next(void)
+{
+	return tw_next_ms(&tcp_tab.tw);
+}
+
+/**
+ * tcp_conn_count() - Count of connections (not spliced) in connection table
+ *
+ * Return: count of connections
+ */
+int tcp_conn_count(void)
+{
+	return tcp_tab.count;
+}
+
+/**
+ * tcp_sock_handler() - Handle new data from socket
  * @c:		Execution context
  * @ref:	epoll reference
  * @events:	epoll events bitmap
@@ -3007,11 +3080,6 @@ void tcp_sock_handler(struct ctx *c, union epoll_ref ref, uint32_t events,
 {
 	struct tcp_conn *conn;
 
-	if (ref.r.p.tcp.tcp.timer) {
-		tcp_timer_handler(c, ref);
-		return;
-	}
-
 	if (ref.r.p.tcp.tcp.splice) {
 		tcp_sock_handler_splice(c, ref, events);
 		return;
@@ -3213,12 +3281,76 @@ static void tcp_sock_init6(const struct ctx *c, int ns,
 void tcp_sock_init(const struct ctx *c, int ns, sa_family_t af,
 		   const void *addr, const char *ifname, in_port_t port)
 {
+	/* Ports already bound by others are skipped, as bind() would fail */
+	if (c->sk_lookup && !ns && !addr && !ifname) {
+		sk_lookup_add(af, port);
+		return;
+	}
+
 	if (af == AF_INET || af == AF_UNSPEC)
 		tcp_sock_init4(c, ns, addr, ifname, port);
 	if (af == AF_INET6 || af == AF_UNSPEC)
 		tcp_sock_init6(c, ns, addr, ifname, port);
 }
 
+/**
+ * tcp_sock_init_lookup() - Open catch-all listening socket for BPF sk_lookup
+ * @c:		Execution context
+ * @af:		Address family, AF_INET6 is dual-stack if IPv4 is enabled
+ *
+ * Bind an ephemeral port on the unspecified address: connections to any other
+ * port are assigned to this socket by the sk_lookup program.
+ *
+ * Return: socket, negative error code on failure
+ */
+int tcp_sock_init_lookup(const struct ctx *c, sa_family_t af)
+{
+	union tcp_epoll_ref tref = { .tcp.listen = 1, .tcp.lookup = 1,
+				     .tcp.v6 = af == AF_INET6 };
+	union epoll_ref ref = { .r.proto = IPPROTO_TCP, .r.p.tcp = tref };
+	struct sockaddr_in6 addr6 = { .sin6_family = AF_INET6,
+				      .sin6_addr = IN6ADDR_ANY_INIT };
+	struct sockaddr_in addr4 = { .sin_family = AF_INET,
+				     .sin_addr = { htonl(INADDR_ANY) } };
+	struct epoll_event ev = { .events = EPOLLIN };
+	int s, v6only = !c->ifi4, ret;
+
+	s = socket(af, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (s < 0)
+		return -errno;
+
+	if (s > SOCKET_MAX) {
+		close(s);
+		return -EIO;
+	}
+
+	if (af == AF_INET6 &&
+	    setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)))
+		goto fail;
+
+	if (af == AF_INET6)
+		ret = bind(s, (struct sockaddr *)&addr6, sizeof(addr6));
+	else
+		ret = bind(s, (struct sockaddr *)&addr4, sizeof(addr4));
+
+	if (ret || listen(s, SOMAXCONN))
+		goto fail;
+
+	tcp_sock_set_bufsize(c, s);
+
+	ref.r.s = s;
+	ev.data.u64 = ref.u64;
+	if (epoll_ctl(c->epollfd, EPOLL_CTL_ADD, s, &ev))
+		goto fail;
+
+	return s;
+
+fail:
+	ret = -errno;
+	close(s);
+	return ret;
+}
+
 /**
  * tcp_sock_init_ns() - Bind sockets in namespace for outbound connections
  * @arg:	Execution context
@@ -3306,6 +3438,30 @@ static int tcp_sock_refill(void *arg)
 	return 0;
 }
 
+/**
+ * tcp_probe_peek_offset_cap() - Check if SO_PEEK_OFF is supported on TCP sockets
+ * @af:		Address family, IPv4 or IPv6
+ *
+ * Return: 1 if supported, 0 otherwise
+ */
+static int tcp_probe_peek_offset_cap(sa_family_t af)
+{
+	int s, off = 0, ret = 0;
+
+	s = socket(af, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (s < 0) {
+		debug("TCP: can't create socket to probe SO_PEEK_OFF: %s",
+		      strerror(errno));
+		return 0;
+	}
+
+	if (!setsockopt(s, SOL_SOCKET, SO_PEEK_OFF, &off, sizeof(off)))
+		ret = 1;
+
+	close(s);
+	return ret;
+}
+
 /**
  * tcp_init() - Get initial sequence, hash secret, initialise per-socket data
  * @c:		Execution context
@@ -3316,30 +3472,8 @@ int tcp_init(struct ctx *c)
 {
 	struct tcp_sock_refill_arg refill_arg = { c, 0 };
 	int i;
-#ifndef HAS_GETRANDOM
-	int dev_random = open("/dev/random", O_RDONLY);
-	unsigned int random_read = 0;
-
-	while (dev_random && random_read < sizeof(c->tcp.hash_secret)) {
-		int ret = read(dev_random,
-			       (uint8_t *)&c->tcp.hash_secret + random_read,
-			       sizeof(c->tcp.hash_secret) - random_read);
-
-		if (ret == -1 && errno == EINTR)
-			continue;
 
-		if (ret <= 0)
-			break;
-
-		random_read += ret;
-	}
-	if (dev_random >= 0)
-		close(dev_random);
-	if (random_read < sizeof(c->tcp.hash_secret)) {
-#else
-	if (getrandom(&c->tcp.hash_secret, sizeof(c->tcp.hash_secret),
-		      GRND_RANDOM) < 0) {
-#endif /* !HAS_GETRANDOM */
+	if (raw_random(&c->tcp.hash_secret, sizeof(c->tcp.hash_secret))) {
 		perror("TCP initial sequence getrandom");
 		exit(EXIT_FAILURE);
 	}
@@ -3361,6 +3495,27 @@ int tcp_init(struct ctx *c)
 	memset(tcp_sock_init_ext,	0xff,	sizeof(tcp_sock_init_ext));
 	memset(tcp_sock_ns,		0xff,	sizeof(tcp_sock_ns));
 
+	/* Check all ports on the first rebind, sockets might be bound already */
+	memset(tcp_rebind[0].retry,	0xff,	PORT_BITMAP_SIZE);
+	memset(tcp_rebind[1].retry,	0xff,	PORT_BITMAP_SIZE);
+
+	if (ctable_init(&tcp_tab, "TCP", sizeof(*tc), c->tcp.max_conns,
+			&tcp_conn_ops, c)) {
+		perror("TCP connection table reservation");
+		exit(EXIT_FAILURE);
+	}
+
+	tc = tcp_tab.mem.base;
+
+	debug("TCP: up to %i connections, %zu bytes each, plus hash buckets",
+	      c->tcp.max_conns, sizeof(*tc) + sizeof(struct tw_entry));
+
+
+	c->tcp.peek_offset_cap = tcp_probe_peek_offset_cap(c->ifi4 ? AF_INET
+								  : AF_INET6);
+	debug("TCP: SO_PEEK_OFF %ssupported",
+	      c->tcp.peek_offset_cap ? "" : "not ");
+
 	tcp_sock_refill(&refill_arg);
 
 	if (c->mode == MODE_PASTA) {
@@ -3369,7 +3524,7 @@ int tcp_init(struct ctx *c)
 		NS_CALL(tcp_sock_init_ns, c);
 
 		refill_arg.ns = 1;
-		NS_CALL(tcp_sock_refill, &refill_arg);
+		ns_call(tcp_sock_refill, &refill_arg);
 
 		tcp_splice_timer(c);
 	}
@@ -3418,83 +3573,134 @@ struct tcp_port_rebind_arg {
 	int bind_in_ns;
 };
 
+/**
+ * tcp_port_unbound() - Check if sockets for a port are missing
+ * @c:		Execution context
+ * @s:		Sockets for port, IPv4 and IPv6
+ *
+ * Return: true if a socket for an enabled IP version is missing
+ */
+static bool tcp_port_unbound(const struct ctx *c, const int s[IP_VERSIONS])
+{
+	return (c->ifi4 && s[V4] == -1) || (c->ifi6 && s[V6] == -1);
+}
+
+/**
+ * tcp_port_close() - Close sockets for a port, if any
+ * @s:		Sockets for port, IPv4 and IPv6, set to -1 on return
+ */
+static void tcp_port_close(int s[IP_VERSIONS])
+{
+	int v;
+
+	for (v = 0; v < IP_VERSIONS; v++) {
+		if (s[v] >= 0) {
+			close(s[v]);
+			s[v] = -1;
+		}
+	}
+}
+
+/**
+ * tcp_port_rebind_one() - Bind or close sockets for a single port
+ * @c:		Execution context
+ * @ns:		Sockets in namespace, not in init
+ * @port:	Port number, host order
+ *
+ * Return: true if sockets should be bound, but binding failed
+ */
+static bool tcp_port_rebind_one(const struct ctx *c, int ns, in_port_t port)
+{
+	const uint8_t *map = ns ? c->tcp.fwd_out.map : c->tcp.fwd_in.map;
+	const uint8_t *excl = ns ? c->tcp.fwd_in.map : c->tcp.fwd_out.map;
+	int *s = ns ? tcp_sock_ns[port] : tcp_sock_init_ext[port];
+
+	if (!bitmap_isset(map, port)) {
+		tcp_port_close(s);
+		if (!ns)
+			tcp_port_close(tcp_sock_init_lo[port]);
+		return false;
+	}
+
+	/* Don't loop back our own ports */
+	if (bitmap_isset(excl, port))
+		return false;
+
+	if (!tcp_port_unbound(c, s))
+		return false;
+
+	tcp_sock_init(c, ns, AF_UNSPEC, NULL, NULL, port);
+
+	return tcp_port_unbound(c, s);
+}
+
 /**
  * tcp_port_rebind() - Rebind ports in namespace or init
  * @arg:		See struct tcp_port_rebind_arg
  *
+ * Only ports whose bits changed in either forwarding map since the last run,
+ * compared a word at a time, and ports that previously failed to bind, are
+ * handled: unchanged ports cost nothing.
+ *
  * Return: 0
  */
 static int tcp_port_rebind(void *arg)
 {
 	struct tcp_port_rebind_arg *a = (struct tcp_port_rebind_arg *)arg;
-	unsigned port;
-
-	if (a->bind_in_ns) {
-		ns_enter(a->c);
-
-		for (port = 0; port < NUM_PORTS; port++) {
-			if (!bitmap_isset(a->c->tcp.fwd_out.map, port)) {
-				if (tcp_sock_ns[port][V4] >= 0) {
-					close(tcp_sock_ns[port][V4]);
-					tcp_sock_ns[port][V4] = -1;
-				}
-
-				if (tcp_sock_ns[port][V6] >= 0) {
-					close(tcp_sock_ns[port][V6]);
-					tcp_sock_ns[port][V6] = -1;
-				}
+	const struct ctx *c = a->c;
+	int ns = a->bind_in_ns;
+	struct tcp_port_rebind_state *st = &tcp_rebind[ns];
+	const unsigned long *map, *excl;
+	unsigned long *old_map = (unsigned long *)st->map;
+	unsigned long *old_excl = (unsigned long *)st->excl;
+	unsigned long *retry = (unsigned long *)st->retry;
+	unsigned w;
+
+	map = (unsigned long *)(ns ? c->tcp.fwd_out.map : c->tcp.fwd_in.map);
+	excl = (unsigned long *)(ns ? c->tcp.fwd_in.map : c->tcp.fwd_out.map);
 
-				continue;
-			}
+	if (ns)
+		ns_enter(c);
 
-			/* Don't loop back our own ports */
-			if (bitmap_isset(a->c->tcp.fwd_in.map, port))
-				continue;
+	for (w = 0; w < PORT_BITMAP_SIZE / sizeof(long); w++) {
+		unsigned long todo = (map[w] ^ old_map[w]) |
+				     (excl[w] ^ old_excl[w]) | retry[w];
 
-			if ((a->c->ifi4 && tcp_sock_ns[port][V4] == -1) ||
-			    (a->c->ifi6 && tcp_sock_ns[port][V6] == -1))
-				tcp_sock_init(a->c, 1, AF_UNSPEC, NULL, NULL,
-					      port);
-		}
-	} else {
-		for (port = 0; port < NUM_PORTS; port++) {
-			if (!bitmap_isset(a->c->tcp.fwd_in.map, port)) {
-				if (tcp_sock_init_ext[port][V4] >= 0) {
-					close(tcp_sock_init_ext[port][V4]);
-					tcp_sock_init_ext[port][V4] = -1;
-				}
-
-				if (tcp_sock_init_ext[port][V6] >= 0) {
-					close(tcp_sock_init_ext[port][V6]);
-					tcp_sock_init_ext[port][V6] = -1;
-				}
-
-				if (tcp_sock_init_lo[port][V4] >= 0) {
-					close(tcp_sock_init_lo[port][V4]);
-					tcp_sock_init_lo[port][V4] = -1;
-				}
-
-				if (tcp_sock_init_lo[port][V6] >= 0) {
-					close(tcp_sock_init_lo[port][V6]);
-					tcp_sock_init_lo[port][V6] = -1;
-				}
-				continue;
-			}
+		old_map[w] = map[w];
+		old_excl[w] = excl[w];
+		retry[w] = 0;
 
-			/* Don't loop back our own ports */
-			if (bitmap_isset(a->c->tcp.fwd_out.map, port))
-				continue;
+		while (todo) {
+			int bit = ffsl(todo) - 1;
+			in_port_t port = w * sizeof(long) * 8 + bit;
 
-			if ((a->c->ifi4 && tcp_sock_init_ext[port][V4] == -1) ||
-			    (a->c->ifi6 && tcp_sock_init_ext[port][V6] == -1))
-				tcp_sock_init(a->c, 0, AF_UNSPEC, NULL, NULL,
-					      port);
+			todo &= todo - 1;
+			if (tcp_port_rebind_one(c, ns, port))
+				bitmap_set(st->retry, port);
 		}
 	}
 
 	return 0;
 }
 
+/**
+ * tcp_table_report() - Log memory used to track connections, if it changed
+ */
+static void tcp_table_report(void)
+{
+	size_t mem = ctable_mem(&tcp_tab);
+	static size_t last;
+
+	if (mem == last)
+		return;
+
+	last = mem;
+
+	debug("TCP: %i connections, %zu KiB committed for connection tracking, "
+	      "%zu bytes per connection", tcp_tab.count, mem / 1024,
+	      tcp_tab.count ? mem / tcp_tab.count : 0);
+}
+
 /**
  * tcp_timer() - Periodic tasks: port detection, closed connections, pool refill
  * @c:		Execution context
@@ -3515,28 +3721,31 @@ void tcp_timer(struct ctx *c, const struct timespec *ts)
 			detect_arg.detect_in_ns = 0;
 			tcp_port_detect(&detect_arg);
 			rebind_arg.bind_in_ns = 1;
-			NS_CALL(tcp_port_rebind, &rebind_arg);
+			ns_call(tcp_port_rebind, &rebind_arg);
 		}
 
 		if (c->tcp.fwd_out.mode == FWD_AUTO) {
 			detect_arg.detect_in_ns = 1;
-			NS_CALL(tcp_port_detect, &detect_arg);
+			ns_call(tcp_port_detect, &detect_arg);
 			rebind_arg.bind_in_ns = 0;
 			tcp_port_rebind(&rebind_arg);
 		}
 	}
 
-	for (conn = CONN(c->tcp.conn_count - 1); conn >= tc; conn--) {
+	for (conn = CONN(tcp_tab.count - 1); conn >= tc; conn--) {
 		if (conn->events == CLOSED)
 			tcp_conn_destroy(c, conn);
 	}
 
+	ctable_migrate(&tcp_tab, TCP_HASH_MIGRATE_TIMER);
+	tcp_table_report();
+
 	tcp_sock_refill(&refill_arg);
 	if (c->mode == MODE_PASTA) {
 		refill_arg.ns = 1;
 		if ((c->ifi4 && ns_sock_pool4[TCP_SOCK_POOL_TSH] < 0) ||
 		    (c->ifi6 && ns_sock_pool6[TCP_SOCK_POOL_TSH] < 0))
-			NS_CALL(tcp_sock_refill, &refill_arg);
+			ns_call(tcp_sock_refill, &refill_arg);
 
 		tcp_splice_timer(c);
 	}
@@ -8,8 +8,9 @@
 
 #define TCP_TIMER_INTERVAL		1000	/* ms */
 
-#define TCP_CONN_INDEX_BITS		17	/* 128k */
+#define TCP_CONN_INDEX_BITS		20	/* 1M */
 #define TCP_MAX_CONNS			(1 << TCP_CONN_INDEX_BITS)
+#define TCP_MAX_CONNS_DEFAULT		(128 * 1024)
 #define TCP_MAX_SOCKS			(TCP_MAX_CONNS + USHRT_MAX * 2)
 
 #define TCP_SOCK_POOL_SIZE		32
@@ -22,9 +23,13 @@ int tcp_tap_handler(struct ctx *c, int af, const void *addr,
 		    const struct pool *p, const struct timespec *now);
 void tcp_sock_init(const struct ctx *c, int ns, sa_family_t af,
 		   const void *addr, const char *ifname, in_port_t port);
+int tcp_sock_init_lookup(const struct ctx *c, sa_family_t af);
 int tcp_init(struct ctx *c);
 void tcp_timer(struct ctx *c, const struct timespec *ts);
 void tcp_defer_handler(struct ctx *c);
+void tcp_conn_timers(struct ctx *c, const struct timespec *now);
+int tcp_conn_timers_next(void);
+int tcp_conn_count(void);
 
 void tcp_sock_set_bufsize(const struct ctx *c, int s);
 void tcp_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
@@ -36,7 +41,7 @@ void tcp_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
  * @splice:		Set if descriptor is associated to a spliced connection
  * @outbound:		Listening socket maps to outbound, spliced connection
  * @v6:			Set for IPv6 sockets or connections
- * @timer:		Reference is a timerfd descriptor for connection
+ * @lookup:		Listening socket for any port, steered by BPF sk_lookup
  * @index:		Index of connection in table, or port for bound sockets
  * @u32:		Opaque u32 value of reference
  */
@@ -46,8 +51,8 @@ union tcp_epoll_ref {
 				splice:1,
 				outbound:1,
 				v6:1,
-				timer:1,
-				index:20;
+				lookup:1,
+				index:TCP_CONN_INDEX_BITS;
 	} tcp;
 	uint32_t u32;
 };
@@ -55,18 +60,19 @@ union tcp_epoll_ref {
 /**
  * struct tcp_ctx - Execution context for TCP routines
  * @hash_secret:	128-bit secret for hash functions, ISN and hash table
- * @conn_count:		Count of connections (not spliced) in connection table
+ * @max_conns:		Maximum count of connections (not spliced), --max-conns
  * @splice_conn_count:	Count of spliced connections in connection table
  * @port_to_tap:	Ports bound host-side, packets to tap or spliced
  * @fwd_in:		Port forwarding configuration for inbound packets
  * @fwd_out:		Port forwarding configuration for outbound packets
  * @timer_run:		Timestamp of most recent timer run
  * @kernel_snd_wnd:	Kernel reports sending window (with commit 8f7baad7f035)
+ * @peek_offset_cap:	Kernel supports SO_PEEK_OFF for TCP sockets
  * @pipe_size:		Size of pipes for spliced connections
  */
 struct tcp_ctx {
 	uint64_t hash_secret[2];
-	int conn_count;
+	int max_conns;
 	int splice_conn_count;
 	struct port_fwd fwd_in;
 	struct port_fwd fwd_out;
@@ -74,6 +80,7 @@ struct tcp_ctx {
 #ifdef HAS_SND_WND
 	int kernel_snd_wnd;
 #endif
+	int peek_offset_cap;
 	size_t pipe_size;
 };
 
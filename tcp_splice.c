@@ -27,6 +27,19 @@
  * - SPLICE_A_FIN_RCVD:		FIN (write shutdown) sent to accepted socket
  * - SPLICE_B_FIN_RCVD:		FIN (write shutdown) sent to target socket
  *
+ * Pipes are not owned by connections: they are taken from a shared pool only
+ * while data is in flight in a given direction, and returned once drained. Up
+ * to TCP_SPLICE_COPY_SIZE bytes, data is first copied with recv() and send(),
+ * without any pipe, which is cheaper for short transfers. If the destination
+ * doesn't take all of it, the remainder is written to a pipe, and we go on with
+ * splice() from there, as we do if the source has more data queued.
+ *
+ * With --sockmap, once a connection is established, and nothing is in flight,
+ * both sockets are inserted into a BPF sockmap, see sockmap.c, and the kernel
+ * forwards data between them. We then only wait for FIN segments, and, before
+ * sending them on, for data received up to that point to be queued on the
+ * other side, comparing byte counters from TCP_INFO with those at insertion.
+ *
  * #syscalls:pasta pipe2|pipe fcntl armv6l:fcntl64 armv7l:fcntl64 ppc64:fcntl64
  */
 
@@ -43,16 +56,21 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include "util.h"
 #include "passt.h"
 #include "log.h"
+#include "ns_helper.h"
+#include "stats.h"
+#include "sockmap.h"
 
 #define MAX_PIPE_SIZE			(8UL * 1024 * 1024)
 #define TCP_SPLICE_MAX_CONNS		(128 * 1024)
-#define TCP_SPLICE_PIPE_POOL_SIZE	16
+#define TCP_SPLICE_PIPE_POOL_SIZE	32
+#define TCP_SPLICE_COPY_SIZE		(16 * 1024)
 #define TCP_SPLICE_CONN_PRESSURE	30	/* % of splice_conn_count */
 #define TCP_SPLICE_FILE_PRESSURE	30	/* % of c->nofile */
 
@@ -62,21 +80,28 @@ extern int init_sock_pool6		[TCP_SOCK_POOL_SIZE];
 extern int ns_sock_pool4		[TCP_SOCK_POOL_SIZE];
 extern int ns_sock_pool6		[TCP_SOCK_POOL_SIZE];
 
-/* Pool of pre-opened pipes */
-static int splice_pipe_pool		[TCP_SPLICE_PIPE_POOL_SIZE][2][2];
+/* Pool of pre-opened pipes, shared by all connections and directions */
+static int splice_pipe_pool		[TCP_SPLICE_PIPE_POOL_SIZE][2];
+
+/* Buffer for copies of short transfers, never holds data between calls */
+static char splice_buf			[TCP_SPLICE_COPY_SIZE];
 
 /**
  * struct tcp_splice_conn - Descriptor for a spliced TCP connection
  * @a:			File descriptor number of socket for accepted connection
- * @pipe_a_b:		Pipe ends for splice() from @a to @b
+ * @pipe_a_b:		Pipe ends for splice() from @a to @b, if data in flight
  * @b:			File descriptor number of peer connected socket
- * @pipe_b_a:		Pipe ends for splice() from @b to @a
+ * @pipe_b_a:		Pipe ends for splice() from @b to @a, if data in flight
  * @events:		Events observed/actions performed on connection
  * @flags:		Connection flags (attributes, not events)
  * @a_read:		Bytes read from @a (not fully written to @b in one shot)
  * @a_written:		Bytes written to @a (not fully written from one @b read)
  * @b_read:		Bytes read from @b (not fully written to @a in one shot)
  * @b_written:		Bytes written to @b (not fully written from one @a read)
+ *
+ * With IN_SOCKMAP, @a_read and @b_written are kernel counters of bytes received
+ * on @a and queued on @b as the connection was inserted into the sockmap, and
+ * @b_read, @a_written the same for the other direction
 */
 struct tcp_splice_conn {
 	int a;
@@ -103,6 +128,7 @@ struct tcp_splice_conn {
 #define RCVLOWAT_ACT_A			BIT(4)
 #define RCVLOWAT_ACT_B			BIT(5)
 #define CLOSING				BIT(6)
+#define IN_SOCKMAP			BIT(7)
 
 	uint32_t a_read;
 	uint32_t a_written;
@@ -127,21 +153,28 @@ static const char *tcp_splice_event_str[] __attribute((__unused__)) = {
 /* Display strings for connection flags */
 static const char *tcp_splice_flag_str[] __attribute((__unused__)) = {
 	"SOCK_V6", "IN_EPOLL", "RCVLOWAT_SET_A", "RCVLOWAT_SET_B",
-	"RCVLOWAT_ACT_A", "RCVLOWAT_ACT_B", "CLOSING",
+	"RCVLOWAT_ACT_A", "RCVLOWAT_ACT_B", "CLOSING", "IN_SOCKMAP",
 };
 
 /**
  * tcp_splice_conn_epoll_events() - epoll events masks for given state
  * @events:	Connection event flags
+ * @flags:	Connection flags
  * @a:		Event mask for socket with accepted connection, set on return
  * @b:		Event mask for connection target socket, set on return
  */
-static void tcp_splice_conn_epoll_events(uint16_t events,
+static void tcp_splice_conn_epoll_events(uint16_t events, uint8_t flags,
 					 uint32_t *a, uint32_t *b)
 {
 	*a = *b = 0;
 
-	if (events & ESTABLISHED) {
+	if (flags & IN_SOCKMAP) {
+		/* Data is forwarded by the kernel: wait for FIN only */
+		if (!(events & A_FIN_RCVD))
+			*a = EPOLLRDHUP;
+		if (!(events & B_FIN_RCVD))
+			*b = EPOLLRDHUP;
+	} else if (events & ESTABLISHED) {
 		if (!(events & B_FIN_SENT))
 			*a = EPOLLIN | EPOLLRDHUP;
 		if (!(events & A_FIN_SENT))
@@ -224,7 +257,8 @@ static int tcp_splice_epoll_ctl(const struct ctx *c,
 	if (conn->flags & CLOSING)
 		goto delete;
 
-	tcp_splice_conn_epoll_events(conn->events, &events_a, &events_b);
+	tcp_splice_conn_epoll_events(conn->events, conn->flags,
+				     &events_a, &events_b);
 	ev_a.events = events_a;
 	ev_b.events = events_b;
 
@@ -320,20 +354,21 @@ static void tcp_table_splice_compact(struct ctx *c,
  */
 static void tcp_splice_destroy(struct ctx *c, struct tcp_splice_conn *conn)
 {
-	if (conn->events & ESTABLISHED) {
-		/* Flushing might need to block: don't recycle them. */
-		if (conn->pipe_a_b[0] != -1) {
-			close(conn->pipe_a_b[0]);
-			close(conn->pipe_a_b[1]);
-			conn->pipe_a_b[0] = conn->pipe_a_b[1] = -1;
-		}
-		if (conn->pipe_b_a[0] != -1) {
-			close(conn->pipe_b_a[0]);
-			close(conn->pipe_b_a[1]);
-			conn->pipe_b_a[0] = conn->pipe_b_a[1] = -1;
-		}
+	/* Pipes still held contain data: flushing might block, don't recycle */
+	if (conn->pipe_a_b[0] != -1) {
+		close(conn->pipe_a_b[0]);
+		close(conn->pipe_a_b[1]);
+		conn->pipe_a_b[0] = conn->pipe_a_b[1] = -1;
+	}
+	if (conn->pipe_b_a[0] != -1) {
+		close(conn->pipe_b_a[0]);
+		close(conn->pipe_b_a[1]);
+		conn->pipe_b_a[0] = conn->pipe_b_a[1] = -1;
 	}
 
+	if (conn->flags & IN_SOCKMAP)
+		sockmap_del(conn->a, conn->b);
+
 	if (conn->events & CONNECT) {
 		close(conn->b);
 		conn->b = -1;
@@ -351,49 +386,82 @@ static void tcp_splice_destroy(struct ctx *c, struct tcp_splice_conn *conn)
 }
 
 /**
- * tcp_splice_connect_finish() - Completion of connect() or call on success
+ * tcp_splice_pipe_open() - Open a new pipe, set its size
  * @c:		Execution context
- * @conn:	Connection pointer
+ * @p:		Pipe ends, set on return
  *
  * Return: 0 on success, -EIO on failure
  */
-static int tcp_splice_connect_finish(const struct ctx *c,
-				     struct tcp_splice_conn *conn)
+static int tcp_splice_pipe_open(const struct ctx *c, int p[2])
 {
-	int i;
+	if (pipe2(p, O_NONBLOCK | O_CLOEXEC)) {
+		p[0] = p[1] = -1;
+		return -EIO;
+	}
 
-	conn->pipe_a_b[0] = conn->pipe_b_a[0] = -1;
-	conn->pipe_a_b[1] = conn->pipe_b_a[1] = -1;
+	if (fcntl(p[0], F_SETPIPE_SZ, c->tcp.pipe_size)) {
+		trace("TCP (spliced): cannot set pipe size to %lu",
+		      c->tcp.pipe_size);
+	}
 
-	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
-		if (splice_pipe_pool[i][0][0] >= 0) {
-			SWAP(conn->pipe_a_b[0], splice_pipe_pool[i][0][0]);
-			SWAP(conn->pipe_a_b[1], splice_pipe_pool[i][0][1]);
+	return 0;
+}
 
-			SWAP(conn->pipe_b_a[0], splice_pipe_pool[i][1][0]);
-			SWAP(conn->pipe_b_a[1], splice_pipe_pool[i][1][1]);
-			break;
+/**
+ * tcp_splice_pipe_get() - Take pipe from pool, open a new one if pool is empty
+ * @c:		Execution context
+ * @p:		Pipe ends, set on return
+ *
+ * Return: 0 on success, -EIO on failure
+ */
+static int tcp_splice_pipe_get(const struct ctx *c, int p[2])
+{
+	int i;
+
+	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
+		if (splice_pipe_pool[i][0] >= 0) {
+			SWAP(p[0], splice_pipe_pool[i][0]);
+			SWAP(p[1], splice_pipe_pool[i][1]);
+			return 0;
 		}
 	}
 
-	if (conn->pipe_a_b[0] < 0) {
-		if (pipe2(conn->pipe_a_b, O_NONBLOCK | O_CLOEXEC) ||
-		    pipe2(conn->pipe_b_a, O_NONBLOCK | O_CLOEXEC)) {
-			conn_flag(c, conn, CLOSING);
-			return -EIO;
-		}
+	stats.splice_pipe_refill++;
+	return tcp_splice_pipe_open(c, p);
+}
 
-		if (fcntl(conn->pipe_a_b[0], F_SETPIPE_SZ, c->tcp.pipe_size)) {
-			trace("TCP (spliced): cannot set a->b pipe size to %lu",
-			      c->tcp.pipe_size);
-		}
+/**
+ * tcp_splice_pipe_put() - Return drained pipe to pool, close it if pool is full
+ * @p:		Pipe ends, set to -1 on return
+ */
+static void tcp_splice_pipe_put(int p[2])
+{
+	int i;
 
-		if (fcntl(conn->pipe_b_a[0], F_SETPIPE_SZ, c->tcp.pipe_size)) {
-			trace("TCP (spliced): cannot set b->a pipe size to %lu",
-			      c->tcp.pipe_size);
+	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
+		if (splice_pipe_pool[i][0] < 0) {
+			SWAP(p[0], splice_pipe_pool[i][0]);
+			SWAP(p[1], splice_pipe_pool[i][1]);
+			return;
 		}
 	}
 
+	close(p[0]);
+	close(p[1]);
+	p[0] = p[1] = -1;
+}
+
+/**
+ * tcp_splice_connect_finish() - Completion of connect() or call on success
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ *
+ * Return: 0
+ */
+static int tcp_splice_connect_finish(const struct ctx *c,
+				     struct tcp_splice_conn *conn)
+{
+	/* Pipes are taken from the pool once there's data to move */
 	if (!(conn->events & ESTABLISHED))
 		conn_event(c, conn, ESTABLISHED);
 
@@ -527,11 +595,14 @@ static int tcp_splice_new(const struct ctx *c, struct tcp_splice_conn *conn,
 			break;
 	}
 
+	if (s < 0)
+		stats.sock_pool_empty++;
+
 	/* No socket available in namespace: create a new one for connect() */
 	if (s < 0 && !outbound) {
 		struct tcp_splice_connect_ns_arg ns_arg = { c, conn, port, 0 };
 
-		NS_CALL(tcp_splice_connect_ns, &ns_arg);
+		ns_call(tcp_splice_connect_ns, &ns_arg);
 		return ns_arg.ret;
 	}
 
@@ -562,6 +633,163 @@ static void tcp_splice_dir(struct tcp_splice_conn *conn, int ref_sock,
 	*pipes = *from == conn->a ? conn->pipe_a_b : conn->pipe_b_a;
 }
 
+/**
+ * tcp_splice_copy() - Forward data with recv() and send(), without a pipe
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ * @from:	Source socket
+ * @to:		Destination socket
+ * @pipes:	Pipe for this direction, taken from pool if data is left over
+ * @seq_read:	Bytes read from @from, not fully written, updated on return
+ * @seq_write:	Bytes written to @to, not fully read, updated on return
+ * @eof:	Set on end of file from @from
+ *
+ * Return: 0 if done, 1 if the source might have more data queued than we can
+ *	   copy in one go: go on with splice(), negative error code on failure
+ */
+static int tcp_splice_copy(const struct ctx *c, struct tcp_splice_conn *conn,
+			   int from, int to, int *pipes,
+			   uint32_t *seq_read, uint32_t *seq_write, int *eof)
+{
+	size_t size = MIN(sizeof(splice_buf), c->tcp.pipe_size);
+	int fin = conn->events & (from == conn->a ? A_FIN_RCVD : B_FIN_RCVD);
+	ssize_t readlen, written;
+
+	while (1) {
+		readlen = recv(from, splice_buf, size, MSG_DONTWAIT);
+		trace("TCP (spliced): %li from copy read", readlen);
+		if (readlen < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return errno == EAGAIN ? 0 : -errno;
+		}
+
+		if (!readlen) {
+			*eof = 1;
+			return 0;
+		}
+
+		written = send(to, splice_buf, readlen,
+			       MSG_DONTWAIT | MSG_NOSIGNAL);
+		trace("TCP (spliced): %li from copy write", written);
+		if (written < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				return -errno;
+
+			written = 0;
+		}
+
+		if (written < readlen) {
+			/* Keep the rest in a pipe, as large as the buffer */
+			if (tcp_splice_pipe_get(c, pipes) ||
+			    write(pipes[1], splice_buf + written,
+				  readlen - written) != readlen - written)
+				return -EIO;
+
+			*seq_read += readlen;
+			*seq_write += written;
+
+			if (to == conn->a)
+				conn_event(c, conn, A_OUT_WAIT);
+			else
+				conn_event(c, conn, B_OUT_WAIT);
+
+			return 0;
+		}
+
+		if ((size_t)readlen == size)
+			return 1;
+
+		/* Short read: done, unless we need to see end of file */
+		if (!fin)
+			return 0;
+	}
+}
+
+/**
+ * tcp_splice_sockmap() - Hand over idle connection to BPF sockmap, if enabled
+ * @c:		Execution context
+ * @conn:	Connection pointer
+ */
+static void tcp_splice_sockmap(const struct ctx *c,
+			       struct tcp_splice_conn *conn)
+{
+	int inq_a, inq_b;
+
+	if (!c->sockmap || (conn->events & ~CONNECT) != ESTABLISHED ||
+	    conn->pipe_a_b[0] >= 0 || conn->pipe_b_a[0] >= 0 ||
+	    (conn->flags & (IN_SOCKMAP | CLOSING |
+			    RCVLOWAT_SET_A | RCVLOWAT_SET_B)))
+		return;
+
+	/* Counters first: if data comes in meanwhile, it's still queued here */
+	if (sockmap_seq(conn->a, conn->b, &conn->a_read, &conn->b_written) ||
+	    sockmap_seq(conn->b, conn->a, &conn->b_read, &conn->a_written) ||
+	    ioctl(conn->a, FIONREAD, &inq_a) || inq_a ||
+	    ioctl(conn->b, FIONREAD, &inq_b) || inq_b ||
+	    sockmap_add(conn->a, conn->b)) {
+		conn->a_read = conn->a_written = 0;
+		conn->b_read = conn->b_written = 0;
+		return;
+	}
+
+	/* Data queued before insertion is forwarded once receive is signalled,
+	 * and setting SO_RCVLOWAT does that right away
+	 */
+	setsockopt(conn->a, SOL_SOCKET, SO_RCVLOWAT, &((int){ 1 }), sizeof(int));
+	setsockopt(conn->b, SOL_SOCKET, SO_RCVLOWAT, &((int){ 1 }), sizeof(int));
+
+	stats.splice_sockmap++;
+	conn_flag(c, conn, IN_SOCKMAP);
+	if (tcp_splice_epoll_ctl(c, conn))
+		conn_flag(c, conn, CLOSING);
+}
+
+/**
+ * tcp_splice_sockmap_fin() - Pass on FIN once data before it is queued
+ * @c:		Execution context
+ * @conn:	Connection pointer, in sockmap
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int tcp_splice_sockmap_fin(const struct ctx *c,
+				  struct tcp_splice_conn *conn)
+{
+	uint32_t in, out;
+	int ret;
+
+	if ((conn->events & A_FIN_RCVD) && !(conn->events & B_FIN_SENT)) {
+		if ((ret = sockmap_seq(conn->a, conn->b, &in, &out)))
+			return ret;
+
+		/* FIN counts as one byte received */
+		if (in - conn->a_read - 1 == out - conn->b_written) {
+			shutdown(conn->b, SHUT_WR);
+			conn_event(c, conn, B_FIN_SENT);
+			conn_event(c, conn, ~B_OUT_WAIT);
+		} else {
+			/* Not redirected yet: check again once @b has room */
+			conn_event(c, conn, B_OUT_WAIT);
+		}
+	}
+
+	if ((conn->events & B_FIN_RCVD) && !(conn->events & A_FIN_SENT)) {
+		if ((ret = sockmap_seq(conn->b, conn->a, &in, &out)))
+			return ret;
+
+		if (in - conn->b_read - 1 == out - conn->a_written) {
+			shutdown(conn->a, SHUT_WR);
+			conn_event(c, conn, A_FIN_SENT);
+			conn_event(c, conn, ~A_OUT_WAIT);
+		} else {
+			conn_event(c, conn, A_OUT_WAIT);
+		}
+	}
+
+	return 0;
+}
+
 /**
  * tcp_sock_handler_splice() - Handler for socket mapped to spliced connection
  * @c:		Execution context
@@ -596,6 +824,8 @@ void tcp_sock_handler_splice(struct ctx *c, union epoll_ref ref,
 		conn = CONN(c->tcp.splice_conn_count++);
 		conn->a = s;
 		conn->flags = ref.r.p.tcp.tcp.v6 ? SOCK_V6 : 0;
+		conn->pipe_a_b[0] = conn->pipe_a_b[1] = -1;
+		conn->pipe_b_a[0] = conn->pipe_b_a[1] = -1;
 
 		if (tcp_splice_new(c, conn, ref.r.p.tcp.tcp.index,
 				   ref.r.p.tcp.tcp.outbound))
@@ -644,6 +874,15 @@ void tcp_sock_handler_splice(struct ctx *c, union epoll_ref ref,
 			conn_event(c, conn, B_FIN_SENT);
 	}
 
+	if (conn->flags & IN_SOCKMAP) {
+		if (tcp_splice_sockmap_fin(c, conn) ||
+		    CONN_HAS(conn, A_FIN_SENT | B_FIN_SENT) ||
+		    (events & EPOLLHUP))
+			goto close;
+
+		return;
+	}
+
 swap:
 	eof = 0;
 	never_read = 1;
@@ -660,6 +899,21 @@ swap:
 		lowat_act_flag = RCVLOWAT_ACT_B;
 	}
 
+	/* Nothing in flight in this direction: try with a plain copy first */
+	if (pipes[0] < 0) {
+		int ret = tcp_splice_copy(c, conn, from, to, pipes,
+					  seq_read, seq_write, &eof);
+
+		if (ret < 0)
+			goto close;
+
+		if (!ret)
+			goto fin;
+
+		if (tcp_splice_pipe_get(c, pipes))
+			goto close;
+	}
+
 	while (1) {
 		ssize_t readlen, to_write = 0, written;
 		int more = 0;
@@ -746,6 +1000,10 @@ eintr:
 			break;
 	}
 
+	if (*seq_read == *seq_write)
+		tcp_splice_pipe_put(pipes);
+
+fin:
 	if ((conn->events & A_FIN_RCVD) && !(conn->events & B_FIN_SENT)) {
 		if (*seq_read == *seq_write && eof) {
 			shutdown(conn->b, SHUT_WR);
@@ -778,6 +1036,7 @@ eintr:
 	if (events & EPOLLHUP)
 		goto close;
 
+	tcp_splice_sockmap(c, conn);
 	return;
 
 close:
@@ -790,12 +1049,12 @@ close:
  */
 static void tcp_set_pipe_size(struct ctx *c)
 {
-	int probe_pipe[TCP_SPLICE_PIPE_POOL_SIZE * 2][2], i, j;
+	int probe_pipe[TCP_SPLICE_PIPE_POOL_SIZE][2], i, j;
 
 	c->tcp.pipe_size = MAX_PIPE_SIZE;
 
 smaller:
-	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE * 2; i++) {
+	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
 		if (pipe2(probe_pipe[i], O_CLOEXEC)) {
 			i++;
 			break;
@@ -810,7 +1069,7 @@ smaller:
 		close(probe_pipe[j][1]);
 	}
 
-	if (i == TCP_SPLICE_PIPE_POOL_SIZE * 2)
+	if (i == TCP_SPLICE_PIPE_POOL_SIZE)
 		return;
 
 	if (!(c->tcp.pipe_size /= 2)) {
@@ -830,27 +1089,13 @@ static void tcp_splice_pipe_refill(const struct ctx *c)
 	int i;
 
 	for (i = 0; i < TCP_SPLICE_PIPE_POOL_SIZE; i++) {
-		if (splice_pipe_pool[i][0][0] >= 0)
-			break;
-		if (pipe2(splice_pipe_pool[i][0], O_NONBLOCK | O_CLOEXEC))
+		if (splice_pipe_pool[i][0] >= 0)
 			continue;
-		if (pipe2(splice_pipe_pool[i][1], O_NONBLOCK | O_CLOEXEC)) {
-			close(splice_pipe_pool[i][1][0]);
-			close(splice_pipe_pool[i][1][1]);
-			continue;
-		}
 
-		if (fcntl(splice_pipe_pool[i][0][0], F_SETPIPE_SZ,
-			  c->tcp.pipe_size)) {
-			trace("TCP (spliced): cannot set a->b pipe size to %lu",
-			      c->tcp.pipe_size);
-		}
+		if (tcp_splice_pipe_open(c, splice_pipe_pool[i]))
+			break;
 
-		if (fcntl(splice_pipe_pool[i][1][0], F_SETPIPE_SZ,
-			  c->tcp.pipe_size)) {
-			trace("TCP (spliced): cannot set b->a pipe size to %lu",
-			      c->tcp.pipe_size);
-		}
+		stats.splice_pipe_refill++;
 	}
 }
 
@@ -860,8 +1105,16 @@ static void tcp_splice_pipe_refill(const struct ctx *c)
  */
 void tcp_splice_init(struct ctx *c)
 {
+	int ret;
+
 	memset(splice_pipe_pool, 0xff, sizeof(splice_pipe_pool));
 	tcp_set_pipe_size(c);
+
+	if (c->sockmap && (ret = sockmap_init(TCP_SPLICE_MAX_CONNS))) {
+		warn("Can't set up BPF sockmap: %s, using splice()",
+		     strerror(-ret));
+		c->sockmap = 0;
+	}
 }
 
 /**
@@ -911,7 +1164,7 @@ void tcp_splice_timer(struct ctx *c)
  */
 void tcp_splice_defer_handler(struct ctx *c)
 {
-	int max_conns = c->tcp.conn_count / 100 * TCP_SPLICE_CONN_PRESSURE;
+	int max_conns = tcp_conn_count() / 100 * TCP_SPLICE_CONN_PRESSURE;
 	int max_files = c->nofile / 100 * TCP_SPLICE_FILE_PRESSURE;
 	struct tcp_splice_conn *conn;
 
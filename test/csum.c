@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * test/csum.c - Check csum() implementations against csum_unaligned(), and
+ *		 report their throughput
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * For each implementation usable on this CPU, compare results for all lengths
+ * up to CHECK_LEN_MAX, and a few longer ones, at all offsets from a 64-byte
+ * boundary up to CHECK_OFF_MAX, then report throughput for typical lengths at
+ * an aligned and a misaligned offset, unless -q is given. Exits with
+ * EXIT_FAILURE on mismatches.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../checksum.h"
+
+#define CHECK_LEN_MAX		2048
+#define CHECK_OFF_MAX		64
+#define BUF_LEN			(65536 + CHECK_OFF_MAX)
+#define BENCH_BYTES		(1UL << 30)
+
+static const char *impls[] = { "avx512", "avx2", "sse4.1", "neon", "generic" };
+
+static const size_t long_lens[] = { 9000, 16383, 32768, 65535 };
+static const size_t bench_lens[] = { 64, 576, 1460, 9000, 65535 };
+static const size_t bench_offs[] = { 0, 2 };
+
+/**
+ * check_one() - Compare csum() against csum_unaligned() for one case
+ * @buf:	Buffer with random data
+ * @off:	Offset from start of buffer
+ * @len:	Length of data to checksum
+ * @fail:	Mismatches so far, to limit output
+ *
+ * Return: 1 on mismatch, 0 otherwise
+ */
+static int check_one(const uint8_t *buf, size_t off, size_t len, int fail)
+{
+	uint32_t init = len * 2654435761U % 0x100000;
+
+	if (csum(buf + off, len, init) == csum_unaligned(buf + off, len, init))
+		return 0;
+
+	if (fail < 10)
+		printf("  mismatch: offset %zu, length %zu\n", off, len);
+
+	return 1;
+}
+
+/**
+ * check() - Compare csum() against csum_unaligned() for lengths and offsets
+ * @buf:	Buffer with random data, BUF_LEN bytes, aligned to 64 bytes
+ *
+ * Return: count of mismatches
+ */
+static int check(const uint8_t *buf)
+{
+	size_t off, len, i;
+	int fail = 0;
+
+	for (off = 0; off < CHECK_OFF_MAX; off++) {
+		for (len = 0; len <= CHECK_LEN_MAX; len++)
+			fail += check_one(buf, off, len, fail);
+
+		for (i = 0; i < sizeof(long_lens) / sizeof(long_lens[0]); i++)
+			fail += check_one(buf, off, long_lens[i], fail);
+	}
+
+	return fail;
+}
+
+/**
+ * bench() - Report throughput of csum() for given length and offset
+ * @buf:	Buffer with random data
+ * @off:	Offset from start of buffer
+ * @len:	Length of data to checksum
+ */
+static void bench(const uint8_t *buf, size_t off, size_t len)
+{
+	unsigned long i, n = BENCH_BYTES / len;
+	volatile uint16_t sink = 0;
+	struct timespec a, b;
+	double ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	for (i = 0; i < n; i++)
+		sink += csum(buf + off, len, 0);
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+	printf("  offset %zu, length %5zu: %8.1f ns, %6.2f GB/s\n",
+	       off, len, ns / n, (double)len * n / ns);
+	(void)sink;
+}
+
+int main(int argc, char **argv)
+{
+	int fail = 0, quick = argc > 1 && !strcmp(argv[1], "-q");
+	uint8_t *buf;
+	size_t i, j;
+
+	if (!(buf = aligned_alloc(64, BUF_LEN))) {
+		perror("aligned_alloc");
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	for (i = 0; i < BUF_LEN; i++)
+		buf[i] = rand();
+
+	for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+		int n;
+
+		if (!csum_select(impls[i]))
+			continue;
+
+		printf("%s:\n", impls[i]);
+
+		if ((n = check(buf))) {
+			printf("  FAIL: %i mismatches\n", n);
+			fail += n;
+			continue;
+		}
+
+		printf("  results match csum_unaligned()\n");
+
+		if (quick)
+			continue;
+
+		for (j = 0; j < sizeof(bench_lens) / sizeof(bench_lens[0]); j++) {
+			bench(buf, bench_offs[0], bench_lens[j]);
+			bench(buf, bench_offs[1], bench_lens[j]);
+		}
+	}
+
+	free(buf);
+	return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
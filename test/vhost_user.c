@@ -0,0 +1,734 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * test/vhost_user.c - Minimal vhost-user front-end, checking the passt back-end
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Start passt with --vhost-user on a temporary socket, and act as front-end
+ * (qemu would), without guest: share a memfd region with rings and buffers,
+ * set up both virtqueues with SET_MEM_TABLE and SET_VRING_* requests, asking
+ * for acknowledgements, then place an ARP request on the transmit queue, kick,
+ * and wait for the ARP reply on the receive queue. The payload of one request
+ * is sent separately from its header, after a pause. Then make more buffers
+ * available on the transmit queue than its size, and check that none is used.
+ *
+ * Then, on new connections, check that queue sizes of zero and not powers of
+ * two are rejected, and that the back-end disconnects, and the same for a used
+ * ring ending past the memory region, with the size set before the addresses,
+ * and after them. Finally, check that descriptors passed along with truncated
+ * headers, or in excess, aren't leaked by the back-end.
+ *
+ * Usage: vhost_user PASST [OPTION]...
+ * where OPTION are further options for passt. Exits with EXIT_FAILURE on any
+ * failure.
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <net/if_arp.h>
+#include <netinet/if_ether.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <linux/vhost_types.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_net.h>
+#include <linux/virtio_ring.h>
+
+#define MEM_SIZE		(1 << 20)
+#define QUEUE_SIZE		256
+#define QUEUE_AREA		16384	/* Descriptors, avail, used ring */
+#define BUF_BASE		(2 * QUEUE_AREA)
+#define BUF_SIZE		2048
+#define RX_BUFS			64
+#define TX_BUF			(BUF_BASE + RX_BUFS * BUF_SIZE)
+
+#define RX_QUEUE		0
+#define TX_QUEUE		1
+
+#define TIMEOUT_MS		2000
+
+#define F_PROTOCOL_FEATURES	30
+#define PROTOCOL_F_REPLY_ACK	3
+#define FLAGS_VERSION		1
+#define FLAGS_NEED_REPLY	(1 << 3)
+
+enum request {
+	GET_FEATURES		= 1,
+	SET_FEATURES		= 2,
+	SET_OWNER		= 3,
+	SET_MEM_TABLE		= 5,
+	SET_VRING_NUM		= 8,
+	SET_VRING_ADDR		= 9,
+	SET_VRING_BASE		= 10,
+	SET_VRING_KICK		= 12,
+	SET_VRING_CALL		= 13,
+	GET_PROTOCOL_FEATURES	= 15,
+	SET_PROTOCOL_FEATURES	= 16,
+	SET_VRING_ENABLE	= 18,
+};
+
+/**
+ * struct memory - Payload of SET_MEM_TABLE, single region
+ * @nregions:		Count of regions, 1
+ * @padding:		Unused
+ * @gpa:		Guest physical address of region
+ * @size:		Size of region
+ * @qva:		Address of region in our process
+ * @mmap_offset:	Offset of region in passed file
+ */
+struct memory {
+	uint32_t nregions;
+	uint32_t padding;
+	uint64_t gpa;
+	uint64_t size;
+	uint64_t qva;
+	uint64_t mmap_offset;
+};
+
+/**
+ * struct msg - vhost-user message, header and payload
+ * @request:	Request type
+ * @flags:	Version and reply flags
+ * @size:	Size of payload
+ * @payload:	Request-specific payload
+ */
+struct msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;
+	union {
+		uint64_t u64;
+		struct vhost_vring_state state;
+		struct vhost_vring_addr addr;
+		struct memory memory;
+	} payload;
+} __attribute__((packed));
+
+#define HDR_SIZE		offsetof(struct msg, payload)
+
+/**
+ * struct arp_frame - ARP message for IPv4 over Ethernet, with virtio-net header
+ * @vnet:	virtio-net header, with num_buffers as VIRTIO_F_VERSION_1 needs
+ * @eh:		Ethernet header
+ * @ah:		ARP header
+ * @sha:	Sender hardware address
+ * @sip:	Sender IPv4 address
+ * @tha:	Target hardware address
+ * @tip:	Target IPv4 address
+ */
+struct arp_frame {
+	struct virtio_net_hdr_mrg_rxbuf vnet;
+	struct ethhdr eh;
+	struct arphdr ah;
+	unsigned char sha[ETH_ALEN];
+	unsigned char sip[4];
+	unsigned char tha[ETH_ALEN];
+	unsigned char tip[4];
+} __attribute__((packed));
+
+static const unsigned char mac[ETH_ALEN] = {
+	0x9a, 0x55, 0x9a, 0x55, 0x9a, 0x55
+};
+
+static char *mem;
+static int kick[2], call[2];
+
+/**
+ * desc() - Get descriptor table of queue, in shared memory
+ * @q:		Queue index
+ *
+ * Return: pointer to descriptor table
+ */
+static struct vring_desc *desc(int q)
+{
+	return (struct vring_desc *)(mem + q * QUEUE_AREA);
+}
+
+/**
+ * avail() - Get available ring of queue, in shared memory
+ * @q:		Queue index
+ *
+ * Return: pointer to available ring
+ */
+static struct vring_avail *avail(int q)
+{
+	return (struct vring_avail *)(mem + q * QUEUE_AREA + 4096);
+}
+
+/**
+ * used() - Get used ring of queue, in shared memory
+ * @q:		Queue index
+ *
+ * Return: pointer to used ring
+ */
+static struct vring_used *used(int q)
+{
+	return (struct vring_used *)(mem + q * QUEUE_AREA + 8192);
+}
+
+/**
+ * msg_send() - Send request, wait for reply or acknowledgement if needed
+ * @s:		Socket connected to back-end
+ * @req:	Request type
+ * @p:		Payload, can be NULL
+ * @size:	Size of payload
+ * @fd:		File descriptor to pass along, -1 for none
+ * @split:	Send payload separately, after a short pause
+ * @reply:	Reply payload for GET_* requests, acknowledgement otherwise, or
+ *		NULL to send request without waiting for acknowledgement
+ *
+ * Return: 0 on success, -1 on failure or if the back-end closed the connection
+ */
+static int msg_send(int s, enum request req, const void *p, size_t size,
+		    int fd, int split, uint64_t *reply)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct msg m = { .request = req, .size = size, .flags = FLAGS_VERSION };
+	struct iovec iov = { &m, HDR_SIZE + (split ? 0 : size) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	if (size)
+		memcpy(&m.payload, p, size);
+
+	if (reply)
+		m.flags |= FLAGS_NEED_REPLY;
+
+	if (fd != -1) {
+		struct cmsghdr *cmsg;
+
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	if (sendmsg(s, &mh, MSG_NOSIGNAL) != (ssize_t)iov.iov_len)
+		return -1;
+
+	if (split) {
+		usleep(100 * 1000);
+		if (send(s, &m.payload, size, MSG_NOSIGNAL) != (ssize_t)size)
+			return -1;
+	}
+
+	if (!reply)
+		return 0;
+
+	if (recv(s, &m, HDR_SIZE, MSG_WAITALL) != HDR_SIZE ||
+	    m.size != sizeof(m.payload.u64) ||
+	    recv(s, &m.payload, m.size, MSG_WAITALL) != (ssize_t)m.size)
+		return -1;
+
+	*reply = m.payload.u64;
+	return 0;
+}
+
+/**
+ * req() - Send request with 64-bit payload, check acknowledgement
+ * @s:		Socket connected to back-end
+ * @r:		Request type
+ * @v:		Payload
+ * @fd:		File descriptor to pass along, -1 for none
+ *
+ * Return: 0 if acknowledged with success, -1 otherwise
+ */
+static int req(int s, enum request r, uint64_t v, int fd)
+{
+	uint64_t ack;
+
+	if (msg_send(s, r, &v, sizeof(v), fd, 0, &ack) || ack) {
+		fprintf(stderr, "Request %i failed\n", r);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * connect_backend() - Connect to back-end, negotiate features
+ * @path:	Path of back-end socket
+ * @split:	Split header and payload of SET_FEATURES request
+ *
+ * A previous connection might not be closed on the back-end side yet, in which
+ * case our connection is closed right away: retry in that case.
+ *
+ * Return: connected socket, -1 on failure
+ */
+static int connect_backend(const char *path, int split)
+{
+	struct sockaddr_un a = { .sun_family = AF_UNIX };
+	struct timeval tv = { .tv_sec = TIMEOUT_MS / 1000 };
+	uint64_t features, protocol_features;
+	int s, tries;
+
+	strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+
+	for (tries = 0; tries < TIMEOUT_MS / 10; tries++, usleep(10 * 1000)) {
+		if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+
+		setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		if (!connect(s, (struct sockaddr *)&a, sizeof(a)) &&
+		    !msg_send(s, GET_FEATURES, NULL, 0, -1, 0, &features))
+			break;
+
+		close(s);
+		s = -1;
+	}
+
+	if (s == -1) {
+		fprintf(stderr, "Can't connect to back-end at %s\n", path);
+		return -1;
+	}
+
+	if (!(features & (1ULL << VIRTIO_F_VERSION_1)) ||
+	    !(features & (1ULL << F_PROTOCOL_FEATURES))) {
+		fprintf(stderr, "Missing features: 0x%llx\n",
+			(unsigned long long)features);
+		goto fail;
+	}
+
+	/* No acknowledgements before REPLY_ACK is negotiated */
+	if (msg_send(s, SET_FEATURES, &features, sizeof(features), -1, split,
+		     NULL))
+		goto fail;
+
+	if (msg_send(s, GET_PROTOCOL_FEATURES, NULL, 0, -1, 0,
+		     &protocol_features) ||
+	    !(protocol_features & (1ULL << PROTOCOL_F_REPLY_ACK))) {
+		fprintf(stderr, "REPLY_ACK not supported\n");
+		goto fail;
+	}
+
+	if (req(s, SET_PROTOCOL_FEATURES, 1ULL << PROTOCOL_F_REPLY_ACK, -1) ||
+	    req(s, SET_OWNER, 0, -1))
+		goto fail;
+
+	return s;
+
+fail:
+	close(s);
+	return -1;
+}
+
+/**
+ * queue_setup() - Set up one virtqueue on the back-end
+ * @s:		Socket connected to back-end
+ * @q:		Queue index
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int queue_setup(int s, int q)
+{
+	struct vhost_vring_addr addr = {
+		.index		 = q,
+		.desc_user_addr	 = (uintptr_t)desc(q),
+		.avail_user_addr = (uintptr_t)avail(q),
+		.used_user_addr	 = (uintptr_t)used(q),
+	};
+	struct vhost_vring_state st = { .index = q, .num = QUEUE_SIZE };
+	uint64_t ack;
+
+	if (msg_send(s, SET_VRING_NUM, &st, sizeof(st), -1, 0, &ack) || ack ||
+	    msg_send(s, SET_VRING_ADDR, &addr, sizeof(addr), -1, 0, &ack) ||
+	    ack) {
+		fprintf(stderr, "Can't set up queue %i\n", q);
+		return -1;
+	}
+
+	st.num = 0;
+	if (msg_send(s, SET_VRING_BASE, &st, sizeof(st), -1, 0, &ack) || ack)
+		return -1;
+
+	if ((kick[q] = eventfd(0, EFD_NONBLOCK)) < 0 ||
+	    (call[q] = eventfd(0, EFD_NONBLOCK)) < 0)
+		return -1;
+
+	if (req(s, SET_VRING_KICK, q, kick[q]) ||
+	    req(s, SET_VRING_CALL, q, call[q]))
+		return -1;
+
+	st.num = 1;
+	if (msg_send(s, SET_VRING_ENABLE, &st, sizeof(st), -1, 0, &ack) || ack)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * arp_check() - Send ARP request on transmit queue, look for reply
+ *
+ * Return: 0 if the reply was received, -1 otherwise
+ */
+static int arp_check(void)
+{
+	struct arp_frame *f = (struct arp_frame *)(mem + TX_BUF);
+	struct pollfd pfd = { .fd = call[RX_QUEUE], .events = POLLIN };
+	uint64_t v = 1;
+	int i, n;
+
+	memset(f, 0, sizeof(*f));
+	memset(f->eh.h_dest, 0xff, ETH_ALEN);
+	memcpy(f->eh.h_source, mac, ETH_ALEN);
+	f->eh.h_proto = htons(ETH_P_ARP);
+	f->ah.ar_hrd = htons(ARPHRD_ETHER);
+	f->ah.ar_pro = htons(ETH_P_IP);
+	f->ah.ar_hln = ETH_ALEN;
+	f->ah.ar_pln = 4;
+	f->ah.ar_op = htons(ARPOP_REQUEST);
+	memcpy(f->sha, mac, ETH_ALEN);
+	memcpy(f->tip, (unsigned char[4]){ 192, 0, 2, 1 }, 4);
+
+	/* Buffers for receive queue, then frame on transmit queue, and kick */
+	for (i = 0; i < RX_BUFS; i++) {
+		desc(RX_QUEUE)[i].addr = htole64(BUF_BASE + i * BUF_SIZE);
+		desc(RX_QUEUE)[i].len = htole32(BUF_SIZE);
+		desc(RX_QUEUE)[i].flags = htole16(VRING_DESC_F_WRITE);
+		avail(RX_QUEUE)->ring[i] = htole16(i);
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	avail(RX_QUEUE)->idx = htole16(RX_BUFS);
+
+	desc(TX_QUEUE)[0].addr = htole64(TX_BUF);
+	desc(TX_QUEUE)[0].len = htole32(sizeof(*f));
+	avail(TX_QUEUE)->ring[0] = 0;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	avail(TX_QUEUE)->idx = htole16(1);
+
+	if (write(kick[TX_QUEUE], &v, sizeof(v)) != sizeof(v))
+		return -1;
+
+	if (poll(&pfd, 1, TIMEOUT_MS) != 1) {
+		fprintf(stderr, "No frames on receive queue\n");
+		return -1;
+	}
+
+	if (le16toh(used(TX_QUEUE)->idx) != 1) {
+		fprintf(stderr, "Frame on transmit queue not used\n");
+		return -1;
+	}
+
+	n = le16toh(used(RX_QUEUE)->idx);
+	for (i = 0; i < n; i++) {
+		unsigned id = le32toh(used(RX_QUEUE)->ring[i].id);
+		struct arp_frame *r;
+
+		if (id >= RX_BUFS ||
+		    le32toh(used(RX_QUEUE)->ring[i].len) < sizeof(*r))
+			continue;
+
+		r = (struct arp_frame *)(mem + BUF_BASE + id * BUF_SIZE);
+		if (r->eh.h_proto == htons(ETH_P_ARP) &&
+		    r->ah.ar_op == htons(ARPOP_REPLY) &&
+		    !memcmp(r->eh.h_dest, mac, ETH_ALEN) &&
+		    !memcmp(r->sip, f->tip, 4) &&
+		    le16toh(r->vnet.num_buffers) == 1)
+			return 0;
+	}
+
+	fprintf(stderr, "No ARP reply in %i received frames\n", n);
+	return -1;
+}
+
+/**
+ * avail_check() - Make more buffers available than queue size, check none used
+ *
+ * Return: 0 if no buffers were used, -1 otherwise
+ */
+static int avail_check(void)
+{
+	uint16_t used_idx = le16toh(used(TX_QUEUE)->idx);
+	uint64_t v = 1;
+
+	avail(TX_QUEUE)->idx = htole16(used_idx + QUEUE_SIZE + 1);
+	if (write(kick[TX_QUEUE], &v, sizeof(v)) != sizeof(v))
+		return -1;
+
+	usleep(100 * 1000);
+
+	if (le16toh(used(TX_QUEUE)->idx) != used_idx) {
+		fprintf(stderr, "Buffers past queue size used on transmit\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * bad_size_check() - Check that a queue size is rejected, with disconnection
+ * @path:	Path of back-end socket
+ * @num:	Queue size
+ *
+ * Return: 0 if rejected, -1 otherwise
+ */
+static int bad_size_check(const char *path, unsigned int num)
+{
+	struct vhost_vring_state st = { .index = RX_QUEUE, .num = num };
+	uint64_t ack;
+	char c;
+	int s;
+
+	if ((s = connect_backend(path, 0)) < 0)
+		return -1;
+
+	if (msg_send(s, SET_VRING_NUM, &st, sizeof(st), -1, 0, &ack) || !ack ||
+	    recv(s, &c, 1, 0) != 0) {
+		fprintf(stderr, "Queue size %u not rejected\n", num);
+		close(s);
+		return -1;
+	}
+
+	close(s);
+	return 0;
+}
+
+/**
+ * bad_ring_check() - Check that rings past the memory region are rejected
+ * @path:	Path of back-end socket
+ * @m:		Memory table, single region
+ * @memfd:	File descriptor for memory region
+ * @num_first:	Set queue size before ring addresses, instead of after
+ *
+ * The used ring starts within the region, and fits there with 64 entries, but
+ * not with QUEUE_SIZE entries.
+ *
+ * Return: 0 if rejected, -1 otherwise
+ */
+static int bad_ring_check(const char *path, const struct memory *m, int memfd,
+			  int num_first)
+{
+	struct vhost_vring_addr addr = {
+		.index		 = RX_QUEUE,
+		.desc_user_addr	 = (uintptr_t)desc(RX_QUEUE),
+		.avail_user_addr = (uintptr_t)avail(RX_QUEUE),
+		.used_user_addr	 = (uintptr_t)mem + MEM_SIZE -
+				   offsetof(struct vring_used, ring) -
+				   64 * sizeof(struct vring_used_elem) -
+				   sizeof(uint16_t),
+	};
+	struct vhost_vring_state small = { .index = RX_QUEUE, .num = 64 };
+	struct vhost_vring_state st = { .index = RX_QUEUE, .num = QUEUE_SIZE };
+	uint64_t ack;
+	char c;
+	int s;
+
+	if ((s = connect_backend(path, 0)) < 0)
+		return -1;
+
+	if (msg_send(s, SET_MEM_TABLE, m, sizeof(*m), memfd, 0, &ack) || ack)
+		goto fail;
+
+	if (num_first) {
+		if (msg_send(s, SET_VRING_NUM, &st, sizeof(st), -1, 0, &ack) ||
+		    ack)
+			goto fail;
+
+		if (msg_send(s, SET_VRING_ADDR, &addr, sizeof(addr), -1, 0,
+			     &ack) || !ack)
+			goto fail;
+	} else {
+		if (msg_send(s, SET_VRING_NUM, &small, sizeof(small), -1, 0,
+			     &ack) || ack ||
+		    msg_send(s, SET_VRING_ADDR, &addr, sizeof(addr), -1, 0,
+			     &ack) || ack)
+			goto fail;
+
+		if (msg_send(s, SET_VRING_NUM, &st, sizeof(st), -1, 0, &ack) ||
+		    !ack)
+			goto fail;
+	}
+
+	if (recv(s, &c, 1, 0) != 0)
+		goto fail;
+
+	close(s);
+	return 0;
+
+fail:
+	fprintf(stderr, "Used ring past memory region not rejected (%s)\n",
+		num_first ? "size first" : "addresses first");
+	close(s);
+	return -1;
+}
+
+/**
+ * fds_count() - Count open file descriptors of a process
+ * @pid:	Process
+ *
+ * Return: count of descriptors, -1 on failure
+ */
+static int fds_count(pid_t pid)
+{
+	char path[64];
+	int n = 0;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "/proc/%i/fd", (int)pid);
+	if (!(d = opendir(path)))
+		return -1;
+
+	while (readdir(d))
+		n++;
+
+	closedir(d);
+	return n;
+}
+
+/**
+ * fd_leak_check() - Pass descriptors with short header, or too many of them
+ * @path:	Path of back-end socket
+ * @pid:	Back-end process
+ *
+ * Return: 0 if the back-end has as many descriptors open as before, -1 if not
+ */
+static int fd_leak_check(const char *path, pid_t pid)
+{
+	struct sockaddr_un a = { .sun_family = AF_UNIX };
+	char cbuf[CMSG_SPACE(sizeof(int) * 12)] = { 0 };
+	int before = fds_count(pid), after, i, j;
+
+	strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+
+	for (i = 0; i < 10; i++) {
+		struct msg m = { .request = SET_OWNER, .flags = FLAGS_VERSION };
+		struct iovec iov = { &m, i % 2 ? HDR_SIZE : HDR_SIZE / 2 };
+		struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+				     .msg_control = cbuf,
+				     .msg_controllen = sizeof(cbuf) };
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+		int fds[12], s, n = i % 2 ? 12 : 4;
+
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+		for (j = 0; j < n; j++) {
+			if ((fds[j] = eventfd(0, 0)) < 0)
+				return -1;
+		}
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+		if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		    connect(s, (struct sockaddr *)&a, sizeof(a)) ||
+		    sendmsg(s, &mh, MSG_NOSIGNAL) < 0)
+			return -1;
+
+		/* Let the back-end read it, before we close the connection */
+		usleep(100 * 1000);
+
+		for (j = 0; j < n; j++)
+			close(fds[j]);
+		close(s);
+		usleep(100 * 1000);
+	}
+
+	if ((after = fds_count(pid)) != before) {
+		fprintf(stderr, "Back-end had %i descriptors, now %i\n",
+			before, after);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct memory m = { .nregions = 1, .size = MEM_SIZE };
+	char path[] = "/tmp/passt_vhost_user_XXXXXX";
+	int s = -1, memfd, ret = EXIT_FAILURE, i;
+	uint64_t ack;
+	char **args;
+	pid_t pid;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s PASST [OPTION]...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!mkdtemp(path) || !(args = calloc(argc + 5, sizeof(*args))))
+		return EXIT_FAILURE;
+
+	args[0] = argv[1];
+	args[1] = "--vhost-user";
+	args[2] = "-f";
+	args[3] = "-s";
+	if (asprintf(&args[4], "%s/sock", path) < 0)
+		return EXIT_FAILURE;
+	for (i = 2; i < argc; i++)
+		args[i + 3] = argv[i];
+
+	if (!(pid = fork())) {
+		execv(args[0], args);
+		perror("execv");
+		_exit(EXIT_FAILURE);
+	}
+
+	if ((memfd = memfd_create("vhost_user", 0)) < 0 ||
+	    ftruncate(memfd, MEM_SIZE) ||
+	    (mem = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			memfd, 0)) == MAP_FAILED) {
+		perror("memfd");
+		goto out;
+	}
+	m.qva = (uintptr_t)mem;
+
+	if ((s = connect_backend(args[4], 1)) < 0)
+		goto out;
+
+	if (msg_send(s, SET_MEM_TABLE, &m, sizeof(m), memfd, 0, &ack) || ack) {
+		fprintf(stderr, "Memory table not accepted\n");
+		goto out;
+	}
+
+	if (queue_setup(s, RX_QUEUE) || queue_setup(s, TX_QUEUE) ||
+	    arp_check() || avail_check())
+		goto out;
+
+	close(s);
+	s = -1;
+
+	if (bad_size_check(args[4], 0) || bad_size_check(args[4], 100) ||
+	    bad_ring_check(args[4], &m, memfd, 1) ||
+	    bad_ring_check(args[4], &m, memfd, 0) ||
+	    fd_leak_check(args[4], pid))
+		goto out;
+
+	ret = EXIT_SUCCESS;
+out:
+	if (s != -1)
+		close(s);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	unlink(args[4]);
+	rmdir(path);
+
+	return ret;
+}
@@ -0,0 +1,313 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * twheel.c - Hierarchical timer wheel, driven by the main loop
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Timers are kept in TW_LEVELS arrays of TW_SLOTS lists: level 0 has one slot
+ * per tick, level 1 one slot per TW_SLOTS ticks, and so on. Timers expiring in
+ * less than TW_SLOTS ticks sit in level 0, others are moved down to lower
+ * levels ("cascaded") as level 0 wraps around. Arming, re-arming and deleting a
+ * timer are constant-time list operations, and there's no file descriptor or
+ * system call involved.
+ *
+ * Entries are kept in an array indexed like the objects they refer to, so
+ * that lists can be linked by index, and objects moved around in their tables
+ * can take their timers with them, see tw_move().
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "util.h"
+#include "twheel.h"
+
+#define TW_MASK			(TW_SLOTS - 1)
+#define TW_MAX_TICKS		((1U << (TW_BITS * TW_LEVELS)) - 1)
+
+/**
+ * tw_ticks() - Convert timestamp to ticks since base
+ * @w:		Timer wheel
+ * @ts:		Timestamp
+ *
+ * Return: ticks, wrapping around
+ */
+static uint32_t tw_ticks(const struct twheel *w, const struct timespec *ts)
+{
+	int64_t ms = (int64_t)(ts->tv_sec - w->base.tv_sec) * 1000 +
+		     (ts->tv_nsec - w->base.tv_nsec) / 1000000;
+
+	return (uint32_t)(ms / TW_TICK_MS);
+}
+
+/**
+ * tw_insert() - Link entry in slot matching its expiry time
+ * @w:		Timer wheel
+ * @i:		Index of entry, with expiry time set, not linked
+ */
+static void tw_insert(struct twheel *w, int i)
+{
+	struct tw_entry *e = &w->e[i];
+	int32_t d = (int32_t)(e->expires - w->now);
+	unsigned int level, idx;
+
+	if (d < 0)
+		d = 0;
+
+	if ((uint32_t)d > TW_MAX_TICKS) {
+		e->expires = w->now + TW_MAX_TICKS;
+		d = TW_MAX_TICKS;
+	}
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if ((uint32_t)d < (1U << (TW_BITS * (level + 1))))
+			break;
+	}
+
+	idx = (e->expires >> (TW_BITS * level)) & TW_MASK;
+
+	e->slot = level * TW_SLOTS + idx + 1;
+	e->prev = -1;
+	e->next = w->head[level][idx];
+	if (e->next != -1)
+		w->e[e->next].prev = i;
+	w->head[level][idx] = i;
+
+	w->count[level]++;
+}
+
+/**
+ * tw_unlink() - Unlink entry from its slot
+ * @w:		Timer wheel
+ * @i:		Index of linked entry
+ */
+static void tw_unlink(struct twheel *w, int i)
+{
+	struct tw_entry *e = &w->e[i];
+	unsigned int level = (e->slot - 1) / TW_SLOTS;
+	unsigned int idx = (e->slot - 1) % TW_SLOTS;
+
+	if (e->prev != -1)
+		w->e[e->prev].next = e->next;
+	else
+		w->head[level][idx] = e->next;
+
+	if (e->next != -1)
+		w->e[e->next].prev = e->prev;
+
+	e->slot = 0;
+	e->prev = e->next = -1;
+	w->count[level]--;
+}
+
+/**
+ * tw_init() - Initialise timer wheel
+ * @w:		Timer wheel
+ * @e:		Array of entries, zero-initialised, that is, all timers unset
+ * @now:	Current timestamp
+ */
+void tw_init(struct twheel *w, struct tw_entry *e, const struct timespec *now)
+{
+	memset(w, 0, sizeof(*w));
+	memset(w->head, 0xff, sizeof(w->head));
+
+	w->e = e;
+	w->base = *now;
+}
+
+/**
+ * tw_add() - Set timer, replacing any previous setting
+ * @w:		Timer wheel
+ * @i:		Index of entry
+ * @ms:		Expiry time from now, milliseconds, rounded up to ticks
+ */
+void tw_add(struct twheel *w, int i, unsigned int ms)
+{
+	struct timespec now;
+	uint32_t t;
+
+	if (w->e[i].slot)
+		tw_unlink(w, i);
+
+	/* The wheel might lag behind a bit: count from current time, but never
+	 * from before the last tick processed, as that slot was already run
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = tw_ticks(w, &now);
+	if ((int32_t)(t - w->now) < 0)
+		t = w->now;
+
+	w->e[i].expires = t + MAX(DIV_ROUND_UP(ms, TW_TICK_MS), 1);
+
+	tw_insert(w, i);
+}
+
+/**
+ * tw_del() - Unset timer, if set
+ * @w:		Timer wheel
+ * @i:		Index of entry
+ */
+void tw_del(struct twheel *w, int i)
+{
+	if (w->e[i].slot)
+		tw_unlink(w, i);
+}
+
+/**
+ * tw_move() - Move entry to a new index, with its object
+ * @w:		Timer wheel
+ * @from:	Current index of entry
+ * @to:		New index of entry, timer not set
+ */
+void tw_move(struct twheel *w, int from, int to)
+{
+	struct tw_entry *e = &w->e[to];
+
+	*e = w->e[from];
+	w->e[from].slot = 0;
+
+	if (!e->slot)
+		return;
+
+	if (e->prev != -1)
+		w->e[e->prev].next = to;
+	else
+		w->head[(e->slot - 1) / TW_SLOTS][(e->slot - 1) % TW_SLOTS] = to;
+
+	if (e->next != -1)
+		w->e[e->next].prev = to;
+}
+
+/**
+ * tw_cascade() - Move entries from slot in higher level to lower levels
+ * @w:		Timer wheel
+ * @level:	Level of slot, at least 1
+ * @idx:	Index of slot in level
+ */
+static void tw_cascade(struct twheel *w, unsigned int level, unsigned int idx)
+{
+	int i = w->head[level][idx];
+
+	w->head[level][idx] = -1;
+
+	while (i != -1) {
+		int next = w->e[i].next;
+
+		w->count[level]--;
+		tw_insert(w, i);
+		i = next;
+	}
+}
+
+/**
+ * tw_next_tick() - Find next tick with timers to run, or with a cascade
+ * @w:		Timer wheel, with at least one timer set
+ *
+ * Level 0 only holds timers expiring in less than TW_SLOTS ticks, and the next
+ * cascade is at the next multiple of the slot size of the lowest higher level
+ * holding timers: no need to look further than that.
+ *
+ * Return: next tick, after the last tick processed, that needs processing
+ */
+static uint32_t tw_next_tick(const struct twheel *w)
+{
+	uint32_t t, end = w->now + TW_SLOTS - 1;
+	unsigned int level;
+
+	for (level = 1; level < TW_LEVELS; level++) {
+		uint32_t cascade;
+
+		if (!w->count[level])
+			continue;
+
+		cascade = (w->now | ((1U << (TW_BITS * level)) - 1)) + 1;
+		if (!w->count[0] || (int32_t)(cascade - end) < 0)
+			end = cascade;
+		break;
+	}
+
+	for (t = w->now + 1; w->count[0] && t != end; t++) {
+		if (w->head[0][t & TW_MASK] != -1)
+			return t;
+	}
+
+	return end;
+}
+
+/**
+ * tw_run() - Advance timer wheel to current time, calling expired timers
+ * @w:		Timer wheel
+ * @now:	Current timestamp
+ * @fn:		Function to call for each expired timer, which is unset first
+ * @arg:	Opaque argument for @fn
+ *
+ * Expired timers can be set again from @fn. Ticks with nothing to do are skipped
+ * altogether, so that a long idle period doesn't cost one iteration per tick.
+ */
+void tw_run(struct twheel *w, const struct timespec *now,
+	    void (*fn)(void *arg, int i), void *arg)
+{
+	uint32_t target = tw_ticks(w, now);
+	unsigned int level;
+
+	while ((int32_t)(target - w->now) > 0) {
+		uint32_t next;
+		int i;
+
+		for (level = 0; level < TW_LEVELS; level++) {
+			if (w->count[level])
+				break;
+		}
+
+		if (level == TW_LEVELS ||
+		    (int32_t)((next = tw_next_tick(w)) - target) > 0) {
+			w->now = target;
+			return;
+		}
+
+		w->now = next;
+
+		for (level = 1; level < TW_LEVELS; level++) {
+			unsigned int shift = TW_BITS * level;
+
+			if (w->now & ((1U << shift) - 1))
+				break;
+		}
+
+		while (--level)
+			tw_cascade(w, level, (w->now >> (TW_BITS * level)) &
+					     TW_MASK);
+
+		while ((i = w->head[0][w->now & TW_MASK]) != -1) {
+			tw_unlink(w, i);
+			fn(arg, i);
+		}
+	}
+}
+
+/**
+ * tw_next_ms() - Time until tw_run() needs to be called again
+ * @w:		Timer wheel
+ *
+ * Return: milliseconds until next expiry or cascade, -1 if no timers are set
+ */
+int tw_next_ms(const struct twheel *w)
+{
+	unsigned int level;
+
+	for (level = 0; level < TW_LEVELS; level++) {
+		if (w->count[level])
+			return (tw_next_tick(w) - w->now) * TW_TICK_MS;
+	}
+
+	return -1;
+}
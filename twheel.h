@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#define TW_TICK_MS		10
+#define TW_BITS			8
+#define TW_SLOTS		(1 << TW_BITS)
+#define TW_LEVELS		3	/* Up to 2^24 ticks, that is, ~46 hours */
+
+/**
+ * struct tw_entry - Timer, same index as the object it refers to
+ * @next:	Index of next entry in slot, -1 if last
+ * @prev:	Index of previous entry in slot, -1 if first
+ * @slot:	Slot holding this entry (level * TW_SLOTS + index) plus one, zero
+ *		if unset, so that zero-initialised entries are valid
+ * @expires:	Expiry time, ticks
+ */
+struct tw_entry {
+	int next;
+	int prev;
+	int slot;
+	uint32_t expires;
+};
+
+/**
+ * struct twheel - Hierarchical timer wheel
+ * @e:		Entries, one for each object that might have a timer
+ * @base:	Timestamp corresponding to tick 0
+ * @now:	Last tick processed
+ * @count:	Number of armed timers, per level
+ * @head:	Index of first entry, for each slot, -1 if empty
+ */
+struct twheel {
+	struct tw_entry *e;
+	struct timespec base;
+	uint32_t now;
+	unsigned int count[TW_LEVELS];
+	int head[TW_LEVELS][TW_SLOTS];
+};
+
+void tw_init(struct twheel *w, struct tw_entry *e, const struct timespec *now);
+void tw_add(struct twheel *w, int i, unsigned int ms);
+void tw_del(struct twheel *w, int i);
+void tw_move(struct twheel *w, int from, int to);
+void tw_run(struct twheel *w, const struct timespec *now,
+	    void (*fn)(void *arg, int i), void *arg);
+int tw_next_ms(const struct twheel *w);
+
+#endif /* TWHEEL_H */
@@ -16,23 +16,38 @@
  * DOC: Theory of Operation
  *
  *
- * For UDP, a reduced version of port-based connection tracking is implemented
- * with two purposes:
+ * For UDP, a reduced version of connection tracking is implemented, using the
+ * flow table (see flow.c), with two purposes:
  * - binding ephemeral ports when they're used as source port by the guest, so
  *   that replies on those ports can be forwarded back to the guest, with a
- *   fixed timeout for this binding
+ *   fixed timeout for this binding (FLOW_UDP_BIND flows)
  * - packets received from the local host get their source changed to a local
  *   address (gateway address) so that they can be forwarded to the guest, and
  *   packets sent as replies by the guest need their destination address to
- *   be changed back to the address of the local host. This is dynamic to allow
- *   connections from the gateway as well, and uses the same fixed 180s timeout
- * 
+ *   be changed back to the address of the local host. This is tracked per
+ *   guest port and peer port (FLOW_UDP flows), and uses the same fixed 180s
+ *   timeout
+ *
+ * Sockets bound to guest ports are not connected, as they're used for any
+ * destination, and the kernel needs to look up route and neighbour for each
+ * datagram. Flows from the guest sending more than UDP_CONN_BUSY_PKTS datagrams
+ * in UDP_CONN_BUSY_WINDOW get a socket bound to the same port and connected to
+ * the peer (FLOW_UDP_CONN flows), which is closed after UDP_CONN_IDLE seconds
+ * without datagrams from the guest. Replies from the peer are then delivered
+ * to this socket, as connected sockets are preferred by the kernel.
+ *
  * Sockets for bound ports are created at initialisation time, one set for IPv4
  * and one for IPv6.
  *
  * Packets are forwarded back and forth, by prepending and stripping UDP headers
  * in the obvious way, with no port translation.
  *
+ * If the kernel supports UDP segmentation offload, runs of datagrams of equal
+ * size in a batch from the guest are passed as a single message with a
+ * UDP_SEGMENT control message, see udp_gso_msg(). In the other direction,
+ * tap-facing sockets are set to UDP_GRO, and super-datagrams coalesced by the
+ * kernel are split back into frames by udp_sock_handler_gro().
+ *
  * In PASTA mode, the L2-L4 translation is skipped for connections to ports
  * bound between namespaces using the loopback interface, messages are directly
  * transferred between L4 sockets instead. These are called spliced connections
@@ -40,54 +55,48 @@
  * actually used as it wouldn't make sense for datagram-based connections: a
  * pair of recvmmsg() and sendmmsg() deals with this case.
  *
- * The connection tracking for PASTA mode is slightly complicated by the absence
- * of actual connections, see struct udp_splice_port, and these examples:
+ * Spliced connections are tracked as FLOW_UDP_TO_NS and FLOW_UDP_TO_INIT flows,
+ * by source and destination port, see these examples:
  *
  * - from init to namespace:
  *
  *   - forward direction: 127.0.0.1:5000 -> 127.0.0.1:80 in init from bound
  *     socket s, with epoll reference: index = 80, splice = UDP_TO_NS
- *     - if udp_splice_map[V4][5000].ns_conn_sock:
- *       - send packet to udp4_splice_map[5000].ns_conn_sock
+ *     - if there's a FLOW_UDP_TO_NS flow for ports 5000, 80:
+ *       - send packet to its socket
  *     - otherwise:
- *       - create new socket udp_splice_map[V4][5000].ns_conn_sock
- *       - connect in namespace to 127.0.0.1:80 (note: this destination port
- *         might be remapped to another port instead)
- *       - get source port of new connected socket (10000) with getsockname()
- *       - add to epoll with reference: index = 10000, splice: UDP_BACK_TO_INIT
- *       - set udp_splice_map[V4][10000].init_bound_sock to s
- *       - set udp_splice_map[V4][10000].init_dst_port to 5000
- *   - update udp_splice_map[V4][5000].ns_conn_ts with current time
+ *       - create new socket, connect in namespace to 127.0.0.1:80 (note: this
+ *         destination port might be remapped to another port instead)
+ *       - add to epoll with reference: index = 5000, splice: UDP_BACK_TO_INIT
+ *       - add FLOW_UDP_TO_NS flow for ports 5000, 80, with the new socket, and
+ *         s as bound socket
+ *   - set timeout for flow
  *
  *   - reverse direction: 127.0.0.1:80 -> 127.0.0.1:10000 in namespace from
- *     connected socket s, having epoll reference: index = 10000,
+ *     connected socket, having epoll reference: index = 5000,
  *     splice = UDP_BACK_TO_INIT
- *     - if udp_splice_map[V4][10000].init_bound_sock:
- *       - send to udp_splice_map[V4][10000].init_bound_sock, with destination
- *         port udp_splice_map[V4][10000].init_dst_port (5000)
+ *     - if there's a FLOW_UDP_TO_NS flow for ports 5000, 80:
+ *       - send to its bound socket, with destination port 5000
  *     - otherwise, discard
  *
  * - from namespace to init:
  *
  *   - forward direction: 127.0.0.1:2000 -> 127.0.0.1:22 in namespace from bound
  *     socket s, with epoll reference: index = 22, splice = UDP_TO_INIT
- *     - if udp4_splice_map[V4][2000].init_conn_sock:
- *       - send packet to udp4_splice_map[2000].init_conn_sock
+ *     - if there's a FLOW_UDP_TO_INIT flow for ports 2000, 22:
+ *       - send packet to its socket
  *     - otherwise:
- *       - create new socket udp_splice_map[V4][2000].init_conn_sock
- *       - connect in init to 127.0.0.1:22 (note: this destination port
- *         might be remapped to another port instead)
- *       - get source port of new connected socket (4000) with getsockname()
- *       - add to epoll with reference: index = 4000, splice = UDP_BACK_TO_NS
- *       - set udp_splice_map[V4][4000].ns_bound_sock to s
- *       - set udp_splice_map[V4][4000].ns_dst_port to 2000
- *     - update udp_splice_map[V4][4000].init_conn_ts with current time
+ *       - create new socket, connect in init to 127.0.0.1:22 (note: this
+ *         destination port might be remapped to another port instead)
+ *       - add to epoll with reference: index = 2000, splice = UDP_BACK_TO_NS
+ *       - add FLOW_UDP_TO_INIT flow for ports 2000, 22, with the new socket,
+ *         and s as bound socket
+ *   - set timeout for flow
  *
  *   - reverse direction: 127.0.0.1:22 -> 127.0.0.1:4000 in init from connected
- *     socket s, having epoll reference: index = 4000, splice = UDP_BACK_TO_NS
- *   - if udp_splice_map[V4][4000].ns_bound_sock:
- *     - send to udp_splice_map[V4][4000].ns_bound_sock, with destination port
- *       udp_splice_map[4000].ns_dst_port (2000)
+ *     socket, having epoll reference: index = 2000, splice = UDP_BACK_TO_NS
+ *   - if there's a FLOW_UDP_TO_INIT flow for ports 2000, 22:
+ *     - send to its bound socket, with destination port 2000
  *   - otherwise, discard
  */
 
@@ -117,66 +126,21 @@
 #include "tap.h"
 #include "pcap.h"
 #include "log.h"
+#include "flow.h"
+#include "ns_helper.h"
+#include "stats.h"
 
 #define UDP_CONN_TIMEOUT	180 /* s, timeout for ephemeral or local bind */
+#define UDP_CONN_BUSY_PKTS	64 /* Datagrams from tap to connect a socket */
+#define UDP_CONN_BUSY_WINDOW	1000 /* ms, window for UDP_CONN_BUSY_PKTS */
+#define UDP_CONN_IDLE		10 /* s, close connected socket if unused */
 #define UDP_SPLICE_FRAMES	32
 #define UDP_TAP_FRAMES_MEM	32
 #define UDP_TAP_FRAMES		(c->mode == MODE_PASST ? UDP_TAP_FRAMES_MEM : 1)
-
-/**
- * struct udp_tap_port - Port tracking based on tap-facing source port
- * @sock:	Socket bound to source port used as index
- * @flags:	Flags for local bind, loopback address/unicast address as source
- * @ts:		Activity timestamp from tap, used for socket aging
- */
-struct udp_tap_port {
-	int sock;
-	uint8_t flags;
-#define PORT_LOCAL	BIT(0)
-#define PORT_LOOPBACK	BIT(1)
-#define PORT_GUA	BIT(2)
-
-	time_t ts;
-};
-
-/**
- * struct udp_splice_port - Source port tracking for traffic between namespaces
- * @ns_conn_sock:	Socket connected in namespace for init source port
- * @init_conn_sock:	Socket connected in init for namespace source port
- * @ns_conn_ts:		Timestamp of activity for socket connected in namespace
- * @init_conn_ts:	Timestamp of activity for socket connceted in init
- * @ns_dst_port:	Destination port in namespace for init source port
- * @init_dst_port:	Destination port in init for namespace source port
- * @ns_bound_sock:	Bound socket in namespace for this source port in init
- * @init_bound_sock:	Bound socket in init for this source port in namespace
- */
-struct udp_splice_port {
-	int ns_conn_sock;
-	int init_conn_sock;
-
-	time_t ns_conn_ts;
-	time_t init_conn_ts;
-
-	in_port_t ns_dst_port;
-	in_port_t init_dst_port;
-
-	int ns_bound_sock;
-	int init_bound_sock;
-};
-
-/* Port tracking, arrays indexed by packet source port (host order) */
-static struct udp_tap_port	udp_tap_map	[IP_VERSIONS][NUM_PORTS];
-static struct udp_splice_port	udp_splice_map	[IP_VERSIONS][NUM_PORTS];
-
-enum udp_act_type {
-	UDP_ACT_TAP,
-	UDP_ACT_NS_CONN,
-	UDP_ACT_INIT_CONN,
-	UDP_ACT_TYPE_MAX,
-};
-
-/* Activity-based aging for bindings */
-static uint8_t udp_act[IP_VERSIONS][UDP_ACT_TYPE_MAX][DIV_ROUND_UP(NUM_PORTS, 8)];
+#define UDP_GRO_FRAMES		8 /* Super-datagrams per recvmmsg() with GRO */
+#define UDP_GSO_MAX_SEGS	64 /* UDP_MAX_SEGMENTS in the kernel */
+#define UDP_GSO_MAX_LEN		(USHRT_MAX - sizeof(struct iphdr) -	\
+				 sizeof(struct udphdr))
 
 /* Static buffers */
 
@@ -214,7 +178,7 @@ udp4_l2_buf[UDP_TAP_FRAMES_MEM];
  */
 struct udp6_l2_buf_t {
 	struct sockaddr_in6 s_in6;
-#ifdef __AVX2__
+#if CSUM_ALIGN == 32
 	/* Align ip6h to 32-byte boundary. */
 	uint8_t pad[64 - (sizeof(struct sockaddr_in6) + sizeof(struct ethhdr) +
 			  sizeof(uint32_t))];
@@ -226,8 +190,8 @@ struct udp6_l2_buf_t {
 	struct udphdr uh;
 	uint8_t data[USHRT_MAX -
 		     (sizeof(struct ipv6hdr) + sizeof(struct udphdr))];
-#ifdef __AVX2__
-} __attribute__ ((packed, aligned(32)))
+#if CSUM_ALIGN == 32
+} __attribute__ ((packed, aligned(CSUM_ALIGN)))
 #else
 } __attribute__ ((packed, aligned(__alignof__(unsigned int))))
 #endif
@@ -249,6 +213,23 @@ static struct mmsghdr	udp6_l2_mh_sock		[UDP_TAP_FRAMES_MEM];
 static struct mmsghdr	udp4_l2_mh_tap		[UDP_TAP_FRAMES_MEM];
 static struct mmsghdr	udp6_l2_mh_tap		[UDP_TAP_FRAMES_MEM];
 
+/* recvmmsg() data for tap-facing sockets with UDP_GRO, super-datagrams */
+static uint8_t		udp_gro_buf		[UDP_GRO_FRAMES][USHRT_MAX];
+static struct sockaddr_in6 udp_gro_name		[UDP_GRO_FRAMES];
+static struct iovec	udp_gro_iov		[UDP_GRO_FRAMES];
+static struct mmsghdr	udp_gro_mh		[UDP_GRO_FRAMES];
+static char		udp_gro_cmsg		[UDP_GRO_FRAMES]
+						[CMSG_SPACE(sizeof(int))]
+	__attribute__ ((aligned(__alignof__(struct cmsghdr))));
+
+/* Control messages for sendmmsg() with UDP_SEGMENT, from tap */
+static char		udp_gso_cmsg		[UIO_MAXIOV]
+						[CMSG_SPACE(sizeof(uint16_t))]
+	__attribute__ ((aligned(__alignof__(struct cmsghdr))));
+
+/* Largest segment size known to be accepted by the kernel for UDP_SEGMENT */
+static size_t udp_gso_seg_max = UDP_GSO_MAX_LEN;
+
 /* recvmmsg()/sendmmsg() data for "spliced" connections */
 static struct iovec	udp_iov_recv		[UDP_SPLICE_FRAMES];
 static struct mmsghdr	udp_mmh_recv		[UDP_SPLICE_FRAMES];
@@ -378,7 +359,7 @@ static void udp_sock6_iov_init(void)
 	for (i = 0; i < ARRAY_SIZE(udp6_l2_buf); i++) {
 		udp6_l2_buf[i] = (struct udp6_l2_buf_t) {
 			{ 0 },
-#ifdef __AVX2__
+#if CSUM_ALIGN == 32
 			{ 0 },
 #endif
 			0, L2_BUF_ETH_IP6_INIT, L2_BUF_IP6_INIT(IPPROTO_UDP),
@@ -411,25 +392,20 @@ static void udp_sock6_iov_init(void)
  * udp_splice_connect() - Create and connect socket for "spliced" binding
  * @c:		Execution context
  * @v6:		Set for IPv6 connections
- * @bound_sock:	Originating bound socket
  * @src:	Source port of original connection, host order
  * @dst:	Destination port of original connection, host order
  * @splice:	UDP_BACK_TO_INIT from init, UDP_BACK_TO_NS from namespace
  *
  * Return: connected socket, negative error code on failure
- *
- * #syscalls:pasta getsockname
  */
-int udp_splice_connect(const struct ctx *c, int v6, int bound_sock,
-		       in_port_t src, in_port_t dst, int splice)
+int udp_splice_connect(const struct ctx *c, int v6, in_port_t src,
+		       in_port_t dst, int splice)
 {
 	struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLHUP };
 	union epoll_ref ref = { .r.proto = IPPROTO_UDP,
-				.r.p.udp.udp = { .splice = splice, .v6 = v6 }
+				.r.p.udp.udp = { .splice = splice, .v6 = v6,
+						 .port = src }
 			      };
-	struct sockaddr_storage sa;
-	struct udp_splice_port *sp;
-	socklen_t sl = sizeof(sa);
 	int s;
 
 	s = socket(v6 ? AF_INET6 : AF_INET, SOCK_DGRAM | SOCK_NONBLOCK,
@@ -463,34 +439,6 @@ int udp_splice_connect(const struct ctx *c, int v6, int bound_sock,
 			goto fail;
 	}
 
-	if (getsockname(s, (struct sockaddr *)&sa, &sl))
-		goto fail;
-
-	if (v6) {
-		struct sockaddr_in6 sa6;
-
-		memcpy(&sa6, &sa, sizeof(sa6));
-		ref.r.p.udp.udp.port = ntohs(sa6.sin6_port);
-	} else {
-		struct sockaddr_in sa4;
-
-		memcpy(&sa4, &sa, sizeof(sa4));
-		ref.r.p.udp.udp.port = ntohs(sa4.sin_port);
-	}
-
-	sp = &udp_splice_map[v6 ? V6 : V4][ref.r.p.udp.udp.port];
-	if (splice == UDP_BACK_TO_INIT) {
-		sp->init_bound_sock = bound_sock;
-		sp->init_dst_port = src;
-		udp_splice_map[v6 ? V6 : V4][src].ns_conn_sock = s;
-		bitmap_set(udp_act[v6 ? V6 : V4][UDP_ACT_NS_CONN], src);
-	} else if (splice == UDP_BACK_TO_NS) {
-		sp->ns_bound_sock = bound_sock;
-		sp->ns_dst_port = src;
-		udp_splice_map[v6 ? V6 : V4][src].init_conn_sock = s;
-		bitmap_set(udp_act[v6 ? V6 : V4][UDP_ACT_INIT_CONN], src);
-	}
-
 	ev.data.u64 = ref.u64;
 	epoll_ctl(c->epollfd, EPOLL_CTL_ADD, s, &ev);
 	return s;
@@ -504,7 +452,6 @@ fail:
  * struct udp_splice_connect_ns_arg - Arguments for udp_splice_connect_ns()
  * @c:		Execution context
  * @v6:		Set for inbound IPv6 connection
- * @bound_sock:	Originating bound socket
  * @src:	Source port of original connection, host order
  * @dst:	Destination port of original connection, host order
  * @s:		Newly created socket or negative error code
@@ -512,7 +459,6 @@ fail:
 struct udp_splice_connect_ns_arg {
 	const struct ctx *c;
 	int v6;
-	int bound_sock;
 	in_port_t src;
 	in_port_t dst;
 	int s;
@@ -533,26 +479,55 @@ static int udp_splice_connect_ns(void *arg)
 	if (ns_enter(a->c))
 		return 0;
 
-	a->s = udp_splice_connect(a->c, a->v6, a->bound_sock, a->src, a->dst,
+	a->s = udp_splice_connect(a->c, a->v6, a->src, a->dst,
 				  UDP_BACK_TO_INIT);
 
 	return 0;
 }
 
+/**
+ * udp_splice_flow_add() - Add flow for new spliced connection
+ * @c:		Execution context
+ * @k:		Flow key
+ * @s:		Connected socket, owned by flow, closed on failure
+ * @bound_sock:	Originating bound socket
+ *
+ * Return: new flow, NULL on failure
+ */
+static struct flow *udp_splice_flow_add(const struct ctx *c,
+					const struct flow_key *k, int s,
+					int bound_sock)
+{
+	struct flow *f = flow_add(k);
+
+	if (!f) {
+		epoll_ctl(c->epollfd, EPOLL_CTL_DEL, s, NULL);
+		close(s);
+		return NULL;
+	}
+
+	f->sock = s;
+	f->u.bound_sock = bound_sock;
+
+	return f;
+}
+
 /**
  * udp_sock_handler_splice() - Handler for socket mapped to "spliced" connection
  * @c:		Execution context
  * @ref:	epoll reference
  * @events:	epoll events bitmap
- * @now:	Current timestamp
  */
 static void udp_sock_handler_splice(const struct ctx *c, union epoll_ref ref,
-				    uint32_t events, const struct timespec *now)
+				    uint32_t events)
 {
 	in_port_t src, dst = ref.r.p.udp.udp.port, send_dst = 0;
 	struct msghdr *mh = &udp_mmh_recv[0].msg_hdr;
 	struct sockaddr_storage *sa_s = mh->msg_name;
 	int s, v6 = ref.r.p.udp.udp.v6, n, i;
+	int af = v6 ? AF_INET6 : AF_INET;
+	struct flow_key k;
+	struct flow *f;
 
 	if (!(events & EPOLLIN))
 		return;
@@ -576,44 +551,53 @@ static void udp_sock_handler_splice(const struct ctx *c, union epoll_ref ref,
 	case UDP_TO_NS:
 		src += c->udp.fwd_out.rdelta[src];
 
-		if (!(s = udp_splice_map[v6][src].ns_conn_sock)) {
+		flow_key_set(&k, FLOW_UDP_TO_NS, af, NULL, src, dst);
+		if (!(f = flow_lookup(&k))) {
 			struct udp_splice_connect_ns_arg arg = {
-				c, v6, ref.r.s, src, dst, -1,
+				c, v6, src, dst, -1,
 			};
 
-			NS_CALL(udp_splice_connect_ns, &arg);
+			ns_call(udp_splice_connect_ns, &arg);
 			if ((s = arg.s) < 0)
 				return;
+
+			if (!(f = udp_splice_flow_add(c, &k, s, ref.r.s)))
+				return;
 		}
-		udp_splice_map[v6][src].ns_conn_ts = now->tv_sec;
 		break;
 	case UDP_BACK_TO_INIT:
-		if (!(s = udp_splice_map[v6][dst].init_bound_sock))
+		flow_key_set(&k, FLOW_UDP_TO_NS, af, NULL, dst, src);
+		if (!(f = flow_lookup(&k)))
 			return;
 
-		send_dst = udp_splice_map[v6][dst].init_dst_port;
+		send_dst = dst;
 		break;
 	case UDP_TO_INIT:
 		src += c->udp.fwd_in.rdelta[src];
 
-		if (!(s = udp_splice_map[v6][src].init_conn_sock)) {
-			s = udp_splice_connect(c, v6, ref.r.s, src, dst,
-					       UDP_BACK_TO_NS);
+		flow_key_set(&k, FLOW_UDP_TO_INIT, af, NULL, src, dst);
+		if (!(f = flow_lookup(&k))) {
+			s = udp_splice_connect(c, v6, src, dst, UDP_BACK_TO_NS);
 			if (s < 0)
 				return;
+
+			if (!(f = udp_splice_flow_add(c, &k, s, ref.r.s)))
+				return;
 		}
-		udp_splice_map[v6][src].init_conn_ts = now->tv_sec;
 		break;
 	case UDP_BACK_TO_NS:
-		if (!(s = udp_splice_map[v6][dst].ns_bound_sock))
+		flow_key_set(&k, FLOW_UDP_TO_INIT, af, NULL, dst, src);
+		if (!(f = flow_lookup(&k)))
 			return;
 
-		send_dst = udp_splice_map[v6][dst].ns_dst_port;
+		send_dst = dst;
 		break;
 	default:
 		return;
 	}
 
+	flow_touch(f, UDP_CONN_TIMEOUT * 1000);
+
 	if (ref.r.p.udp.udp.splice == UDP_TO_NS ||
 	    ref.r.p.udp.udp.splice == UDP_TO_INIT) {
 		for (i = 0; i < n; i++) {
@@ -622,7 +606,7 @@ static void udp_sock_handler_splice(const struct ctx *c, union epoll_ref ref,
 			mh_s->msg_iov->iov_len = udp_mmh_recv[i].msg_len;
 		}
 
-		sendmmsg(s, udp_mmh_send, n, MSG_NOSIGNAL);
+		sendmmsg(f->sock, udp_mmh_send, n, MSG_NOSIGNAL);
 		return;
 	}
 
@@ -650,7 +634,35 @@ static void udp_sock_handler_splice(const struct ctx *c, union epoll_ref ref,
 		});
 	}
 
-	sendmmsg(s, udp_mmh_sendto, n, MSG_NOSIGNAL);
+	sendmmsg(f->u.bound_sock, udp_mmh_sendto, n, MSG_NOSIGNAL);
+}
+
+/**
+ * udp_local_flow() - Track local source address for replies from guest
+ * @af:		Address family, AF_INET or AF_INET6
+ * @faddr:	Source address as seen by the guest, pointer to in_addr or in6_addr
+ * @addr:	Actual source address, pointer to in_addr or in6_addr
+ * @eport:	Destination (guest) port, host order
+ * @fport:	Source port, host order
+ */
+static void udp_local_flow(int af, const void *faddr, const void *addr,
+			   in_port_t eport, in_port_t fport)
+{
+	struct flow_key k;
+	struct flow *f;
+
+	flow_key_set(&k, FLOW_UDP, af, faddr, eport, fport);
+	if (!(f = flow_lookup(&k)) && !(f = flow_add(&k)))
+		return;
+
+	if (af == AF_INET) {
+		memset(&f->u.addr, 0, sizeof(f->u.addr));
+		memcpy(&f->u.addr.s6_addr[12], addr, sizeof(struct in_addr));
+	} else {
+		f->u.addr = *(const struct in6_addr *)addr;
+	}
+
+	flow_touch(f, UDP_CONN_TIMEOUT * 1000);
 }
 
 /**
@@ -660,12 +672,10 @@ static void udp_sock_handler_splice(const struct ctx *c, union epoll_ref ref,
  * @ref:	epoll reference from socket
  * @msg_idx:	Index within message being prepared (spans multiple buffers)
  * @msg_len:	Length of current message being prepared for sending
- * @now:	Current timestamp
  */
 static void udp_sock_fill_data_v4(const struct ctx *c, int n,
 				  union epoll_ref ref,
-				  int *msg_idx, int *msg_bufs, ssize_t *msg_len,
-				  const struct timespec *now)
+				  int *msg_idx, int *msg_bufs, ssize_t *msg_len)
 {
 	struct msghdr *mh = &udp6_l2_mh_tap[*msg_idx].msg_hdr;
 	struct udp4_l2_buf_t *b = &udp4_l2_buf[n];
@@ -685,16 +695,15 @@ static void udp_sock_fill_data_v4(const struct ctx *c, int n,
 	} else if (IN4_IS_ADDR_LOOPBACK(&b->s_in.sin_addr) ||
 		   IN4_IS_ADDR_UNSPECIFIED(&b->s_in.sin_addr)||
 		   IN4_ARE_ADDR_EQUAL(&b->s_in.sin_addr, &c->ip4.addr_seen)) {
+		struct in_addr addr = { htonl(INADDR_LOOPBACK) };
+
 		b->iph.saddr = c->ip4.gw.s_addr;
-		udp_tap_map[V4][src_port].ts = now->tv_sec;
-		udp_tap_map[V4][src_port].flags |= PORT_LOCAL;
 
 		if (IN4_ARE_ADDR_EQUAL(&b->s_in.sin_addr.s_addr, &c->ip4.addr_seen))
-			udp_tap_map[V4][src_port].flags &= ~PORT_LOOPBACK;
-		else
-			udp_tap_map[V4][src_port].flags |= PORT_LOOPBACK;
+			addr = c->ip4.addr_seen;
 
-		bitmap_set(udp_act[V4][UDP_ACT_TAP], src_port);
+		udp_local_flow(AF_INET, &c->ip4.gw, &addr,
+			       ref.r.p.udp.udp.port, src_port);
 	} else {
 		b->iph.saddr = b->s_in.sin_addr.s_addr;
 	}
@@ -716,9 +725,9 @@ static void udp_sock_fill_data_v4(const struct ctx *c, int n,
 		 */
 		void *frame = (char *)b + offsetof(struct udp4_l2_buf_t, eh);
 
-		if (write(c->fd_tap, frame, sizeof(b->eh) + ip_len) < 0)
+		/* The tap expects a virtio-net header: let tap_send() add it */
+		if (tap_send(c, frame, sizeof(b->eh) + ip_len) < 0)
 			debug("tap write: %s", strerror(errno));
-		pcap(frame, sizeof(b->eh) + ip_len);
 
 		return;
 	}
@@ -747,12 +756,10 @@ static void udp_sock_fill_data_v4(const struct ctx *c, int n,
  * @ref:	epoll reference from socket
  * @msg_idx:	Index within message being prepared (spans multiple buffers)
  * @msg_len:	Length of current message being prepared for sending
- * @now:	Current timestamp
  */
 static void udp_sock_fill_data_v6(const struct ctx *c, int n,
 				  union epoll_ref ref,
-				  int *msg_idx, int *msg_bufs, ssize_t *msg_len,
-				  const struct timespec *now)
+				  int *msg_idx, int *msg_bufs, ssize_t *msg_len)
 {
 	struct msghdr *mh = &udp6_l2_mh_tap[*msg_idx].msg_hdr;
 	struct udp6_l2_buf_t *b = &udp6_l2_buf[n];
@@ -784,20 +791,8 @@ static void udp_sock_fill_data_v6(const struct ctx *c, int n,
 		else
 			b->ip6h.saddr = c->ip6.addr_ll;
 
-		udp_tap_map[V6][src_port].ts = now->tv_sec;
-		udp_tap_map[V6][src_port].flags |= PORT_LOCAL;
-
-		if (IN6_IS_ADDR_LOOPBACK(src))
-			udp_tap_map[V6][src_port].flags |= PORT_LOOPBACK;
-		else
-			udp_tap_map[V6][src_port].flags &= ~PORT_LOOPBACK;
-
-		if (IN6_ARE_ADDR_EQUAL(src, &c->ip6.addr))
-			udp_tap_map[V6][src_port].flags |= PORT_GUA;
-		else
-			udp_tap_map[V6][src_port].flags &= ~PORT_GUA;
-
-		bitmap_set(udp_act[V6][UDP_ACT_TAP], src_port);
+		udp_local_flow(AF_INET6, &b->ip6h.saddr, src,
+			       ref.r.p.udp.udp.port, src_port);
 	} else {
 		b->ip6h.daddr = c->ip6.addr_seen;
 		b->ip6h.saddr = b->s_in6.sin6_addr;
@@ -807,9 +802,17 @@ static void udp_sock_fill_data_v6(const struct ctx *c, int n,
 	b->uh.dest = htons(ref.r.p.udp.udp.port);
 	b->uh.len = b->ip6h.payload_len;
 
-	b->ip6h.hop_limit = IPPROTO_UDP;
-	b->ip6h.version = b->ip6h.nexthdr = b->uh.check = 0;
-	b->uh.check = csum(&b->ip6h, ip_len, 0);
+	if (c->csum_offload) {
+		struct in6_addr saddr = b->ip6h.saddr, daddr = b->ip6h.daddr;
+
+		b->uh.check = csum_ip6_pseudo(&saddr, &daddr,
+					      ntohs(b->uh.len), IPPROTO_UDP);
+	} else {
+		b->ip6h.hop_limit = IPPROTO_UDP;
+		b->ip6h.version = b->ip6h.nexthdr = b->uh.check = 0;
+		b->uh.check = csum(&b->ip6h, ip_len, 0);
+	}
+
 	b->ip6h.version = 6;
 	b->ip6h.nexthdr = IPPROTO_UDP;
 	b->ip6h.hop_limit = 255;
@@ -818,9 +821,9 @@ static void udp_sock_fill_data_v6(const struct ctx *c, int n,
 		/* See udp_sock_fill_data_v4() for the reason behind 'frame' */
 		void *frame = (char *)b + offsetof(struct udp6_l2_buf_t, eh);
 
-		if (write(c->fd_tap, frame, sizeof(b->eh) + ip_len) < 0)
+		/* With --csum-offload, uh.check is the pseudo-header sum only */
+		if (tap_send_csum(c, frame, sizeof(b->eh) + ip_len) < 0)
 			debug("tap write: %s", strerror(errno));
-		pcap(frame, sizeof(b->eh) + ip_len);
 
 		return;
 	}
@@ -843,67 +846,66 @@ static void udp_sock_fill_data_v6(const struct ctx *c, int n,
 }
 
 /**
- * udp_sock_handler() - Handle new data from socket
+ * udp_tap_stats() - Account for frames passed to sendmmsg() towards tap
+ * @mmh:	Message headers, each with frames starting with vnet_len
+ * @vlen:	Number of messages passed to sendmmsg()
+ * @sent:	Return value from sendmmsg()
+ */
+static void udp_tap_stats(const struct mmsghdr *mmh, unsigned int vlen,
+			  int sent)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < vlen; i++) {
+		const struct msghdr *mh = &mmh[i].msg_hdr;
+
+		if ((int)i >= sent) {
+			stats.tap_drop += mh->msg_iovlen;
+			continue;
+		}
+
+		for (j = 0; j < mh->msg_iovlen; j++) {
+			const struct iovec *iov = &mh->msg_iov[j];
+
+			stats_frame(STATS_TO_TAP,
+				    (char *)iov->iov_base + sizeof(uint32_t),
+				    iov->iov_len - sizeof(uint32_t));
+		}
+	}
+}
+
+/**
+ * udp_tap_send() - Send frames prepared by udp_sock_fill_data_v{4,6}() to tap
  * @c:		Execution context
- * @ref:	epoll reference
- * @events:	epoll events bitmap
- * @now:	Current timestamp
+ * @v6:		Set for IPv6 frames
+ * @n:		Number of frames
+ * @msg_i:	Index of last message (batch of frames) for qemu
+ * @msg_bufs:	Number of frames in last message
  *
- * #syscalls recvmmsg
  * #syscalls:passt sendmmsg sendmsg
  */
-void udp_sock_handler(const struct ctx *c, union epoll_ref ref, uint32_t events,
-		      const struct timespec *now)
+static void udp_tap_send(struct ctx *c, int v6, int n, int msg_i,
+			 int msg_bufs)
 {
-	ssize_t n, msg_len = 0, missing = 0;
-	int msg_bufs = 0, msg_i = 0, ret;
-	struct mmsghdr *tap_mmh;
+	struct mmsghdr *tap_mmh = v6 ? udp6_l2_mh_tap : udp4_l2_mh_tap;
+	ssize_t msg_len, missing = 0;
 	struct msghdr *last_mh;
 	unsigned int i;
+	int ret;
 
-	if (events == EPOLLERR)
+	if (c->mode == MODE_PASTA)
 		return;
 
-	if (ref.r.p.udp.udp.splice) {
-		udp_sock_handler_splice(c, ref, events, now);
+	if (c->vhost_user) {
+		tap_send_frames(c, v6 ? udp6_l2_iov_tap : udp4_l2_iov_tap, n);
 		return;
 	}
 
-	if (ref.r.p.udp.udp.v6) {
-		n = recvmmsg(ref.r.s, udp6_l2_mh_sock, UDP_TAP_FRAMES, 0, NULL);
-		if (n <= 0)
-			return;
-
-		udp6_l2_mh_tap[0].msg_hdr.msg_iov = &udp6_l2_iov_tap[0];
-
-		for (i = 0; i < (unsigned)n; i++) {
-			udp_sock_fill_data_v6(c, i, ref,
-					      &msg_i, &msg_bufs, &msg_len, now);
-		}
-
-		udp6_l2_mh_tap[msg_i].msg_hdr.msg_iovlen = msg_bufs;
-		tap_mmh = udp6_l2_mh_tap;
-	} else {
-		n = recvmmsg(ref.r.s, udp4_l2_mh_sock, UDP_TAP_FRAMES, 0, NULL);
-		if (n <= 0)
-			return;
-
-		udp6_l2_mh_tap[0].msg_hdr.msg_iov = &udp6_l2_iov_tap[0];
-
-		for (i = 0; i < (unsigned)n; i++) {
-			udp_sock_fill_data_v4(c, i, ref,
-					      &msg_i, &msg_bufs, &msg_len, now);
-		}
-
-		udp4_l2_mh_tap[msg_i].msg_hdr.msg_iovlen = msg_bufs;
-		tap_mmh = udp4_l2_mh_tap;
-	}
-
-	if (c->mode == MODE_PASTA)
-		return;
+	tap_mmh[msg_i].msg_hdr.msg_iovlen = msg_bufs;
 
 	ret = sendmmsg(c->fd_tap, tap_mmh, msg_i + 1,
 		       MSG_NOSIGNAL | MSG_DONTWAIT);
+	udp_tap_stats(tap_mmh, msg_i + 1, ret);
 	if (ret <= 0)
 		return;
 
@@ -943,6 +945,7 @@ void udp_sock_handler(const struct ctx *c, union epoll_ref ref, uint32_t events,
 
 			last_mh->msg_iov = &last_mh->msg_iov[i];
 
+			stats.tap_partial++;
 			if (sendmsg(c->fd_tap, last_mh, MSG_NOSIGNAL) < 0)
 				debug("UDP: %li bytes to tap missing", missing);
 
@@ -954,6 +957,410 @@ void udp_sock_handler(const struct ctx *c, union epoll_ref ref, uint32_t events,
 	pcapmm(tap_mmh, ret);
 }
 
+/**
+ * udp_gro_size() - Get segment size for datagram received with UDP_GRO
+ * @mh:		Message header from recvmmsg(), with control messages
+ * @len:	Length of (super-)datagram
+ *
+ * Return: segment size, @len if the datagram wasn't coalesced
+ */
+static size_t udp_gro_size(struct msghdr *mh, size_t len)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+		int gso;
+
+		if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+			continue;
+
+		memcpy(&gso, CMSG_DATA(cmsg), sizeof(gso));
+		if (gso > 0 && (size_t)gso < len)
+			return gso;
+	}
+
+	return len;
+}
+
+/**
+ * udp_sock_handler_gro() - Receive (super-)datagrams, split them into frames
+ * @c:		Execution context
+ * @ref:	epoll reference
+ *
+ * With UDP_GRO, the kernel might coalesce a run of datagrams from the same
+ * peer into a single super-datagram, where all the segments are as long as
+ * the first one, except for the last one, which might be shorter. Copy each
+ * segment into a frame buffer, and send frames to the tap as buffers fill up.
+ *
+ * #syscalls recvmmsg
+ */
+static void udp_sock_handler_gro(struct ctx *c, union epoll_ref ref)
+{
+	int v6 = ref.r.p.udp.udp.v6, msg_bufs = 0, msg_i = 0, n, i, k = 0;
+	struct mmsghdr *tap_mmh = v6 ? udp6_l2_mh_tap : udp4_l2_mh_tap;
+	struct iovec *tap_iov = v6 ? udp6_l2_iov_tap : udp4_l2_iov_tap;
+	ssize_t msg_len = 0;
+
+	for (i = 0; i < UDP_GRO_FRAMES; i++)
+		udp_gro_mh[i].msg_hdr.msg_controllen = sizeof(udp_gro_cmsg[i]);
+
+	n = recvmmsg(ref.r.s, udp_gro_mh, UDP_GRO_FRAMES, 0, NULL);
+	if (n <= 0)
+		return;
+
+	/* udp_tap_send() moves msg_iov of a partially sent message forward */
+	tap_mmh[0].msg_hdr.msg_iov = &tap_iov[0];
+
+	for (i = 0; i < n; i++) {
+		struct msghdr *mh = &udp_gro_mh[i].msg_hdr;
+		size_t len = udp_gro_mh[i].msg_len, off = 0, seg, l;
+
+		seg = udp_gro_size(mh, len);
+
+		do {
+			l = MIN(seg, len - off);
+
+			if (v6) {
+				struct udp6_l2_buf_t *b = &udp6_l2_buf[k];
+
+				memcpy(&b->s_in6, mh->msg_name, sizeof(b->s_in6));
+				memcpy(b->data, udp_gro_buf[i] + off, l);
+				udp6_l2_mh_sock[k].msg_len = l;
+
+				udp_sock_fill_data_v6(c, k, ref,
+						      &msg_i, &msg_bufs, &msg_len);
+			} else {
+				struct udp4_l2_buf_t *b = &udp4_l2_buf[k];
+
+				memcpy(&b->s_in, mh->msg_name, sizeof(b->s_in));
+				memcpy(b->data, udp_gro_buf[i] + off, l);
+				udp4_l2_mh_sock[k].msg_len = l;
+
+				udp_sock_fill_data_v4(c, k, ref,
+						      &msg_i, &msg_bufs, &msg_len);
+			}
+
+			if (++k == UDP_TAP_FRAMES) {
+				udp_tap_send(c, v6, k, msg_i, msg_bufs);
+				k = msg_i = msg_bufs = 0;
+				msg_len = 0;
+				tap_mmh[0].msg_hdr.msg_iov = &tap_iov[0];
+			}
+		} while ((off += l) < len);
+	}
+
+	if (k)
+		udp_tap_send(c, v6, k, msg_i, msg_bufs);
+}
+
+/**
+ * udp_sock_handler() - Handle new data from socket
+ * @c:		Execution context
+ * @ref:	epoll reference
+ * @events:	epoll events bitmap
+ * @now:	Current timestamp
+ *
+ * #syscalls recvmmsg
+ */
+void udp_sock_handler(struct ctx *c, union epoll_ref ref, uint32_t events,
+		      const struct timespec *now)
+{
+	int msg_bufs = 0, msg_i = 0;
+	ssize_t n, msg_len = 0;
+	unsigned int i;
+
+	(void)now;
+
+	if (events == EPOLLERR)
+		return;
+
+	if (ref.r.p.udp.udp.splice) {
+		udp_sock_handler_splice(c, ref, events);
+		return;
+	}
+
+	if (c->udp.gro) {
+		udp_sock_handler_gro(c, ref);
+		return;
+	}
+
+	if (ref.r.p.udp.udp.v6) {
+		n = recvmmsg(ref.r.s, udp6_l2_mh_sock, UDP_TAP_FRAMES, 0, NULL);
+		if (n <= 0)
+			return;
+
+		udp6_l2_mh_tap[0].msg_hdr.msg_iov = &udp6_l2_iov_tap[0];
+
+		for (i = 0; i < (unsigned)n; i++) {
+			udp_sock_fill_data_v6(c, i, ref,
+					      &msg_i, &msg_bufs, &msg_len);
+		}
+	} else {
+		n = recvmmsg(ref.r.s, udp4_l2_mh_sock, UDP_TAP_FRAMES, 0, NULL);
+		if (n <= 0)
+			return;
+
+		udp4_l2_mh_tap[0].msg_hdr.msg_iov = &udp4_l2_iov_tap[0];
+
+		for (i = 0; i < (unsigned)n; i++) {
+			udp_sock_fill_data_v4(c, i, ref,
+					      &msg_i, &msg_bufs, &msg_len);
+		}
+	}
+
+	udp_tap_send(c, ref.r.p.udp.udp.v6, n, msg_i, msg_bufs);
+}
+
+/**
+ * udp_sock_gro() - Enable UDP_GRO on tap-facing socket, failure is harmless
+ * @s:		Socket, ignored if negative
+ */
+static void udp_sock_gro(int s)
+{
+	int y = 1;
+
+	if (s >= 0)
+		setsockopt(s, SOL_UDP, UDP_GRO, &y, sizeof(y));
+}
+
+/**
+ * udp_tap_sock() - Get socket bound to guest source port, create it if needed
+ * @c:		Execution context
+ * @af:		Address family, AF_INET or AF_INET6
+ * @bind_addr:	Address to bind a new socket to, NULL for any
+ * @port:	Guest source port, host order
+ *
+ * Return: socket, negative error code on failure
+ */
+static int udp_tap_sock(const struct ctx *c, int af, const void *bind_addr,
+			in_port_t port)
+{
+	union udp_epoll_ref uref = { .udp.bound = 1, .udp.v6 = af == AF_INET6,
+				     .udp.port = port };
+	struct flow_key k;
+	struct flow *f;
+	int s;
+
+	flow_key_set(&k, FLOW_UDP_BIND, af, NULL, port, 0);
+
+	/* Sockets for configured ports are not owned by the flow: no timeout */
+	if ((f = flow_lookup(&k)) && f->sock < 0)
+		return f->u.bound_sock;
+
+	if (!f) {
+		s = sock_l4(c, af, IPPROTO_UDP, bind_addr, NULL, port,
+			    uref.u32);
+		if (s < 0)
+			return s;
+
+		udp_sock_gro(s);
+
+		if (!(f = flow_add(&k))) {
+			close(s);
+			return -ENOMEM;
+		}
+
+		f->sock = s;
+	}
+
+	flow_touch(f, UDP_CONN_TIMEOUT * 1000);
+
+	return f->sock;
+}
+
+/**
+ * udp_tap_conn_sock() - Count datagrams for flow, connect a socket if busy
+ * @c:		Execution context
+ * @af:		Address family, AF_INET or AF_INET6
+ * @faddr:	Destination address as seen by the guest
+ * @sa:		Actual destination, socket address
+ * @sl:		Length of @sa
+ * @bind_addr:	Address to bind a new socket to, NULL for any
+ * @src:	Guest source port, host order
+ * @dst:	Destination port, host order
+ * @n:		Number of datagrams from guest
+ *
+ * Return: connected socket for flow, -1 if there's none (yet)
+ */
+static int udp_tap_conn_sock(const struct ctx *c, int af, const void *faddr,
+			     const struct sockaddr *sa, socklen_t sl,
+			     const void *bind_addr, in_port_t src, in_port_t dst,
+			     unsigned int n)
+{
+	union udp_epoll_ref uref = { .udp.bound = 1, .udp.v6 = af == AF_INET6,
+				     .udp.port = src };
+	struct flow_key k;
+	struct flow *f;
+	int s;
+
+	flow_key_set(&k, FLOW_UDP_CONN, af, faddr, src, dst);
+	if (!(f = flow_lookup(&k))) {
+		if (!(f = flow_add(&k)))
+			return -1;
+
+		/* Not renewed until connected: count restarts on expiry */
+		flow_touch(f, UDP_CONN_BUSY_WINDOW);
+	}
+
+	if (f->sock >= 0) {
+		flow_touch(f, UDP_CONN_IDLE * 1000);
+		return f->sock;
+	}
+
+	if ((f->u.pkts += n) < UDP_CONN_BUSY_PKTS)
+		return -1;
+
+	f->u.pkts = 0;
+
+	s = sock_l4(c, af, IPPROTO_UDP, bind_addr, NULL, src, uref.u32);
+	if (s < 0)
+		return -1;
+
+	udp_sock_gro(s);
+
+	if (connect(s, sa, sl)) {
+		debug("UDP: can't connect socket for port %u: %s", src,
+		      strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	debug("UDP: connected socket %i for busy flow from port %u", s, src);
+
+	f->sock = s;
+	flow_touch(f, UDP_CONN_IDLE * 1000);
+
+	return s;
+}
+
+/**
+ * udp_gso_msg() - Prepare message for datagrams from tap, segmented if possible
+ * @c:		Execution context
+ * @mh:		Message header to fill, except for address
+ * @ctl:	Buffer for UDP_SEGMENT control message
+ * @m:		Payloads of remaining datagrams
+ * @n:		Count of remaining datagrams
+ *
+ * A run of datagrams of the same length, optionally terminated by a shorter
+ * one, can be sent as a single message with UDP_SEGMENT, and the kernel (or
+ * the device) splits it back into datagrams.
+ *
+ * Return: count of datagrams in message
+ */
+static int udp_gso_msg(const struct ctx *c, struct msghdr *mh, void *ctl,
+		       struct iovec *m, int n)
+{
+	size_t seg = m[0].iov_len, len = seg;
+	struct cmsghdr *cmsg;
+	int i = 1;
+
+	mh->msg_iov = m;
+	mh->msg_control = NULL;
+	mh->msg_controllen = 0;
+	mh->msg_flags = 0;
+
+	if (c->udp.gso && seg && seg <= udp_gso_seg_max) {
+		for (; i < n && i < UDP_GSO_MAX_SEGS; i++) {
+			if (!m[i].iov_len || m[i].iov_len > seg ||
+			    len + m[i].iov_len > UDP_GSO_MAX_LEN)
+				break;
+
+			len += m[i].iov_len;
+			if (m[i].iov_len < seg) {
+				i++;
+				break;
+			}
+		}
+	}
+
+	mh->msg_iovlen = i;
+	if (i == 1)
+		return 1;
+
+	mh->msg_control = ctl;
+	mh->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+	cmsg = CMSG_FIRSTHDR(mh);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	memcpy(CMSG_DATA(cmsg), &(uint16_t){ seg }, sizeof(uint16_t));
+
+	return i;
+}
+
+/**
+ * udp_tap_sendmmsg() - Send datagrams from tap, runs of them with UDP_SEGMENT
+ * @c:		Execution context
+ * @s:		Socket to send datagrams from
+ * @sa:		Destination address, NULL for connected socket
+ * @sl:		Length of @sa
+ * @m:		Datagram payloads
+ * @n:		Count of datagrams
+ *
+ * Return: count of consumed datagrams
+ *
+ * #syscalls sendmmsg sendmsg
+ */
+static int udp_tap_sendmmsg(struct ctx *c, int s, struct sockaddr *sa,
+			    socklen_t sl, struct iovec *m, int n)
+{
+	struct mmsghdr mm[UIO_MAXIOV];
+	int i, count, sent = 0;
+
+	for (i = 0, count = 0; i < n; count++) {
+		mm[count].msg_hdr.msg_name = sa;
+		mm[count].msg_hdr.msg_namelen = sl;
+
+		i += udp_gso_msg(c, &mm[count].msg_hdr, udp_gso_cmsg[count],
+				 m + i, n - i);
+	}
+
+	while (sent < count) {
+		struct msghdr *mh = &mm[sent].msg_hdr;
+		size_t seg = mh->msg_iov[0].iov_len;
+		int ret;
+
+		ret = sendmmsg(s, mm + sent, count - sent, MSG_NOSIGNAL);
+		if (ret > 0) {
+			sent += ret;
+			continue;
+		}
+
+		if (!mh->msg_control || (errno != EINVAL && errno != EIO))
+			break;
+
+		/* Segment too big for route (EINVAL), or no checksum offload
+		 * (EIO): send datagrams one by one, and stop trying that.
+		 */
+		if (errno == EIO) {
+			debug("UDP: segmentation offload unusable, disabling");
+			c->udp.gso = 0;
+		} else {
+			debug("UDP: segment size %lu rejected", seg);
+			udp_gso_seg_max = seg - 1;
+		}
+
+		for (i = 0; i < (int)mh->msg_iovlen; i++) {
+			struct msghdr one = { .msg_name = sa, .msg_namelen = sl,
+					      .msg_iov = &mh->msg_iov[i],
+					      .msg_iovlen = 1 };
+
+			sendmsg(s, &one, MSG_NOSIGNAL);
+		}
+
+		sent++;
+	}
+
+	if (!sent)
+		return 1;
+
+	if (sent < count)
+		return mm[sent].msg_hdr.msg_iov - m;
+
+	return n;
+}
+
 /**
  * udp_tap_handler() - Handle packets from tap
  * @c:		Execution context
@@ -963,23 +1370,23 @@ void udp_sock_handler(const struct ctx *c, union epoll_ref ref, uint32_t events,
  * @now:	Current timestamp
  *
  * Return: count of consumed packets
- *
- * #syscalls sendmmsg
  */
 int udp_tap_handler(struct ctx *c, int af, const void *addr,
 		    const struct pool *p, const struct timespec *now)
 {
-	struct mmsghdr mm[UIO_MAXIOV];
 	struct iovec m[UIO_MAXIOV];
 	struct sockaddr_in6 s_in6;
 	struct sockaddr_in s_in;
+	const void *bind_addr = NULL;
 	struct sockaddr *sa;
-	int i, s, count = 0;
+	int i, s, cs;
 	in_port_t src, dst;
+	struct flow_key k;
 	struct udphdr *uh;
+	struct flow *f;
 	socklen_t sl;
 
-	(void)c;
+	(void)now;
 
 	uh = packet_get(p, 0, 0, sizeof(*uh), NULL);
 	if (!uh)
@@ -1001,27 +1408,18 @@ int udp_tap_handler(struct ctx *c, int af, const void *addr,
 		sa = (struct sockaddr *)&s_in;
 		sl = sizeof(s_in);
 
-		if (!(s = udp_tap_map[V4][src].sock)) {
-			union udp_epoll_ref uref = { .udp.bound = 1,
-						     .udp.port = src };
-
-			s = sock_l4(c, AF_INET, IPPROTO_UDP, NULL, NULL, src,
-				    uref.u32);
-			if (s < 0)
-				return p->count;
-
-			udp_tap_map[V4][src].sock = s;
-			bitmap_set(udp_act[V4][UDP_ACT_TAP], src);
-		}
-
-		udp_tap_map[V4][src].ts = now->tv_sec;
+		if ((s = udp_tap_sock(c, AF_INET, NULL, src)) < 0)
+			return p->count;
 
 		if (IN4_ARE_ADDR_EQUAL(&s_in.sin_addr, &c->ip4.gw) && !c->no_map_gw) {
-			if (!(udp_tap_map[V4][dst].flags & PORT_LOCAL) ||
-			    (udp_tap_map[V4][dst].flags & PORT_LOOPBACK))
+			flow_key_set(&k, FLOW_UDP, AF_INET, addr, src, dst);
+			if ((f = flow_lookup(&k))) {
+				memcpy(&s_in.sin_addr, &f->u.addr.s6_addr[12],
+				       sizeof(s_in.sin_addr));
+				flow_touch(f, UDP_CONN_TIMEOUT * 1000);
+			} else {
 				s_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-			else
-				s_in.sin_addr = c->ip4.addr_seen;
+			}
 		} else if (IN4_ARE_ADDR_EQUAL(&s_in.sin_addr, &c->ip4.dns_fwd) &&
 			   ntohs(s_in.sin_port) == 53) {
 			s_in.sin_addr = c->ip4.dns[0];
@@ -1032,19 +1430,19 @@ int udp_tap_handler(struct ctx *c, int af, const void *addr,
 			.sin6_port = uh->dest,
 			.sin6_addr = *(struct in6_addr *)addr,
 		};
-		const void *bind_addr = &in6addr_any;
 
+		bind_addr = &in6addr_any;
 		sa = (struct sockaddr *)&s_in6;
 		sl = sizeof(s_in6);
 
 		if (IN6_ARE_ADDR_EQUAL(addr, &c->ip6.gw) && !c->no_map_gw) {
-			if (!(udp_tap_map[V6][dst].flags & PORT_LOCAL) ||
-			    (udp_tap_map[V6][dst].flags & PORT_LOOPBACK))
+			flow_key_set(&k, FLOW_UDP, AF_INET6, addr, src, dst);
+			if ((f = flow_lookup(&k))) {
+				s_in6.sin6_addr = f->u.addr;
+				flow_touch(f, UDP_CONN_TIMEOUT * 1000);
+			} else {
 				s_in6.sin6_addr = in6addr_loopback;
-			else if (udp_tap_map[V6][dst].flags & PORT_GUA)
-				s_in6.sin6_addr = c->ip6.addr;
-			else
-				s_in6.sin6_addr = c->ip6.addr_seen;
+			}
 		} else if (IN6_ARE_ADDR_EQUAL(addr, &c->ip6.dns_fwd) &&
 			   ntohs(s_in6.sin6_port) == 53) {
 			s_in6.sin6_addr = c->ip6.dns[0];
@@ -1052,21 +1450,16 @@ int udp_tap_handler(struct ctx *c, int af, const void *addr,
 			bind_addr = &c->ip6.addr_ll;
 		}
 
-		if (!(s = udp_tap_map[V6][src].sock)) {
-			union udp_epoll_ref uref = { .udp.bound = 1,
-						     .udp.v6 = 1,
-						     .udp.port = src };
-
-			s = sock_l4(c, AF_INET6, IPPROTO_UDP, bind_addr, NULL,
-				    src, uref.u32);
-			if (s < 0)
-				return p->count;
-
-			udp_tap_map[V6][src].sock = s;
-			bitmap_set(udp_act[V6][UDP_ACT_TAP], src);
-		}
+		if ((s = udp_tap_sock(c, AF_INET6, bind_addr, src)) < 0)
+			return p->count;
+	}
 
-		udp_tap_map[V6][src].ts = now->tv_sec;
+	cs = udp_tap_conn_sock(c, af, addr, sa, sl, bind_addr, src, dst,
+			       p->count);
+	if (cs >= 0) {
+		s = cs;
+		sa = NULL;
+		sl = 0;
 	}
 
 	for (i = 0; i < (int)p->count; i++) {
@@ -1077,32 +1470,32 @@ int udp_tap_handler(struct ctx *c, int af, const void *addr,
 		if (!uh_send)
 			return p->count;
 
-		mm[i].msg_hdr.msg_name = sa;
-		mm[i].msg_hdr.msg_namelen = sl;
-
-		if (len) {
-			m[i].iov_base = (char *)(uh_send + 1);
-			m[i].iov_len = len;
+		m[i].iov_base = (char *)(uh_send + 1);
+		m[i].iov_len = len;
+	}
 
-			mm[i].msg_hdr.msg_iov = m + i;
-			mm[i].msg_hdr.msg_iovlen = 1;
-		} else {
-			mm[i].msg_hdr.msg_iov = NULL;
-			mm[i].msg_hdr.msg_iovlen = 0;
-		}
+	return udp_tap_sendmmsg(c, s, sa, sl, m, p->count);
+}
 
-		mm[i].msg_hdr.msg_control = NULL;
-		mm[i].msg_hdr.msg_controllen = 0;
-		mm[i].msg_hdr.msg_flags = 0;
+/**
+ * udp_bind_flow() - Use socket for configured port for replies from guest, too
+ * @af:		Address family, AF_INET or AF_INET6
+ * @port:	Guest-facing port, host order
+ * @s:		Socket bound to port, ignored if negative
+ */
+static void udp_bind_flow(int af, in_port_t port, int s)
+{
+	struct flow_key k;
+	struct flow *f;
 
-		count++;
-	}
+	if (s < 0)
+		return;
 
-	count = sendmmsg(s, mm, count, MSG_NOSIGNAL);
-	if (count < 0)
-		return 1;
+	flow_key_set(&k, FLOW_UDP_BIND, af, NULL, port, 0);
+	if (!(f = flow_lookup(&k)) && !(f = flow_add(&k)))
+		return;
 
-	return count;
+	f->u.bound_sock = s;
 }
 
 /**
@@ -1142,7 +1535,8 @@ void udp_sock_init(const struct ctx *c, int ns, sa_family_t af,
 			s = sock_l4(c, AF_INET, IPPROTO_UDP, bind_addr, ifname,
 				    port, uref.u32);
 
-			udp_tap_map[V4][uref.udp.port].sock = s;
+			udp_sock_gro(s);
+			udp_bind_flow(AF_INET, uref.udp.port, s);
 		}
 
 		if (c->mode == MODE_PASTA) {
@@ -1175,7 +1569,8 @@ void udp_sock_init(const struct ctx *c, int ns, sa_family_t af,
 			s = sock_l4(c, AF_INET6, IPPROTO_UDP, bind_addr, ifname,
 				    port, uref.u32);
 
-			udp_tap_map[V6][uref.udp.port].sock = s;
+			udp_sock_gro(s);
+			udp_bind_flow(AF_INET6, uref.udp.port, s);
 		}
 
 		if (c->mode == MODE_PASTA) {
@@ -1268,108 +1663,82 @@ static void udp_splice_iov_init(void)
 }
 
 /**
- * udp_init() - Initialise per-socket data, and sockets in namespace
- * @c:		Execution context
- *
- * Return: 0
+ * udp_gro_iov_init() - Set up buffers and descriptors for recvmmsg() with GRO
  */
-int udp_init(struct ctx *c)
+static void udp_gro_iov_init(void)
 {
-	if (c->ifi4)
-		udp_sock4_iov_init();
+	int i;
 
-	if (c->ifi6)
-		udp_sock6_iov_init();
+	for (i = 0; i < UDP_GRO_FRAMES; i++) {
+		struct msghdr *mh = &udp_gro_mh[i].msg_hdr;
 
-	udp_invert_portmap(&c->udp.fwd_in);
-	udp_invert_portmap(&c->udp.fwd_out);
+		udp_gro_iov[i].iov_base = udp_gro_buf[i];
+		udp_gro_iov[i].iov_len = sizeof(udp_gro_buf[i]);
 
-	if (c->mode == MODE_PASTA) {
-		udp_splice_iov_init();
-		NS_CALL(udp_sock_init_ns, c);
+		mh->msg_name = &udp_gro_name[i];
+		mh->msg_namelen = sizeof(udp_gro_name[i]);
+		mh->msg_iov = &udp_gro_iov[i];
+		mh->msg_iovlen = 1;
+		mh->msg_control = udp_gro_cmsg[i];
+		mh->msg_controllen = sizeof(udp_gro_cmsg[i]);
 	}
-
-	return 0;
 }
 
 /**
- * udp_timer_one() - Handler for timed events on one port
- * @c:		Execution context
- * @v6:		Set for IPv6 connections
- * @type:	Socket type
- * @port:	Port number, host order
- * @ts:		Timestamp from caller
+ * udp_probe_offload() - Check if UDP socket option for offloads is supported
+ * @af:		Address family, IPv4 or IPv6
+ * @opt:	Socket option, UDP_SEGMENT or UDP_GRO
+ *
+ * Return: 1 if supported, 0 otherwise
  */
-static void udp_timer_one(struct ctx *c, int v6, enum udp_act_type type,
-			  in_port_t port, const struct timespec *ts)
+static int udp_probe_offload(sa_family_t af, int opt)
 {
-	struct udp_splice_port *sp;
-	struct udp_tap_port *tp;
-	int s = -1;
-
-	switch (type) {
-	case UDP_ACT_TAP:
-		tp = &udp_tap_map[v6 ? V6 : V4][port];
-
-		if (ts->tv_sec - tp->ts > UDP_CONN_TIMEOUT) {
-			s = tp->sock;
-			tp->flags = 0;
-		}
+	int s, v = opt == UDP_GRO, ret = 0;
 
-		break;
-	case UDP_ACT_INIT_CONN:
-		sp = &udp_splice_map[v6 ? V6 : V4][port];
-
-		if (ts->tv_sec - sp->init_conn_ts > UDP_CONN_TIMEOUT)
-			s = sp->init_conn_sock;
-
-		break;
-	case UDP_ACT_NS_CONN:
-		sp = &udp_splice_map[v6 ? V6 : V4][port];
-
-		if (ts->tv_sec - sp->ns_conn_ts > UDP_CONN_TIMEOUT)
-			s = sp->ns_conn_sock;
-
-		break;
-	default:
-		return;
+	s = socket(af, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (s < 0) {
+		debug("UDP: can't create socket to probe offloads: %s",
+		      strerror(errno));
+		return 0;
 	}
 
-	if (s > 0) {
-		epoll_ctl(c->epollfd, EPOLL_CTL_DEL, s, NULL);
-		close(s);
-		bitmap_clear(udp_act[v6 ? V6 : V4][type], port);
-	}
+	if (!setsockopt(s, SOL_UDP, opt, &v, sizeof(v)))
+		ret = 1;
+
+	close(s);
+	return ret;
 }
 
 /**
- * udp_timer() - Scan activity bitmaps for ports with associated timed events
+ * udp_init() - Initialise per-socket data, and sockets in namespace
  * @c:		Execution context
- * @ts:		Timestamp from caller
+ *
+ * Return: 0
  */
-void udp_timer(struct ctx *c, const struct timespec *ts)
+int udp_init(struct ctx *c)
 {
-	int n, t, v6 = 0;
-	unsigned int i;
-	long *word, tmp;
-
-	if (!c->ifi4)
-		v6 = 1;
-v6:
-	for (t = 0; t < UDP_ACT_TYPE_MAX; t++) {
-		word = (long *)udp_act[v6 ? V6 : V4][t];
-		for (i = 0; i < ARRAY_SIZE(udp_act[0][0]);
-		     i += sizeof(long), word++) {
-			tmp = *word;
-			while ((n = ffsl(tmp))) {
-				tmp &= ~(1UL << (n - 1));
-				udp_timer_one(c, v6, t, i * 8 + n - 1, ts);
-			}
-		}
-	}
+	if (c->ifi4)
+		udp_sock4_iov_init();
 
-	if (!v6 && c->ifi6) {
-		v6 = 1;
-		goto v6;
+	if (c->ifi6)
+		udp_sock6_iov_init();
+
+	udp_invert_portmap(&c->udp.fwd_in);
+	udp_invert_portmap(&c->udp.fwd_out);
+
+	c->udp.gso = udp_probe_offload(c->ifi4 ? AF_INET : AF_INET6,
+				       UDP_SEGMENT);
+	c->udp.gro = udp_probe_offload(c->ifi4 ? AF_INET : AF_INET6, UDP_GRO);
+	debug("UDP: UDP_SEGMENT %ssupported, UDP_GRO %ssupported",
+	      c->udp.gso ? "" : "not ", c->udp.gro ? "" : "not ");
+
+	if (c->udp.gro)
+		udp_gro_iov_init();
+
+	if (c->mode == MODE_PASTA) {
+		udp_splice_iov_init();
+		NS_CALL(udp_sock_init_ns, c);
 	}
+
+	return 0;
 }
@@ -6,16 +6,13 @@
 #ifndef UDP_H
 #define UDP_H
 
-#define UDP_TIMER_INTERVAL		1000 /* ms */
-
-void udp_sock_handler(const struct ctx *c, union epoll_ref ref, uint32_t events,
+void udp_sock_handler(struct ctx *c, union epoll_ref ref, uint32_t events,
 		      const struct timespec *now);
 int udp_tap_handler(struct ctx *c, int af, const void *addr,
 		    const struct pool *p, const struct timespec *now);
 void udp_sock_init(const struct ctx *c, int ns, sa_family_t af,
 		   const void *addr, const char *ifname, in_port_t port);
 int udp_init(struct ctx *c);
-void udp_timer(struct ctx *c, const struct timespec *ts);
 void udp_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
 		       const struct in_addr *ip_da);
 
@@ -24,7 +21,8 @@ void udp_update_l2_buf(const unsigned char *eth_d, const unsigned char *eth_s,
  * @bound:		Set if this file descriptor is a bound socket
  * @splice:		Set if descriptor is associated to "spliced" connection
  * @v6:			Set for IPv6 sockets or connections
- * @port:		Source port for connected sockets, bound port otherwise
+ * @port:		Original source port for connected "spliced" sockets,
+ *			bound port otherwise
  * @u32:		Opaque u32 value of reference
  */
 union udp_epoll_ref {
@@ -57,12 +55,14 @@ struct udp_port_fwd {
  * struct udp_ctx - Execution context for UDP
  * @fwd_in:		Port forwarding configuration for inbound packets
  * @fwd_out:		Port forwarding configuration for outbound packets
- * @timer_run:		Timestamp of most recent timer run
+ * @gso:		Send runs of datagrams from tap with UDP_SEGMENT
+ * @gro:		Receive super-datagrams with UDP_GRO, split them for tap
  */
 struct udp_ctx {
 	struct udp_port_fwd fwd_in;
 	struct udp_port_fwd fwd_out;
-	struct timespec timer_run;
+	int gso;
+	int gro;
 };
 
 #endif /* UDP_H */
@@ -18,22 +18,34 @@
 #include <arpa/inet.h>
 #include <net/ethernet.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <netinet/tcp.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#ifdef HAS_GETRANDOM
+#include <sys/random.h>
+#endif
 
 #include "util.h"
 #include "passt.h"
 #include "packet.h"
 #include "lineread.h"
 #include "log.h"
+#include "ns_helper.h"
 
 #define IPV6_NH_OPT(nh)							\
 	((nh) == 0   || (nh) == 43  || (nh) == 44  || (nh) == 50  ||	\
 	 (nh) == 51  || (nh) == 60  || (nh) == 135 || (nh) == 139 ||	\
 	 (nh) == 140 || (nh) == 253 || (nh) == 254)
 
+/* Receive buffer for sock_diag dumps, the kernel fills up to 32 KiB at a time */
+#define DIAG_BUF_SIZE		(64 * 1024)
+
 /**
  * ipv6_l4hdr() - Find pointer to L4 header in IPv6 packet and extract protocol
  * @p:		Packet pool, packet number @index has IPv6 header at @offset
@@ -256,6 +268,19 @@ int timespec_diff_ms(const struct timespec *a, const struct timespec *b)
 	       (a->tv_sec - b->tv_sec) * 1000;
 }
 
+/**
+ * timespec_diff_us() - Report difference in microseconds between two timestamps
+ * @a:		Minuend timestamp
+ * @b:		Subtrahend timestamp
+ *
+ * Return: difference in microseconds
+ */
+long timespec_diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000L +
+	       (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
 /**
  * bitmap_set() - Set single bit in bitmap
  * @map:	Pointer to bitmap
@@ -294,6 +319,84 @@ int bitmap_isset(const uint8_t *map, int bit)
 	return !!(*word & BITMAP_BIT(bit));
 }
 
+/**
+ * diag_scan_listen() - Set bits for listening TCP or UDP sockets via sock_diag
+ * @c:		Execution context
+ * @proto:	IPPROTO_TCP or IPPROTO_UDP
+ * @ip_version:	IP version, V4 or V6
+ * @ns:		Use saved socket for namespace if set
+ * @map:	Bitmap where numbers of ports in listening state will be set
+ * @exclude:	Bitmap of ports to exclude from setting (and clear)
+ *
+ * Dump sockets from NETLINK_SOCK_DIAG, with the kernel filtering them on state:
+ * for TCP, only the table of listening sockets is walked, and no text needs to
+ * be formatted or parsed, unlike with /proc/net/tcp{,6} and /proc/net/udp{,6}.
+ *
+ * Return: 0 on success, negative error code if the dump failed
+ */
+int diag_scan_listen(struct ctx *c, uint8_t proto, int ip_version, int ns,
+		     uint8_t *map, uint8_t *exclude)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 r;
+	} req = {
+		.nlh.nlmsg_len		= sizeof(req),
+		.nlh.nlmsg_type		= SOCK_DIAG_BY_FAMILY,
+		.nlh.nlmsg_flags	= NLM_F_REQUEST | NLM_F_DUMP,
+		.r.sdiag_family		= ip_version == V4 ? AF_INET : AF_INET6,
+		.r.sdiag_protocol	= proto,
+		.r.idiag_states		= proto == IPPROTO_TCP ?
+					  1 << TCP_LISTEN : 1 << TCP_CLOSE,
+	};
+	static char buf[DIAG_BUF_SIZE];
+	int *s = &c->sock_diag[ns], ret;
+	ssize_t n;
+
+	if (*s == -1 &&
+	    (*s = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+			 NETLINK_SOCK_DIAG)) < 0)
+		return -errno;
+
+	if (send(*s, &req, sizeof(req), 0) < 0)
+		goto fail;
+
+	while ((n = recv(*s, buf, sizeof(buf), 0)) > 0) {
+		const struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+		size_t nm = n;
+
+		for ( ; NLMSG_OK(nh, nm); nh = NLMSG_NEXT(nh, nm)) {
+			const struct inet_diag_msg *msg = NLMSG_DATA(nh);
+			in_port_t port;
+
+			if (nh->nlmsg_type == NLMSG_DONE)
+				return 0;
+
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *e = NLMSG_DATA(nh);
+
+				errno = e->error ? -e->error : EIO;
+				goto fail;
+			}
+
+			port = ntohs(msg->id.idiag_sport);
+			if (bitmap_isset(exclude, port))
+				bitmap_clear(map, port);
+			else
+				bitmap_set(map, port);
+		}
+	}
+
+	if (!n)
+		errno = EIO;
+fail:
+	/* Don't leave a partial dump behind for the next call to find */
+	ret = -errno;
+	close(*s);
+	*s = -1;
+	return ret;
+}
+
 /**
  * procfs_scan_listen() - Set bits for listening TCP or UDP sockets from procfs
  * @proto:	IPPROTO_TCP or IPPROTO_UDP
@@ -366,6 +469,9 @@ void procfs_scan_listen(struct ctx *c, uint8_t proto, int ip_version, int ns,
  */
 int ns_enter(const struct ctx *c)
 {
+	if (ns_helper_self)
+		return 0;
+
 	if (setns(c->pasta_netns_fd, CLONE_NEWNET))
 		exit(EXIT_FAILURE);
 
@@ -482,3 +588,131 @@ int write_file(const char *path, const char *buf)
 	close(fd);
 	return len == 0 ? 0 : -1;
 }
+
+/**
+ * raw_random() - Get high quality random bytes
+ * @buf:	Buffer to fill
+ * @len:	Number of bytes to read
+ *
+ * Return: 0 on success, -1 on failure
+ *
+ * #syscalls getrandom
+ */
+int raw_random(void *buf, size_t len)
+{
+	size_t random_read = 0;
+#ifndef HAS_GETRANDOM
+	int dev_random = open("/dev/random", O_RDONLY | O_CLOEXEC);
+
+	while (dev_random >= 0 && random_read < len) {
+		ssize_t ret = read(dev_random, (uint8_t *)buf + random_read,
+				   len - random_read);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			break;
+
+		random_read += ret;
+	}
+	if (dev_random >= 0)
+		close(dev_random);
+#else
+	while (random_read < len) {
+		ssize_t ret = getrandom((uint8_t *)buf + random_read,
+					len - random_read, GRND_RANDOM);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			break;
+
+		random_read += ret;
+	}
+#endif /* !HAS_GETRANDOM */
+
+	return random_read < len ? -1 : 0;
+}
+
+/**
+ * lazy_mem_init() - Reserve address space, initially not accessible
+ * @m:		Area descriptor, filled on return
+ * @size:	Size to reserve, bytes
+ *
+ * Return: 0 on success, negative error code on failure
+ *
+ * Reserved space isn't accounted as committed memory, and committed pages are
+ * only populated (as zero pages) once they're accessed.
+ *
+ * #syscalls mmap|mmap2
+ */
+int lazy_mem_init(struct lazy_mem *m, size_t size)
+{
+	m->size = ROUND_UP(size, LAZY_MEM_CHUNK);
+	m->committed = 0;
+
+	m->base = mmap(NULL, m->size, PROT_NONE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m->base == MAP_FAILED) {
+		m->base = NULL;
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * lazy_mem_commit() - Make sure area is accessible up to a given length
+ * @m:		Area descriptor
+ * @len:	Length that needs to be accessible, from start of area
+ *
+ * Return: 0 on success, negative error code on failure
+ *
+ * #syscalls mprotect
+ */
+int lazy_mem_commit(struct lazy_mem *m, size_t len)
+{
+	size_t want = ROUND_UP(len, LAZY_MEM_CHUNK);
+
+	if (want <= m->committed)
+		return 0;
+
+	if (want > m->size)
+		return -ENOMEM;
+
+	if (mprotect((char *)m->base + m->committed, want - m->committed,
+		     PROT_READ | PROT_WRITE))
+		return -errno;
+
+	m->committed = want;
+	return 0;
+}
+
+/**
+ * lazy_mem_release() - Release memory beyond given length, keeping one chunk
+ * @m:		Area descriptor
+ * @len:	Length that needs to stay accessible, from start of area
+ *
+ * One spare chunk is kept, to avoid churn around chunk boundaries. Released
+ * memory reads as zero once committed again.
+ *
+ * #syscalls madvise
+ */
+void lazy_mem_release(struct lazy_mem *m, size_t len)
+{
+	size_t keep = ROUND_UP(len, LAZY_MEM_CHUNK) + LAZY_MEM_CHUNK;
+	char *start = (char *)m->base + keep;
+
+	if (keep >= m->committed)
+		return;
+
+	if (madvise(start, m->committed - keep, MADV_DONTNEED) ||
+	    mprotect(start, m->committed - keep, PROT_NONE)) {
+		debug("Failed to release memory: %s", strerror(errno));
+		return;
+	}
+
+	m->committed = keep;
+}
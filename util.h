@@ -167,6 +167,20 @@
 
 struct ctx;
 
+#define LAZY_MEM_CHUNK		(64 * 1024)
+
+/**
+ * struct lazy_mem - Reserved address space, accessible on demand from start
+ * @base:	Start of reserved area
+ * @size:	Size of reserved area, bytes
+ * @committed:	Size of accessible area, from @base, multiple of LAZY_MEM_CHUNK
+ */
+struct lazy_mem {
+	void *base;
+	size_t size;
+	size_t committed;
+};
+
 struct ipv6hdr {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wpedantic"
@@ -205,10 +219,13 @@ int sock_l4(const struct ctx *c, int af, uint8_t proto,
 	    uint32_t data);
 void sock_probe_mem(struct ctx *c);
 int timespec_diff_ms(const struct timespec *a, const struct timespec *b);
+long timespec_diff_us(const struct timespec *a, const struct timespec *b);
 void bitmap_set(uint8_t *map, int bit);
 void bitmap_clear(uint8_t *map, int bit);
 int bitmap_isset(const uint8_t *map, int bit);
 char *line_read(char *buf, size_t len, int fd);
+int diag_scan_listen(struct ctx *c, uint8_t proto, int ip_version, int ns,
+		     uint8_t *map, uint8_t *exclude);
 void procfs_scan_listen(struct ctx *c, uint8_t proto, int ip_version, int ns,
 			uint8_t *map, uint8_t *exclude);
 int ns_enter(const struct ctx *c);
@@ -216,5 +233,9 @@ void write_pidfile(int fd, pid_t pid);
 int __daemon(int pidfile_fd, int devnull_fd);
 int fls(unsigned long x);
 int write_file(const char *path, const char *buf);
+int raw_random(void *buf, size_t len);
+int lazy_mem_init(struct lazy_mem *m, size_t size);
+int lazy_mem_commit(struct lazy_mem *m, size_t len);
+void lazy_mem_release(struct lazy_mem *m, size_t len);
 
 #endif /* UTIL_H */
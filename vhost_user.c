@@ -0,0 +1,953 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * vhost_user.c - vhost-user-net back-end for passt mode
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Instead of exchanging frames over the AF_UNIX stream socket, with a 4-byte
+ * length descriptor, the front-end (qemu, cloud-hypervisor) shares guest
+ * memory with us and we read and write frames directly from and to the
+ * virtqueues of the virtio-net device, using eventfds for notifications. The
+ * AF_UNIX socket is then only used for the vhost-user control protocol.
+ *
+ * Only split virtqueues, without indirect descriptors or event index, and a
+ * single queue pair are supported. Frames from the guest are copied to
+ * @pkt_buf once, and handed to the usual tap4_handler()/tap6_handler() path.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+
+#include <linux/vhost_types.h>
+
+#include "util.h"
+#include "passt.h"
+#include "tap.h"
+#include "virtio.h"
+#include "vhost_user.h"
+#include "log.h"
+
+#define VU_BIT(n)			(1ULL << (n))
+
+#define VHOST_USER_VERSION		1
+#define VHOST_USER_FLAGS_REPLY		BIT(2)
+#define VHOST_USER_FLAGS_NEED_REPLY	BIT(3)
+
+#define VHOST_USER_F_PROTOCOL_FEATURES	30
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK	3
+
+#define VHOST_USER_VRING_IDX_MASK	0xff
+#define VHOST_USER_VRING_NOFD_MASK	BIT(8)
+
+#define VHOST_USER_MAX_FDS		8
+
+#define VU_FEATURES							\
+	(VU_BIT(VIRTIO_F_VERSION_1) | VU_BIT(VIRTIO_NET_F_MRG_RXBUF) |	\
+	 VU_BIT(VHOST_USER_F_PROTOCOL_FEATURES))
+#define VU_PROTOCOL_FEATURES	VU_BIT(VHOST_USER_PROTOCOL_F_REPLY_ACK)
+
+enum vhost_user_request {
+	VHOST_USER_GET_FEATURES			= 1,
+	VHOST_USER_SET_FEATURES			= 2,
+	VHOST_USER_SET_OWNER			= 3,
+	VHOST_USER_RESET_OWNER			= 4,
+	VHOST_USER_SET_MEM_TABLE		= 5,
+	VHOST_USER_SET_LOG_BASE			= 6,
+	VHOST_USER_SET_LOG_FD			= 7,
+	VHOST_USER_SET_VRING_NUM		= 8,
+	VHOST_USER_SET_VRING_ADDR		= 9,
+	VHOST_USER_SET_VRING_BASE		= 10,
+	VHOST_USER_GET_VRING_BASE		= 11,
+	VHOST_USER_SET_VRING_KICK		= 12,
+	VHOST_USER_SET_VRING_CALL		= 13,
+	VHOST_USER_SET_VRING_ERR		= 14,
+	VHOST_USER_GET_PROTOCOL_FEATURES	= 15,
+	VHOST_USER_SET_PROTOCOL_FEATURES	= 16,
+	VHOST_USER_GET_QUEUE_NUM		= 17,
+	VHOST_USER_SET_VRING_ENABLE		= 18,
+};
+
+/**
+ * struct vhost_user_memory_region - Guest memory region, as sent on the wire
+ * @gpa:		Guest physical address of the region
+ * @size:		Size of the region, bytes
+ * @qva:		Address of the region in the front-end process
+ * @mmap_offset:	Offset of the region start in the passed file
+ */
+struct vhost_user_memory_region {
+	uint64_t gpa;
+	uint64_t size;
+	uint64_t qva;
+	uint64_t mmap_offset;
+};
+
+/**
+ * struct vhost_user_memory - Payload of VHOST_USER_SET_MEM_TABLE
+ * @nregions:	Count of regions, also count of passed file descriptors
+ * @padding:	Unused
+ * @regions:	Memory regions
+ */
+struct vhost_user_memory {
+	uint32_t nregions;
+	uint32_t padding;
+	struct vhost_user_memory_region regions[VU_MAX_MEM_REGIONS];
+};
+
+/**
+ * struct vhost_user_msg - vhost-user control message
+ * @request:	Request type, enum vhost_user_request
+ * @flags:	Version, and reply flags
+ * @size:	Size of payload, bytes
+ * @payload:	Request-specific payload, follows header without padding on
+ *		the wire, but kept aligned here (see VHOST_USER_HDR_SIZE)
+ */
+struct vhost_user_msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;
+	union {
+		uint64_t u64;
+		struct vhost_vring_state state;
+		struct vhost_vring_addr addr;
+		struct vhost_user_memory memory;
+	} payload;
+};
+
+#define VHOST_USER_HDR_SIZE	(offsetof(struct vhost_user_msg, size) + \
+				 sizeof(uint32_t))
+
+static struct vu_dev vdev;
+
+/**
+ * struct vu_ctl_stream - Reassembly state for control messages from front-end
+ * @msg:	Message being received, header, then payload
+ * @have:	Bytes of @msg received so far, as sent (header, then payload)
+ * @fds:	File descriptors received so far along with @msg
+ * @nfds:	Count of valid entries in @fds
+ */
+static struct vu_ctl_stream {
+	struct vhost_user_msg msg;
+	size_t have;
+	int fds[VHOST_USER_MAX_FDS];
+	int nfds;
+} vu_ctl;
+
+/**
+ * vu_init() - Reset device state for a new front-end connection
+ * @c:		Execution context
+ */
+void vu_init(struct ctx *c)
+{
+	int i;
+
+	memset(&vdev, 0, sizeof(vdev));
+	vdev.hdrlen = sizeof(struct virtio_net_hdr);
+
+	for (i = 0; i < VU_MAX_QUEUES; i++)
+		vdev.vq[i].kick_fd = vdev.vq[i].call_fd = -1;
+
+	vu_ctl.have = vu_ctl.nfds = 0;
+
+	c->fd_vu_kick = -1;
+}
+
+/**
+ * vu_unmap_regions() - Unmap all guest memory regions
+ *
+ * #syscalls:passt munmap
+ */
+static void vu_unmap_regions(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < vdev.nregions; i++) {
+		struct vu_dev_region *r = &vdev.regions[i];
+
+		if (r->mmap_addr)
+			munmap((void *)(uintptr_t)r->mmap_addr,
+			       r->size + r->mmap_offset);
+	}
+
+	vdev.nregions = 0;
+}
+
+/**
+ * vu_virtq_stop() - Stop processing a virtqueue, close its eventfds
+ * @c:		Execution context
+ * @idx:	Queue index
+ */
+static void vu_virtq_stop(struct ctx *c, unsigned int idx)
+{
+	struct vu_virtq *vq = &vdev.vq[idx];
+
+	vq->started = 0;
+
+	if (vq->kick_fd != -1) {
+		if (vq->kick_fd == c->fd_vu_kick) {
+			epoll_ctl(c->epollfd, EPOLL_CTL_DEL, vq->kick_fd, NULL);
+			c->fd_vu_kick = -1;
+		}
+		close(vq->kick_fd);
+		vq->kick_fd = -1;
+	}
+
+	if (vq->call_fd != -1) {
+		close(vq->call_fd);
+		vq->call_fd = -1;
+	}
+}
+
+/**
+ * vu_cleanup() - Release resources associated to front-end connection
+ * @c:		Execution context
+ */
+void vu_cleanup(struct ctx *c)
+{
+	int i;
+
+	for (i = 0; i < VU_MAX_QUEUES; i++)
+		vu_virtq_stop(c, i);
+
+	/* Descriptors passed along with an incomplete message */
+	for (i = 0; i < vu_ctl.nfds; i++)
+		close(vu_ctl.fds[i]);
+
+	vu_unmap_regions();
+	vu_init(c);
+}
+
+/**
+ * vu_virtq_check() - Start virtqueue once it's fully set up and enabled
+ * @idx:	Queue index
+ */
+static void vu_virtq_check(unsigned int idx)
+{
+	struct vu_virtq *vq = &vdev.vq[idx];
+
+	vq->started = vq->enabled && vq->num && vq->kick_fd != -1 &&
+		      vq->desc && vq->avail && vq->used;
+
+	if (vq->started)
+		debug("vhost-user: queue %i started, size %i", idx, vq->num);
+}
+
+/**
+ * vu_ring_map() - Map a ring, check that it fits in a single region
+ * @qva:	Address of ring in front-end process
+ * @len:	Size of ring, bytes
+ *
+ * Return: pointer to ring in our address space, NULL if it doesn't fit
+ */
+static void *vu_ring_map(uint64_t qva, uint64_t len)
+{
+	uint64_t plen = len;
+	void *p;
+
+	if (!(p = vu_qva_to_va(&vdev, &plen, qva)) || plen != len)
+		return NULL;
+
+	return p;
+}
+
+/**
+ * vu_virtq_map() - Map rings of virtqueue, if addresses and size are known
+ * @vq:		Virtqueue
+ *
+ * Rings are left unset if any part of them isn't in guest memory: otherwise, a
+ * front-end could place a ring at the end of a region, and we would access
+ * memory past our mapping.
+ *
+ * Return: 0 if rings are mapped or can't be mapped yet, -1 if they don't fit
+ */
+static int vu_virtq_map(struct vu_virtq *vq)
+{
+	vq->desc = NULL;
+	vq->avail = NULL;
+	vq->used = NULL;
+
+	if (!vq->desc_qva || !vq->num)
+		return 0;
+
+	vq->desc  = vu_ring_map(vq->desc_qva,
+				sizeof(struct vring_desc) * vq->num);
+	vq->avail = vu_ring_map(vq->avail_qva,
+				offsetof(struct vring_avail, ring) +
+				sizeof(uint16_t) * (vq->num + 1));
+	vq->used  = vu_ring_map(vq->used_qva,
+				offsetof(struct vring_used, ring) +
+				sizeof(struct vring_used_elem) * vq->num +
+				sizeof(uint16_t));
+
+	if (vq->desc && vq->avail && vq->used)
+		return 0;
+
+	vq->desc = NULL;
+	vq->avail = NULL;
+	vq->used = NULL;
+	return -1;
+}
+
+/**
+ * vu_virtq_addr_set() - Map rings once address or size changes, check them
+ * @idx:	Queue index
+ *
+ * Return: 0 on success or if rings can't be mapped yet, -1 if they don't fit
+ */
+static int vu_virtq_addr_set(unsigned int idx)
+{
+	struct vu_virtq *vq = &vdev.vq[idx];
+
+	if (vu_virtq_map(vq)) {
+		err("vhost-user: rings of queue %u don't fit in guest memory",
+		    idx);
+		return -1;
+	}
+
+	/* Pick up from where the front-end says the device is */
+	if (vq->used)
+		vq->used_idx = le16toh(vq->used->idx);
+
+	vu_virtq_check(idx);
+
+	return 0;
+}
+
+/**
+ * vu_set_mem_table() - Map guest memory regions passed by front-end
+ * @msg:	VHOST_USER_SET_MEM_TABLE message
+ * @fds:	File descriptors for memory regions
+ * @nfds:	Count of passed file descriptors
+ *
+ * Return: 0 on success, -1 on failure
+ *
+ * #syscalls:passt mmap|mmap2
+ */
+static int vu_set_mem_table(const struct vhost_user_msg *msg,
+			    const int *fds, int nfds)
+{
+	const struct vhost_user_memory *m = &msg->payload.memory;
+	unsigned int i;
+
+	vu_unmap_regions();
+
+	if (m->nregions > VU_MAX_MEM_REGIONS || (int)m->nregions != nfds)
+		return -1;
+
+	for (i = 0; i < m->nregions; i++) {
+		const struct vhost_user_memory_region *mr = &m->regions[i];
+		struct vu_dev_region *r = &vdev.regions[i];
+		void *p;
+
+		p = mmap(NULL, mr->size + mr->mmap_offset,
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE,
+			 fds[i], 0);
+		if (p == MAP_FAILED) {
+			err("vhost-user: can't map guest memory: %s",
+			    strerror(errno));
+			return -1;
+		}
+
+		r->gpa		= mr->gpa;
+		r->size		= mr->size;
+		r->qva		= mr->qva;
+		r->mmap_offset	= mr->mmap_offset;
+		r->mmap_addr	= (uintptr_t)p;
+		vdev.nregions++;
+
+		debug("vhost-user: region %i, guest address 0x%llx, size %llu",
+		      i, (unsigned long long)r->gpa,
+		      (unsigned long long)r->size);
+	}
+
+	for (i = 0; i < VU_MAX_QUEUES; i++) {
+		if (vu_virtq_map(&vdev.vq[i])) {
+			err("vhost-user: rings of queue %u not in guest memory",
+			    i);
+		}
+		vu_virtq_check(i);
+	}
+
+	return 0;
+}
+
+/**
+ * vu_set_vring_fd() - Handle VHOST_USER_SET_VRING_KICK and _CALL
+ * @c:		Execution context
+ * @msg:	Message, payload contains index and flag for missing descriptor
+ * @fds:	Passed file descriptors, at most one expected
+ * @nfds:	Count of passed file descriptors
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int vu_set_vring_fd(struct ctx *c, const struct vhost_user_msg *msg,
+			   const int *fds, int nfds)
+{
+	unsigned int idx = msg->payload.u64 & VHOST_USER_VRING_IDX_MASK;
+	struct vu_virtq *vq;
+	int fd = -1;
+
+	if (msg->payload.u64 & VHOST_USER_VRING_NOFD_MASK) {
+		if (nfds)
+			return -1;
+	} else {
+		if (nfds != 1)
+			return -1;
+		fd = fds[0];
+	}
+
+	if (idx >= VU_MAX_QUEUES)
+		return -1;
+
+	vq = &vdev.vq[idx];
+
+	if (msg->request == VHOST_USER_SET_VRING_CALL) {
+		if (vq->call_fd != -1)
+			close(vq->call_fd);
+		vq->call_fd = fd;
+		return 0;
+	}
+
+	if (vq->kick_fd != -1) {
+		if (vq->kick_fd == c->fd_vu_kick) {
+			epoll_ctl(c->epollfd, EPOLL_CTL_DEL, vq->kick_fd, NULL);
+			c->fd_vu_kick = -1;
+		}
+		close(vq->kick_fd);
+	}
+	vq->kick_fd = fd;
+
+	/* Without VHOST_USER_F_PROTOCOL_FEATURES, rings start enabled */
+	if (!(vdev.features & VU_BIT(VHOST_USER_F_PROTOCOL_FEATURES)))
+		vq->enabled = 1;
+
+	if (idx == VU_TX_QUEUE && fd != -1) {
+		struct epoll_event ev = { .events = EPOLLIN };
+
+		ev.data.fd = c->fd_vu_kick = fd;
+		epoll_ctl(c->epollfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	vu_virtq_check(idx);
+
+	return 0;
+}
+
+/**
+ * vu_send_reply() - Send reply to front-end request
+ * @c:		Execution context
+ * @msg:	Request message, payload already updated with reply
+ * @size:	Size of reply payload
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int vu_send_reply(const struct ctx *c, struct vhost_user_msg *msg,
+			 size_t size)
+{
+	struct iovec iov[2] = {
+		{ msg,			VHOST_USER_HDR_SIZE },
+		{ &msg->payload,	size },
+	};
+	struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 2 };
+
+	msg->flags = VHOST_USER_VERSION | VHOST_USER_FLAGS_REPLY;
+	msg->size = size;
+
+	if (sendmsg(c->fd_tap, &mh, MSG_NOSIGNAL) !=
+	    (ssize_t)(VHOST_USER_HDR_SIZE + size))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * vu_handle_msg() - Handle a single vhost-user control message
+ * @c:		Execution context
+ * @msg:	Message, with payload
+ * @fds:	Passed file descriptors, closed here unless stored
+ * @nfds:	Count of passed file descriptors
+ *
+ * Return: 0 on success, -1 on failure (front-end needs to be disconnected)
+ */
+static int vu_handle_msg(struct ctx *c, struct vhost_user_msg *msg,
+			 const int *fds, int nfds)
+{
+	bool need_reply = msg->flags & VHOST_USER_FLAGS_NEED_REPLY;
+	unsigned int idx = msg->payload.state.index;
+	bool keep_fds = false;
+	int ret = 0, i;
+
+	trace("vhost-user: request %i, size %i, %i descriptors",
+	      msg->request, msg->size, nfds);
+
+	switch (msg->request) {
+	case VHOST_USER_GET_FEATURES:
+		msg->payload.u64 = VU_FEATURES;
+		need_reply = false;
+		ret = vu_send_reply(c, msg, sizeof(msg->payload.u64));
+		break;
+	case VHOST_USER_SET_FEATURES:
+		if (!(msg->payload.u64 & VU_BIT(VIRTIO_F_VERSION_1))) {
+			err("vhost-user: front-end doesn't support virtio 1.0");
+			ret = -1;
+			break;
+		}
+
+		vdev.features = msg->payload.u64;
+		vdev.hdrlen = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+		break;
+	case VHOST_USER_GET_PROTOCOL_FEATURES:
+		msg->payload.u64 = VU_PROTOCOL_FEATURES;
+		need_reply = false;
+		ret = vu_send_reply(c, msg, sizeof(msg->payload.u64));
+		break;
+	case VHOST_USER_SET_PROTOCOL_FEATURES:
+		vdev.protocol_features = msg->payload.u64;
+		break;
+	case VHOST_USER_GET_QUEUE_NUM:
+		msg->payload.u64 = VU_MAX_QUEUES / 2;
+		need_reply = false;
+		ret = vu_send_reply(c, msg, sizeof(msg->payload.u64));
+		break;
+	case VHOST_USER_SET_OWNER:
+	case VHOST_USER_RESET_OWNER:
+		break;
+	case VHOST_USER_SET_MEM_TABLE:
+		ret = vu_set_mem_table(msg, fds, nfds);
+		break;
+	case VHOST_USER_SET_VRING_NUM:
+		/* Ring indices wrap at 2^16: sizes need to be powers of two */
+		if (idx >= VU_MAX_QUEUES || !msg->payload.state.num ||
+		    msg->payload.state.num > VIRTQUEUE_MAX_SIZE ||
+		    (msg->payload.state.num & (msg->payload.state.num - 1))) {
+			err("vhost-user: invalid size %u for queue %u",
+			    msg->payload.state.num, idx);
+			ret = -1;
+			break;
+		}
+		vdev.vq[idx].num = msg->payload.state.num;
+
+		/* Rings might be set already, and their size just changed */
+		ret = vu_virtq_addr_set(idx);
+		break;
+	case VHOST_USER_SET_VRING_ADDR:
+		if ((idx = msg->payload.addr.index) >= VU_MAX_QUEUES) {
+			ret = -1;
+			break;
+		}
+
+		vdev.vq[idx].desc_qva  = msg->payload.addr.desc_user_addr;
+		vdev.vq[idx].avail_qva = msg->payload.addr.avail_user_addr;
+		vdev.vq[idx].used_qva  = msg->payload.addr.used_user_addr;
+		ret = vu_virtq_addr_set(idx);
+		break;
+	case VHOST_USER_SET_VRING_BASE:
+		if (idx >= VU_MAX_QUEUES) {
+			ret = -1;
+			break;
+		}
+		vdev.vq[idx].last_avail_idx = msg->payload.state.num;
+		vdev.vq[idx].used_idx = msg->payload.state.num;
+		break;
+	case VHOST_USER_GET_VRING_BASE:
+		if (idx >= VU_MAX_QUEUES) {
+			ret = -1;
+			break;
+		}
+
+		vu_virtq_stop(c, idx);
+		msg->payload.state.num = vdev.vq[idx].last_avail_idx;
+		need_reply = false;
+		ret = vu_send_reply(c, msg, sizeof(msg->payload.state));
+		break;
+	case VHOST_USER_SET_VRING_KICK:
+	case VHOST_USER_SET_VRING_CALL:
+		ret = vu_set_vring_fd(c, msg, fds, nfds);
+		keep_fds = !ret;
+		break;
+	case VHOST_USER_SET_VRING_ERR:
+		break;
+	case VHOST_USER_SET_VRING_ENABLE:
+		if (idx >= VU_MAX_QUEUES) {
+			ret = -1;
+			break;
+		}
+		vdev.vq[idx].enabled = msg->payload.state.num;
+		vu_virtq_check(idx);
+		break;
+	default:
+		/* Not fatal by itself, front-end decides if it asked for ack */
+		debug("vhost-user: unsupported request %i", msg->request);
+		ret = -EOPNOTSUPP;
+		break;
+	}
+
+	/* Memory region descriptors aren't needed once mapped */
+	for (i = 0; !keep_fds && i < nfds; i++)
+		close(fds[i]);
+
+	if (need_reply &&
+	    (vdev.protocol_features & VU_BIT(VHOST_USER_PROTOCOL_F_REPLY_ACK))) {
+		msg->payload.u64 = !!ret;
+		if (vu_send_reply(c, msg, sizeof(msg->payload.u64)))
+			return -1;
+	}
+
+	return ret == -EOPNOTSUPP ? 0 : ret;
+}
+
+/**
+ * vu_recv_fds() - Get file descriptors passed with message, close extra ones
+ * @mh:		Message header from recvmsg(), with control messages
+ * @fds:	Passed file descriptors, set on return
+ * @max:	Maximum count of descriptors to store in @fds
+ *
+ * Return: count of descriptors in @fds, -1 if control data was truncated (all
+ *	   passed descriptors are closed in that case)
+ */
+static int vu_recv_fds(struct msghdr *mh, int *fds, int max)
+{
+	struct cmsghdr *cmsg;
+	int nfds = 0, i;
+
+	for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+		size_t len;
+
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		len = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < (int)len; i++) {
+			int fd = ((int *)CMSG_DATA(cmsg))[i];
+
+			if (nfds < max)
+				fds[nfds++] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	/* We can't know which descriptors were lost, if any */
+	if (mh->msg_flags & MSG_CTRUNC) {
+		err("vhost-user: control data truncated, descriptors lost");
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+		return -1;
+	}
+
+	return nfds;
+}
+
+/**
+ * vu_control_handler() - Handle control messages from front-end socket
+ * @c:		Execution context
+ *
+ * Messages are read as they come, without waiting for the rest of a message:
+ * partial ones, and descriptors passed along, are kept in @vu_ctl until
+ * complete, so that a slow front-end can't stall the main loop.
+ *
+ * Return: 0 on success, -1 if the connection needs to be reset
+ *
+ * #syscalls:passt recvmsg
+ */
+int vu_control_handler(struct ctx *c)
+{
+	char cmsg_buf[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_FDS)];
+	struct vu_ctl_stream *s = &vu_ctl;
+
+	for (;;) {
+		struct iovec iov;
+		struct msghdr mh = {
+			.msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cmsg_buf,
+			.msg_controllen = sizeof(cmsg_buf),
+		};
+		int nfds, ret;
+		ssize_t n;
+
+		/* Payload is aligned in struct vhost_user_msg, not on wire */
+		if (s->have < VHOST_USER_HDR_SIZE) {
+			iov.iov_base = (char *)&s->msg + s->have;
+			iov.iov_len = VHOST_USER_HDR_SIZE - s->have;
+		} else {
+			iov.iov_base = (char *)&s->msg.payload +
+				       (s->have - VHOST_USER_HDR_SIZE);
+			iov.iov_len = VHOST_USER_HDR_SIZE + s->msg.size -
+				      s->have;
+		}
+
+		n = recvmsg(c->fd_tap, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			      errno == EINTR))
+			return 0;
+
+		if (n <= 0)
+			return -1;
+
+		/* Descriptors can come with any data: don't leak them */
+		nfds = vu_recv_fds(&mh, s->fds + s->nfds,
+				   VHOST_USER_MAX_FDS - s->nfds);
+		if (nfds < 0)
+			return -1;
+
+		s->nfds += nfds;
+		s->have += n;
+
+		if (s->have < VHOST_USER_HDR_SIZE)
+			continue;
+
+		if (s->msg.size > sizeof(s->msg.payload)) {
+			err("vhost-user: payload too long for request %u",
+			    s->msg.request);
+			return -1;
+		}
+
+		if (s->have < VHOST_USER_HDR_SIZE + s->msg.size)
+			continue;
+
+		ret = vu_handle_msg(c, &s->msg, s->fds, s->nfds);
+		s->have = s->nfds = 0;
+
+		if (ret)
+			return -1;
+	}
+}
+
+/**
+ * vu_iov_to_buf() - Copy data from device-readable buffers to linear buffer
+ * @iov:	Buffers from descriptor chain
+ * @num:	Count of buffers
+ * @offset:	Offset in buffers to start copying from
+ * @buf:	Destination
+ * @size:	Size of destination
+ *
+ * Return: bytes in buffers after @offset, copied only if not exceeding @size
+ */
+static size_t vu_iov_to_buf(const struct iovec *iov, unsigned int num,
+			    size_t offset, char *buf, size_t size)
+{
+	size_t total = 0, copied = 0;
+	unsigned int i;
+
+	for (i = 0; i < num; i++)
+		total += iov[i].iov_len;
+
+	if (total < offset || total - offset > size)
+		return total < offset ? 0 : total - offset;
+
+	for (i = 0; i < num; i++) {
+		size_t len = iov[i].iov_len;
+		const char *p = iov[i].iov_base;
+
+		if (offset >= len) {
+			offset -= len;
+			continue;
+		}
+
+		memcpy(buf + copied, p + offset, len - offset);
+		copied += len - offset;
+		offset = 0;
+	}
+
+	return copied;
+}
+
+/**
+ * vu_kick_handler() - Handle frames sent by guest on transmit queue
+ * @c:		Execution context
+ * @now:	Current timestamp
+ */
+void vu_kick_handler(struct ctx *c, const struct timespec *now)
+{
+	struct vu_virtq *vq = &vdev.vq[VU_TX_QUEUE];
+	static struct vu_virtq_elem elem;
+	unsigned int count;
+	bool full;
+	uint64_t v;
+
+	if (read(vq->kick_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		debug("vhost-user: failed to read kick: %s", strerror(errno));
+
+	do {
+		size_t n = 0;
+		int ret;
+
+		tap_flush_pools();
+
+		for (count = 0; !(full = n + ETH_MAX_MTU > TAP_BUF_BYTES);
+		     count++) {
+			size_t len;
+
+			ret = vu_queue_pop(&vdev, vq, &elem);
+			if (ret == -EAGAIN || ret == -EFAULT)
+				break;
+
+			if (!ret) {
+				len = vu_iov_to_buf(elem.out_sg, elem.out_num,
+						    vdev.hdrlen, pkt_buf + n,
+						    ETH_MAX_MTU);
+
+				if (len >= ETH_HLEN && len <= ETH_MAX_MTU) {
+					tap_add_packet(c, len, pkt_buf + n);
+					n += len;
+				}
+			}
+
+			vu_queue_fill(vq, &elem, 0, count);
+		}
+
+		vu_queue_flush(vq, count);
+		if (count)
+			vu_queue_notify(vq);
+
+		tap_handle_pools(c, now);
+	} while (full);
+}
+
+/**
+ * vu_send_one() - Copy one frame to receive queue, don't publish it yet
+ * @vq:		Receive virtqueue
+ * @data:	Frame, including L2 header
+ * @len:	Frame length
+ * @used:	Count of used entries filled in this batch, updated on success
+ *
+ * Return: 0 on success, -1 if guest buffers are missing or unusable
+ */
+static int vu_send_one(struct vu_virtq *vq, const char *data, size_t len,
+		       unsigned int *used)
+{
+	bool mrg = vdev.features & VU_BIT(VIRTIO_NET_F_MRG_RXBUF);
+	struct virtio_net_hdr_mrg_rxbuf *hdr = NULL;
+	static struct vu_virtq_elem elem;
+	unsigned int nbufs = 0;
+	size_t copied = 0;
+	int ret;
+
+	while (!nbufs || copied < len) {
+		size_t written = 0, off = 0;
+		unsigned int i;
+
+		if (nbufs && !mrg)
+			goto fail;
+
+		if ((ret = vu_queue_pop(&vdev, vq, &elem))) {
+			if (ret == -EINVAL) {
+				err("vhost-user: bad descriptor chain on receive queue");
+				vq->started = 0;
+				nbufs++;
+			}
+			goto fail;
+		}
+		nbufs++;
+
+		if (!elem.in_num)
+			goto fail;
+
+		if (nbufs == 1) {
+			if (elem.in_sg[0].iov_len < vdev.hdrlen)
+				goto fail;
+
+			hdr = elem.in_sg[0].iov_base;
+			memset(hdr, 0, vdev.hdrlen);
+			off = written = vdev.hdrlen;
+		}
+
+		for (i = 0; i < elem.in_num && copied < len; i++, off = 0) {
+			size_t n = MIN(elem.in_sg[i].iov_len - off,
+				       len - copied);
+
+			memcpy((char *)elem.in_sg[i].iov_base + off,
+			       data + copied, n);
+			copied += n;
+			written += n;
+		}
+
+		vu_queue_fill(vq, &elem, written, *used + nbufs - 1);
+	}
+
+	if (mrg)
+		hdr->num_buffers = htole16(nbufs);
+
+	*used += nbufs;
+	return 0;
+
+fail:
+	vu_queue_rewind(vq, nbufs);
+	return -1;
+}
+
+/**
+ * vu_send() - Send one frame to the guest
+ * @c:		Execution context
+ * @data:	Frame, including L2 header
+ * @len:	Frame length
+ *
+ * Return: @len on success, -1 on failure
+ */
+int vu_send(const struct ctx *c, const void *data, size_t len)
+{
+	struct vu_virtq *vq = &vdev.vq[VU_RX_QUEUE];
+	unsigned int used = 0;
+
+	(void)c;
+
+	if (!vq->started || vu_send_one(vq, data, len, &used))
+		return -1;
+
+	vu_queue_flush(vq, used);
+	vu_queue_notify(vq);
+
+	return len;
+}
+
+/**
+ * vu_send_frames() - Send multiple frames to the guest, notify once
+ * @c:		Execution context
+ * @iov:	Array of buffers, each containing one frame, with vnet_len
+ * @n:		Number of buffers/frames in @iov
+ *
+ * Return: number of frames sent
+ */
+size_t vu_send_frames(const struct ctx *c, const struct iovec *iov, size_t n)
+{
+	struct vu_virtq *vq = &vdev.vq[VU_RX_QUEUE];
+	unsigned int used = 0;
+	size_t i;
+
+	(void)c;
+
+	if (!vq->started)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		const char *frame = (char *)iov[i].iov_base + sizeof(uint32_t);
+
+		if (vu_send_one(vq, frame, iov[i].iov_len - sizeof(uint32_t),
+				&used))
+			break;
+	}
+
+	vu_queue_flush(vq, used);
+	if (used)
+		vu_queue_notify(vq);
+
+	return i;
+}
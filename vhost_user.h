@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#ifndef VHOST_USER_H
+#define VHOST_USER_H
+
+void vu_init(struct ctx *c);
+void vu_cleanup(struct ctx *c);
+int vu_control_handler(struct ctx *c);
+void vu_kick_handler(struct ctx *c, const struct timespec *now);
+int vu_send(const struct ctx *c, const void *data, size_t len);
+size_t vu_send_frames(const struct ctx *c, const struct iovec *iov, size_t n);
+
+#endif /* VHOST_USER_H */
@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+/* PASST - Plug A Simple Socket Transport
+ *  for qemu/UNIX domain socket mode
+ *
+ * PASTA - Pack A Subtle Tap Abstraction
+ *  for network namespace/tap device mode
+ *
+ * virtio.c - Split virtqueue handling for vhost-user back-end
+ *
+ * Copyright (c) 2023 Red Hat GmbH
+ *
+ * Descriptor tables and rings live in guest memory shared by the front-end
+ * (qemu, cloud-hypervisor) and mapped by vhost_user.c: addresses in descriptors
+ * are guest physical addresses, addresses of rings are front-end virtual
+ * addresses. Everything is little-endian (VIRTIO_F_VERSION_1 is required).
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "util.h"
+#include "virtio.h"
+#include "log.h"
+
+/**
+ * vu_gpa_to_va() - Translate guest physical address to our virtual address
+ * @dev:	vhost-user device
+ * @plen:	Length of buffer, updated to length contiguous in region
+ * @gpa:	Guest physical address
+ *
+ * Return: pointer to memory in our address space, NULL if not mapped
+ */
+void *vu_gpa_to_va(const struct vu_dev *dev, uint64_t *plen, uint64_t gpa)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->nregions; i++) {
+		const struct vu_dev_region *r = &dev->regions[i];
+
+		if (gpa >= r->gpa && gpa - r->gpa < r->size) {
+			if (*plen > r->size - (gpa - r->gpa))
+				*plen = r->size - (gpa - r->gpa);
+
+			return (void *)(uintptr_t)(gpa - r->gpa +
+						   r->mmap_addr +
+						   r->mmap_offset);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * vu_qva_to_va() - Translate front-end virtual address to our virtual address
+ * @dev:	vhost-user device
+ * @plen:	Length of buffer, updated to length contiguous in region
+ * @qva:	Virtual address in front-end process
+ *
+ * Return: pointer to memory in our address space, NULL if not mapped
+ */
+void *vu_qva_to_va(const struct vu_dev *dev, uint64_t *plen, uint64_t qva)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->nregions; i++) {
+		const struct vu_dev_region *r = &dev->regions[i];
+
+		if (qva >= r->qva && qva - r->qva < r->size) {
+			if (*plen > r->size - (qva - r->qva))
+				*plen = r->size - (qva - r->qva);
+
+			return (void *)(uintptr_t)(qva - r->qva +
+						   r->mmap_addr +
+						   r->mmap_offset);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * vu_queue_avail_idx() - Read index of available ring, with barrier
+ * @vq:		Virtqueue
+ *
+ * Return: next index the driver will write to, host order
+ */
+static uint16_t vu_queue_avail_idx(const struct vu_virtq *vq)
+{
+	uint16_t idx = le16toh(vq->avail->idx);
+
+	/* Don't read ring entries before the index they're published with */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return idx;
+}
+
+/**
+ * vu_queue_map_desc() - Map a descriptor buffer, possibly across regions
+ * @dev:	vhost-user device
+ * @iov:	Array of buffers to append to
+ * @num:	Count of valid entries in @iov, updated on return
+ * @gpa:	Guest physical address of buffer
+ * @len:	Length of buffer
+ *
+ * Return: 0 on success, -1 if the buffer can't be mapped, or doesn't fit
+ */
+static int vu_queue_map_desc(const struct vu_dev *dev, struct iovec *iov,
+			     unsigned int *num, uint64_t gpa, uint64_t len)
+{
+	while (len) {
+		uint64_t plen = len;
+		void *p;
+
+		if (*num == VIRTQUEUE_ELEM_IOVS)
+			return -1;
+
+		if (!(p = vu_gpa_to_va(dev, &plen, gpa)))
+			return -1;
+
+		iov[*num].iov_base = p;
+		iov[*num].iov_len = plen;
+		(*num)++;
+
+		gpa += plen;
+		len -= plen;
+	}
+
+	return 0;
+}
+
+/**
+ * vu_queue_pop() - Get next available descriptor chain from virtqueue
+ * @dev:	vhost-user device
+ * @vq:		Virtqueue
+ * @elem:	Descriptor chain, filled on return
+ *
+ * The driver can't make more chains available than there are descriptors: if
+ * it claims so, counting chains we popped and didn't return yet, entries we
+ * fill in the used ring would wrap over each other. Stop the queue in that
+ * case, as the device is broken, similarly to what vhost does.
+ *
+ * Return: 0 on success, -EAGAIN if no buffers are available, -EINVAL if the
+ *	   descriptor chain is malformed (it's consumed anyway), -EFAULT if the
+ *	   available index is invalid (queue is stopped)
+ */
+int vu_queue_pop(const struct vu_dev *dev, struct vu_virtq *vq,
+		 struct vu_virtq_elem *elem)
+{
+	unsigned int head, i, n = 0;
+	uint16_t avail_idx;
+
+	if (!vq->started)
+		return -EAGAIN;
+
+	if ((avail_idx = vu_queue_avail_idx(vq)) == vq->last_avail_idx)
+		return -EAGAIN;
+
+	if ((uint16_t)(avail_idx - vq->used_idx) > vq->num) {
+		err("vhost-user: guest moved available index from %u to %u",
+		    vq->last_avail_idx, avail_idx);
+		vq->started = 0;
+		return -EFAULT;
+	}
+
+	head = le16toh(vq->avail->ring[vq->last_avail_idx % vq->num]);
+	vq->last_avail_idx++;
+	vq->inuse++;
+
+	elem->index = head;
+	elem->in_num = elem->out_num = 0;
+
+	if (head >= vq->num)
+		return -EINVAL;
+
+	for (i = head; ; i = le16toh(vq->desc[i].next)) {
+		const struct vring_desc *d = &vq->desc[i];
+		uint16_t flags = le16toh(d->flags);
+		int ret;
+
+		if (flags & VRING_DESC_F_WRITE) {
+			ret = vu_queue_map_desc(dev, elem->in_sg,
+						&elem->in_num,
+						le64toh(d->addr),
+						le32toh(d->len));
+		} else {
+			/* Device-readable buffers come first in a chain */
+			if (elem->in_num)
+				return -EINVAL;
+
+			ret = vu_queue_map_desc(dev, elem->out_sg,
+						&elem->out_num,
+						le64toh(d->addr),
+						le32toh(d->len));
+		}
+
+		if (ret)
+			return -EINVAL;
+
+		if (!(flags & VRING_DESC_F_NEXT))
+			break;
+
+		if (le16toh(d->next) >= vq->num || ++n >= vq->num)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * vu_queue_rewind() - Give back descriptor chains popped but not used
+ * @vq:		Virtqueue
+ * @num:	Count of descriptor chains to give back
+ */
+void vu_queue_rewind(struct vu_virtq *vq, unsigned int num)
+{
+	vq->last_avail_idx -= num;
+	vq->inuse -= num;
+}
+
+/**
+ * vu_queue_fill() - Write descriptor chain to used ring, don't publish yet
+ * @vq:		Virtqueue
+ * @elem:	Descriptor chain popped from @vq
+ * @len:	Bytes written by device to @elem buffers
+ * @idx:	Offset from current used index, for multiple outstanding chains
+ */
+void vu_queue_fill(struct vu_virtq *vq, const struct vu_virtq_elem *elem,
+		   unsigned int len, unsigned int idx)
+{
+	struct vring_used_elem *u;
+
+	u = &vq->used->ring[(uint16_t)(vq->used_idx + idx) % vq->num];
+	u->id = htole32(elem->index);
+	u->len = htole32(len);
+}
+
+/**
+ * vu_queue_flush() - Publish filled used ring entries to the driver
+ * @vq:		Virtqueue
+ * @count:	Count of entries filled with vu_queue_fill()
+ */
+void vu_queue_flush(struct vu_virtq *vq, unsigned int count)
+{
+	if (!count)
+		return;
+
+	/* Ring entries must be visible before the index is updated */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	vq->used_idx += count;
+	vq->used->idx = htole16(vq->used_idx);
+	vq->inuse -= count;
+}
+
+/**
+ * vu_queue_notify() - Signal used buffers to the guest, unless suppressed
+ * @vq:		Virtqueue
+ */
+void vu_queue_notify(const struct vu_virtq *vq)
+{
+	uint64_t v = 1;
+
+	/* Pairs with the driver reading the used index before flags */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (vq->call_fd < 0 ||
+	    (le16toh(vq->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT))
+		return;
+
+	if (write(vq->call_fd, &v, sizeof(v)) < 0)
+		debug("vhost-user: failed to notify guest: %s", strerror(errno));
+}
@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: AGPL-3.0-or-later
+ * Copyright (c) 2023 Red Hat GmbH
+ */
+
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <linux/virtio_ring.h>
+#include <linux/virtio_net.h>
+#include <linux/virtio_config.h>
+
+#define VIRTQUEUE_MAX_SIZE	1024
+#define VIRTQUEUE_ELEM_IOVS	64 /* Maximum descriptors in a single chain */
+
+#define VU_MAX_MEM_REGIONS	8
+#define VU_MAX_QUEUES		2
+
+#define VU_RX_QUEUE		0 /* Device to guest, named from guest side */
+#define VU_TX_QUEUE		1 /* Guest to device */
+
+/**
+ * struct vu_dev_region - Guest shared memory region
+ * @gpa:		Guest physical address of the region
+ * @size:		Size of the region, bytes
+ * @qva:		Address of the region in the front-end (qemu) process
+ * @mmap_offset:	Offset of the region start in the mapped file
+ * @mmap_addr:		Address of our mapping of the region, 0 if unmapped
+ */
+struct vu_dev_region {
+	uint64_t gpa;
+	uint64_t size;
+	uint64_t qva;
+	uint64_t mmap_offset;
+	uint64_t mmap_addr;
+};
+
+/**
+ * struct vu_virtq - Split virtqueue state
+ * @num:		Size of the queue, descriptors
+ * @desc:		Descriptor table, mapped in our address space
+ * @avail:		Available ring (driver area), mapped in our address space
+ * @used:		Used ring (device area), mapped in our address space
+ * @desc_qva:		Address of descriptor table in front-end process
+ * @avail_qva:		Address of available ring in front-end process
+ * @used_qva:		Address of used ring in front-end process
+ * @last_avail_idx:	Next available ring index we'll look at
+ * @used_idx:		Shadow copy of used ring index, before flushing
+ * @inuse:		Count of descriptor chains popped but not flushed yet
+ * @kick_fd:		eventfd signalled by front-end on new buffers, or -1
+ * @call_fd:		eventfd we signal to interrupt the guest, or -1
+ * @enabled:		Queue enabled by front-end
+ * @started:		Queue set up and usable
+ */
+struct vu_virtq {
+	unsigned int num;
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint64_t desc_qva;
+	uint64_t avail_qva;
+	uint64_t used_qva;
+	uint16_t last_avail_idx;
+	uint16_t used_idx;
+	unsigned int inuse;
+	int kick_fd;
+	int call_fd;
+	int enabled;
+	int started;
+};
+
+/**
+ * struct vu_dev - vhost-user device state
+ * @regions:		Guest memory regions, mapped from front-end
+ * @nregions:		Count of valid entries in @regions
+ * @vq:			Virtqueues, receive and transmit
+ * @features:		virtio features acknowledged by front-end
+ * @protocol_features:	vhost-user protocol features acknowledged
+ * @hdrlen:		Length of virtio-net header, depends on features
+ */
+struct vu_dev {
+	struct vu_dev_region regions[VU_MAX_MEM_REGIONS];
+	unsigned int nregions;
+	struct vu_virtq vq[VU_MAX_QUEUES];
+	uint64_t features;
+	uint64_t protocol_features;
+	size_t hdrlen;
+};
+
+/**
+ * struct vu_virtq_elem - Descriptor chain popped from a virtqueue
+ * @index:	Index of head descriptor, returned in used ring
+ * @in_num:	Count of device-writable buffers in @in_sg
+ * @out_num:	Count of device-readable buffers in @out_sg
+ * @in_sg:	Device-writable buffers, mapped in our address space
+ * @out_sg:	Device-readable buffers, mapped in our address space
+ */
+struct vu_virtq_elem {
+	unsigned int index;
+	unsigned int in_num;
+	unsigned int out_num;
+	struct iovec in_sg[VIRTQUEUE_ELEM_IOVS];
+	struct iovec out_sg[VIRTQUEUE_ELEM_IOVS];
+};
+
+void *vu_gpa_to_va(const struct vu_dev *dev, uint64_t *plen, uint64_t gpa);
+void *vu_qva_to_va(const struct vu_dev *dev, uint64_t *plen, uint64_t qva);
+int vu_queue_pop(const struct vu_dev *dev, struct vu_virtq *vq,
+		 struct vu_virtq_elem *elem);
+void vu_queue_rewind(struct vu_virtq *vq, unsigned int num);
+void vu_queue_fill(struct vu_virtq *vq, const struct vu_virtq_elem *elem,
+		   unsigned int len, unsigned int idx);
+void vu_queue_flush(struct vu_virtq *vq, unsigned int count);
+void vu_queue_notify(const struct vu_virtq *vq);
+
+#endif /* VIRTIO_H */